@@ -0,0 +1,86 @@
+#ifndef _BOUNDED_QUEUE_H_
+#define _BOUNDED_QUEUE_H_
+
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+
+/*
+    * 线程间传递数据的有界阻塞队列，用于mapOptimization中各流水线阶段之间的连接
+    * 队列满时push阻塞(反压到上游)，队列空时pop阻塞，close()之后唤醒所有等待的线程
+    */
+template <typename T>
+class BoundedQueue{
+
+private:
+
+    std::deque<T> items;
+    size_t capacity;
+    bool closed;
+
+    std::mutex mtx;
+    std::condition_variable notEmpty;
+    std::condition_variable notFull;
+
+public:
+
+    BoundedQueue(size_t capacityIn):
+        capacity(capacityIn),
+        closed(false)
+    {
+    }
+
+    // 队列满时阻塞，队列已关闭时返回false
+    bool push(const T &item){
+        std::unique_lock<std::mutex> lock(mtx);
+        notFull.wait(lock, [this]{ return closed || items.size() < capacity; });
+        if (closed)
+            return false;
+        items.push_back(item);
+        notEmpty.notify_one();
+        return true;
+    }
+
+    // 队列空时阻塞，队列已关闭且为空时返回false
+    bool pop(T &item){
+        std::unique_lock<std::mutex> lock(mtx);
+        notEmpty.wait(lock, [this]{ return closed || !items.empty(); });
+        if (items.empty())
+            return false;
+        item = items.front();
+        items.pop_front();
+        notFull.notify_one();
+        return true;
+    }
+
+    // 不阻塞，队列为空时返回false
+    bool tryPop(T &item){
+        std::lock_guard<std::mutex> lock(mtx);
+        if (items.empty())
+            return false;
+        item = items.front();
+        items.pop_front();
+        notFull.notify_one();
+        return true;
+    }
+
+    void close(){
+        std::lock_guard<std::mutex> lock(mtx);
+        closed = true;
+        notEmpty.notify_all();
+        notFull.notify_all();
+    }
+
+    size_t size(){
+        std::lock_guard<std::mutex> lock(mtx);
+        return items.size();
+    }
+
+    // 队列已满，下一次push会阻塞
+    bool full(){
+        std::lock_guard<std::mutex> lock(mtx);
+        return items.size() >= capacity;
+    }
+};
+
+#endif
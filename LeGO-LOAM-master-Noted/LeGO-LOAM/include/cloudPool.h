@@ -0,0 +1,51 @@
+#ifndef _CLOUD_POOL_H_
+#define _CLOUD_POOL_H_
+
+#include "utility.h"
+
+/*
+    * 每帧使用的点云对象池，各节点共用
+    * 发布出去或送入流水线的点云由订阅者/下游阶段持有，不能在下一帧直接清空复用，原来每帧都new新的点云，
+    * 稳态下每帧也要分配和释放多次大块内存，与回环检测、可视化等线程竞争分配器，并带来耗时抖动
+    * 池中保留所有分配过的点云，acquire()返回一个没有其他持有者(use_count() == 1)的点云，清空后复用原有容量，
+    * 点云数达到同时在用的最大数目、容量达到最大帧的点数之后，稳态下不再分配内存
+    * 每个池只在一个线程中调用acquire()，其他线程只持有和释放共享指针(引用计数是原子的)，不需要加锁
+    */
+template <typename PointT>
+class CloudPool{
+
+public:
+
+    typedef typename pcl::PointCloud<PointT>::Ptr CloudPtr;
+
+private:
+
+    std::vector<CloudPtr> clouds;
+    uint64_t allocationNum;
+
+public:
+
+    CloudPool(): allocationNum(0) {}
+
+    // 返回一个空的点云，调用者持有期间不会被再次取出
+    CloudPtr acquire(){
+        for (size_t i = 0; i < clouds.size(); ++i){
+            // 只有池本身持有的点云，其他线程已经不再使用，持有者数目也不会再增加
+            if (clouds[i].use_count() == 1){
+                clouds[i]->clear();
+                return clouds[i];
+            }
+        }
+        clouds.push_back(CloudPtr(new pcl::PointCloud<PointT>()));
+        ++allocationNum;
+        return clouds.back();
+    }
+
+    // 池中点云的数目，即同时在用的最大数目
+    size_t size() const { return clouds.size(); }
+
+    // 累计新分配的点云数，稳态下不再增加
+    uint64_t allocations() const { return allocationNum; }
+};
+
+#endif
@@ -0,0 +1,121 @@
+#ifndef _COMPACT_CLOUD_H_
+#define _COMPACT_CLOUD_H_
+
+#include "utility.h"
+#include "cloud_msgs/CompactCloud.h"
+
+#include <cstring>
+
+/*
+    * imageProjection与featureAssociation之间的紧凑格式(cloud_msgs/CompactCloud，话题/segmented_cloud_compact)
+    * 原来分割点云和分割信息分两个话题发送，featureAssociation按时间戳配对：
+    *   /segmented_cloud中每个点为32字节的PointXYZI，intensity中存放行号 + 列号/10000
+    *   /segmented_cloud_info中的三个数组总是按N_SCAN*Horizon_SCAN的长度发送(VLP-16为28800 * 9字节)，与实际的分割点数无关
+    * 紧凑格式把两者合并为一个消息，只发送实际的分割点，每个点17字节，各字段为连续的数组(SoA，见CompactCloud.msg)，
+    * data是一个uint8[]，反序列化只是一次内存拷贝
+    * 解码时intensity按projectPointCloud中相同的表达式由线号和列号恢复，与原来的值完全相同；
+    * 距离量化为compactRangeResolution的整数倍，曲率和遮挡判断中使用的距离与原来相差不超过其一半
+    * 线号占7位，N_SCAN超过128时不能使用
+    */
+
+static const size_t compactPointBytes = 3 * sizeof(float) + 2 * sizeof(uint16_t) + sizeof(uint8_t);
+
+// 两个节点由相同的参数得到相同的结果，imageProjection据此选择发布的话题，featureAssociation选择订阅的话题
+inline bool compactCloudEnabled(){
+    ros::NodeHandle pnh("lego_loam/compact_cloud");
+    bool enable;
+    pnh.param<bool>("enable", enable, compactCloudFlag);
+    if (enable == true && N_SCAN > 128){
+        ROS_WARN("Compact cloud format supports at most 128 rings (N_SCAN = %d), using /segmented_cloud and /segmented_cloud_info.", N_SCAN);
+        return false;
+    }
+    return enable;
+}
+
+// 由分割点云和分割信息(三个数组的前cloud.size()个元素有效)生成紧凑格式，msg中的数组复用已有容量
+inline void encodeCompactCloud(const pcl::PointCloud<PointType> &cloud, const cloud_msgs::cloud_info &info,
+                               cloud_msgs::CompactCloud &msg){
+    const size_t n = cloud.points.size();
+
+    msg.header = info.header;
+    msg.startRingIndex = info.startRingIndex;
+    msg.endRingIndex = info.endRingIndex;
+    msg.startOrientation = info.startOrientation;
+    msg.endOrientation = info.endOrientation;
+    msg.orientationDiff = info.orientationDiff;
+    msg.pointNum = n;
+    msg.rangeResolution = compactRangeResolution;
+    msg.data.resize(n * compactPointBytes);
+
+    uint8_t *x = msg.data.data();
+    uint8_t *y = x + n * sizeof(float);
+    uint8_t *z = y + n * sizeof(float);
+    uint8_t *range = z + n * sizeof(float);
+    uint8_t *column = range + n * sizeof(uint16_t);
+    uint8_t *ring = column + n * sizeof(uint16_t);
+
+    for (size_t i = 0; i < n; ++i){
+        const PointType &p = cloud.points[i];
+        memcpy(x + i * sizeof(float), &p.x, sizeof(float));
+        memcpy(y + i * sizeof(float), &p.y, sizeof(float));
+        memcpy(z + i * sizeof(float), &p.z, sizeof(float));
+        // 四舍五入，超出uint16范围的距离截断为最大值
+        float quantized = std::min(info.segmentedCloudRange[i] / compactRangeResolution + 0.5f, 65535.0f);
+        uint16_t rangeValue = (uint16_t)quantized;
+        uint16_t columnValue = (uint16_t)info.segmentedCloudColInd[i];
+        memcpy(range + i * sizeof(uint16_t), &rangeValue, sizeof(uint16_t));
+        memcpy(column + i * sizeof(uint16_t), &columnValue, sizeof(uint16_t));
+        // 分割点的intensity整数部分即为线号
+        ring[i] = (uint8_t)(int(p.intensity) & 0x7f) | (info.segmentedCloudGroundFlag[i] ? 0x80 : 0);
+    }
+}
+
+// 解码为分割点云和分割信息，与原来分别收到/segmented_cloud和/segmented_cloud_info时相同，数据长度不符时返回false
+inline bool decodeCompactCloud(const cloud_msgs::CompactCloud &msg, pcl::PointCloud<PointType> &cloud,
+                               cloud_msgs::cloud_info &info){
+    const size_t n = msg.pointNum;
+    if (msg.data.size() != n * compactPointBytes)
+        return false;
+
+    info.header = msg.header;
+    info.startRingIndex = msg.startRingIndex;
+    info.endRingIndex = msg.endRingIndex;
+    info.startOrientation = msg.startOrientation;
+    info.endOrientation = msg.endOrientation;
+    info.orientationDiff = msg.orientationDiff;
+    info.segmentedCloudGroundFlag.resize(n);
+    info.segmentedCloudColInd.resize(n);
+    info.segmentedCloudRange.resize(n);
+
+    cloud.header = pcl_conversions::toPCL(msg.header);
+    cloud.header.frame_id = "base_link";
+    cloud.points.resize(n);
+    cloud.width = n;
+    cloud.height = 1;
+
+    const uint8_t *x = msg.data.data();
+    const uint8_t *y = x + n * sizeof(float);
+    const uint8_t *z = y + n * sizeof(float);
+    const uint8_t *range = z + n * sizeof(float);
+    const uint8_t *column = range + n * sizeof(uint16_t);
+    const uint8_t *ring = column + n * sizeof(uint16_t);
+
+    for (size_t i = 0; i < n; ++i){
+        PointType &p = cloud.points[i];
+        memcpy(&p.x, x + i * sizeof(float), sizeof(float));
+        memcpy(&p.y, y + i * sizeof(float), sizeof(float));
+        memcpy(&p.z, z + i * sizeof(float), sizeof(float));
+        uint16_t rangeValue, columnValue;
+        memcpy(&rangeValue, range + i * sizeof(uint16_t), sizeof(uint16_t));
+        memcpy(&columnValue, column + i * sizeof(uint16_t), sizeof(uint16_t));
+        int rowIdn = ring[i] & 0x7f;
+        // 与projectPointCloud中的表达式相同
+        p.intensity = (float)rowIdn + (float)columnValue / 10000.0;
+        info.segmentedCloudGroundFlag[i] = (ring[i] & 0x80) != 0;
+        info.segmentedCloudColInd[i] = columnValue;
+        info.segmentedCloudRange[i] = rangeValue * msg.rangeResolution;
+    }
+    return true;
+}
+
+#endif
@@ -0,0 +1,288 @@
+#ifndef _IMU_BUFFER_H_
+#define _IMU_BUFFER_H_
+
+#include "utility.h"
+#include "pointTransform.h"
+
+#include <atomic>
+
+/*
+    * imu消息的无锁环形缓冲区，featureAssociation和mapOptimization共用
+    * 原来每个节点用约20个并行的float[imuQueLength]数组保存imu数据，每个点都从上一次的位置线性向后查找对应的imu时刻，
+    * 再对每个通道分别插值；这里每个imu时刻的全部数据保存在一个ImuSample中(一次读取即可得到插值需要的所有量)，
+    * 按时间戳二分查找，只有一个写线程(imu回调)，读线程不加锁：
+    *   每个槽位带一个序号(seqlock)，写之前置为奇数，写完置为偶数，读者在读取前后检查序号，
+    *   读到正在写入或已被覆盖的槽位时视为比该时刻更早的数据
+    */
+
+// 一个imu时刻的数据，坐标轴已交换为左上前(与featureAssociation中的点云相同)
+struct ImuSample{
+    double time;
+    float roll, pitch, yaw;     // 世界坐标下的姿态
+    float accX, accY, accZ;     // 左上前坐标系(局部)下去除重力后的加速度
+    float veloX, veloY, veloZ;  // 世界坐标下积分的速度
+    float shiftX, shiftY, shiftZ;   // 世界坐标下积分的位移
+    float angularVeloX, angularVeloY, angularVeloZ; // 角速度(!!!交换前的前左上坐标系下)
+    float angularRotationX, angularRotationY, angularRotationZ; // 积分的转角(!!!交换前的前左上坐标系下)
+};
+
+class ImuBuffer{
+
+private:
+
+    struct Slot{
+        std::atomic<uint64_t> seq;
+        ImuSample sample;
+    };
+
+    uint64_t capacity;
+    std::vector<Slot> slots;
+    std::atomic<uint64_t> head;     // 已写入的imu消息数，序号为index的消息保存在slots[index % capacity]
+
+    ImuSample last;                 // 只由写线程访问，用于积分
+
+    // 读取序号为index的消息，槽位正在写入或已被覆盖时返回false
+    bool read(uint64_t index, ImuSample &out) const {
+        const Slot &slot = slots[index % capacity];
+        uint64_t seq = slot.seq.load(std::memory_order_acquire);
+        if (seq != 2 * index + 2)
+            return false;
+        out = slot.sample;
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return slot.seq.load(std::memory_order_relaxed) == seq;
+    }
+
+    // [begin, end)中第一个时间戳大于t的消息序号，没有时返回end
+    uint64_t upperBound(double t, uint64_t begin, uint64_t end) const {
+        while (begin < end){
+            uint64_t mid = begin + (end - begin) / 2;
+            ImuSample sample;
+            if (!read(mid, sample) || sample.time <= t)
+                begin = mid + 1;
+            else
+                end = mid;
+        }
+        return begin;
+    }
+
+    // 与原来的AccumulateIMUShiftAndRotation相同：在世界坐标系下积分速度与位移，在交换前的坐标系下积分转角
+    void accumulate(ImuSample &cur) const {
+
+        // 加速度转换到世界坐标系: R = Ry(yaw)*Rx(pitch)*Rz(roll)
+        float x1 = cos(cur.roll) * cur.accX - sin(cur.roll) * cur.accY;
+        float y1 = sin(cur.roll) * cur.accX + cos(cur.roll) * cur.accY;
+        float z1 = cur.accZ;
+
+        float x2 = x1;
+        float y2 = cos(cur.pitch) * y1 - sin(cur.pitch) * z1;
+        float z2 = sin(cur.pitch) * y1 + cos(cur.pitch) * z1;
+
+        float accX = cos(cur.yaw) * x2 + sin(cur.yaw) * z2;
+        float accY = y2;
+        float accZ = -sin(cur.yaw) * x2 + cos(cur.yaw) * z2;
+
+        // 第一帧以及相邻两帧间隔过长时不积分，沿用上一时刻的速度、位移和转角
+        cur.veloX = last.veloX; cur.veloY = last.veloY; cur.veloZ = last.veloZ;
+        cur.shiftX = last.shiftX; cur.shiftY = last.shiftY; cur.shiftZ = last.shiftZ;
+        cur.angularRotationX = last.angularRotationX;
+        cur.angularRotationY = last.angularRotationY;
+        cur.angularRotationZ = last.angularRotationZ;
+
+        double timeDiff = cur.time - last.time;
+        if (head.load(std::memory_order_relaxed) == 0 || timeDiff >= scanPeriod || timeDiff < 0)
+            return;
+
+        cur.shiftX += last.veloX * timeDiff + accX * timeDiff * timeDiff / 2;
+        cur.shiftY += last.veloY * timeDiff + accY * timeDiff * timeDiff / 2;
+        cur.shiftZ += last.veloZ * timeDiff + accZ * timeDiff * timeDiff / 2;
+
+        cur.veloX += accX * timeDiff;
+        cur.veloY += accY * timeDiff;
+        cur.veloZ += accZ * timeDiff;
+
+        cur.angularRotationX += last.angularVeloX * timeDiff;
+        cur.angularRotationY += last.angularVeloY * timeDiff;
+        cur.angularRotationZ += last.angularVeloZ * timeDiff;
+    }
+
+public:
+
+    ImuBuffer(int capacityIn):
+        capacity(capacityIn),
+        slots(capacityIn),
+        head(0)
+    {
+        for (size_t i = 0; i < slots.size(); ++i)
+            slots[i].seq.store(0, std::memory_order_relaxed);
+        memset(&last, 0, sizeof(last));
+    }
+
+    bool empty() const {
+        return head.load(std::memory_order_acquire) == 0;
+    }
+
+    // imu回调中调用(唯一的写线程)，imu安装的坐标系为x轴向前，y轴向左，z轴向上(与激光雷达的安装坐标系相同)
+    void push(const sensor_msgs::Imu &imuIn){
+
+        ImuSample cur;
+        double roll, pitch, yaw;
+        tf::Quaternion orientation;
+        tf::quaternionMsgToTF(imuIn.orientation, orientation);
+        tf::Matrix3x3(orientation).getRPY(roll, pitch, yaw); // 全局坐标系下的姿态
+
+        cur.time = imuIn.header.stamp.toSec();
+        cur.roll = roll;
+        cur.pitch = pitch;
+        cur.yaw = yaw;
+
+        // 减去重力的影响，并交换到z轴向前，x轴向左，y轴向上的右手坐标系，交换过后RPY对应fixed axes ZXY
+        cur.accX = imuIn.linear_acceleration.y - sin(roll) * cos(pitch) * 9.81;
+        cur.accY = imuIn.linear_acceleration.z - cos(roll) * cos(pitch) * 9.81;
+        cur.accZ = imuIn.linear_acceleration.x + sin(pitch) * 9.81;
+
+        cur.angularVeloX = imuIn.angular_velocity.x;
+        cur.angularVeloY = imuIn.angular_velocity.y;
+        cur.angularVeloZ = imuIn.angular_velocity.z;
+
+        accumulate(cur);
+        last = cur;
+
+        uint64_t index = head.load(std::memory_order_relaxed);
+        Slot &slot = slots[index % capacity];
+        slot.seq.store(2 * index + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        slot.sample = cur;
+        slot.seq.store(2 * index + 2, std::memory_order_release);
+        head.store(index + 1, std::memory_order_release);
+    }
+
+    // t时刻的imu数据：t晚于最新的消息时返回最新的消息，早于缓冲区中最早的消息时返回最早的消息，否则在前后两个时刻之间线性插值
+    bool at(double t, ImuSample &out) const {
+
+        uint64_t end = head.load(std::memory_order_acquire);
+        if (end == 0)
+            return false;
+        // 留出一个槽位，避免二分查找时最早的消息正在被覆盖
+        uint64_t begin = end > capacity ? end - capacity + 1 : 0;
+
+        uint64_t front = upperBound(t, begin, end);
+        if (front == end)
+            return read(end - 1, out);
+
+        ImuSample back;
+        if (!read(front, out))
+            return false;
+        if (front == begin || !read(front - 1, back))
+            return true;
+
+        // 按时间距离线性插值
+        float ratioFront = (t - back.time) / (out.time - back.time);
+        float ratioBack = (out.time - t) / (out.time - back.time);
+
+        // roll和pitch通常都在0度左右，不需要考虑超过2*M_PI的情况，yaw需要处理跨越正负pi的情况
+        float backYaw = back.yaw;
+        if (out.yaw - back.yaw > M_PI)
+            backYaw += 2 * M_PI;
+        else if (out.yaw - back.yaw < -M_PI)
+            backYaw -= 2 * M_PI;
+
+        out.time = t;
+        out.roll = out.roll * ratioFront + back.roll * ratioBack;
+        out.pitch = out.pitch * ratioFront + back.pitch * ratioBack;
+        out.yaw = out.yaw * ratioFront + backYaw * ratioBack;
+        out.accX = out.accX * ratioFront + back.accX * ratioBack;
+        out.accY = out.accY * ratioFront + back.accY * ratioBack;
+        out.accZ = out.accZ * ratioFront + back.accZ * ratioBack;
+        out.veloX = out.veloX * ratioFront + back.veloX * ratioBack;
+        out.veloY = out.veloY * ratioFront + back.veloY * ratioBack;
+        out.veloZ = out.veloZ * ratioFront + back.veloZ * ratioBack;
+        out.shiftX = out.shiftX * ratioFront + back.shiftX * ratioBack;
+        out.shiftY = out.shiftY * ratioFront + back.shiftY * ratioBack;
+        out.shiftZ = out.shiftZ * ratioFront + back.shiftZ * ratioBack;
+        out.angularVeloX = out.angularVeloX * ratioFront + back.angularVeloX * ratioBack;
+        out.angularVeloY = out.angularVeloY * ratioFront + back.angularVeloY * ratioBack;
+        out.angularVeloZ = out.angularVeloZ * ratioFront + back.angularVeloZ * ratioBack;
+        out.angularRotationX = out.angularRotationX * ratioFront + back.angularRotationX * ratioBack;
+        out.angularRotationY = out.angularRotationY * ratioFront + back.angularRotationY * ratioBack;
+        out.angularRotationZ = out.angularRotationZ * ratioFront + back.angularRotationZ * ratioBack;
+        return true;
+    }
+};
+
+/*
+    * featureAssociation::adjustDistortion中每一帧的imu去畸变表
+    * 点p的去畸变变换为 p_start = R_start^T * R(t) * p + shift，R = Ry(yaw)*Rx(pitch)*Rz(roll)
+    * 原来每个点都要查找imu时刻、插值姿态并求9次sin/cos；这里在点云覆盖的时间范围内每隔imuDeskewTableStep
+    * 计算一次R_start^T * R(t)，每个点只在相邻两个节点的矩阵之间线性插值，不再有查找、分支和三角函数，循环可以向量化并行
+    */
+class ImuDeskewTable{
+
+private:
+
+    float begin;        // 第一个节点相对于扫描开始的时间
+    float invStep;
+    int nodeNum;
+    std::vector<float> table;   // 每个节点9个元素，按行保存R_start^T * R(t)
+    float shift[3];
+
+public:
+
+    ImuDeskewTable():
+        begin(0),
+        invStep(1.0 / imuDeskewTableStep),
+        nodeNum(0)
+    {
+        shift[0] = shift[1] = shift[2] = 0;
+    }
+
+    // scanTime为扫描开始时间，[timeBegin, timeEnd]为点相对于扫描开始的时间范围，shiftIn为所有点共同的位移补偿
+    void build(const ImuBuffer &imuBuffer, double scanTime, float timeBegin, float timeEnd,
+               const ImuSample &start, const float shiftIn[]){
+
+        begin = timeBegin;
+        nodeNum = std::max(int(ceil((timeEnd - timeBegin) * invStep)) + 1, 2);
+        table.resize(nodeNum * 9);
+        for (int i = 0; i < 3; ++i)
+            shift[i] = shiftIn[i];
+
+        Eigen::Matrix3f startInverse = poseToMatrixYXZ(start.pitch, start.yaw, start.roll, 0, 0, 0)
+                                       .topLeftCorner<3, 3>().transpose();
+        for (int j = 0; j < nodeNum; ++j){
+            ImuSample cur = start;
+            imuBuffer.at(scanTime + begin + j * imuDeskewTableStep, cur);
+            Eigen::Matrix3f R = startInverse * poseToMatrixYXZ(cur.pitch, cur.yaw, cur.roll, 0, 0, 0).topLeftCorner<3, 3>();
+            float *node = &table[j * 9];
+            for (int r = 0; r < 3; ++r)
+                for (int c = 0; c < 3; ++c)
+                    node[r * 3 + c] = R(r, c);
+        }
+    }
+
+    // 对cloud中从first开始的点去畸变，pointTime[i]为第i个点相对于扫描开始的时间
+    void apply(pcl::PointCloud<PointType> &cloud, const std::vector<float> &pointTime, int first) const {
+
+        int cloudSize = cloud.points.size();
+        const float *nodes = table.data();
+        float maxPos = nodeNum - 1.001f;
+
+        #pragma omp parallel for num_threads(numberOfCores) schedule(static)
+        for (int i = first; i < cloudSize; ++i){
+            float pos = std::min(std::max((pointTime[i] - begin) * invStep, 0.0f), maxPos);
+            int k = int(pos);
+            float w = pos - k;
+            const float *a = nodes + k * 9;
+            const float *b = a + 9;
+            float m[9];
+            for (int e = 0; e < 9; ++e)
+                m[e] = a[e] + w * (b[e] - a[e]);
+
+            PointType &p = cloud.points[i];
+            float x = p.x, y = p.y, z = p.z;
+            p.x = m[0] * x + m[1] * y + m[2] * z + shift[0];
+            p.y = m[3] * x + m[4] * y + m[5] * z + shift[1];
+            p.z = m[6] * x + m[7] * y + m[8] * z + shift[2];
+        }
+    }
+};
+
+#endif
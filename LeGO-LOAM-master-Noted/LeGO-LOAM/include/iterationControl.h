@@ -0,0 +1,116 @@
+#ifndef _ITERATION_CONTROL_H_
+#define _ITERATION_CONTROL_H_
+
+#include "utility.h"
+
+#include <chrono>
+
+/*
+    * featureAssociation(两步LM)和mapOptimization(scan-to-map)中非线性优化的迭代控制
+    * 原来的最大迭代次数、收敛阈值和重新查找对应点的间隔都写死在代码中，这里每个阶段一组参数，
+    * 可在lego_loam/convergence/<stage>/下覆盖(stage为scan2scan_surf、scan2scan_corner、scan2map)：
+    *   max_iterations      最大迭代次数
+    *   delta_r, delta_t    一次迭代的旋转(度)和平移(cm)增量都小于该值时认为收敛
+    *   research_interval   每n次迭代到一次重新查找对应点的时机(第一次迭代总是查找)
+    *   research_delta_r/t  到了重新查找的时机，位姿自上次查找以来累计的旋转(度)和平移(cm)变化都小于该值时沿用上次的对应点，
+    *                       对应点不变时跳过近邻搜索(scan-to-map中还跳过直线/平面拟合)，0表示总是重新查找
+    *   deadline            从这一帧开始优化起的时间限制(ms)，超时后不再开始新的迭代(至少迭代一次)，0表示不限制
+    * 默认值与原来的行为相同
+    */
+class IterationControl{
+
+public:
+
+    typedef std::chrono::steady_clock Clock;
+
+private:
+
+    int maxIterations;
+    float deltaR, deltaT;
+    int researchInterval;
+    float researchDeltaR, researchDeltaT;
+    Clock::duration deadline;
+    bool hasDeadline;
+
+    Clock::time_point deadlineTime;
+    int sinceResearch;              // 上次查找对应点之后的迭代次数
+    float movedR, movedT;           // 上次查找对应点之后累计的位姿变化
+    int iterationNum;
+    int researchNum;
+    bool deadlineHit;
+
+public:
+
+    IterationControl(const string &stage, int maxIterationsIn, float deltaRIn, float deltaTIn, int researchIntervalIn,
+                     float researchDeltaRIn, float researchDeltaTIn, double deadlineMsIn)
+    {
+        double deadlineMs;
+        ros::NodeHandle pnh("lego_loam/convergence/" + stage);
+        pnh.param<int>("max_iterations", maxIterations, maxIterationsIn);
+        pnh.param<float>("delta_r", deltaR, deltaRIn);
+        pnh.param<float>("delta_t", deltaT, deltaTIn);
+        pnh.param<int>("research_interval", researchInterval, researchIntervalIn);
+        pnh.param<float>("research_delta_r", researchDeltaR, researchDeltaRIn);
+        pnh.param<float>("research_delta_t", researchDeltaT, researchDeltaTIn);
+        pnh.param<double>("deadline", deadlineMs, deadlineMsIn);
+
+        maxIterations = std::max(maxIterations, 1);
+        researchInterval = std::max(researchInterval, 1);
+        hasDeadline = deadlineMs > 0;
+        deadline = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double, std::milli>(deadlineMs));
+        start(Clock::now());
+    }
+
+    // 每帧优化开始时调用，同一帧的几个阶段传入相同的frameStart即共用一个时间限制
+    void start(const Clock::time_point &frameStart){
+        deadlineTime = frameStart + deadline;
+        sinceResearch = 0;
+        movedR = movedT = 0;
+        iterationNum = 0;
+        researchNum = 0;
+        deadlineHit = false;
+    }
+
+    // 第iterCount次迭代是否进行
+    bool running(int iterCount){
+        if (iterCount >= maxIterations)
+            return false;
+        if (iterCount > 0 && hasDeadline && Clock::now() >= deadlineTime){
+            deadlineHit = true;
+            return false;
+        }
+        return true;
+    }
+
+    // 每次迭代开始时调用一次，返回true表示这次迭代需要重新查找对应点
+    bool research(){
+        bool search = researchNum == 0 ||
+                      (sinceResearch >= researchInterval && (movedR >= researchDeltaR || movedT >= researchDeltaT));
+        if (search){
+            sinceResearch = 0;
+            movedR = movedT = 0;
+            ++researchNum;
+        }
+        ++sinceResearch;
+        ++iterationNum;
+        return search;
+    }
+
+    // 一次迭代的旋转(度)和平移(cm)增量，返回true表示已收敛
+    bool converged(float iterDeltaR, float iterDeltaT){
+        movedR += iterDeltaR;
+        movedT += iterDeltaT;
+        return iterDeltaR < deltaR && iterDeltaT < deltaT;
+    }
+
+    // 这一帧进行的迭代次数
+    int iterations() const { return iterationNum; }
+
+    // 这一帧查找对应点的次数
+    int researches() const { return researchNum; }
+
+    // 这一帧是否因为时间限制提前结束
+    bool isDeadlineHit() const { return deadlineHit; }
+};
+
+#endif
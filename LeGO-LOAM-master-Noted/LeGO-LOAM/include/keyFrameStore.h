@@ -0,0 +1,246 @@
+#ifndef _KEY_FRAME_STORE_H_
+#define _KEY_FRAME_STORE_H_
+
+#include "utility.h"
+
+#include <list>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+/*
+    * 关键帧点云的外存存储
+    * 原来所有关键帧的corner/surf/outlier点云一直保存在内存中(PointXYZI带填充每个点32字节)，长时间运行时内存无限增长
+    * 这里每个关键帧加入时压缩写入磁盘文件，内存中只保留最近使用的maxResident个关键帧(LRU)，其余的在需要时通过mmap读回
+    * 压缩格式每个点8字节：x/y/z为int16定点数(每个点云单独的比例，关键帧是局部坐标，100m范围内精度约3mm)，
+    * intensity为int16定点数(1/256，保持线号整数部分不变，相对时间部分精度约0.004)
+    * 加入时即按压缩后的精度解码，保证点云无论是否被换出过，读回的结果都相同
+    * 所有接口都是线程安全的
+    */
+class KeyFrameStore{
+
+public:
+
+    struct KeyFrame{
+        pcl::PointCloud<PointType>::ConstPtr corner;
+        pcl::PointCloud<PointType>::ConstPtr surf;
+        pcl::PointCloud<PointType>::ConstPtr outlier;
+    };
+
+private:
+
+    struct PackedPoint{
+        int16_t x, y, z;
+        int16_t intensity;
+    };
+
+    struct CloudHeader{
+        uint32_t pointNum;
+        float scale;    // 坐标 = 定点数 * scale
+    };
+
+    struct Entry{
+        off_t offset;   // 在文件中的起始位置，-1表示文件不可用、只保存在内存中
+        size_t bytes;
+        KeyFrame frame; // 换出后为空
+        std::list<int>::iterator lruIter;
+        bool resident;
+    };
+
+    std::string path;
+    int fd;
+    off_t fileEnd;
+    size_t maxResident;
+
+    std::vector<Entry> entries;
+    std::list<int> lru;     // 最近使用的在前
+    std::vector<uint8_t> buffer;
+
+    std::mutex mtx;
+
+    static constexpr float intensityScale = 256.0f;
+
+    static float cloudScale(const pcl::PointCloud<PointType> &cloud){
+        float maxAbs = 0;
+        for (size_t i = 0; i < cloud.points.size(); ++i){
+            maxAbs = std::max(maxAbs, std::fabs(cloud.points[i].x));
+            maxAbs = std::max(maxAbs, std::fabs(cloud.points[i].y));
+            maxAbs = std::max(maxAbs, std::fabs(cloud.points[i].z));
+        }
+        return maxAbs > 0 ? maxAbs / 32767.0f : 1.0f;
+    }
+
+    static int16_t quantize(float v, float scale){
+        float q = std::round(v / scale);
+        return (int16_t)std::min(std::max(q, -32767.0f), 32767.0f);
+    }
+
+    static void pack(const pcl::PointCloud<PointType> &cloud, std::vector<uint8_t> &out){
+        CloudHeader header;
+        header.pointNum = cloud.points.size();
+        header.scale = cloudScale(cloud);
+        size_t start = out.size();
+        out.resize(start + sizeof(CloudHeader) + header.pointNum * sizeof(PackedPoint));
+        memcpy(&out[start], &header, sizeof(CloudHeader));
+        PackedPoint *packed = (PackedPoint*)&out[start + sizeof(CloudHeader)];
+        for (uint32_t i = 0; i < header.pointNum; ++i){
+            const PointType &p = cloud.points[i];
+            packed[i].x = quantize(p.x, header.scale);
+            packed[i].y = quantize(p.y, header.scale);
+            packed[i].z = quantize(p.z, header.scale);
+            packed[i].intensity = quantize(p.intensity, 1.0f / intensityScale);
+        }
+    }
+
+    // 从ptr处解码一个点云，返回下一个点云的起始位置
+    static const uint8_t* unpack(const uint8_t *ptr, pcl::PointCloud<PointType>::Ptr &cloud){
+        CloudHeader header;
+        memcpy(&header, ptr, sizeof(CloudHeader));
+        ptr += sizeof(CloudHeader);
+        cloud.reset(new pcl::PointCloud<PointType>());
+        cloud->points.resize(header.pointNum);
+        cloud->width = header.pointNum;
+        cloud->height = 1;
+        for (uint32_t i = 0; i < header.pointNum; ++i){
+            PackedPoint packed;
+            memcpy(&packed, ptr + i * sizeof(PackedPoint), sizeof(PackedPoint));
+            PointType &p = cloud->points[i];
+            p.x = packed.x * header.scale;
+            p.y = packed.y * header.scale;
+            p.z = packed.z * header.scale;
+            p.intensity = packed.intensity / intensityScale;
+        }
+        return ptr + header.pointNum * sizeof(PackedPoint);
+    }
+
+    static KeyFrame unpackFrame(const uint8_t *ptr){
+        pcl::PointCloud<PointType>::Ptr corner, surf, outlier;
+        ptr = unpack(ptr, corner);
+        ptr = unpack(ptr, surf);
+        unpack(ptr, outlier);
+        KeyFrame frame;
+        frame.corner = corner;
+        frame.surf = surf;
+        frame.outlier = outlier;
+        return frame;
+    }
+
+    // 通过mmap读回第index个关键帧，mmap的起始位置需要按页对齐
+    bool load(int index, KeyFrame &frame){
+        const Entry &entry = entries[index];
+        long pageSize = sysconf(_SC_PAGESIZE);
+        off_t alignedOffset = entry.offset - entry.offset % pageSize;
+        size_t mapBytes = entry.bytes + (entry.offset - alignedOffset);
+        void *map = mmap(NULL, mapBytes, PROT_READ, MAP_PRIVATE, fd, alignedOffset);
+        if (map == MAP_FAILED){
+            ROS_ERROR("KeyFrameStore: failed to map key frame %d from %s", index, path.c_str());
+            return false;
+        }
+        frame = unpackFrame((const uint8_t*)map + (entry.offset - alignedOffset));
+        munmap(map, mapBytes);
+        return true;
+    }
+
+    void touch(int index){
+        Entry &entry = entries[index];
+        if (entry.resident)
+            lru.erase(entry.lruIter);
+        lru.push_front(index);
+        entry.lruIter = lru.begin();
+        entry.resident = true;
+    }
+
+    // 换出最久未使用的关键帧，已经写入文件的才能换出
+    void evict(){
+        while (lru.size() > maxResident){
+            Entry &entry = entries[lru.back()];
+            if (entry.offset < 0)
+                break;
+            entry.frame = KeyFrame();
+            entry.resident = false;
+            lru.pop_back();
+        }
+    }
+
+public:
+
+    // file: 存储文件路径，启动时清空，析构时删除；residentNum: 内存中最多保留的关键帧数
+    KeyFrameStore(const string &file, int residentNum):
+        path(file),
+        fileEnd(0),
+        maxResident(residentNum)
+    {
+        fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+            ROS_WARN("KeyFrameStore: cannot open %s, key frames will be kept in memory", path.c_str());
+    }
+
+    ~KeyFrameStore(){
+        if (fd >= 0){
+            close(fd);
+            unlink(path.c_str());
+        }
+    }
+
+    int size(){
+        std::lock_guard<std::mutex> lock(mtx);
+        return entries.size();
+    }
+
+    // 加入一个关键帧(局部坐标)，返回其索引
+    int add(const pcl::PointCloud<PointType> &corner, const pcl::PointCloud<PointType> &surf,
+            const pcl::PointCloud<PointType> &outlier){
+
+        std::lock_guard<std::mutex> lock(mtx);
+
+        buffer.clear();
+        pack(corner, buffer);
+        pack(surf, buffer);
+        pack(outlier, buffer);
+
+        Entry entry;
+        entry.offset = -1;
+        entry.bytes = buffer.size();
+        entry.resident = false;
+        if (fd >= 0){
+            if (pwrite(fd, &buffer[0], buffer.size(), fileEnd) == (ssize_t)buffer.size()){
+                entry.offset = fileEnd;
+                fileEnd += buffer.size();
+            }else{
+                ROS_ERROR("KeyFrameStore: failed to write key frame to %s", path.c_str());
+            }
+        }
+        entry.frame = unpackFrame(&buffer[0]);
+
+        entries.push_back(entry);
+        int index = entries.size() - 1;
+        touch(index);
+        evict();
+        return index;
+    }
+
+    // 读取第index个关键帧，不在内存中时从文件读回；返回的点云在换出后仍然有效
+    KeyFrame get(int index){
+
+        std::lock_guard<std::mutex> lock(mtx);
+
+        Entry &entry = entries[index];
+        if (entry.resident == false){
+            KeyFrame frame;
+            if (load(index, frame) == false){
+                frame.corner.reset(new pcl::PointCloud<PointType>());
+                frame.surf.reset(new pcl::PointCloud<PointType>());
+                frame.outlier.reset(new pcl::PointCloud<PointType>());
+                return frame;
+            }
+            entry.frame = frame;
+        }
+        touch(index);
+        KeyFrame frame = entry.frame;
+        evict();
+        return frame;
+    }
+};
+
+#endif
@@ -0,0 +1,134 @@
+#ifndef _KEY_POSE_INDEX_H_
+#define _KEY_POSE_INDEX_H_
+
+#include "utility.h"
+#include "voxelKey.h"
+
+#include <unordered_map>
+#include <boost/thread/shared_mutex.hpp>
+#include <boost/thread/locks.hpp>
+
+/*
+    * 关键帧位置的增量空间索引
+    * 原来回环检测、局部地图重建和全局地图可视化每次都对全部关键帧位置重新setInputCloud构建KD树，耗时随轨迹长度线性增长
+    * 这里用一个各线程共享的均匀网格哈希：新关键帧O(1)追加，回环修正后批量更新位置，
+    * 半径查询只访问与查询球相交的网格(网格较多时改为遍历非空网格)，读写锁允许多个线程同时查询
+    * 查询结果按距离从近到远排列，与KdTreeFLANN::radiusSearch一致
+    */
+class KeyPoseIndex{
+
+private:
+
+    float cellSize;
+    std::vector<PointType> positions;
+    std::unordered_map<uint64_t, std::vector<int>, VoxelKeyHash> cells;
+
+    mutable boost::shared_mutex mtx;
+
+    int indexOf(float v) const {
+        return (int)floor(v / cellSize);
+    }
+
+    uint64_t keyOf(const PointType &p) const {
+        return packVoxelKey(indexOf(p.x), indexOf(p.y), indexOf(p.z));
+    }
+
+    void insertCell(int index){
+        cells[keyOf(positions[index])].push_back(index);
+    }
+
+    void collect(const std::vector<int> &cell, const PointType &query, float sqRadius,
+                 std::vector<std::pair<float, int> > &found) const {
+        for (size_t i = 0; i < cell.size(); ++i){
+            const PointType &p = positions[cell[i]];
+            float dx = p.x - query.x, dy = p.y - query.y, dz = p.z - query.z;
+            float sqDis = dx * dx + dy * dy + dz * dz;
+            if (sqDis <= sqRadius)
+                found.push_back(std::make_pair(sqDis, cell[i]));
+        }
+    }
+
+public:
+
+    KeyPoseIndex(float cell):
+        cellSize(cell)
+    {
+    }
+
+    int size() const {
+        boost::shared_lock<boost::shared_mutex> lock(mtx);
+        return positions.size();
+    }
+
+    // saveKeyFramesAndFactor中追加新的关键帧位置，索引与cloudKeyPoses3D相同
+    void add(const PointType &position){
+        boost::unique_lock<boost::shared_mutex> lock(mtx);
+        positions.push_back(position);
+        insertCell(positions.size() - 1);
+    }
+
+    // correctPoses中回环修正之后，按cloudKeyPoses3D批量更新所有位置
+    void update(const pcl::PointCloud<PointType> &keyPoses){
+        boost::unique_lock<boost::shared_mutex> lock(mtx);
+        positions.assign(keyPoses.points.begin(), keyPoses.points.end());
+        cells.clear();
+        for (int i = 0; i < (int)positions.size(); ++i)
+            insertCell(i);
+    }
+
+    // 只有第begin个之后的关键帧位置被修正时(滑动窗口的位姿图)，只移动这些关键帧所在的网格
+    void update(const pcl::PointCloud<PointType> &keyPoses, int begin){
+        boost::unique_lock<boost::shared_mutex> lock(mtx);
+        positions.resize(keyPoses.points.size());
+        for (int i = std::max(begin, 0); i < (int)positions.size(); ++i){
+            uint64_t oldKey = keyOf(positions[i]);
+            positions[i] = keyPoses.points[i];
+            uint64_t newKey = keyOf(positions[i]);
+            if (newKey == oldKey)
+                continue;
+            std::vector<int> &cell = cells[oldKey];
+            cell.erase(std::remove(cell.begin(), cell.end(), i), cell.end());
+            if (cell.empty())
+                cells.erase(oldKey);
+            insertCell(i);
+        }
+    }
+
+    // 查询与query距离不超过radius的关键帧，结果按距离从近到远排列
+    int radiusSearch(const PointType &query, float radius, std::vector<int> &indices, std::vector<float> &sqDistances) const {
+
+        boost::shared_lock<boost::shared_mutex> lock(mtx);
+
+        std::vector<std::pair<float, int> > found;
+        float sqRadius = radius * radius;
+        int x0 = indexOf(query.x - radius), x1 = indexOf(query.x + radius);
+        int y0 = indexOf(query.y - radius), y1 = indexOf(query.y + radius);
+        int z0 = indexOf(query.z - radius), z1 = indexOf(query.z + radius);
+        double boxCells = double(x1 - x0 + 1) * (y1 - y0 + 1) * (z1 - z0 + 1);
+
+        if (boxCells <= cells.size()){
+            for (int x = x0; x <= x1; ++x)
+                for (int y = y0; y <= y1; ++y)
+                    for (int z = z0; z <= z1; ++z){
+                        auto it = cells.find(packVoxelKey(x, y, z));
+                        if (it != cells.end())
+                            collect(it->second, query, sqRadius, found);
+                    }
+        }else{
+            // 查询范围很大时(如全局地图可视化)直接遍历非空网格
+            for (auto it = cells.begin(); it != cells.end(); ++it)
+                collect(it->second, query, sqRadius, found);
+        }
+
+        std::sort(found.begin(), found.end());
+        indices.resize(found.size());
+        sqDistances.resize(found.size());
+        for (size_t i = 0; i < found.size(); ++i){
+            sqDistances[i] = found[i].first;
+            indices[i] = found[i].second;
+        }
+        return found.size();
+    }
+};
+
+#endif
@@ -0,0 +1,148 @@
+#ifndef _LOAD_SHEDDER_H_
+#define _LOAD_SHEDDER_H_
+
+#include "utility.h"
+
+#include <mutex>
+
+/*
+    * mapOptimization建图跟不上输入时的降级控制
+    * 原来建图流水线的入口队列满时阻塞回调线程，ROS订阅队列(长度2)中的点云被直接丢弃，建图周期整段跳过，
+    * 这里按每帧scan-to-map的耗时与帧间隔之比(指数平滑)以及入口队列是否已满，逐级降低建图的计算量：
+    *   level 1: 界外点(outlier)降采样体素增大到两倍
+    *   level 2: 当前帧边缘点/平面点降采样体素增大到1.5倍
+    *   level 3: 界外点不再参与scan-to-map匹配(仍然保存在关键帧中)，局部地图半径缩小到0.7倍
+    *   level 4: 当前帧降采样体素增大到两倍，局部地图半径缩小到0.5倍
+    *   level 5: 另外请求featureAssociation每次多跳过一帧再发送给mapOptimization(/mapping_backpressure)
+    * 平滑后的负载超过high_ratio或入口队列已满且连续escalate_frames帧时升一级，低于low_ratio且连续recover_frames帧时降一级，
+    * 每次调整后等待hold_frames帧再判断，使调整的效果体现在耗时中
+    * featureAssociation和transformFusion的里程计始终全速运行，只降低建图的精度和频率
+    * 参数在lego_loam/load_shedding/下设置：enable, high_ratio, low_ratio, escalate_frames, recover_frames, hold_frames, max_level
+    * 耗时依赖系统时钟，离线回放(要求结果可复现)时默认关闭
+    */
+class LoadShedder{
+
+public:
+
+    // 一帧建图使用的降级设置，在送入流水线时取出，各阶段只读
+    struct Settings{
+        int level;
+        float cornerLeaf;       // 当前帧边缘点降采样体素
+        float surfLeaf;         // 当前帧平面点降采样体素
+        float outlierLeaf;      // 当前帧界外点降采样体素
+        bool matchOutliers;     // 界外点是否参与scan-to-map匹配
+        float submapScale;      // 局部地图半径(关键帧数)的比例
+        int extraSkipFrames;    // 请求featureAssociation额外跳过的帧数
+
+        Settings(int levelIn = 0):
+            level(levelIn),
+            cornerLeaf(levelIn >= 4 ? 0.4 : (levelIn >= 2 ? 0.3 : 0.2)),
+            surfLeaf(levelIn >= 4 ? 0.8 : (levelIn >= 2 ? 0.6 : 0.4)),
+            outlierLeaf(levelIn >= 1 ? 0.8 : 0.4),
+            matchOutliers(levelIn < 3),
+            submapScale(levelIn >= 4 ? 0.5 : (levelIn >= 3 ? 0.7 : 1.0)),
+            extraSkipFrames(levelIn >= 5 ? 1 : 0)
+        {
+        }
+    };
+
+    static const int MaxLevel = 5;
+
+private:
+
+    bool enabled;
+    float highRatio, lowRatio;
+    int escalateFrames, recoverFrames, holdFrames;
+    int maxLevel;
+
+    std::mutex mtx;
+    Settings settings;
+    double load;            // 平滑后的耗时/帧间隔
+    double lastStamp;
+    int overFrames, underFrames, holdLeft;
+    bool queueFull;
+
+    void setLevel(int level){
+        settings = Settings(level);
+        overFrames = underFrames = 0;
+        holdLeft = holdFrames;
+    }
+
+public:
+
+    LoadShedder():
+        load(0),
+        lastStamp(-1),
+        overFrames(0),
+        underFrames(0),
+        holdLeft(0),
+        queueFull(false)
+    {
+        ros::NodeHandle pnh("lego_loam/load_shedding");
+        pnh.param<bool>("enable", enabled, loadSheddingFlag);
+        pnh.param<float>("high_ratio", highRatio, loadSheddingHighRatio);
+        pnh.param<float>("low_ratio", lowRatio, loadSheddingLowRatio);
+        pnh.param<int>("escalate_frames", escalateFrames, 3);
+        pnh.param<int>("recover_frames", recoverFrames, 20);
+        pnh.param<int>("hold_frames", holdFrames, 5);
+        pnh.param<int>("max_level", maxLevel, int(MaxLevel));
+        maxLevel = std::min(std::max(maxLevel, 0), int(MaxLevel));
+    }
+
+    bool isEnabled() const { return enabled; }
+
+    // 主线程送入流水线之前调用，入口队列已满说明建图跟不上输入
+    void markQueueFull(){
+        std::lock_guard<std::mutex> lock(mtx);
+        queueFull = true;
+    }
+
+    // 主线程送入流水线时取出这一帧的设置
+    Settings current(){
+        std::lock_guard<std::mutex> lock(mtx);
+        return settings;
+    }
+
+    // scan-to-map线程处理完一帧后调用，stamp为点云时间戳(s)，latencyMs为这一帧的处理耗时
+    // 返回true表示级别发生了变化
+    bool addFrame(double stamp, double latencyMs){
+        if (enabled == false)
+            return false;
+
+        std::lock_guard<std::mutex> lock(mtx);
+        double period = stamp - lastStamp;
+        lastStamp = stamp;
+        // 第一帧或时间戳跳变(回放重新开始)时只记录时间戳
+        if (period <= 0 || period > 10 * mappingProcessInterval)
+            return false;
+
+        load = load == 0 ? latencyMs / (period * 1000) : 0.8 * load + 0.2 * latencyMs / (period * 1000);
+        bool over = load > highRatio || queueFull;
+        bool under = load < lowRatio && queueFull == false;
+        queueFull = false;
+
+        if (holdLeft > 0){
+            --holdLeft;
+            return false;
+        }
+
+        overFrames = over ? overFrames + 1 : 0;
+        underFrames = under ? underFrames + 1 : 0;
+        if (overFrames >= escalateFrames && settings.level < maxLevel){
+            setLevel(settings.level + 1);
+            return true;
+        }
+        if (underFrames >= recoverFrames && settings.level > 0){
+            setLevel(settings.level - 1);
+            return true;
+        }
+        return false;
+    }
+
+    double currentLoad(){
+        std::lock_guard<std::mutex> lock(mtx);
+        return load;
+    }
+};
+
+#endif
@@ -0,0 +1,220 @@
+#ifndef _LOCAL_VOXEL_MAP_H_
+#define _LOCAL_VOXEL_MAP_H_
+
+#include "utility.h"
+#include "voxelKey.h"
+
+#include <unordered_map>
+
+/*
+    * 基于体素哈希的增量式局部地图，替代每帧重新拼接submap + VoxelGrid降采样 + 重建KD树的流程
+    * 两层结构：
+    *   leaf  : 降采样体素(大小与原downSizeFilter一致)，保存落入该体素所有点的均值(与VoxelGrid结果相同)
+    *   block : 由整数个leaf组成的哈希块，边长不小于近邻搜索半径，查询时只需访问周围3x3x3个block
+    * 每个block记录最近一次向其插入点的关键帧位置和序号，当该位置离开搜索半径(evict)或序号早于最近N个关键帧(evictOlderThan)时整个block被移除，
+    * 这样与原来"距离当前位置surroundingKeyframeSearchRadius以内的关键帧构成submap"
+    * 或"最近surroundingKeyframeSearchNum个关键帧构成submap"(开启回环时)的语义保持一致
+    */
+class LocalVoxelMap{
+
+private:
+
+    struct Block{
+        std::vector<int> leaves;    // 该block内的leaf在points中的索引
+        PointType origin;           // 最近一次插入该block的关键帧位置(世界坐标)
+        int keyFrame;               // 最近一次插入该block的关键帧序号
+    };
+
+    float leafSize;
+    float blockSize;
+    int blockRatio;     // 每个block在各方向上包含的leaf数
+    float searchSqRadius;
+
+    typedef std::unordered_map<uint64_t, Block, VoxelKeyHash> BlockMap;
+    BlockMap blocks;
+
+    std::vector<PointType> points;  // 各leaf的均值点，可通过索引直接访问
+    std::vector<int> pointCounts;   // 各leaf累计的点数，0表示该位置空闲
+    std::vector<uint64_t> leafKeys;
+    std::vector<int> freeLeaves;
+    int leafNum;
+
+    int indexOf(float v, float size) const {
+        return (int)floor(v / size);
+    }
+
+    // leaf索引 -> block索引(向下取整)
+    int blockIndexOf(int leafIndex) const {
+        return leafIndex >= 0 ? leafIndex / blockRatio : -((-leafIndex - 1) / blockRatio) - 1;
+    }
+
+    // 释放block中的leaf，返回下一个block
+    BlockMap::iterator removeBlock(BlockMap::iterator iter){
+        for (int j = 0; j < iter->second.leaves.size(); ++j){
+            int leafInd = iter->second.leaves[j];
+            pointCounts[leafInd] = 0;
+            freeLeaves.push_back(leafInd);
+            --leafNum;
+        }
+        return blocks.erase(iter);
+    }
+
+public:
+
+    // leaf: 降采样体素大小，searchRadius: nearestKSearch保证精确的最大近邻距离
+    LocalVoxelMap(float leaf, float searchRadius):
+        leafSize(leaf),
+        blockSize(leaf * ceil(searchRadius / leaf)),
+        blockRatio((int)ceil(searchRadius / leaf)),
+        searchSqRadius(searchRadius * searchRadius),
+        leafNum(0)
+    {
+    }
+
+    int size() const {
+        return leafNum;
+    }
+
+    const PointType& operator[](int index) const {
+        return points[index];
+    }
+
+    void clear(){
+        blocks.clear();
+        points.clear();
+        pointCounts.clear();
+        leafKeys.clear();
+        freeLeaves.clear();
+        leafNum = 0;
+    }
+
+    // 插入一帧世界坐标系下的点云，origin为该关键帧的位置，keyFrame为该关键帧的序号(不按序号移除时可以省略)
+    void insert(const pcl::PointCloud<PointType> &cloud, const PointType &origin, int keyFrame = 0){
+
+        int cloudSize = cloud.points.size();
+        for (int i = 0; i < cloudSize; ++i){
+
+            const PointType &p = cloud.points[i];
+            int lx = indexOf(p.x, leafSize), ly = indexOf(p.y, leafSize), lz = indexOf(p.z, leafSize);
+            uint64_t leafKey = packVoxelKey(lx, ly, lz);
+
+            // blockSize是leafSize的整数倍，因此每个leaf完整地落在一个block里
+            Block &block = blocks[packVoxelKey(blockIndexOf(lx), blockIndexOf(ly), blockIndexOf(lz))];
+            block.origin = origin;
+            block.keyFrame = keyFrame;
+
+            int leafInd = -1;
+            for (int j = 0; j < block.leaves.size(); ++j){
+                if (leafKeys[block.leaves[j]] == leafKey){
+                    leafInd = block.leaves[j];
+                    break;
+                }
+            }
+
+            if (leafInd == -1){
+                if (!freeLeaves.empty()){
+                    leafInd = freeLeaves.back();
+                    freeLeaves.pop_back();
+                    points[leafInd] = p;
+                    pointCounts[leafInd] = 1;
+                    leafKeys[leafInd] = leafKey;
+                }else{
+                    leafInd = points.size();
+                    points.push_back(p);
+                    pointCounts.push_back(1);
+                    leafKeys.push_back(leafKey);
+                }
+                block.leaves.push_back(leafInd);
+                ++leafNum;
+                continue;
+            }
+
+            // 增量式求均值，与VoxelGrid对体素内所有点取平均等价
+            PointType &mean = points[leafInd];
+            float w = 1.0 / (++pointCounts[leafInd]);
+            mean.x += (p.x - mean.x) * w;
+            mean.y += (p.y - mean.y) * w;
+            mean.z += (p.z - mean.z) * w;
+            mean.intensity += (p.intensity - mean.intensity) * w;
+        }
+    }
+
+    // 移除所有最近一次观测关键帧距离center超过radius的block
+    void evict(const PointType &center, float radius){
+
+        float sqRadius = radius * radius;
+        for (auto iter = blocks.begin(); iter != blocks.end();){
+            const PointType &o = iter->second.origin;
+            float dx = o.x - center.x, dy = o.y - center.y, dz = o.z - center.z;
+            if (dx * dx + dy * dy + dz * dz > sqRadius)
+                iter = removeBlock(iter);
+            else
+                ++iter;
+        }
+    }
+
+    // 移除所有最近一次观测关键帧的序号小于keyFrame的block
+    void evictOlderThan(int keyFrame){
+
+        for (auto iter = blocks.begin(); iter != blocks.end();){
+            if (iter->second.keyFrame < keyFrame)
+                iter = removeBlock(iter);
+            else
+                ++iter;
+        }
+    }
+
+    // k近邻搜索，只返回searchRadius以内的点，按距离从小到大排列，返回找到的点数
+    // 当第k个近邻在searchRadius以内时，结果与对降采样submap建KD树搜索的结果相同
+    // candidates为调用者提供的缓存，不修改地图本身，因此可以多线程同时查询
+    int nearestKSearch(const PointType &point, int k, std::vector<int> &pointSearchInd, std::vector<float> &pointSearchSqDis,
+                       std::vector<std::pair<float, int> > &candidates) const {
+
+        candidates.clear();
+
+        int bx = blockIndexOf(indexOf(point.x, leafSize));
+        int by = blockIndexOf(indexOf(point.y, leafSize));
+        int bz = blockIndexOf(indexOf(point.z, leafSize));
+
+        for (int ix = bx - 1; ix <= bx + 1; ++ix){
+            for (int iy = by - 1; iy <= by + 1; ++iy){
+                for (int iz = bz - 1; iz <= bz + 1; ++iz){
+                    auto iter = blocks.find(packVoxelKey(ix, iy, iz));
+                    if (iter == blocks.end())
+                        continue;
+                    const std::vector<int> &leaves = iter->second.leaves;
+                    for (int j = 0; j < leaves.size(); ++j){
+                        const PointType &q = points[leaves[j]];
+                        float dx = q.x - point.x, dy = q.y - point.y, dz = q.z - point.z;
+                        float sqDis = dx * dx + dy * dy + dz * dz;
+                        if (sqDis < searchSqRadius)
+                            candidates.push_back(std::make_pair(sqDis, leaves[j]));
+                    }
+                }
+            }
+        }
+
+        int found = std::min(k, (int)candidates.size());
+        std::partial_sort(candidates.begin(), candidates.begin() + found, candidates.end());
+
+        pointSearchInd.resize(found);
+        pointSearchSqDis.resize(found);
+        for (int j = 0; j < found; ++j){
+            pointSearchSqDis[j] = candidates[j].first;
+            pointSearchInd[j] = candidates[j].second;
+        }
+        return found;
+    }
+
+    // 导出当前地图中的所有点，仅用于可视化
+    void getCloud(pcl::PointCloud<PointType> &cloudOut) const {
+        cloudOut.clear();
+        cloudOut.reserve(leafNum);
+        for (int i = 0; i < points.size(); ++i){
+            if (pointCounts[i] > 0)
+                cloudOut.push_back(points[i]);
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,344 @@
+#ifndef _LOCALIZATION_MAP_H_
+#define _LOCALIZATION_MAP_H_
+
+#include "utility.h"
+#include "voxelKey.h"
+
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <unordered_map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+/*
+    * 纯定位模式使用的分块二进制地图(fileDirectory/localizationMap.bin)
+    * 建图结束时由MapExporter按导出地图的分块写入(与mapTiles/下的块相同)，文件结构：
+    *   文件头 | 各块的点(float x, y, z, intensity，世界坐标系) | 块索引(层、块在x-z平面上的位置和大小、点数、偏移)
+    * 启动时只读入文件头和块索引，几千个块也只需几毫秒，
+    * 运行时只加载与当前位置水平距离在radius以内的块，块中心的水平距离超过radius + 最大块大小之后卸载(留出余量避免在块边界上反复加载)
+    * 块按(x, z)网格索引建哈希表，每次只访问radius覆盖的网格，开销与地图总块数无关；
+    * 块的读取在后台线程中进行，scan-to-map线程只发出请求并取走已读入的块，不做文件I/O
+    * 点云坐标轴为左上前(y轴向上)，与mapOptimization中的局部地图相同
+    */
+class LocalizationMap{
+
+public:
+
+    enum Layer{ Corner = 0, Surf = 1 };
+
+private:
+
+    struct FileHeader{
+        char magic[8];
+        uint32_t version;
+        uint32_t tileNum;
+        uint64_t indexOffset;
+    };
+
+    struct TileEntry{
+        int32_t layer;
+        int32_t x, z;       // 块的索引，覆盖[x * size, (x + 1) * size) x [z * size, (z + 1) * size)
+        float size;
+        uint64_t offset;
+        uint32_t pointNum;
+        uint32_t reserved;
+    };
+
+    static const char *magicString(){ return "LEGOMAP"; }
+    static const uint32_t Version = 1;
+
+    // 相同大小的块构成一个网格，网格索引 -> 该位置各层的块
+    struct Grid{
+        float size;
+        std::unordered_map<uint64_t, std::vector<int>, VoxelKeyHash> cells;
+    };
+
+    string file;
+    std::vector<TileEntry> index;
+    std::vector<Grid> grids;        // 通常两层的块大小相同，只有一个网格
+    float maxTileSize;
+    std::unordered_map<int, pcl::PointCloud<PointType>::Ptr> loaded;
+    std::vector<char> pending;      // 已请求但还未取走的块，只在调用update的线程中访问
+
+    // 后台读取线程的请求和结果，读取失败的块结果为空指针
+    std::deque<int> requests;
+    std::vector<std::pair<int, pcl::PointCloud<PointType>::Ptr> > ready;
+    bool stopRequested;
+    std::mutex mtx;
+    std::condition_variable requestReady;
+    std::thread loader;
+
+    // 水平面上position到块的最近距离
+    static float distanceTo(const TileEntry &tile, const PointType &position){
+        float x0 = tile.x * tile.size, z0 = tile.z * tile.size;
+        float dx = std::max(std::max(x0 - position.x, position.x - (x0 + tile.size)), 0.0f);
+        float dz = std::max(std::max(z0 - position.z, position.z - (z0 + tile.size)), 0.0f);
+        return sqrt(dx * dx + dz * dz);
+    }
+
+    void buildGrids(){
+        grids.clear();
+        for (int i = 0; i < (int)index.size(); ++i){
+            const TileEntry &tile = index[i];
+            size_t g = 0;
+            while (g < grids.size() && grids[g].size != tile.size)
+                ++g;
+            if (g == grids.size()){
+                grids.push_back(Grid());
+                grids[g].size = tile.size;
+            }
+            grids[g].cells[packVoxelKey(tile.x, 0, tile.z)].push_back(i);
+        }
+    }
+
+    // 卸载的判据，与LocalVoxelMap::evict(horizontalPosition, unloadRadius)对以centerOf为观测位置插入的block的判断相同
+    bool outOfRange(int tile, const PointType &position, float radius) const {
+        PointType center = centerOf(tile);
+        float dx = center.x - position.x, dz = center.z - position.z;
+        float r = unloadRadius(radius);
+        return dx * dx + dz * dz > r * r;
+    }
+
+    void loaderThread(){
+        while (true){
+            int tile;
+            {
+                std::unique_lock<std::mutex> lock(mtx);
+                requestReady.wait(lock, [this]{ return stopRequested || !requests.empty(); });
+                if (stopRequested)
+                    break;
+                tile = requests.front();
+                requests.pop_front();
+            }
+            pcl::PointCloud<PointType>::Ptr cloud(new pcl::PointCloud<PointType>());
+            if (readTile(tile, *cloud) == false)
+                cloud.reset();
+            std::lock_guard<std::mutex> lock(mtx);
+            ready.push_back(std::make_pair(tile, cloud));
+        }
+    }
+
+    void stopLoader(){
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            stopRequested = true;
+            requestReady.notify_one();
+        }
+        if (loader.joinable())
+            loader.join();
+        stopRequested = false;
+        requests.clear();
+        ready.clear();
+    }
+
+    bool readTile(int i, pcl::PointCloud<PointType> &cloud) const {
+        const TileEntry &tile = index[i];
+        FILE *fp = fopen(file.c_str(), "rb");
+        if (fp == NULL)
+            return false;
+        std::vector<float> data(4 * (size_t)tile.pointNum);
+        bool ok = fseeko(fp, tile.offset, SEEK_SET) == 0 &&
+                  fread(data.data(), sizeof(float), data.size(), fp) == data.size();
+        fclose(fp);
+        if (!ok)
+            return false;
+        cloud.resize(tile.pointNum);
+        for (size_t j = 0; j < tile.pointNum; ++j){
+            cloud.points[j].x = data[4 * j];
+            cloud.points[j].y = data[4 * j + 1];
+            cloud.points[j].z = data[4 * j + 2];
+            cloud.points[j].intensity = data[4 * j + 3];
+        }
+        return true;
+    }
+
+public:
+
+    // 顺序写入各块，最后写入块索引
+    class Writer{
+
+    private:
+
+        FILE *fp;
+        std::vector<TileEntry> entries;
+
+    public:
+
+        Writer(): fp(NULL) {}
+
+        ~Writer(){
+            if (fp != NULL)
+                fclose(fp);
+        }
+
+        bool open(const string &fileName){
+            fp = fopen(fileName.c_str(), "wb");
+            if (fp == NULL)
+                return false;
+            FileHeader header;
+            memset(&header, 0, sizeof(header));
+            return fwrite(&header, sizeof(header), 1, fp) == 1;
+        }
+
+        bool add(Layer layer, int x, int z, float size, const pcl::PointCloud<PointType> &cloud){
+            TileEntry entry;
+            memset(&entry, 0, sizeof(entry));
+            entry.layer = layer;
+            entry.x = x;
+            entry.z = z;
+            entry.size = size;
+            entry.offset = ftello(fp);
+            entry.pointNum = cloud.points.size();
+            std::vector<float> data(4 * cloud.points.size());
+            for (size_t j = 0; j < cloud.points.size(); ++j){
+                data[4 * j] = cloud.points[j].x;
+                data[4 * j + 1] = cloud.points[j].y;
+                data[4 * j + 2] = cloud.points[j].z;
+                data[4 * j + 3] = cloud.points[j].intensity;
+            }
+            entries.push_back(entry);
+            return fwrite(data.data(), sizeof(float), data.size(), fp) == data.size();
+        }
+
+        bool close(){
+            FileHeader header;
+            memset(&header, 0, sizeof(header));
+            strncpy(header.magic, magicString(), sizeof(header.magic));
+            header.version = Version;
+            header.tileNum = entries.size();
+            header.indexOffset = ftello(fp);
+            bool ok = fwrite(entries.data(), sizeof(TileEntry), entries.size(), fp) == entries.size() &&
+                      fseeko(fp, 0, SEEK_SET) == 0 &&
+                      fwrite(&header, sizeof(header), 1, fp) == 1;
+            ok = fclose(fp) == 0 && ok;
+            fp = NULL;
+            return ok;
+        }
+    };
+
+    LocalizationMap(): maxTileSize(0), stopRequested(false) {}
+
+    ~LocalizationMap(){
+        stopLoader();
+    }
+
+    // 读入块索引并启动后台读取线程，文件不存在或格式不对时返回false
+    bool open(const string &fileName){
+        stopLoader();
+        file = fileName;
+        index.clear();
+        loaded.clear();
+        pending.clear();
+        grids.clear();
+        maxTileSize = 0;
+        FILE *fp = fopen(file.c_str(), "rb");
+        if (fp == NULL)
+            return false;
+        FileHeader header;
+        bool ok = fread(&header, sizeof(header), 1, fp) == 1 &&
+                  strncmp(header.magic, magicString(), sizeof(header.magic)) == 0 &&
+                  header.version == Version;
+        if (ok){
+            index.resize(header.tileNum);
+            ok = fseeko(fp, header.indexOffset, SEEK_SET) == 0 &&
+                 fread(index.data(), sizeof(TileEntry), index.size(), fp) == index.size();
+        }
+        fclose(fp);
+        if (!ok){
+            index.clear();
+            return false;
+        }
+        for (size_t i = 0; i < index.size(); ++i)
+            maxTileSize = std::max(maxTileSize, index[i].size);
+        pending.assign(index.size(), 0);
+        buildGrids();
+        loader = std::thread(&LocalizationMap::loaderThread, this);
+        return true;
+    }
+
+    int tileNum() const { return index.size(); }
+
+    // 卸载半径，加载时块的最近距离在radius以内，块中心的距离不超过radius + size/sqrt(2)，因此刚加载的块不会被卸载
+    float unloadRadius(float radius) const { return radius + maxTileSize; }
+
+    // 按当前位置卸载块、取走后台已读入的块并请求新进入radius的块，不等待读取完成
+    // added为本次新加载的块，返回true表示有块被卸载，
+    // 调用者用LocalVoxelMap::evict(水平位置, unloadRadius(radius))从局部地图中移除这些块的体素
+    bool update(const PointType &position, float radius, std::vector<int> &added){
+        added.clear();
+        bool removed = false;
+        for (auto it = loaded.begin(); it != loaded.end(); ){
+            if (outOfRange(it->first, position, radius)){
+                it = loaded.erase(it);
+                removed = true;
+            }else{
+                ++it;
+            }
+        }
+
+        std::vector<std::pair<int, pcl::PointCloud<PointType>::Ptr> > finished;
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            finished.swap(ready);
+        }
+        for (size_t j = 0; j < finished.size(); ++j){
+            int i = finished[j].first;
+            pending[i] = 0;
+            if (!finished[j].second){
+                ROS_ERROR_THROTTLE(5.0, "LocalizationMap: failed to read tile %d from %s", i, file.c_str());
+                continue;
+            }
+            // 读取期间已经离开的块直接丢弃
+            if (outOfRange(i, position, radius))
+                continue;
+            loaded[i] = finished[j].second;
+            added.push_back(i);
+        }
+
+        // 只访问与以position为中心、边长2 * radius的正方形相交的网格
+        std::vector<int> wanted;
+        for (size_t g = 0; g < grids.size(); ++g){
+            const Grid &grid = grids[g];
+            int x0 = (int)floor((position.x - radius) / grid.size), x1 = (int)floor((position.x + radius) / grid.size);
+            int z0 = (int)floor((position.z - radius) / grid.size), z1 = (int)floor((position.z + radius) / grid.size);
+            for (int x = x0; x <= x1; ++x){
+                for (int z = z0; z <= z1; ++z){
+                    auto cell = grid.cells.find(packVoxelKey(x, 0, z));
+                    if (cell == grid.cells.end())
+                        continue;
+                    for (size_t j = 0; j < cell->second.size(); ++j){
+                        int i = cell->second[j];
+                        if (pending[i] || loaded.count(i) || distanceTo(index[i], position) > radius)
+                            continue;
+                        pending[i] = 1;
+                        wanted.push_back(i);
+                    }
+                }
+            }
+        }
+        if (!wanted.empty()){
+            std::lock_guard<std::mutex> lock(mtx);
+            requests.insert(requests.end(), wanted.begin(), wanted.end());
+            requestReady.notify_one();
+        }
+        return removed;
+    }
+
+    Layer layerOf(int tile) const { return (Layer)index[tile].layer; }
+
+    const pcl::PointCloud<PointType> &cloudOf(int tile) const { return *loaded.at(tile); }
+
+    // 块的中心，插入局部地图时作为观测位置
+    PointType centerOf(int tile) const {
+        PointType center;
+        center.x = (index[tile].x + 0.5) * index[tile].size;
+        center.y = 0;
+        center.z = (index[tile].z + 0.5) * index[tile].size;
+        center.intensity = 0;
+        return center;
+    }
+};
+
+#endif
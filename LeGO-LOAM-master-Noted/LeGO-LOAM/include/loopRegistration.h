@@ -0,0 +1,252 @@
+#ifndef _LOOP_REGISTRATION_H_
+#define _LOOP_REGISTRATION_H_
+
+#include "utility.h"
+#include "normalEquations.h"
+
+#include <omp.h>
+#include <Eigen/StdVector>
+
+/*
+    * 回环检测的点云配准，替代pcl::IterativeClosestPoint
+    * 原来的ICP最大对应距离为100m、最多迭代100次，每次迭代都在完整分辨率的子图上做最近邻搜索，耗时可达几百毫秒
+    * 这里使用点到平面的ICP，由粗到细在体素金字塔上迭代：
+    *   粗层对应距离大，用于消除回环处较大的漂移；细层对应距离小，只保留可靠的对应点
+    *   目标点云每层预先建立KD树并用最近的5个点拟合平面得到法向量，同一个待回环子图重复配准时直接复用
+    *   对应点搜索和法方程累加按线程并行，每个线程累加自己的NormalEquations，最后合并
+    * 配准后的得分与pcl::Registration::getFitnessScore()相同：
+    * 变换后的源点云每个点到最细层目标点云最近点的距离平方的均值，继续用historyKeyframeFitnessScore判断
+    */
+class LoopRegistration{
+
+private:
+
+    struct Level{
+        float leafSize;              // 该层体素大小，0表示直接使用输入点云
+        float maxCorrespondenceDis;  // 该层的最大对应距离
+        pcl::PointCloud<PointType>::Ptr target;
+        pcl::KdTreeFLANN<PointType>::Ptr kdtree;
+        std::vector<Eigen::Vector4f, Eigen::aligned_allocator<Eigen::Vector4f> > planes; // 平面参数(nx, ny, nz, d)，拟合失败时为0
+    };
+
+    struct ThreadScratch{
+        std::vector<int> pointSearchInd;
+        std::vector<float> pointSearchSqDis;
+        NormalEquations<6> equations;
+        int correspondenceNum;
+        EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+    };
+
+    std::vector<Level> levels;
+    std::vector<ThreadScratch, Eigen::aligned_allocator<ThreadScratch> > scratch;
+    pcl::VoxelGrid<PointType> downSizeFilter;
+
+    bool converged;
+    double fitness;
+
+    int threadIndex(){
+#ifdef _OPENMP
+        return omp_get_thread_num();
+#else
+        return 0;
+#endif
+    }
+
+    // 用最近的5个点拟合平面，与surfOptimization中的方法相同
+    static Eigen::Vector4f fitPlane(const pcl::PointCloud<PointType> &cloud, const std::vector<int> &indices){
+        Eigen::Matrix<float, 5, 3> matA0;
+        Eigen::Matrix<float, 5, 1> matB0 = -Eigen::Matrix<float, 5, 1>::Ones();
+        for (int j = 0; j < 5; j++){
+            const PointType &p = cloud.points[indices[j]];
+            matA0.row(j) << p.x, p.y, p.z;
+        }
+        Eigen::Vector3f norm = matA0.colPivHouseholderQr().solve(matB0);
+        float ps = norm.norm();
+        if (ps < 1e-6)
+            return Eigen::Vector4f::Zero();
+        Eigen::Vector4f plane(norm(0) / ps, norm(1) / ps, norm(2) / ps, 1.0f / ps);
+        for (int j = 0; j < 5; j++){
+            const PointType &p = cloud.points[indices[j]];
+            if (fabs(plane(0) * p.x + plane(1) * p.y + plane(2) * p.z + plane(3)) > 0.2)
+                return Eigen::Vector4f::Zero();
+        }
+        return plane;
+    }
+
+    void buildLevel(Level &level, const pcl::PointCloud<PointType>::ConstPtr &cloud){
+        level.target.reset(new pcl::PointCloud<PointType>());
+        if (level.leafSize > 0){
+            downSizeFilter.setLeafSize(level.leafSize, level.leafSize, level.leafSize);
+            downSizeFilter.setInputCloud(cloud);
+            downSizeFilter.filter(*level.target);
+        }else{
+            *level.target = *cloud;
+        }
+        level.kdtree.reset(new pcl::KdTreeFLANN<PointType>());
+        level.planes.assign(level.target->points.size(), Eigen::Vector4f::Zero());
+        if (level.target->points.size() < 5)
+            return;
+        level.kdtree->setInputCloud(level.target);
+
+        #pragma omp parallel for num_threads(numberOfCores) schedule(static)
+        for (int i = 0; i < (int)level.target->points.size(); ++i){
+            ThreadScratch &s = scratch[threadIndex()];
+            level.kdtree->nearestKSearch(level.target->points[i], 5, s.pointSearchInd, s.pointSearchSqDis);
+            if (s.pointSearchInd.size() == 5)
+                level.planes[i] = fitPlane(*level.target, s.pointSearchInd);
+        }
+    }
+
+    static PointType transformPoint(const Eigen::Matrix4f &T, const PointType &p){
+        PointType q;
+        q.x = T(0,0) * p.x + T(0,1) * p.y + T(0,2) * p.z + T(0,3);
+        q.y = T(1,0) * p.x + T(1,1) * p.y + T(1,2) * p.z + T(1,3);
+        q.z = T(2,0) * p.x + T(2,1) * p.y + T(2,2) * p.z + T(2,3);
+        q.intensity = p.intensity;
+        return q;
+    }
+
+    // 在一层上做一次高斯牛顿迭代，T左乘增量更新，返回增量的大小(旋转弧度+平移米)，对应点不足时返回负数
+    float iterate(const Level &level, const pcl::PointCloud<PointType> &source, Eigen::Matrix4f &T){
+
+        float maxSqDis = level.maxCorrespondenceDis * level.maxCorrespondenceDis;
+        for (size_t t = 0; t < scratch.size(); ++t){
+            scratch[t].equations.reset();
+            scratch[t].correspondenceNum = 0;
+        }
+
+        #pragma omp parallel for num_threads(numberOfCores) schedule(static)
+        for (int i = 0; i < (int)source.points.size(); ++i){
+            ThreadScratch &s = scratch[threadIndex()];
+            PointType p = transformPoint(T, source.points[i]);
+            level.kdtree->nearestKSearch(p, 1, s.pointSearchInd, s.pointSearchSqDis);
+            if (s.pointSearchInd.empty() || s.pointSearchSqDis[0] > maxSqDis)
+                continue;
+            const PointType &q = level.target->points[s.pointSearchInd[0]];
+            const Eigen::Vector4f &plane = level.planes[s.pointSearchInd[0]];
+            Eigen::Vector3f pv(p.x, p.y, p.z);
+            Eigen::Matrix<float, 6, 1> a;
+            if (plane(3) != 0){
+                // 点到平面：r = n·p + d，对旋转增量w和平移增量t的导数为 (p×n, n)
+                Eigen::Vector3f n = plane.head<3>();
+                a << pv.cross(n), n;
+                s.equations.add(a, -(n.dot(pv) + plane(3)));
+            }else{
+                // 拟合不出平面的点退化为点到点
+                Eigen::Vector3f d = pv - Eigen::Vector3f(q.x, q.y, q.z);
+                for (int k = 0; k < 3; ++k){
+                    Eigen::Vector3f e = Eigen::Vector3f::Zero();
+                    e(k) = 1;
+                    a << pv.cross(e), e;
+                    s.equations.add(a, -d(k));
+                }
+            }
+            ++s.correspondenceNum;
+        }
+
+        NormalEquations<6> equations;
+        int correspondenceNum = 0;
+        for (size_t t = 0; t < scratch.size(); ++t){
+            equations.AtA += scratch[t].equations.AtA;
+            equations.AtB += scratch[t].equations.AtB;
+            correspondenceNum += scratch[t].correspondenceNum;
+        }
+        if (correspondenceNum < 50)
+            return -1;
+
+        Eigen::Matrix<float, 6, 1> x = equations.solve();
+        if (x.allFinite() == false)
+            return -1;
+
+        Eigen::Matrix4f delta = Eigen::Matrix4f::Identity();
+        Eigen::Vector3f w = x.head<3>();
+        if (w.norm() > 1e-12)
+            delta.topLeftCorner<3,3>() = Eigen::AngleAxisf(w.norm(), w.normalized()).toRotationMatrix();
+        delta.topRightCorner<3,1>() = x.tail<3>();
+        T = delta * T;
+        return w.norm() + x.tail<3>().norm();
+    }
+
+public:
+
+    LoopRegistration():
+        converged(false),
+        fitness(std::numeric_limits<double>::max())
+    {
+        // 最细层直接使用detectLoopClosure中0.4m降采样后的子图
+        float leafSizes[] = {1.6, 0.8, 0};
+        float correspondenceDis[] = {historyKeyframeSearchRadius, historyKeyframeSearchRadius / 2, 1.5};
+        levels.resize(3);
+        for (int i = 0; i < 3; ++i){
+            levels[i].leafSize = leafSizes[i];
+            levels[i].maxCorrespondenceDis = correspondenceDis[i];
+        }
+        scratch.resize(numberOfCores);
+    }
+
+    // 设置待回环的子图并建立各层的KD树和平面参数，子图不变时不需要重复调用
+    void setTarget(const pcl::PointCloud<PointType>::ConstPtr &target){
+        for (size_t i = 0; i < levels.size(); ++i)
+            buildLevel(levels[i], target);
+    }
+
+    // 把source配准到目标子图上，transform为配准结果(左乘到source上)
+    // 返回值与pcl::Registration::hasConverged()含义相同
+    bool align(const pcl::PointCloud<PointType>::ConstPtr &source, Eigen::Matrix4f &transform){
+
+        transform = Eigen::Matrix4f::Identity();
+        converged = false;
+        fitness = std::numeric_limits<double>::max();
+        if (source->points.empty() || levels.back().target == NULL || levels.back().target->points.size() < 5)
+            return false;
+
+        pcl::PointCloud<PointType>::Ptr sourceDS(new pcl::PointCloud<PointType>());
+        for (size_t l = 0; l < levels.size(); ++l){
+            const Level &level = levels[l];
+            const pcl::PointCloud<PointType> *levelSource = source.get();
+            if (level.leafSize > 0){
+                downSizeFilter.setLeafSize(level.leafSize, level.leafSize, level.leafSize);
+                downSizeFilter.setInputCloud(source);
+                downSizeFilter.filter(*sourceDS);
+                levelSource = sourceDS.get();
+            }
+            if (level.target->points.size() < 5)
+                continue;
+            for (int iter = 0; iter < loopRegistrationMaxIterations; ++iter){
+                float deltaNorm = iterate(level, *levelSource, transform);
+                if (deltaNorm < 0){
+                    // 粗层对应点不足时进入下一层，最细层不足时配准失败
+                    if (l + 1 == levels.size())
+                        return false;
+                    break;
+                }
+                if (deltaNorm < 1e-4)
+                    break;
+            }
+        }
+        converged = true;
+
+        // 与getFitnessScore()相同：不限制距离，对所有点取最近点距离平方的均值
+        const Level &finest = levels.back();
+        double sqDisSum = 0;
+        int pointNum = 0;
+        #pragma omp parallel for num_threads(numberOfCores) schedule(static) reduction(+:sqDisSum, pointNum)
+        for (int i = 0; i < (int)source->points.size(); ++i){
+            ThreadScratch &s = scratch[threadIndex()];
+            finest.kdtree->nearestKSearch(transformPoint(transform, source->points[i]), 1, s.pointSearchInd, s.pointSearchSqDis);
+            if (s.pointSearchInd.empty() == false){
+                sqDisSum += s.pointSearchSqDis[0];
+                ++pointNum;
+            }
+        }
+        if (pointNum > 0)
+            fitness = sqDisSum / pointNum;
+        return converged;
+    }
+
+    bool hasConverged() const { return converged; }
+
+    double getFitnessScore() const { return fitness; }
+};
+
+#endif
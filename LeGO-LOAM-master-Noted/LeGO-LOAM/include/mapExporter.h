@@ -0,0 +1,419 @@
+#ifndef _MAP_EXPORTER_H_
+#define _MAP_EXPORTER_H_
+
+#include "utility.h"
+#include "voxelKey.h"
+#include "keyFrameStore.h"
+#include "pointTransform.h"
+#include "localizationMap.h"
+
+#include <unordered_map>
+#include <condition_variable>
+#include <chrono>
+#include <functional>
+#include <sys/stat.h>
+#include <pcl/io/pcd_io.h>
+
+/*
+    * 后台增量导出全局地图
+    * 原来在程序退出时把所有关键帧变换拼接成完整地图，再整体VoxelGrid降采样，以ASCII格式写入pcd，地图较大时退出需要几分钟、占用数GB内存
+    * 这里每个关键帧加入后由后台线程变换到世界坐标系，累加进按体素划分的地图(每个体素保存落入点的均值，与VoxelGrid结果相同)，
+    * 体素按水平方向(x-z平面，y轴向上)mapExportTileSize大小分块，有更新的块每隔mapExportInterval秒并行写入fileDirectory/mapTiles/下的压缩pcd，
+    * 退出时只需处理剩余的关键帧、写入有更新的块，再把各块顺序写成二进制格式的cornerMap.pcd/surfaceMap.pcd，
+    * 以及纯定位模式使用的分块地图localizationMap.bin(见localizationMap.h)
+    * 回环修正了关键帧位姿之后，只对位姿有变化的关键帧减去按原位姿加入的点、再按新位姿重新加入，只有这些关键帧覆盖的块会更新
+    * 同一张体素地图也用于发布全局地图：每隔globalMapPublishInterval秒把上次发布之后有变化的块交给setTileListener设置的回调，
+    * 不再每次对所有关键帧重新变换、拼接和降采样
+    */
+class MapExporter{
+
+public:
+
+    // 交给回调的一个地图块，cloud为空表示块中的点已被全部移除
+    struct TileUpdate{
+        int layer;      // 0: 边缘点，1: 平面点(与cloud_msgs/MapTile中的layer相同)
+        int x, z;       // 块在x-z平面上的索引，覆盖[x * size, (x + 1) * size) x [z * size, (z + 1) * size)
+        float size;
+        pcl::PointCloud<PointType>::Ptr cloud;
+    };
+
+    // reset为true时updates是全部非空的块，接收方应丢弃之前收到的块
+    typedef std::function<void(const std::vector<TileUpdate> &updates, bool reset)> TileListener;
+
+private:
+
+    struct Voxel{
+        // 落入该体素的点的坐标和，关键帧位姿修正时反复减去旧的贡献再加上新的，用double避免累积误差
+        double x, y, z, intensity;
+        int count;
+    };
+
+    struct Tile{
+        std::unordered_map<uint64_t, Voxel> voxels;
+        int x, z;       // 块在x-z平面上的索引
+        bool dirty;     // 上次写入文件之后有新的点
+        bool written;   // 已经写入过文件
+        bool changed;   // 上次发布之后有变化
+        Tile(): x(0), z(0), dirty(false), written(false), changed(false) {}
+    };
+
+    static int indexOf(float v, float size){
+        return (int)floor(v / size);
+    }
+
+    static int floorDiv(int a, int b){
+        return a >= 0 ? a / b : -((-a - 1) / b) - 1;
+    }
+
+    // 一层体素地图(边缘点或平面点)
+    struct Layer{
+        int id;
+        string name;
+        float leafSize;
+        int tileVoxels;     // 每块在水平方向上包含的体素数
+        std::unordered_map<uint64_t, Tile, VoxelKeyHash> tiles;
+    };
+
+    struct Job{
+        int index;
+        PointTypePose pose;
+    };
+
+    KeyFrameStore &keyFrameStore;
+    string directory;
+    string tileDirectory;
+
+    Layer cornerLayer;
+    Layer surfLayer;
+    pcl::PointCloud<PointType> worldCloud;
+
+    // 每个关键帧加入地图时使用的位姿，只在后台线程中访问
+    std::vector<char> inserted;
+    pcl::PointCloud<PointTypePose> insertedPoses;
+
+    std::deque<Job> jobs;
+    TileListener tileListener;
+    bool fullUpdatePending;
+    bool stopRequested;
+    std::mutex mtx;
+    std::condition_variable jobReady;
+    std::thread worker;
+
+    // sign为1时加入点，为-1时减去之前按同一位姿加入的点
+    void accumulate(Layer &layer, const pcl::PointCloud<PointType> &cloud, int sign){
+        for (size_t i = 0; i < cloud.points.size(); ++i){
+            const PointType &p = cloud.points[i];
+            int vx = indexOf(p.x, layer.leafSize), vy = indexOf(p.y, layer.leafSize), vz = indexOf(p.z, layer.leafSize);
+            // 由体素索引计算块索引，保证同一个体素的点总是落在同一块中
+            int tx = floorDiv(vx, layer.tileVoxels), tz = floorDiv(vz, layer.tileVoxels);
+            uint64_t voxelKey = packVoxelKey(vx, vy, vz);
+            if (sign > 0){
+                Tile &tile = layer.tiles[packVoxelKey(tx, 0, tz)];
+                tile.x = tx;
+                tile.z = tz;
+                Voxel &voxel = tile.voxels.emplace(voxelKey, Voxel{0, 0, 0, 0, 0}).first->second;
+                voxel.x += p.x;
+                voxel.y += p.y;
+                voxel.z += p.z;
+                voxel.intensity += p.intensity;
+                ++voxel.count;
+                tile.dirty = true;
+                tile.changed = true;
+            }else{
+                // 变换结果与加入时逐位相同，点总是落回同一个体素
+                auto t = layer.tiles.find(packVoxelKey(tx, 0, tz));
+                if (t == layer.tiles.end())
+                    continue;
+                auto v = t->second.voxels.find(voxelKey);
+                if (v == t->second.voxels.end())
+                    continue;
+                Voxel &voxel = v->second;
+                voxel.x -= p.x;
+                voxel.y -= p.y;
+                voxel.z -= p.z;
+                voxel.intensity -= p.intensity;
+                if (--voxel.count <= 0)
+                    t->second.voxels.erase(v);
+                t->second.dirty = true;
+                t->second.changed = true;
+            }
+        }
+    }
+
+    void accumulateKeyFrame(const KeyFrameStore::KeyFrame &keyFrame, const PointTypePose &pose, int sign){
+        Eigen::Matrix4f T = poseToMatrixYXZ(pose.roll, pose.pitch, pose.yaw, pose.x, pose.y, pose.z);
+        ::transformPointCloud(T, *keyFrame.corner, worldCloud);
+        accumulate(cornerLayer, worldCloud, sign);
+        ::transformPointCloud(T, *keyFrame.surf, worldCloud);
+        accumulate(surfLayer, worldCloud, sign);
+        ::transformPointCloud(T, *keyFrame.outlier, worldCloud);
+        accumulate(surfLayer, worldCloud, sign);
+    }
+
+    static bool samePose(const PointTypePose &a, const PointTypePose &b){
+        return a.x == b.x && a.y == b.y && a.z == b.z && a.roll == b.roll && a.pitch == b.pitch && a.yaw == b.yaw;
+    }
+
+    // 新的关键帧直接加入；已经加入的关键帧位姿有变化时先按原位姿减去，再按新位姿加入
+    void addKeyFrame(const Job &job){
+        if (job.index >= (int)inserted.size()){
+            inserted.resize(job.index + 1, 0);
+            insertedPoses.points.resize(job.index + 1);
+        }
+        bool moved = inserted[job.index] != 0;
+        if (moved && samePose(insertedPoses.points[job.index], job.pose))
+            return;
+
+        KeyFrameStore::KeyFrame keyFrame = keyFrameStore.get(job.index);
+        if (moved)
+            accumulateKeyFrame(keyFrame, insertedPoses.points[job.index], -1);
+        accumulateKeyFrame(keyFrame, job.pose, 1);
+        inserted[job.index] = 1;
+        insertedPoses.points[job.index] = job.pose;
+    }
+
+    float tileSizeOf(const Layer &layer) const {
+        return layer.tileVoxels * layer.leafSize;
+    }
+
+    static void voxelsToCloud(const Tile &tile, pcl::PointCloud<PointType> &cloud){
+        cloud.clear();
+        cloud.reserve(tile.voxels.size());
+        for (auto it = tile.voxels.begin(); it != tile.voxels.end(); ++it){
+            const Voxel &v = it->second;
+            PointType p;
+            p.x = v.x / v.count;
+            p.y = v.y / v.count;
+            p.z = v.z / v.count;
+            p.intensity = v.intensity / v.count;
+            cloud.push_back(p);
+        }
+    }
+
+    string tilePath(const Layer &layer, const Tile &tile) const {
+        std::stringstream ss;
+        ss << tileDirectory << layer.name << "_" << tile.x << "_" << tile.z << ".pcd";
+        return ss.str();
+    }
+
+    // 并行写入有更新的块
+    void writeDirtyTiles(Layer &layer){
+        std::vector<Tile*> dirtyTiles;
+        for (auto it = layer.tiles.begin(); it != layer.tiles.end(); ++it)
+            if (it->second.dirty)
+                dirtyTiles.push_back(&it->second);
+        #pragma omp parallel for num_threads(numberOfCores) schedule(dynamic)
+        for (int i = 0; i < (int)dirtyTiles.size(); ++i){
+            dirtyTiles[i]->dirty = false;
+            // 点已被全部移除的块删除文件
+            if (dirtyTiles[i]->voxels.empty()){
+                if (dirtyTiles[i]->written)
+                    std::remove(tilePath(layer, *dirtyTiles[i]).c_str());
+                dirtyTiles[i]->written = false;
+                continue;
+            }
+            pcl::PointCloud<PointType> cloud;
+            voxelsToCloud(*dirtyTiles[i], cloud);
+            if (pcl::io::savePCDFileBinaryCompressed(tilePath(layer, *dirtyTiles[i]), cloud) == 0)
+                dirtyTiles[i]->written = true;
+        }
+    }
+
+    // 把上次发布之后有变化的块(reset时为全部非空的块)交给listener
+    void publishTiles(const TileListener &listener, bool reset){
+        std::vector<TileUpdate> updates;
+        Layer *layers[2] = {&cornerLayer, &surfLayer};
+        for (int l = 0; l < 2; ++l){
+            for (auto it = layers[l]->tiles.begin(); it != layers[l]->tiles.end(); ++it){
+                Tile &tile = it->second;
+                bool send = reset ? tile.voxels.empty() == false : tile.changed;
+                tile.changed = false;
+                if (send == false)
+                    continue;
+                TileUpdate update;
+                update.layer = layers[l]->id;
+                update.x = tile.x;
+                update.z = tile.z;
+                update.size = tileSizeOf(*layers[l]);
+                update.cloud.reset(new pcl::PointCloud<PointType>());
+                voxelsToCloud(tile, *update.cloud);
+                updates.push_back(update);
+            }
+        }
+        if (reset || updates.empty() == false)
+            listener(updates, reset);
+    }
+
+    // 把若干层的所有块顺序写成二进制pcd，不需要先拼接成完整的点云
+    bool writeLayers(const std::vector<const Layer*> &layers, const string &file) const {
+        size_t pointNum = 0;
+        for (size_t l = 0; l < layers.size(); ++l)
+            for (auto it = layers[l]->tiles.begin(); it != layers[l]->tiles.end(); ++it)
+                pointNum += it->second.voxels.size();
+
+        std::ofstream out(file.c_str(), std::ios::binary);
+        if (!out)
+            return false;
+        out << "# .PCD v0.7 - Point Cloud Data file format\n"
+            << "VERSION 0.7\n"
+            << "FIELDS x y z intensity\n"
+            << "SIZE 4 4 4 4\n"
+            << "TYPE F F F F\n"
+            << "COUNT 1 1 1 1\n"
+            << "WIDTH " << pointNum << "\n"
+            << "HEIGHT 1\n"
+            << "VIEWPOINT 0 0 0 1 0 0 0\n"
+            << "POINTS " << pointNum << "\n"
+            << "DATA binary\n";
+        for (size_t l = 0; l < layers.size(); ++l){
+            for (auto it = layers[l]->tiles.begin(); it != layers[l]->tiles.end(); ++it){
+                for (auto v = it->second.voxels.begin(); v != it->second.voxels.end(); ++v){
+                    float p[4] = {float(v->second.x / v->second.count), float(v->second.y / v->second.count),
+                                  float(v->second.z / v->second.count), float(v->second.intensity / v->second.count)};
+                    out.write((const char*)p, sizeof(p));
+                }
+            }
+        }
+        return out.good();
+    }
+
+    bool writeLocalizationMap(const string &file) const {
+        LocalizationMap::Writer writer;
+        if (writer.open(file) == false)
+            return false;
+        const Layer *layers[2] = {&cornerLayer, &surfLayer};
+        const LocalizationMap::Layer types[2] = {LocalizationMap::Corner, LocalizationMap::Surf};
+        pcl::PointCloud<PointType> cloud;
+        for (int l = 0; l < 2; ++l){
+            float tileSize = tileSizeOf(*layers[l]);
+            for (auto it = layers[l]->tiles.begin(); it != layers[l]->tiles.end(); ++it){
+                if (it->second.voxels.empty())
+                    continue;
+                voxelsToCloud(it->second, cloud);
+                if (writer.add(types[l], it->second.x, it->second.z, tileSize, cloud) == false)
+                    return false;
+            }
+        }
+        return writer.close();
+    }
+
+    void exportThread(){
+        std::chrono::steady_clock::time_point lastWrite = std::chrono::steady_clock::now();
+        std::chrono::steady_clock::time_point lastPublish = lastWrite;
+        double waitTime = std::min(mapExportInterval, globalMapPublishInterval);
+        while (true){
+            std::deque<Job> batch;
+            TileListener listener;
+            bool fullUpdate, stop;
+            {
+                std::unique_lock<std::mutex> lock(mtx);
+                jobReady.wait_for(lock, std::chrono::duration<double>(waitTime),
+                                  [this]{ return stopRequested || fullUpdatePending || !jobs.empty(); });
+                batch.swap(jobs);
+                listener = tileListener;
+                fullUpdate = fullUpdatePending;
+                stop = stopRequested;
+                fullUpdatePending = false;
+            }
+
+            for (size_t i = 0; i < batch.size(); ++i)
+                addKeyFrame(batch[i]);
+
+            std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+            if (listener && stop == false &&
+                (fullUpdate || std::chrono::duration<double>(now - lastPublish).count() >= globalMapPublishInterval)){
+                publishTiles(listener, fullUpdate);
+                lastPublish = now;
+            }
+            if (stop || std::chrono::duration<double>(now - lastWrite).count() >= mapExportInterval){
+                writeDirtyTiles(cornerLayer);
+                writeDirtyTiles(surfLayer);
+                lastWrite = now;
+            }
+            if (stop)
+                break;
+        }
+    }
+
+public:
+
+    MapExporter(KeyFrameStore &store, const string &dir):
+        keyFrameStore(store),
+        directory(dir),
+        tileDirectory(dir + "mapTiles/"),
+        fullUpdatePending(false),
+        stopRequested(false)
+    {
+        cornerLayer.id = 0;
+        cornerLayer.name = "corner";
+        cornerLayer.leafSize = 0.2;
+        cornerLayer.tileVoxels = std::max(1, (int)round(mapExportTileSize / cornerLayer.leafSize));
+        surfLayer.id = 1;
+        surfLayer.name = "surface";
+        surfLayer.leafSize = 0.4;
+        surfLayer.tileVoxels = std::max(1, (int)round(mapExportTileSize / surfLayer.leafSize));
+        mkdir(tileDirectory.c_str(), 0755);
+        worker = std::thread(&MapExporter::exportThread, this);
+    }
+
+    ~MapExporter(){
+        stopWorker();
+    }
+
+    // 关键帧加入keyFrameStore之后调用，pose为该关键帧当前的位姿
+    void addKeyFrame(int index, const PointTypePose &pose){
+        std::lock_guard<std::mutex> lock(mtx);
+        jobs.push_back(Job{index, pose});
+        jobReady.notify_one();
+    }
+
+    // 关键帧位姿被回环修正之后调用，poses中从begin开始的位姿可能有变化，位姿没有变化的关键帧在后台跳过
+    void correctPoses(const pcl::PointCloud<PointTypePose> &poses, int begin){
+        std::lock_guard<std::mutex> lock(mtx);
+        for (size_t i = begin; i < poses.points.size(); ++i)
+            jobs.push_back(Job{(int)i, poses.points[i]});
+        jobReady.notify_one();
+    }
+
+    // 设置接收有变化的地图块的回调(在后台线程中调用)，设置后先发送一次全部的块
+    void setTileListener(const TileListener &listener){
+        std::lock_guard<std::mutex> lock(mtx);
+        tileListener = listener;
+        fullUpdatePending = true;
+        jobReady.notify_one();
+    }
+
+    // 有新的订阅者时调用，下次发布时发送全部的块
+    void requestFullUpdate(){
+        std::lock_guard<std::mutex> lock(mtx);
+        fullUpdatePending = true;
+        jobReady.notify_one();
+    }
+
+    void stopWorker(){
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            stopRequested = true;
+            jobReady.notify_one();
+        }
+        if (worker.joinable())
+            worker.join();
+    }
+
+    // 退出时调用：处理剩余的关键帧，写入最终的地图和轨迹，finalCloud.pcd为两层地图合并的结果
+    void finish(const pcl::PointCloud<PointType> &trajectory){
+        stopWorker();
+        std::vector<const Layer*> allLayers;
+        allLayers.push_back(&cornerLayer);
+        allLayers.push_back(&surfLayer);
+        if (writeLayers(std::vector<const Layer*>(1, &cornerLayer), directory + "cornerMap.pcd") == false ||
+            writeLayers(std::vector<const Layer*>(1, &surfLayer), directory + "surfaceMap.pcd") == false ||
+            writeLayers(allLayers, directory + "finalCloud.pcd") == false)
+            ROS_ERROR("MapExporter: failed to write map to %s", directory.c_str());
+        if (writeLocalizationMap(directory + "localizationMap.bin") == false)
+            ROS_ERROR("MapExporter: failed to write localization map to %s", directory.c_str());
+        pcl::io::savePCDFileBinary(directory + "trajectory.pcd", trajectory);
+    }
+};
+
+#endif
@@ -0,0 +1,73 @@
+#ifndef _NORMAL_EQUATIONS_H_
+#define _NORMAL_EQUATIONS_H_
+
+#include <Eigen/Dense>
+
+/*
+    * 高斯牛顿法的法方程 A^T*A*X = A^T*B 的定长累加器
+    * 每个特征点的雅克比行a和残差b直接累加进N*N的A^T*A和N*1的A^T*B，
+    * 不再构造N*6的matA/matB再转置相乘，迭代过程中没有堆内存分配
+    */
+template <int N>
+class NormalEquations{
+
+public:
+
+    typedef Eigen::Matrix<float, N, N> MatrixType;
+    typedef Eigen::Matrix<float, N, 1> VectorType;
+
+    MatrixType AtA;
+    VectorType AtB;
+
+    NormalEquations(){
+        reset();
+    }
+
+    void reset(){
+        AtA.setZero();
+        AtB.setZero();
+    }
+
+    // 累加一个约束：雅克比行a，残差b
+    void add(const VectorType &a, float b){
+        AtA.noalias() += a * a.transpose();
+        AtB.noalias() += a * b;
+    }
+
+    // 通过QR分解求解AtA*X=AtB，与cv::solve(..., cv::DECOMP_QR)一致
+    VectorType solve() const {
+        return AtA.householderQr().solve(AtB);
+    }
+
+    // 对近似的Hessian矩阵求特征值和特征向量，特征值小于eignThre的方向视为退化方向
+    // 特征值按从大到小排列，特征向量按行存放在matV中(与cv::eigen相同)，
+    // 将退化方向对应的行置零得到matV2，matP = matV^-1 * matV2
+    // 返回是否发生退化
+    bool computeDegeneracy(float eignThre, MatrixType &matP) const {
+
+        Eigen::SelfAdjointEigenSolver<MatrixType> esolver(AtA);
+
+        MatrixType matV, matV2;
+        VectorType matE;
+        for (int i = 0; i < N; ++i){
+            // SelfAdjointEigenSolver的特征值从小到大排列，特征向量按列存放
+            matE(i) = esolver.eigenvalues()(N - 1 - i);
+            matV.row(i) = esolver.eigenvectors().col(N - 1 - i).transpose();
+        }
+        matV2 = matV;
+
+        bool isDegenerate = false;
+        for (int i = N - 1; i >= 0; i--) {
+            if (matE(i) < eignThre) {
+                matV2.row(i).setZero();
+                isDegenerate = true;
+            } else {
+                break;
+            }
+        }
+        matP = matV.inverse() * matV2;
+        return isDegenerate;
+    }
+};
+
+#endif
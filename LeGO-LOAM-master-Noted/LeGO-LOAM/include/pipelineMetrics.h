@@ -0,0 +1,370 @@
+#ifndef _PIPELINE_METRICS_H_
+#define _PIPELINE_METRICS_H_
+
+#include "utility.h"
+
+#include <diagnostic_msgs/DiagnosticArray.h>
+
+#include <chrono>
+#include <cstdarg>
+#include <cstring>
+#include <map>
+#include <unistd.h>
+
+/*
+    * 各节点处理阶段的耗时、点数/迭代次数/KD树大小等数值以及丢帧计数的统计
+    * 用ScopedTimer包住一个处理阶段即可记录耗时，每次记录只有两次时钟读取和一次加锁，disable时什么都不做
+    * 每隔lego_loam/metrics/publish_period秒在/diagnostics上发布一次diagnostic_msgs/DiagnosticArray(可用rqt_runtime_monitor查看)：
+    *   每个阶段给出这一周期内的次数、均值、p50/p95/p99、最大值以及对数分桶的直方图，
+    *   数值给出均值/最小/最大/最新值，计数给出累计值和本周期的增量，标记为warn的计数增加时状态为WARN
+    * 设置lego_loam/metrics/trace_directory后，每个节点把所有阶段写成Chrome trace格式(chrome://tracing或ui.perfetto.dev打开)，
+    *   文件为<trace_directory>/<节点名>_<pid>.json，时间戳为系统时间(微秒)，不同节点的文件可以用 jq -s add *.json 合并到同一时间轴上，
+    *   事件的args.stamp为该阶段处理的点云时间戳，用于找出同一帧在各节点、各线程中的关键路径
+    * 阶段和数值的名字必须是字符串常量，内部只保存指针
+    * 线程安全，mapOptimization的各个工作线程共用一个对象
+    */
+class PipelineMetrics{
+
+public:
+
+    typedef std::chrono::steady_clock Clock;
+
+private:
+
+    struct NameLess{
+        bool operator()(const char *a, const char *b) const { return strcmp(a, b) < 0; }
+    };
+
+    // 耗时直方图，第i个桶为(upperBound(i-1), upperBound(i)]，相邻桶的上界相差sqrt(2)倍，
+    // 上界从0.014ms到0.01 * 2^20ms(约10.5s)，更长的耗时计入最后一个桶
+    struct Histogram{
+        static const int BucketNum = 40;
+        uint32_t buckets[BucketNum];
+        uint64_t count;
+        uint64_t total;     // 累计次数，不随周期清零
+        double sum;
+        double max;
+
+        Histogram(): total(0) { reset(); }
+
+        static double upperBound(int i){
+            return 0.01 * pow(2.0, 0.5 * (i + 1));
+        }
+
+        void add(double ms){
+            int i = ms > 0.01 ? (int)ceil(2 * log2(ms / 0.01)) - 1 : 0;
+            ++buckets[std::min(std::max(i, 0), BucketNum - 1)];
+            ++count;
+            ++total;
+            sum += ms;
+            max = std::max(max, ms);
+        }
+
+        // 按桶的上界估计分位数，不超过实际的最大值
+        double percentile(double q) const {
+            uint64_t rank = (uint64_t)ceil(q * count);
+            uint64_t accumulated = 0;
+            for (int i = 0; i < BucketNum; ++i){
+                accumulated += buckets[i];
+                if (accumulated >= rank)
+                    return std::min(upperBound(i), max);
+            }
+            return max;
+        }
+
+        void reset(){
+            for (int i = 0; i < BucketNum; ++i)
+                buckets[i] = 0;
+            count = 0;
+            sum = 0;
+            max = 0;
+        }
+    };
+
+    struct ValueStat{
+        uint64_t count;
+        double sum, min, max, last;
+
+        ValueStat(): last(0) { reset(); }
+
+        void add(double value){
+            ++count;
+            sum += value;
+            min = std::min(min, value);
+            max = std::max(max, value);
+            last = value;
+        }
+
+        void reset(){
+            count = 0;
+            sum = 0;
+            min = DBL_MAX;
+            max = -DBL_MAX;
+        }
+    };
+
+    struct Counter{
+        uint64_t total;
+        uint64_t reported;  // 上次发布时的累计值
+        bool warn;          // 本周期内增加时诊断状态为WARN
+
+        Counter(): total(0), reported(0), warn(false) {}
+    };
+
+    string nodeName;
+    bool enabled;
+    Clock::duration publishPeriod;
+    Clock::time_point nextPublish;
+    Clock::time_point periodStart;
+
+    std::mutex mtx;
+    std::map<const char*, Histogram, NameLess> stages;
+    std::map<const char*, ValueStat, NameLess> values;
+    std::map<const char*, Counter, NameLess> counters;
+
+    ros::Publisher pubDiagnostics;
+
+    // trace文件，没有打开时不记录事件
+    std::ofstream traceFile;
+    bool traceFirstEvent;
+    int pid;
+    Clock::time_point steadyBase;               // 与systemBase同时读取，用于把steady_clock换算成系统时间
+    int64_t systemBase;                         // 微秒
+
+    // 线程号由std::thread::id得到，同一进程中的几个节点(离线回放)合并trace后同一线程落在同一行
+    static int traceThreadId(){
+        return (int)(std::hash<std::thread::id>()(std::this_thread::get_id()) & 0x7fffffff);
+    }
+
+    int64_t traceTimestamp(Clock::time_point t) const {
+        return systemBase + std::chrono::duration_cast<std::chrono::microseconds>(t - steadyBase).count();
+    }
+
+    void writeTraceEvent(const char *event){
+        traceFile << (traceFirstEvent ? "\n" : ",\n") << event;
+        traceFirstEvent = false;
+    }
+
+    // 调用时需要持有mtx
+    void writeMetadata(const char *type, int tid, const char *name){
+        char event[256];
+        snprintf(event, sizeof(event), "{\"name\":\"%s\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                 type, pid, tid, name);
+        writeTraceEvent(event);
+    }
+
+    void openTrace(const string &directory){
+        std::ostringstream path;
+        path << directory << "/" << nodeName << "_" << pid << ".json";
+        traceFile.open(path.str().c_str());
+        if (traceFile.is_open() == false){
+            ROS_WARN("%s: cannot open trace file %s", nodeName.c_str(), path.str().c_str());
+            return;
+        }
+        traceFile << "[";
+        writeMetadata("process_name", 0, nodeName.c_str());
+        ROS_INFO("%s: writing trace to %s", nodeName.c_str(), path.str().c_str());
+    }
+
+    static void addKeyValue(diagnostic_msgs::DiagnosticStatus &status, const string &key, const char *format, ...){
+        char value[1024];
+        va_list args;
+        va_start(args, format);
+        vsnprintf(value, sizeof(value), format, args);
+        va_end(args);
+        diagnostic_msgs::KeyValue keyValue;
+        keyValue.key = key;
+        keyValue.value = value;
+        status.values.push_back(keyValue);
+    }
+
+    // 调用时需要持有mtx，生成本周期的诊断信息并清零周期内的统计
+    void collect(diagnostic_msgs::DiagnosticStatus &status, Clock::time_point now){
+
+        status.name = "lego_loam: " + nodeName;
+        status.hardware_id = "lego_loam";
+        status.level = diagnostic_msgs::DiagnosticStatus::OK;
+        double period = std::chrono::duration<double>(now - periodStart).count();
+        periodStart = now;
+        addKeyValue(status, "period (s)", "%.2f", period);
+
+        for (std::map<const char*, Histogram, NameLess>::iterator it = stages.begin(); it != stages.end(); ++it){
+            Histogram &h = it->second;
+            if (h.count > 0){
+                addKeyValue(status, string(it->first) + " (ms)", "n=%d mean=%.3f p50=%.3f p95=%.3f p99=%.3f max=%.3f total=%llu",
+                            (int)h.count, h.sum / h.count, h.percentile(0.5), h.percentile(0.95), h.percentile(0.99), h.max,
+                            (unsigned long long)h.total);
+                // 只列出非空的桶，格式为 上界:次数
+                std::ostringstream buckets;
+                for (int i = 0; i < Histogram::BucketNum; ++i)
+                    if (h.buckets[i] > 0)
+                        buckets << (buckets.tellp() > 0 ? " " : "") << std::setprecision(3) << Histogram::upperBound(i) << ":" << h.buckets[i];
+                addKeyValue(status, string(it->first) + " histogram (ms)", "%s", buckets.str().c_str());
+            }
+            h.reset();
+        }
+
+        for (std::map<const char*, ValueStat, NameLess>::iterator it = values.begin(); it != values.end(); ++it){
+            ValueStat &v = it->second;
+            if (v.count > 0)
+                addKeyValue(status, it->first, "mean=%.1f min=%.1f max=%.1f last=%.1f", v.sum / v.count, v.min, v.max, v.last);
+            v.reset();
+        }
+
+        string warnings;
+        for (std::map<const char*, Counter, NameLess>::iterator it = counters.begin(); it != counters.end(); ++it){
+            Counter &c = it->second;
+            uint64_t delta = c.total - c.reported;
+            addKeyValue(status, it->first, "%llu (+%llu)", (unsigned long long)c.total, (unsigned long long)delta);
+            if (c.warn == true && delta > 0){
+                status.level = diagnostic_msgs::DiagnosticStatus::WARN;
+                warnings += (warnings.empty() ? "" : ", ") + string(it->first);
+            }
+            c.reported = c.total;
+        }
+        status.message = warnings.empty() ? "OK" : warnings;
+    }
+
+public:
+
+    PipelineMetrics(ros::NodeHandle &nh, const string &name):
+        nodeName(name),
+        traceFirstEvent(true),
+        pid(getpid())
+    {
+        ros::NodeHandle pnh("lego_loam/metrics");
+        double period;
+        string traceDirectory;
+        pnh.param<bool>("enable", enabled, true);
+        pnh.param<double>("publish_period", period, metricsPublishPeriod);
+        pnh.param<string>("trace_directory", traceDirectory, "");
+
+        publishPeriod = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(period));
+        periodStart = Clock::now();
+        nextPublish = periodStart + publishPeriod;
+        steadyBase = Clock::now();
+        systemBase = std::chrono::duration_cast<std::chrono::microseconds>(
+                         std::chrono::system_clock::now().time_since_epoch()).count();
+
+        if (enabled == false)
+            return;
+        pubDiagnostics = nh.advertise<diagnostic_msgs::DiagnosticArray>("/diagnostics", 10);
+        if (traceDirectory.empty() == false)
+            openTrace(traceDirectory);
+    }
+
+    ~PipelineMetrics(){
+        if (traceFile.is_open())
+            traceFile << "\n]\n";
+    }
+
+    bool isEnabled() const { return enabled; }
+
+    // 记录一个阶段从start到end的耗时，stamp为该阶段处理的点云时间戳(秒)，小于0表示没有
+    void addTime(const char *stage, Clock::time_point start, Clock::time_point end, double stamp = -1){
+        if (enabled == false)
+            return;
+        double ms = std::chrono::duration<double, std::milli>(end - start).count();
+        std::lock_guard<std::mutex> lock(mtx);
+        stages[stage].add(ms);
+        if (traceFile.is_open() == false)
+            return;
+        char event[256];
+        int length = snprintf(event, sizeof(event), "{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%lld,\"dur\":%lld,\"pid\":%d,\"tid\":%d",
+                              stage, nodeName.c_str(), (long long)traceTimestamp(start),
+                              (long long)std::chrono::duration_cast<std::chrono::microseconds>(end - start).count(),
+                              pid, traceThreadId());
+        if (length > 0 && length < (int)sizeof(event))
+            snprintf(event + length, sizeof(event) - length, stamp >= 0 ? ",\"args\":{\"stamp\":%.6f}}" : "}", stamp);
+        writeTraceEvent(event);
+    }
+
+    // 点数、迭代次数、KD树大小、队列深度等每帧一个的数值
+    void addValue(const char *name, double value){
+        if (enabled == false)
+            return;
+        std::lock_guard<std::mutex> lock(mtx);
+        values[name].add(value);
+    }
+
+    // 丢帧等累计计数，warn为true时本周期内增加会使诊断状态变为WARN
+    void increment(const char *name, uint64_t num = 1, bool warn = false){
+        if (enabled == false)
+            return;
+        std::lock_guard<std::mutex> lock(mtx);
+        Counter &c = counters[name];
+        c.total += num;
+        c.warn = warn;
+    }
+
+    // 计数已经在别处累计(如StampSynchronizer::droppedNum())时直接设置累计值
+    void setCounter(const char *name, uint64_t total, bool warn = false){
+        if (enabled == false)
+            return;
+        std::lock_guard<std::mutex> lock(mtx);
+        Counter &c = counters[name];
+        c.total = total;
+        c.warn = warn;
+    }
+
+    // 在trace中给当前线程命名，各工作线程开始时调用一次
+    void nameThread(const char *name){
+        if (enabled == false)
+            return;
+        std::lock_guard<std::mutex> lock(mtx);
+        if (traceFile.is_open())
+            writeMetadata("thread_name", traceThreadId(), name);
+    }
+
+    // 到达发布周期时发布诊断信息，在各节点每帧的处理中调用，不需要单独的定时器
+    void publishIfDue(){
+        if (enabled == false)
+            return;
+        Clock::time_point now = Clock::now();
+        diagnostic_msgs::DiagnosticArray msg;
+        msg.status.resize(1);
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            if (now < nextPublish)
+                return;
+            nextPublish = now + publishPeriod;
+            collect(msg.status[0], now);
+            if (traceFile.is_open())
+                traceFile.flush();
+        }
+        msg.header.stamp = ros::Time::now();
+        pubDiagnostics.publish(msg);
+    }
+};
+
+/*
+    * 记录所在作用域的耗时，用法：
+    *   { ScopedTimer timer(metrics, "extractFeatures", stamp); extractFeatures(); }
+    */
+class ScopedTimer{
+
+private:
+
+    PipelineMetrics &metrics;
+    const char *stage;
+    double stamp;
+    PipelineMetrics::Clock::time_point start;
+
+public:
+
+    ScopedTimer(PipelineMetrics &metricsIn, const char *stageIn, double stampIn = -1):
+        metrics(metricsIn),
+        stage(stageIn),
+        stamp(stampIn)
+    {
+        if (metrics.isEnabled())
+            start = PipelineMetrics::Clock::now();
+    }
+
+    ~ScopedTimer(){
+        if (metrics.isEnabled())
+            metrics.addTime(stage, start, PipelineMetrics::Clock::now(), stamp);
+    }
+};
+
+#endif
@@ -0,0 +1,164 @@
+#ifndef _POINT_CLOUD2_READER_H_
+#define _POINT_CLOUD2_READER_H_
+
+#include "utility.h"
+
+#include <cstring>
+
+/*
+    * 直接从sensor_msgs::PointCloud2的字节缓存中读取点的x/y/z/intensity/ring，不经过pcl::fromROSMsg，
+    * 避免先反序列化成中间的PCL点云(带ring时还要反序列化两次)再逐点拷贝
+    * 字段偏移只在点云格式(各字段的名称、偏移和类型)变化时重新解析，读取前检查消息长度和字节序，格式不对的消息直接丢弃
+    */
+class PointCloud2Reader{
+
+private:
+
+    struct Field{
+        int offset;         // -1表示消息中没有该字段
+        uint8_t datatype;
+    };
+
+    Field fieldX, fieldY, fieldZ, fieldIntensity, fieldRing;
+
+    std::vector<sensor_msgs::PointField> cachedFields;
+
+    // 消息缓存不保证对齐，用memcpy读取
+    template <typename T>
+    static T readAs(const uint8_t *ptr){
+        T value;
+        memcpy(&value, ptr, sizeof(T));
+        return value;
+    }
+
+    static float readField(const uint8_t *pointPtr, const Field &field){
+        const uint8_t *ptr = pointPtr + field.offset;
+        switch (field.datatype){
+            case sensor_msgs::PointField::INT8:    return readAs<int8_t>(ptr);
+            case sensor_msgs::PointField::UINT8:   return readAs<uint8_t>(ptr);
+            case sensor_msgs::PointField::INT16:   return readAs<int16_t>(ptr);
+            case sensor_msgs::PointField::UINT16:  return readAs<uint16_t>(ptr);
+            case sensor_msgs::PointField::INT32:   return readAs<int32_t>(ptr);
+            case sensor_msgs::PointField::UINT32:  return readAs<uint32_t>(ptr);
+            case sensor_msgs::PointField::FLOAT64: return readAs<double>(ptr);
+            default:                               return readAs<float>(ptr);
+        }
+    }
+
+    static size_t sizeOf(uint8_t datatype){
+        switch (datatype){
+            case sensor_msgs::PointField::INT8:
+            case sensor_msgs::PointField::UINT8:   return 1;
+            case sensor_msgs::PointField::INT16:
+            case sensor_msgs::PointField::UINT16:  return 2;
+            case sensor_msgs::PointField::FLOAT64: return 8;
+            default:                               return 4;
+        }
+    }
+
+    static bool sameLayout(const std::vector<sensor_msgs::PointField> &a, const std::vector<sensor_msgs::PointField> &b){
+        if (a.size() != b.size())
+            return false;
+        for (size_t i = 0; i < a.size(); ++i){
+            if (a[i].name != b[i].name || a[i].offset != b[i].offset || a[i].datatype != b[i].datatype)
+                return false;
+        }
+        return true;
+    }
+
+    static Field findField(const sensor_msgs::PointCloud2 &msg, const string &name){
+        Field field;
+        field.offset = -1;
+        field.datatype = sensor_msgs::PointField::FLOAT32;
+        for (size_t i = 0; i < msg.fields.size(); ++i){
+            if (msg.fields[i].name == name){
+                field.offset = msg.fields[i].offset;
+                field.datatype = msg.fields[i].datatype;
+                break;
+            }
+        }
+        return field;
+    }
+
+public:
+
+    PointCloud2Reader()
+    {
+        fieldX.offset = fieldY.offset = fieldZ.offset = fieldIntensity.offset = fieldRing.offset = -1;
+    }
+
+    // 解析字段偏移，消息中缺少x/y/z字段时返回false
+    bool resolve(const sensor_msgs::PointCloud2 &msg){
+        if (cachedFields.empty() || sameLayout(msg.fields, cachedFields) == false){
+            fieldX = findField(msg, "x");
+            fieldY = findField(msg, "y");
+            fieldZ = findField(msg, "z");
+            fieldIntensity = findField(msg, "intensity");
+            fieldRing = findField(msg, "ring");
+            cachedFields = msg.fields;
+        }
+        return fieldX.offset >= 0 && fieldY.offset >= 0 && fieldZ.offset >= 0;
+    }
+
+    // resolve之后调用：检查字节序、字段是否在point_step以内以及数据长度，
+    // 不满足时输出错误并返回false，这样pointData和getPoint不会越界读取
+    bool validate(const sensor_msgs::PointCloud2 &msg) const {
+        if (msg.is_bigendian){
+            ROS_ERROR_THROTTLE(5.0, "PointCloud2Reader: big-endian point clouds are not supported, dropping the message");
+            return false;
+        }
+        const Field *fields[5] = {&fieldX, &fieldY, &fieldZ, &fieldIntensity, &fieldRing};
+        for (int i = 0; i < 5; ++i){
+            if (fields[i]->offset >= 0 && fields[i]->offset + sizeOf(fields[i]->datatype) > msg.point_step){
+                ROS_ERROR_THROTTLE(5.0, "PointCloud2Reader: field at offset %d exceeds point_step %u, dropping the message",
+                                   fields[i]->offset, msg.point_step);
+                return false;
+            }
+        }
+        if ((uint64_t)msg.row_step < (uint64_t)msg.width * msg.point_step ||
+            (uint64_t)msg.data.size() < (uint64_t)msg.row_step * msg.height){
+            ROS_ERROR_THROTTLE(5.0, "PointCloud2Reader: %zu bytes of data for %u x %u points (point_step %u, row_step %u), dropping the message",
+                               msg.data.size(), msg.width, msg.height, msg.point_step, msg.row_step);
+            return false;
+        }
+        return true;
+    }
+
+    // 字段偏移和类型，依次为x, y, z, intensity, ring，供GPU后端在设备上读取点(rangeImageGpu.h)
+    void getLayout(int offsets[5], uint8_t datatypes[5]) const {
+        const Field *fields[5] = {&fieldX, &fieldY, &fieldZ, &fieldIntensity, &fieldRing};
+        for (int i = 0; i < 5; ++i){
+            offsets[i] = fields[i]->offset;
+            datatypes[i] = fields[i]->datatype;
+        }
+    }
+
+    bool hasIntensity() const { return fieldIntensity.offset >= 0; }
+    bool hasRing() const { return fieldRing.offset >= 0; }
+
+    size_t size(const sensor_msgs::PointCloud2 &msg) const {
+        return (size_t)msg.width * msg.height;
+    }
+
+    // 第index个点的起始地址，有序点云(height > 1)每行末尾可能有填充，需要按row_step寻址
+    const uint8_t* pointData(const sensor_msgs::PointCloud2 &msg, size_t index) const {
+        if (msg.height <= 1)
+            return &msg.data[index * msg.point_step];
+        return &msg.data[(index / msg.width) * msg.row_step + (index % msg.width) * msg.point_step];
+    }
+
+    // 读取坐标和强度，坐标中有NaN/Inf时返回false(与removeNaNFromPointCloud的判断相同)
+    bool getPoint(const uint8_t *pointPtr, PointType &point) const {
+        point.x = readField(pointPtr, fieldX);
+        point.y = readField(pointPtr, fieldY);
+        point.z = readField(pointPtr, fieldZ);
+        point.intensity = hasIntensity() ? readField(pointPtr, fieldIntensity) : 0;
+        return std::isfinite(point.x) && std::isfinite(point.y) && std::isfinite(point.z);
+    }
+
+    int getRing(const uint8_t *pointPtr) const {
+        return (int)readField(pointPtr, fieldRing);
+    }
+};
+
+#endif
@@ -0,0 +1,146 @@
+#ifndef _POINT_TRANSFORM_H_
+#define _POINT_TRANSFORM_H_
+
+#include "utility.h"
+
+#include <Eigen/Dense>
+#include <Eigen/StdVector>
+
+/*
+    * 点云批量刚体变换
+    * 原来每个点都要对同一组欧拉角重复求sin/cos再逐轴旋转，这里把sin/cos、三次旋转和平移预先合成一个4x4矩阵，
+    * 每个点只需要一次Matrix4f*Vector4f(Eigen对定长4x4矩阵使用SSE向量化)
+    */
+
+// R = Ry*Rx*Rz：先绕z轴，再绕x轴，最后绕y轴，然后平移
+// 与mapOptimization中pointAssociateToMap、transformPointCloud的旋转顺序一致
+inline Eigen::Matrix4f poseToMatrixYXZ(float rx, float ry, float rz, float tx, float ty, float tz){
+    Eigen::Matrix4f T = Eigen::Matrix4f::Identity();
+    T.topLeftCorner<3, 3>() = (Eigen::AngleAxisf(ry, Eigen::Vector3f::UnitY())
+                             * Eigen::AngleAxisf(rx, Eigen::Vector3f::UnitX())
+                             * Eigen::AngleAxisf(rz, Eigen::Vector3f::UnitZ())).toRotationMatrix();
+    T.topRightCorner<3, 1>() << tx, ty, tz;
+    return T;
+}
+
+// R = Rz*Rx*Ry：先绕y轴，再绕x轴，最后绕z轴，然后平移
+// 与featureAssociation中transformCur(T_end_start)的旋转顺序一致
+inline Eigen::Matrix4f poseToMatrixZXY(float rx, float ry, float rz, float tx, float ty, float tz){
+    Eigen::Matrix4f T = Eigen::Matrix4f::Identity();
+    T.topLeftCorner<3, 3>() = (Eigen::AngleAxisf(rz, Eigen::Vector3f::UnitZ())
+                             * Eigen::AngleAxisf(rx, Eigen::Vector3f::UnitX())
+                             * Eigen::AngleAxisf(ry, Eigen::Vector3f::UnitY())).toRotationMatrix();
+    T.topRightCorner<3, 1>() << tx, ty, tz;
+    return T;
+}
+
+// po = T * pi，intensity保持不变，pi与po可以是同一个点
+inline void transformPoint(const Eigen::Matrix4f &T, const PointType &pi, PointType &po){
+    Eigen::Vector4f q = T * Eigen::Vector4f(pi.x, pi.y, pi.z, 1.0);
+    po.x = q(0);
+    po.y = q(1);
+    po.z = q(2);
+    po.intensity = pi.intensity;
+}
+
+// 对整帧点云进行变换，cloudOut复用已有内存，可以与cloudIn是同一个点云(原地变换)
+inline void transformPointCloud(const Eigen::Matrix4f &T, const pcl::PointCloud<PointType> &cloudIn,
+                                pcl::PointCloud<PointType> &cloudOut){
+    int cloudSize = cloudIn.points.size();
+    if (&cloudIn != &cloudOut)
+        cloudOut.resize(cloudSize);
+    for (int i = 0; i < cloudSize; ++i)
+        transformPoint(T, cloudIn.points[i], cloudOut.points[i]);
+}
+
+// 变换后追加到cloudOut末尾，代替*cloudOut += *transformed，不需要临时点云，cloudIn与cloudOut不能是同一个点云
+inline void appendTransformedPointCloud(const Eigen::Matrix4f &T, const pcl::PointCloud<PointType> &cloudIn,
+                                        pcl::PointCloud<PointType> &cloudOut){
+    int cloudSize = cloudIn.points.size();
+    size_t offset = cloudOut.points.size();
+    cloudOut.points.resize(offset + cloudSize);
+    for (int i = 0; i < cloudSize; ++i)
+        transformPoint(T, cloudIn.points[i], cloudOut.points[offset + i]);
+    cloudOut.width = cloudOut.points.size();
+    cloudOut.height = 1;
+}
+
+/*
+    * featureAssociation中按点的相对时间插值的去畸变变换(TransformToStart/TransformToEnd)
+    * 点的相对时间s∈[0,1]保存在intensity的小数部分(intensity = 线号 + scanPeriod * s)，
+    * 该点的变换为 post * (R(s*transform) | s*t)^-1，其中R = Rz*Rx*Ry
+    * s按timeSteps等分量化，每个量化区间的矩阵在第一次用到时计算一次并缓存到下一次reset，
+    * 这样一帧里时间相同的点不再重复求sin/cos
+    */
+class InterpolatedTransform{
+
+private:
+
+    int timeSteps;
+    float transform[6];
+    Eigen::Matrix4f post;
+
+    std::vector<Eigen::Matrix4f, Eigen::aligned_allocator<Eigen::Matrix4f> > table;
+    std::vector<int> tableStamp;    // 与stamp相同时table中对应的矩阵有效
+    int stamp;
+
+public:
+
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+    InterpolatedTransform(int steps):
+        timeSteps(steps),
+        post(Eigen::Matrix4f::Identity()),
+        table(steps + 1),
+        tableStamp(steps + 1, 0),
+        stamp(0)
+    {
+        for (int i = 0; i < 6; ++i)
+            transform[i] = 0;
+    }
+
+    // transform或post改变之后调用，使缓存失效
+    void reset(const float transformIn[], const Eigen::Matrix4f &postIn){
+        for (int i = 0; i < 6; ++i)
+            transform[i] = transformIn[i];
+        post = postIn;
+        ++stamp;
+    }
+
+    void reset(const float transformIn[]){
+        reset(transformIn, Eigen::Matrix4f::Identity());
+    }
+
+    const Eigen::Matrix4f& at(float relTime){
+        int bin = int(relTime * timeSteps + 0.5);
+        bin = std::min(std::max(bin, 0), timeSteps);
+        if (tableStamp[bin] != stamp){
+            float s = float(bin) / timeSteps;
+            Eigen::Matrix4f T = poseToMatrixZXY(s * transform[0], s * transform[1], s * transform[2],
+                                                s * transform[3], s * transform[4], s * transform[5]);
+            // 刚体变换的逆：R^T * (p - t)
+            Eigen::Matrix4f Tinv = Eigen::Matrix4f::Identity();
+            Tinv.topLeftCorner<3, 3>() = T.topLeftCorner<3, 3>().transpose();
+            Tinv.topRightCorner<3, 1>() = -Tinv.topLeftCorner<3, 3>() * T.topRightCorner<3, 1>();
+            table[bin] = post * Tinv;
+            tableStamp[bin] = stamp;
+        }
+        return table[bin];
+    }
+
+    // intensity保持不变，pi与po可以是同一个点
+    void apply(const PointType &pi, PointType &po){
+        float relTime = (pi.intensity - int(pi.intensity)) / scanPeriod;
+        transformPoint(at(relTime), pi, po);
+    }
+
+    void apply(const pcl::PointCloud<PointType> &cloudIn, pcl::PointCloud<PointType> &cloudOut){
+        int cloudSize = cloudIn.points.size();
+        if (&cloudIn != &cloudOut)
+            cloudOut.resize(cloudSize);
+        for (int i = 0; i < cloudSize; ++i)
+            apply(cloudIn.points[i], cloudOut.points[i]);
+    }
+};
+
+#endif
@@ -0,0 +1,267 @@
+#ifndef _POSE_GRAPH_BACKEND_H_
+#define _POSE_GRAPH_BACKEND_H_
+
+#include "utility.h"
+
+#include <gtsam/geometry/Pose3.h>
+#include <gtsam/slam/PriorFactor.h>
+#include <gtsam/slam/BetweenFactor.h>
+#include <gtsam/nonlinear/NonlinearFactorGraph.h>
+#include <gtsam/nonlinear/LevenbergMarquardtOptimizer.h>
+#include <gtsam/nonlinear/Marginals.h>
+#include <gtsam/nonlinear/Values.h>
+#include <gtsam/nonlinear/ISAM2.h>
+
+#include <limits>
+
+/*
+    * mapOptimization的关键帧位姿图
+    * windowSize为0时与原来相同：所有关键帧和约束都在同一个ISAM2中，每个关键帧的更新和回环后的位姿修正随轨迹长度变慢
+    * windowSize大于0时ISAM2中只保留最近的windowSize ~ 1.25*windowSize个关键帧(滑动窗口)：
+    *   窗口超过上限时把最早的关键帧边缘化为新窗口起点(anchor)上的先验，先验的协方差由被移出的约束计算，
+    *   跨越窗口起点的约束以移出的关键帧的当前位姿为准转换为新窗口内关键帧上的先验，
+    *   窗口之外的关键帧位姿保持不变，每个关键帧的后端耗时只与windowSize有关
+    *   回环的历史关键帧在窗口内时直接在窗口中优化；在窗口之外时需要修正整条轨迹，
+    *   由调用者在后台对保存的全部约束做一次批量LM优化(prepareBatch/optimizeBatch/applyBatch)，然后以结果重建窗口
+    * 关键帧的索引与cloudKeyPoses3D/6D相同，调用者负责加锁(mapOptimization中由mtx保护，optimizeBatch不需要持有锁)
+    */
+class PoseGraphBackend{
+
+private:
+
+    // to < 0时为from上的先验，否则为from与to之间的相对位姿约束(measured = pose(from).between(pose(to)))
+    struct Constraint{
+        int from;
+        int to;
+        gtsam::Pose3 measured;
+        gtsam::SharedNoiseModel noise;
+    };
+
+    int windowSize;     // 0表示不限制
+    gtsam::ISAM2Params parameters;
+    boost::shared_ptr<gtsam::ISAM2> isam;
+
+    int anchor;         // 窗口中最早的关键帧，窗口之前的关键帧不再优化
+    int loopBegin;      // 窗口内回环之后位姿被修正的最早关键帧，窗口可能在取出修正结果之前移动
+    std::vector<gtsam::Pose3> estimates;    // 每个关键帧最近一次得到的位姿
+    std::vector<Constraint> constraints;    // 所有约束，只在windowSize大于0时保存，用于批量优化
+    std::vector<Constraint> windowConstraints;  // 当前窗口中除anchor先验之外的约束
+    Constraint anchorPrior;
+
+    static void addFactor(gtsam::NonlinearFactorGraph &graph, const Constraint &c){
+        if (c.to < 0)
+            graph.add(gtsam::PriorFactor<gtsam::Pose3>(c.from, c.measured, c.noise));
+        else
+            graph.add(gtsam::BetweenFactor<gtsam::Pose3>(c.from, c.to, c.measured, c.noise));
+    }
+
+    static int maxKey(const Constraint &c){ return std::max(c.from, c.to); }
+    static int minKey(const Constraint &c){ return c.to < 0 ? c.from : std::min(c.from, c.to); }
+
+    void addConstraint(const Constraint &c, gtsam::NonlinearFactorGraph &graph){
+        addFactor(graph, c);
+        if (windowSize > 0){
+            constraints.push_back(c);
+            windowConstraints.push_back(c);
+        }
+    }
+
+    // 用窗口中最新的优化结果更新estimates
+    void refreshWindowEstimates(){
+        gtsam::Values values = isam->calculateEstimate();
+        for (int key = anchor; key < size(); ++key)
+            estimates[key] = values.at<gtsam::Pose3>(key);
+    }
+
+    // 从source中取出以newAnchor为起点的窗口约束，跨越newAnchor的相对约束转换为窗口内关键帧上的先验
+    void rebuildWindow(int newAnchor, const std::vector<Constraint> &source, const gtsam::Matrix &anchorCovariance){
+
+        std::vector<Constraint> inWindow;
+        for (size_t i = 0; i < source.size(); ++i){
+            const Constraint &c = source[i];
+            if (minKey(c) >= newAnchor){
+                inWindow.push_back(c);
+            }else if (c.to >= 0 && maxKey(c) > newAnchor){
+                Constraint prior;
+                prior.to = -1;
+                prior.noise = c.noise;
+                if (c.from < c.to){
+                    prior.from = c.to;
+                    prior.measured = estimates[c.from].compose(c.measured);
+                }else{
+                    prior.from = c.from;
+                    prior.measured = estimates[c.to].compose(c.measured.inverse());
+                }
+                inWindow.push_back(prior);
+            }
+        }
+        windowConstraints.swap(inWindow);
+
+        anchor = newAnchor;
+        anchorPrior.from = anchor;
+        anchorPrior.to = -1;
+        anchorPrior.measured = estimates[anchor];
+        anchorPrior.noise = gtsam::noiseModel::Gaussian::Covariance(anchorCovariance);
+
+        gtsam::NonlinearFactorGraph graph;
+        gtsam::Values values;
+        addFactor(graph, anchorPrior);
+        for (size_t i = 0; i < windowConstraints.size(); ++i)
+            addFactor(graph, windowConstraints[i]);
+        for (int key = anchor; key < size(); ++key)
+            values.insert(key, estimates[key]);
+        isam.reset(new gtsam::ISAM2(parameters));
+        isam->update(graph, values);
+    }
+
+    // 窗口超过上限时把最早的关键帧边缘化到newAnchor上
+    void slideWindow(){
+
+        int newAnchor = size() - windowSize;
+        refreshWindowEstimates();
+
+        // 被移出的约束(anchor先验以及两端都不晚于newAnchor的约束)对newAnchor的边缘分布即为新的先验
+        gtsam::NonlinearFactorGraph past;
+        gtsam::Values values;
+        addFactor(past, anchorPrior);
+        for (size_t i = 0; i < windowConstraints.size(); ++i)
+            if (maxKey(windowConstraints[i]) <= newAnchor)
+                addFactor(past, windowConstraints[i]);
+        for (int key = anchor; key <= newAnchor; ++key)
+            values.insert(key, estimates[key]);
+        gtsam::Matrix covariance = gtsam::Marginals(past, values).marginalCovariance(newAnchor);
+
+        std::vector<Constraint> source;
+        source.swap(windowConstraints);
+        rebuildWindow(newAnchor, source, covariance);
+    }
+
+    gtsam::Pose3 addKeyFrame(const Constraint &c, const gtsam::Pose3 &initial){
+        int key = size();
+        gtsam::NonlinearFactorGraph graph;
+        gtsam::Values values;
+        if (c.to < 0){
+            // 第一个关键帧的先验即为初始窗口的anchor先验，不放入windowConstraints
+            anchorPrior = c;
+            if (windowSize > 0)
+                constraints.push_back(c);
+            addFactor(graph, c);
+        }else{
+            addConstraint(c, graph);
+        }
+        values.insert(key, initial);
+        isam->update(graph, values);
+        isam->update();
+        estimates.push_back(isam->calculateEstimate<gtsam::Pose3>(key));
+
+        if (windowSize > 0 && size() - anchor > windowSize + windowSize / 4)
+            slideWindow();
+        return estimates[key];
+    }
+
+public:
+
+    // 批量优化的输入和结果，prepareBatch和applyBatch之间的optimizeBatch不需要持有锁
+    struct Batch{
+        gtsam::NonlinearFactorGraph graph;
+        gtsam::NonlinearFactorGraph past;   // 两端都不晚于anchor的约束，用于计算新窗口起点的先验
+        gtsam::Values initial;
+        int keyNum;
+        int anchor;
+        gtsam::Values result;
+        gtsam::Matrix anchorCovariance;
+    };
+
+    PoseGraphBackend(int windowSizeIn):
+        windowSize(windowSizeIn),
+        anchor(0),
+        loopBegin(std::numeric_limits<int>::max())
+    {
+        parameters.relinearizeThreshold = 0.01;
+        parameters.relinearizeSkip = 1;
+        isam.reset(new gtsam::ISAM2(parameters));
+    }
+
+    int size() const { return estimates.size(); }
+
+    int windowBegin() const { return anchor; }
+
+    const gtsam::Pose3 &estimate(int key) const { return estimates[key]; }
+
+    // 第一个关键帧，返回优化后的位姿
+    gtsam::Pose3 addPrior(const gtsam::Pose3 &pose, const gtsam::SharedNoiseModel &noise){
+        Constraint c = {0, -1, pose, noise};
+        return addKeyFrame(c, pose);
+    }
+
+    // 新关键帧与上一关键帧之间的里程计约束，initial为新关键帧的初值，返回优化后的位姿
+    gtsam::Pose3 addOdometry(const gtsam::Pose3 &measured, const gtsam::Pose3 &initial, const gtsam::SharedNoiseModel &noise){
+        Constraint c = {size() - 1, size(), measured, noise};
+        return addKeyFrame(c, initial);
+    }
+
+    // 回环约束，返回true表示已在窗口中优化，修正后的位姿由takeLoopCorrection取出；
+    // 返回false表示历史关键帧在窗口之外，需要批量优化
+    bool addLoop(int from, int to, const gtsam::Pose3 &measured, const gtsam::SharedNoiseModel &noise){
+        Constraint c = {from, to, measured, noise};
+        if (windowSize > 0 && std::min(from, to) < anchor){
+            constraints.push_back(c);
+            return false;
+        }
+        gtsam::NonlinearFactorGraph graph;
+        addConstraint(c, graph);
+        isam->update(graph);
+        isam->update();
+        refreshWindowEstimates();
+        loopBegin = std::min(loopBegin, anchor);
+        return true;
+    }
+
+    // addLoop返回true之后，取当前窗口的优化结果，返回位姿被修正的最早关键帧
+    int takeLoopCorrection(){
+        refreshWindowEstimates();
+        int begin = std::min(loopBegin, anchor);
+        loopBegin = size();
+        return begin;
+    }
+
+    // 持有锁时调用，复制全部约束和当前位姿
+    void prepareBatch(Batch &batch){
+        refreshWindowEstimates();
+        batch.keyNum = size();
+        batch.anchor = std::max(0, size() - windowSize);
+        batch.graph = gtsam::NonlinearFactorGraph();
+        batch.past = gtsam::NonlinearFactorGraph();
+        batch.initial = gtsam::Values();
+        for (size_t i = 0; i < constraints.size(); ++i){
+            addFactor(batch.graph, constraints[i]);
+            if (maxKey(constraints[i]) <= batch.anchor)
+                addFactor(batch.past, constraints[i]);
+        }
+        for (int key = 0; key < batch.keyNum; ++key)
+            batch.initial.insert(key, estimates[key]);
+    }
+
+    // 不需要持有锁，耗时随轨迹长度增长，在回环检测线程中执行
+    static void optimizeBatch(Batch &batch){
+        batch.result = gtsam::LevenbergMarquardtOptimizer(batch.graph, batch.initial).optimize();
+        gtsam::Values pastValues;
+        for (int key = 0; key <= batch.anchor; ++key)
+            pastValues.insert(key, batch.result.at<gtsam::Pose3>(key));
+        batch.anchorCovariance = gtsam::Marginals(batch.past, pastValues).marginalCovariance(batch.anchor);
+    }
+
+    // 持有锁时调用，批量优化期间新加入的关键帧随优化前最后一个关键帧一起修正，然后重建窗口
+    void applyBatch(const Batch &batch){
+        refreshWindowEstimates();
+        int last = batch.keyNum - 1;
+        gtsam::Pose3 correction = batch.result.at<gtsam::Pose3>(last).compose(estimates[last].inverse());
+        for (int key = batch.keyNum; key < size(); ++key)
+            estimates[key] = correction.compose(estimates[key]);
+        for (int key = 0; key < batch.keyNum; ++key)
+            estimates[key] = batch.result.at<gtsam::Pose3>(key);
+        rebuildWindow(batch.anchor, constraints, batch.anchorCovariance);
+    }
+};
+
+#endif
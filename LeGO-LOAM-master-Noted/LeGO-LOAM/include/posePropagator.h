@@ -0,0 +1,120 @@
+#ifndef _POSE_PROPAGATOR_H_
+#define _POSE_PROPAGATOR_H_
+
+#include "utility.h"
+#include "pointTransform.h"
+#include "imuBuffer.h"
+
+/*
+    * transformFusion中以imu频率向前推算的位姿
+    * 原来只在收到激光里程计(约10Hz)时发布融合后的位姿，输出的延迟包括了整个featureAssociation的处理时间；
+    * 这里以最近一次融合的位姿为锚点(激光里程计的时刻t_a，建图修正到达时在同一时刻重新锚定)，每收到一个imu消息推算一次：
+    *   R(t) = R_a * R_imu(t_a)^T * R_imu(t)
+    *   p(t) = p_a + v_a * (t - t_a) + R_a * R_imu(t_a)^T * (s(t) - s(t_a) - v_imu(t_a) * (t - t_a))
+    * 其中R_imu和s为ImuBuffer中的姿态和积分的位移，只用imu的加速度积分项，速度v_a由相邻两帧激光里程计(transformSum)估计，
+    * 再旋转到建图修正后的坐标系，建图修正带来的位置跳变不计入速度
+    * 位姿的表示与transformMapped相同(R = Ry*Rx*Rz，左上前坐标系)
+    */
+class PosePropagator{
+
+private:
+
+    bool anchored;
+    double anchorTime;
+    Eigen::Matrix3f anchorRotation;
+    Eigen::Vector3f anchorPosition;
+    Eigen::Vector3f velocity;   // 锚点处建图坐标系下的速度
+
+    bool odomValid;             // 上一帧激光里程计，用于估计速度
+    double odomTime;
+    Eigen::Vector3f odomPosition;
+
+    static Eigen::Matrix3f rotation(const float transform[6]){
+        return poseToMatrixYXZ(transform[0], transform[1], transform[2], 0, 0, 0).topLeftCorner<3, 3>();
+    }
+
+    static Eigen::Matrix3f imuRotation(const ImuSample &imu){
+        return poseToMatrixYXZ(imu.pitch, imu.yaw, imu.roll, 0, 0, 0).topLeftCorner<3, 3>();
+    }
+
+public:
+
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+    PosePropagator():
+        anchored(false),
+        anchorTime(0),
+        anchorRotation(Eigen::Matrix3f::Identity()),
+        anchorPosition(Eigen::Vector3f::Zero()),
+        velocity(Eigen::Vector3f::Zero()),
+        odomValid(false),
+        odomTime(0),
+        odomPosition(Eigen::Vector3f::Zero())
+    {}
+
+    // t时刻融合后的位姿transformMapped和激光里程计的位姿transformSum
+    // newScan为false表示同一时刻的建图修正，只更新锚点，不重新估计速度
+    void anchor(double t, const float transformMapped[6], const float transformSum[6], bool newScan){
+
+        Eigen::Matrix3f mappedRotation = rotation(transformMapped);
+        Eigen::Vector3f sumPosition(transformSum[3], transformSum[4], transformSum[5]);
+
+        if (newScan == true){
+            double dt = t - odomTime;
+            if (odomValid == true && dt > 0 && dt < 3 * scanPeriod){
+                // 里程计坐标系下的速度旋转到建图修正后的坐标系
+                Eigen::Matrix3f correction = mappedRotation * rotation(transformSum).transpose();
+                velocity = correction * (sumPosition - odomPosition) / dt;
+            }else{
+                velocity.setZero();
+            }
+            odomValid = true;
+            odomTime = t;
+            odomPosition = sumPosition;
+        }
+
+        anchored = true;
+        anchorTime = t;
+        anchorRotation = mappedRotation;
+        anchorPosition = Eigen::Vector3f(transformMapped[3], transformMapped[4], transformMapped[5]);
+    }
+
+    bool isAnchored() const { return anchored; }
+    double getAnchorTime() const { return anchorTime; }
+
+    // 推算t时刻的位姿(与transformMapped的表示相同)和建图坐标系下的速度
+    // 没有锚点、t早于锚点或晚于锚点maxAge以上、没有imu数据时返回false
+    bool predict(const ImuBuffer &imuBuffer, double t, double maxAge,
+                 float transformOut[6], Eigen::Vector3f &velocityOut) const {
+
+        double age = t - anchorTime;
+        if (anchored == false || age < 0 || age > maxAge)
+            return false;
+
+        ImuSample imuAnchor, imuCur;
+        if (!imuBuffer.at(anchorTime, imuAnchor) || !imuBuffer.at(t, imuCur))
+            return false;
+
+        // imu世界坐标系到建图坐标系的旋转
+        Eigen::Matrix3f imuToMap = anchorRotation * imuRotation(imuAnchor).transpose();
+        Eigen::Matrix3f R = imuToMap * imuRotation(imuCur);
+
+        Eigen::Vector3f imuVelocity(imuAnchor.veloX, imuAnchor.veloY, imuAnchor.veloZ);
+        Eigen::Vector3f accShift = Eigen::Vector3f(imuCur.shiftX - imuAnchor.shiftX,
+                                                   imuCur.shiftY - imuAnchor.shiftY,
+                                                   imuCur.shiftZ - imuAnchor.shiftZ) - imuVelocity * age;
+        Eigen::Vector3f p = anchorPosition + velocity * age + imuToMap * accShift;
+        velocityOut = velocity + imuToMap * (Eigen::Vector3f(imuCur.veloX, imuCur.veloY, imuCur.veloZ) - imuVelocity);
+
+        // R = Ry*Rx*Rz：R(1,2) = -sin(rx)，R(1,0)/R(1,1) = tan(rz)，R(0,2)/R(2,2) = tan(ry)
+        transformOut[0] = -asin(std::min(std::max(R(1, 2), -1.0f), 1.0f));
+        transformOut[1] = atan2(R(0, 2), R(2, 2));
+        transformOut[2] = atan2(R(1, 0), R(1, 1));
+        transformOut[3] = p.x();
+        transformOut[4] = p.y();
+        transformOut[5] = p.z();
+        return true;
+    }
+};
+
+#endif
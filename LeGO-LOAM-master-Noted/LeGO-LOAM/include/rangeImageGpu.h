@@ -0,0 +1,72 @@
+#ifndef _RANGE_IMAGE_GPU_H_
+#define _RANGE_IMAGE_GPU_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+/*
+    * imageProjection的CUDA后端(以catkin_make -DUSE_CUDA=ON编译，运行时由lego_loam/gpu/enable选择)
+    * 在设备上完成距离图像投影(projectPointCloud)、地面点标记(groundRemoval)和连通域合并(labelComponents的第1、2步)，
+    * 得到rangeMat、groundMat、labelMat(只有-1和0)、fullCloud/fullInfoCloud以及每个待分割点所在聚类的根节点(聚类中行优先顺序的第一个点)，
+    * 聚类的取舍和标签分配仍在CPU上按行优先顺序进行(labelComponents的第3、4步)，标签顺序、cloud_info和分割点云与CPU版本的定义相同
+    *   投影：每个点一个线程，多个点落在同一像素时与CPU一样保留原始点云中靠后的点(atomicMax)
+    *   地面：每列一个线程，沿列向上检查groundScanInd线
+    *   分割：每个像素保存所在聚类的最小索引，与相连的邻点取最小值并做指针跳跃，直到不再变化
+    * 设备上的atan2f/sinf/cosf与主机的误差在几个ulp以内，恰好落在像素边界或阈值上的点可能与CPU版本不同
+    * 这个头文件也由nvcc编译(src/rangeImageGpu.cu)，不包含ROS/PCL的头文件，点云以原始字节和字段布局传入
+    */
+class RangeImageGpu{
+
+public:
+
+    struct Params{
+        int rows, cols;             // N_SCAN, Horizon_SCAN
+        bool useRing;               // useCloudRing
+        float angBottom, angResX, angResY;
+        float minRange;             // sensorMinimumRange
+        int groundScanInd;
+        float mountAngle;           // sensorMountAngle
+        float segmentTheta, alphaX, alphaY;
+    };
+
+    // 原始点云的布局，字段依次为x, y, z, intensity, ring，offset为-1表示没有该字段，datatype与sensor_msgs::PointField相同
+    struct Layout{
+        int offset[5];
+        uint8_t datatype[5];
+        uint32_t width, height, pointStep, rowStep;
+    };
+
+    // 结果写入的主机内存，均为rows * cols个元素，按行存储
+    // fullCloud/fullInfoCloud的每个点为8个float(与pcl::PointXYZI相同：x, y, z, 1, intensity, 填充)
+    struct Output{
+        float *range;
+        int8_t *ground;
+        int *label;
+        int *component;     // labelMat为0的像素所在聚类的根节点
+        float *fullCloud;
+        float *fullInfoCloud;
+    };
+
+private:
+
+    struct Impl;        // 设备内存，只在rangeImageGpu.cu中定义
+    Impl *impl;
+
+    RangeImageGpu(const RangeImageGpu &);
+    RangeImageGpu &operator=(const RangeImageGpu &);
+
+public:
+
+    explicit RangeImageGpu(const Params &params);
+    ~RangeImageGpu();
+
+    // 是否有可用的设备并分配了内存，失败时error()返回原因
+    bool ok() const;
+    const std::string &error() const;
+
+    // 处理一帧点云，iterations为分割中标签传播的迭代次数，失败时返回false，输出的内容不确定
+    bool process(const uint8_t *data, size_t bytes, const Layout &layout, const Output &output, int &iterations);
+};
+
+#endif
@@ -0,0 +1,137 @@
+#ifndef _RANGE_IMAGE_INDEX_H_
+#define _RANGE_IMAGE_INDEX_H_
+
+#include "utility.h"
+
+/*
+    * featureAssociation中上一帧特征点的距离图像索引，用于投影数据关联(projectiveAssociationFlag)
+    * 原来每一帧都要对laserCloudCornerLast/laserCloudSurfLast重建KD树，每5次迭代对每个特征点做一次nearestKSearch，
+    * 再沿着按线号排列的点云向前后查找相邻线上的点；上一帧的特征点本来就来自N_SCAN x Horizon_SCAN的距离图像，
+    * 这里按线号(intensity的整数部分)和水平角把点放回距离图像的像素中，查询点投影到图像后只在附近的窗口中查找，
+    * 建立和查询都只与窗口大小有关，访问的内存是连续的几行像素
+    * 点云坐标轴为左上前(z轴向前，x轴向左，y轴向上)，与featureAssociation中的点云相同
+    */
+class RangeImageIndex{
+
+private:
+
+    int rows, cols;
+    int windowCols;             // 水平方向上查找的像素数(单侧)
+    std::vector<int> head;      // 每个像素中第一个点在cloud中的索引，-1表示没有点
+    std::vector<int> next;      // 同一像素中的下一个点
+    std::vector<int> touched;   // 有点的像素，下次build时只清空这些像素
+    pcl::PointCloud<PointType>::ConstPtr cloud;
+
+    static int rowOf(const PointType &p){
+        return int(p.intensity);
+    }
+
+    // 与imageProjection中的列号计算相同，交换前的x对应这里的z，交换前的y对应这里的x
+    int columnOf(const PointType &p) const {
+        float horizonAngle = atan2(p.z, p.x) * 180 / M_PI;
+        int col = -round((horizonAngle - 90.0) / ang_res_x) + cols / 2;
+        if (col >= cols)
+            col -= cols;
+        if (col < 0)
+            col += cols;
+        return std::min(std::max(col, 0), cols - 1);
+    }
+
+    // 在[rowBegin, rowEnd]行、以col为中心的窗口中，满足accept的点里与q最近且平方距离小于minSqDis的点，没有时返回-1
+    template <typename Accept>
+    int search(const PointType &q, int rowBegin, int rowEnd, int col, Accept accept, float &minSqDis) const {
+        int best = -1;
+        rowBegin = std::max(rowBegin, 0);
+        rowEnd = std::min(rowEnd, rows - 1);
+        for (int r = rowBegin; r <= rowEnd; ++r){
+            for (int dc = -windowCols; dc <= windowCols; ++dc){
+                int c = col + dc;
+                if (c < 0)
+                    c += cols;
+                else if (c >= cols)
+                    c -= cols;
+                for (int k = head[r * cols + c]; k >= 0; k = next[k]){
+                    if (!accept(k, r))
+                        continue;
+                    const PointType &p = cloud->points[k];
+                    float sqDis = (p.x - q.x) * (p.x - q.x) + (p.y - q.y) * (p.y - q.y) + (p.z - q.z) * (p.z - q.z);
+                    if (sqDis < minSqDis){
+                        minSqDis = sqDis;
+                        best = k;
+                    }
+                }
+            }
+        }
+        return best;
+    }
+
+public:
+
+    RangeImageIndex(int rowsIn, int colsIn, int windowColsIn):
+        rows(rowsIn),
+        cols(colsIn),
+        windowCols(windowColsIn),
+        head(rowsIn * colsIn, -1)
+    {
+    }
+
+    // publishCloudsLast中代替kdtree->setInputCloud，索引与cloudIn中的点相同
+    void build(const pcl::PointCloud<PointType>::ConstPtr &cloudIn){
+        for (size_t i = 0; i < touched.size(); ++i)
+            head[touched[i]] = -1;
+        touched.clear();
+
+        cloud = cloudIn;
+        int cloudSize = cloud->points.size();
+        next.assign(cloudSize, -1);
+        // 倒序插入，同一像素中的点按索引从小到大排列
+        for (int i = cloudSize - 1; i >= 0; --i){
+            const PointType &p = cloud->points[i];
+            int r = rowOf(p);
+            if (r < 0 || r >= rows)
+                continue;
+            int cell = r * cols + columnOf(p);
+            if (head[cell] < 0)
+                touched.push_back(cell);
+            next[i] = head[cell];
+            head[cell] = i;
+        }
+    }
+
+    // 边缘点：最近点j(论文中的点j)，以及j所在线相邻2线之内、不同线上的最近点l，没有找到时为-1
+    void findCorner(const PointType &q, int &closestPointInd, int &minPointInd2) const {
+        int row = rowOf(q), col = columnOf(q);
+        float minPointSqDis = nearestFeatureSearchSqDist;
+        closestPointInd = search(q, row - projectiveSearchRows, row + projectiveSearchRows, col,
+                                 [](int, int){ return true; }, minPointSqDis);
+        minPointInd2 = -1;
+        if (closestPointInd < 0)
+            return;
+
+        int closestPointScan = rowOf(cloud->points[closestPointInd]);
+        float minPointSqDis2 = nearestFeatureSearchSqDist;
+        minPointInd2 = search(q, closestPointScan - 2, closestPointScan + 2, col,
+                              [closestPointScan](int, int r){ return r != closestPointScan; }, minPointSqDis2);
+    }
+
+    // 平面点：最近点j，与j同一线上的最近点l，以及j所在线相邻2线之内、不同线上的最近点m，没有找到时为-1
+    void findSurf(const PointType &q, int &closestPointInd, int &minPointInd2, int &minPointInd3) const {
+        int row = rowOf(q), col = columnOf(q);
+        float minPointSqDis = nearestFeatureSearchSqDist;
+        closestPointInd = search(q, row - projectiveSearchRows, row + projectiveSearchRows, col,
+                                 [](int, int){ return true; }, minPointSqDis);
+        minPointInd2 = -1;
+        minPointInd3 = -1;
+        if (closestPointInd < 0)
+            return;
+
+        int closestPointScan = rowOf(cloud->points[closestPointInd]);
+        float minPointSqDis2 = nearestFeatureSearchSqDist, minPointSqDis3 = nearestFeatureSearchSqDist;
+        minPointInd2 = search(q, closestPointScan, closestPointScan, col,
+                              [closestPointInd](int k, int){ return k != closestPointInd; }, minPointSqDis2);
+        minPointInd3 = search(q, closestPointScan - 2, closestPointScan + 2, col,
+                              [closestPointScan](int, int r){ return r != closestPointScan; }, minPointSqDis3);
+    }
+};
+
+#endif
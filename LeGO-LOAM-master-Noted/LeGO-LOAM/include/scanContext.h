@@ -0,0 +1,320 @@
+#ifndef _SCAN_CONTEXT_H_
+#define _SCAN_CONTEXT_H_
+
+#include "utility.h"
+
+#include <queue>
+
+/*
+    * 基于Scan Context的全局位置识别，为回环检测提供候选关键帧
+    * 原来只在漂移后的当前位置historyKeyframeSearchRadius范围内寻找回环，漂移较大时回环无法被发现
+    * 每个关键帧保存时在其局部坐标系下(相机坐标系，y轴向上)计算描述子：
+    *   水平面按距离分为scanContextRingNum个环、按方位角分为scanContextSectorNum个扇区，
+    *   每个格子保存落入点的最大高度，按scanContextHeightResolution量化为uint8，每个关键帧只占Ring*Sector字节
+    *   ring key(每个环的均值)与旋转无关，用于检索；sector key(每个扇区的均值)用于快速估计候选帧之间的航向差
+    * ring key保存在KD树中，每加入scanContextTreeRebuildNum个关键帧重建一次，查询时间为对数级；
+    * 尚未加入KD树的少量关键帧线性比较
+    * 只对ring key最近的scanContextCandidateNum个候选计算列平移后的余弦距离，得到最佳匹配帧和航向差
+    * 调用者负责加锁(mapOptimization中由mtx保护)
+    */
+class ScanContext{
+
+private:
+
+    // ring key的静态KD树，节点隐式存放：每个子树对应order中连续的一段
+    class RingKeyTree{
+
+    private:
+
+        struct Node{
+            int begin, end;     // 对应order[begin, end)
+            int splitDim;       // -1表示叶子节点
+            float splitValue;
+            int left, right;
+        };
+
+        const std::vector<float> *keys;
+        int dim;
+        std::vector<int> order;
+        std::vector<Node> nodes;
+
+        float key(int index, int d) const {
+            return (*keys)[index * dim + d];
+        }
+
+        int build(int begin, int end){
+            Node node;
+            node.begin = begin;
+            node.end = end;
+            node.splitDim = -1;
+            node.left = node.right = -1;
+            int nodeIndex = nodes.size();
+            nodes.push_back(node);
+            if (end - begin <= 8)
+                return nodeIndex;
+
+            // 按跨度最大的维度在中位数处划分
+            int bestDim = 0;
+            float bestSpread = -1;
+            for (int d = 0; d < dim; ++d){
+                float minV = FLT_MAX, maxV = -FLT_MAX;
+                for (int i = begin; i < end; ++i){
+                    minV = std::min(minV, key(order[i], d));
+                    maxV = std::max(maxV, key(order[i], d));
+                }
+                if (maxV - minV > bestSpread){
+                    bestSpread = maxV - minV;
+                    bestDim = d;
+                }
+            }
+            int mid = (begin + end) / 2;
+            std::nth_element(order.begin() + begin, order.begin() + mid, order.begin() + end,
+                             [this, bestDim](int a, int b){ return key(a, bestDim) < key(b, bestDim); });
+            nodes[nodeIndex].splitDim = bestDim;
+            nodes[nodeIndex].splitValue = key(order[mid], bestDim);
+            int left = build(begin, mid);
+            int right = build(mid, end);
+            nodes[nodeIndex].left = left;
+            nodes[nodeIndex].right = right;
+            return nodeIndex;
+        }
+
+        void search(int nodeIndex, const float *query, int k, std::priority_queue<std::pair<float, int> > &heap) const {
+            const Node &node = nodes[nodeIndex];
+            if (node.splitDim < 0){
+                for (int i = node.begin; i < node.end; ++i){
+                    float sqDis = 0;
+                    for (int d = 0; d < dim; ++d){
+                        float diff = key(order[i], d) - query[d];
+                        sqDis += diff * diff;
+                    }
+                    if ((int)heap.size() < k){
+                        heap.push(std::make_pair(sqDis, order[i]));
+                    }else if (sqDis < heap.top().first){
+                        heap.pop();
+                        heap.push(std::make_pair(sqDis, order[i]));
+                    }
+                }
+                return;
+            }
+            float diff = query[node.splitDim] - node.splitValue;
+            int nearChild = diff < 0 ? node.left : node.right;
+            int farChild = diff < 0 ? node.right : node.left;
+            search(nearChild, query, k, heap);
+            if ((int)heap.size() < k || diff * diff < heap.top().first)
+                search(farChild, query, k, heap);
+        }
+
+    public:
+
+        RingKeyTree(): keys(NULL), dim(0) {}
+
+        int size() const { return order.size(); }
+
+        // 用keys中前num个ring key建立KD树
+        void build(const std::vector<float> &allKeys, int keyDim, int num){
+            keys = &allKeys;
+            dim = keyDim;
+            order.resize(num);
+            for (int i = 0; i < num; ++i)
+                order[i] = i;
+            nodes.clear();
+            if (num > 0)
+                build(0, num);
+        }
+
+        // 在KD树中搜索与query最近的k个，结果压入heap(大顶堆，堆顶为当前第k近)
+        void knnSearch(const float *query, int k, std::priority_queue<std::pair<float, int> > &heap) const {
+            if (nodes.empty() == false)
+                search(0, query, k, heap);
+        }
+    };
+
+    int ringNum;
+    int sectorNum;
+    std::vector<uint8_t> descriptors;   // 每个关键帧ringNum*sectorNum字节，按环优先存放
+    std::vector<float> ringKeys;        // 每个关键帧ringNum个
+    std::vector<float> sectorKeys;      // 每个关键帧sectorNum个
+    std::vector<double> times;
+    RingKeyTree tree;
+
+    const uint8_t* descriptor(int index) const {
+        return &descriptors[(size_t)index * ringNum * sectorNum];
+    }
+
+    void accumulate(const pcl::PointCloud<PointType> &cloud, uint8_t *desc){
+        for (size_t i = 0; i < cloud.points.size(); ++i){
+            const PointType &p = cloud.points[i];
+            // 相机坐标系下水平面为z-x平面，y轴向上
+            float range = sqrt(p.x * p.x + p.z * p.z);
+            if (range >= scanContextMaxRadius)
+                continue;
+            float azimuth = atan2(p.x, p.z) + M_PI;
+            int ring = std::min((int)(range / scanContextMaxRadius * ringNum), ringNum - 1);
+            int sector = std::min((int)(azimuth / (2 * M_PI) * sectorNum), sectorNum - 1);
+            // 占据的格子至少为1，与空格子区分
+            int height = (int)round((p.y + scanContextLidarHeight) / scanContextHeightResolution);
+            height = std::min(std::max(height, 1), 255);
+            uint8_t &cell = desc[ring * sectorNum + sector];
+            cell = std::max(cell, (uint8_t)height);
+        }
+    }
+
+    // 当前帧的第j - shift列与候选帧的第j列比较，返回列余弦距离的均值
+    float distance(const uint8_t *query, const uint8_t *candidate, int shift) const {
+        float sum = 0;
+        int validNum = 0;
+        for (int j = 0; j < sectorNum; ++j){
+            int jq = (j - shift + sectorNum) % sectorNum;
+            float dot = 0, normQ = 0, normC = 0;
+            for (int i = 0; i < ringNum; ++i){
+                float q = query[i * sectorNum + jq], c = candidate[i * sectorNum + j];
+                dot += q * c;
+                normQ += q * q;
+                normC += c * c;
+            }
+            if (normQ == 0 || normC == 0)
+                continue;
+            sum += dot / sqrt(normQ * normC);
+            ++validNum;
+        }
+        if (validNum == 0)
+            return 1;
+        return 1 - sum / validNum;
+    }
+
+    // 先用sector key求出粗略的列平移，再在其附近搜索描述子距离最小的平移
+    float alignedDistance(int queryIndex, int candidateIndex, int &bestShift) const {
+        const float *sq = &sectorKeys[(size_t)queryIndex * sectorNum];
+        const float *sc = &sectorKeys[(size_t)candidateIndex * sectorNum];
+        int initShift = 0;
+        float initDis = FLT_MAX;
+        for (int shift = 0; shift < sectorNum; ++shift){
+            float dis = 0;
+            for (int j = 0; j < sectorNum; ++j){
+                float diff = sq[(j - shift + sectorNum) % sectorNum] - sc[j];
+                dis += diff * diff;
+            }
+            if (dis < initDis){
+                initDis = dis;
+                initShift = shift;
+            }
+        }
+
+        int searchRadius = std::max(1, (int)round(sectorNum * scanContextSearchRatio));
+        float bestDis = FLT_MAX;
+        bestShift = initShift;
+        for (int k = -searchRadius; k <= searchRadius; ++k){
+            int shift = (initShift + k + sectorNum) % sectorNum;
+            float dis = distance(descriptor(queryIndex), descriptor(candidateIndex), shift);
+            if (dis < bestDis){
+                bestDis = dis;
+                bestShift = shift;
+            }
+        }
+        return bestDis;
+    }
+
+public:
+
+    ScanContext():
+        ringNum(scanContextRingNum),
+        sectorNum(scanContextSectorNum)
+    {
+    }
+
+    int size() const {
+        return times.size();
+    }
+
+    // 关键帧保存时调用，点云为该关键帧局部坐标系下的特征点，索引与cloudKeyPoses3D相同
+    void add(const pcl::PointCloud<PointType> &corner, const pcl::PointCloud<PointType> &surf,
+             const pcl::PointCloud<PointType> &outlier, double time){
+
+        size_t cellNum = ringNum * sectorNum;
+        descriptors.resize(descriptors.size() + cellNum, 0);
+        uint8_t *desc = &descriptors[descriptors.size() - cellNum];
+        accumulate(corner, desc);
+        accumulate(surf, desc);
+        accumulate(outlier, desc);
+
+        for (int i = 0; i < ringNum; ++i){
+            float sum = 0;
+            for (int j = 0; j < sectorNum; ++j)
+                sum += desc[i * sectorNum + j];
+            ringKeys.push_back(sum / sectorNum);
+        }
+        for (int j = 0; j < sectorNum; ++j){
+            float sum = 0;
+            for (int i = 0; i < ringNum; ++i)
+                sum += desc[i * sectorNum + j];
+            sectorKeys.push_back(sum / ringNum);
+        }
+        times.push_back(time);
+
+        if (size() - tree.size() >= scanContextTreeRebuildNum)
+            tree.build(ringKeys, ringNum, size());
+    }
+
+    // 为第queryIndex个关键帧寻找回环候选：只考虑时间相差超过timeDiff的关键帧
+    // 找到时返回true，candidateIndex为匹配的关键帧，yawDiff为当前帧相对候选帧绕y轴(竖直方向)的旋转角
+    bool detect(int queryIndex, double timeDiff, int &candidateIndex, float &yawDiff) const {
+
+        if (queryIndex < 0 || queryIndex >= size())
+            return false;
+
+        // 在KD树中取ring key最近的候选，时间相差不足的(通常是刚刚经过的关键帧)不能作为候选，
+        // 有效候选不足时扩大搜索数量
+        const float *query = &ringKeys[(size_t)queryIndex * ringNum];
+        int k = scanContextCandidateNum;
+        std::vector<std::pair<float, int> > candidates;
+        for (int searchNum = 2 * k; ; searchNum *= 2){
+            std::priority_queue<std::pair<float, int> > heap;
+            tree.knnSearch(query, searchNum, heap);
+            candidates.clear();
+            while (heap.empty() == false){
+                if (std::abs(times[heap.top().second] - times[queryIndex]) > timeDiff)
+                    candidates.push_back(heap.top());
+                heap.pop();
+            }
+            if ((int)candidates.size() >= k || searchNum >= tree.size())
+                break;
+        }
+        // 尚未加入KD树的关键帧线性比较
+        for (int index = tree.size(); index < size(); ++index){
+            if (std::abs(times[index] - times[queryIndex]) <= timeDiff)
+                continue;
+            float sqDis = 0;
+            for (int d = 0; d < ringNum; ++d){
+                float diff = ringKeys[(size_t)index * ringNum + d] - query[d];
+                sqDis += diff * diff;
+            }
+            candidates.push_back(std::make_pair(sqDis, index));
+        }
+
+        std::sort(candidates.begin(), candidates.end());
+        if ((int)candidates.size() > k)
+            candidates.resize(k);
+
+        float bestDis = FLT_MAX;
+        int bestShift = 0;
+        candidateIndex = -1;
+        for (size_t i = 0; i < candidates.size(); ++i){
+            int shift;
+            float dis = alignedDistance(queryIndex, candidates[i].second, shift);
+            if (dis < bestDis){
+                bestDis = dis;
+                bestShift = shift;
+                candidateIndex = candidates[i].second;
+            }
+        }
+        if (candidateIndex < 0 || bestDis > scanContextDistThreshold){
+            candidateIndex = -1;
+            return false;
+        }
+        yawDiff = bestShift * 2 * M_PI / sectorNum;
+        return true;
+    }
+};
+
+#endif
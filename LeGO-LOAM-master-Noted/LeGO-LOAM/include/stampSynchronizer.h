@@ -0,0 +1,82 @@
+#ifndef _STAMP_SYNCHRONIZER_H_
+#define _STAMP_SYNCHRONIZER_H_
+
+#include <ros/ros.h>
+#include <pcl_conversions/pcl_conversions.h>
+
+/*
+    * 按时间戳精确匹配同一帧的多路消息
+    * 原来各节点以200Hz轮询接收标志，并用|t1 - t2| < 0.05(或0.005)判断是否属于同一帧，每一级最多增加5ms延迟
+    * 这里每路消息到达时在回调中调用add()，N路的时间戳相同时立即返回true，由回调直接触发处理
+    * pcl点云的时间戳只有微秒精度，所以统一按微秒比较(message_filters::TimeSynchronizer按纳秒比较，无法匹配pcl点云与ROS消息)
+    * 每路只保留最新的一个时间戳，某一路丢帧时该帧不会被处理，与原来的行为相同
+    * 发布频率高于其他路的通道(例如每帧都发布的odometry)用ignoreDrops()标记，其时间戳被覆盖是正常的，不计入dropped
+    * 只在回调线程中使用，不加锁
+    */
+template <int N>
+class StampSynchronizer{
+
+private:
+
+    uint64_t stamps[N];
+    bool valid[N];
+    bool countDrops[N]; // false表示该路的时间戳被覆盖时不计入dropped
+    uint64_t matched;   // 已匹配的帧数
+    uint64_t dropped;   // 被同一路更新的时间戳覆盖、没有匹配上的消息数(不包括ignoreDrops()的通道)
+
+public:
+
+    StampSynchronizer():
+        matched(0),
+        dropped(0)
+    {
+        for (int i = 0; i < N; ++i){
+            stamps[i] = 0;
+            valid[i] = false;
+            countDrops[i] = true;
+        }
+    }
+
+    // 该路只有一部分消息能与其他路匹配，被覆盖的时间戳不算作丢失
+    void ignoreDrops(int channel){
+        countDrops[channel] = false;
+    }
+
+    static uint64_t toMicroseconds(const ros::Time &stamp){
+        return pcl_conversions::toPCL(stamp);
+    }
+
+    // 第channel路收到时间戳为stamp(微秒)的消息，N路都收到同一时间戳时返回true
+    bool add(int channel, uint64_t stamp){
+        if (valid[channel] == true && stamps[channel] != stamp && countDrops[channel] == true)
+            ++dropped;
+        stamps[channel] = stamp;
+        valid[channel] = true;
+        for (int i = 0; i < N; ++i)
+            if (valid[i] == false || stamps[i] != stamp)
+                return false;
+        for (int i = 0; i < N; ++i)
+            valid[i] = false;
+        ++matched;
+        return true;
+    }
+
+    bool add(int channel, const ros::Time &stamp){
+        return add(channel, toMicroseconds(stamp));
+    }
+
+    // 已经到达、等待其他路的消息数
+    int pending() const {
+        int num = 0;
+        for (int i = 0; i < N; ++i)
+            if (valid[i] == true)
+                ++num;
+        return num;
+    }
+
+    uint64_t matchedNum() const { return matched; }
+
+    uint64_t droppedNum() const { return dropped; }
+};
+
+#endif
@@ -63,65 +63,47 @@ extern const string fileDirectory = "/tmp/";
     ring: 第几根线(从下至上，0~15)，ring id 与 laser id 并不是一一对应的，具体见launch/VLP-16_id.png
     激光雷达首先会按照一定顺序发射激光线束，垂直方向上是跳跃发射，这样避免邻近的干扰。
 */
-// Using velodyne cloud "ring" channel for image projection (other lidar may have different name for this channel, change "PointXYZIR" below)
-extern const bool useCloudRing = true; // if true, ang_res_y and ang_bottom are not used
-
-// VLP-16
-extern const int N_SCAN = 16;               // 多线激光雷达线数
-extern const int Horizon_SCAN = 1800;       // 单线水平扫描点数
-extern const float ang_res_x = 0.2;         // 水平方向分辨率
-extern const float ang_res_y = 2.0;         // 垂直方向分辨率
-extern const float ang_bottom = 15.0+0.1;   // 这里应该是垂直方向的视场角(一半)
-extern const int groundScanInd = 7;         // 地面检测索引
-
-// HDL-32E
-// extern const int N_SCAN = 32;
-// extern const int Horizon_SCAN = 1800;
-// extern const float ang_res_x = 360.0/float(Horizon_SCAN);
-// extern const float ang_res_y = 41.33/float(N_SCAN-1);
-// extern const float ang_bottom = 30.67;
-// extern const int groundScanInd = 20;
-
-// VLS-128
-// extern const int N_SCAN = 128;
-// extern const int Horizon_SCAN = 1800;
-// extern const float ang_res_x = 0.2;
-// extern const float ang_res_y = 0.3;
-// extern const float ang_bottom = 25.0;
-// extern const int groundScanInd = 10;
-
+// 激光雷达参数在程序启动时由readSensorParams()从参数服务器(lego_loam/sensor/*)读取，同一个程序可以用于不同型号的雷达
+// 各型号的参数见config/目录下的yaml文件(VLP-16, HDL-32E, VLS-128, Ouster OS1-16/64)，未设置时使用下面VLP-16的默认值
+// 读取之后不再修改
 // Ouster users may need to uncomment line 159 in imageProjection.cpp
 // Usage of Ouster imu data is not fully supported yet (LeGO-LOAM needs 9-DOF IMU), please just publish point cloud data
-// Ouster OS1-16
-// extern const int N_SCAN = 16;
-// extern const int Horizon_SCAN = 1024;
-// extern const float ang_res_x = 360.0/float(Horizon_SCAN);
-// extern const float ang_res_y = 33.2/float(N_SCAN-1);
-// extern const float ang_bottom = 16.6+0.1;
-// extern const int groundScanInd = 7;
-
-// Ouster OS1-64
-// extern const int N_SCAN = 64;
-// extern const int Horizon_SCAN = 1024;
-// extern const float ang_res_x = 360.0/float(Horizon_SCAN);
-// extern const float ang_res_y = 33.2/float(N_SCAN-1);
-// extern const float ang_bottom = 16.6+0.1;
-// extern const int groundScanInd = 15;
+
+// Using velodyne cloud "ring" channel for image projection (other lidar may have different name for this channel)
+bool useCloudRing = true; // if true, ang_res_y and ang_bottom are not used
+
+// VLP-16
+int N_SCAN = 16;               // 多线激光雷达线数
+int Horizon_SCAN = 1800;       // 单线水平扫描点数
+float ang_res_x = 0.2;         // 水平方向分辨率
+float ang_res_y = 2.0;         // 垂直方向分辨率
+float ang_bottom = 15.0+0.1;   // 这里应该是垂直方向的视场角(一半)
+int groundScanInd = 7;         // 地面检测索引
 
 extern const bool loopClosureEnableFlag = false;    // 是否开启回环检测标志
 extern const double mappingProcessInterval = 0.3;   // 建图过程的时间间隔
+extern const bool loadSheddingFlag = false;         // 建图跟不上输入时逐级降低降采样精度和局部地图大小，见loadShedder.h
+extern const float loadSheddingHighRatio = 0.8;     // scan-to-map每帧耗时与帧间隔之比超过该值时升一级
+extern const float loadSheddingLowRatio = 0.5;      // 低于该值时降一级
+extern const bool localizationModeFlag = false;     // 纯定位模式：在fileDirectory/localizationMap.bin上做scan-to-map匹配，不插入关键帧、不进行图优化，见localizationMap.h
 
 extern const float scanPeriod = 0.1;    // 扫描间隔 = 1 / 频率
 extern const int systemDelay = 0;       // 系统延时
-extern const int imuQueLength = 200;    // imu队列长度
+extern const int imuQueLength = 1024;   // imu环形缓冲区长度，400Hz的imu约可保存2.5s，见imuBuffer.h
+extern const float imuDeskewTableStep = 0.001; // featureAssociation去畸变表的时间间隔(s)
+extern const bool imuPropagationFlag = false;    // transformFusion以imu频率向前推算位姿并发布在/integrated_to_init_imu上，见posePropagator.h
+extern const double imuPropagationMaxAge = 0.5;  // 距最近一次激光里程计超过该时长(s)后不再推算
 
 extern const float sensorMinimumRange = 1.0;    // 激光雷达传感器最小测距范围
 extern const float sensorMountAngle = 0.0;
 extern const float segmentTheta = 60.0/180.0*M_PI; // 60度--->弧度，在imageProjection中用于判断平面，decrese this value may improve accuracy
 extern const int segmentValidPointNum = 5;  // 分割有效点数
 extern const int segmentValidLineNum = 3;   // 分割有效线数
-extern const float segmentAlphaX = ang_res_x / 180.0 * M_PI;    // 分辨率对应的弧度值
-extern const float segmentAlphaY = ang_res_y / 180.0 * M_PI;
+float segmentAlphaX = ang_res_x / 180.0 * M_PI;    // 分辨率对应的弧度值，由readSensorParams()更新
+float segmentAlphaY = ang_res_y / 180.0 * M_PI;
+extern const bool gpuBackendFlag = false; // 投影、地面检测和分割在GPU上计算(需要以-DUSE_CUDA=ON编译)，见rangeImageGpu.h
+extern const bool compactCloudFlag = false;        // imageProjection与featureAssociation之间以紧凑格式传递分割点云和分割信息，见compactCloud.h
+extern const float compactRangeResolution = 0.005; // 紧凑格式中距离的量化精度(m)，uint16最大表示327m
 
 
 extern const int edgeFeatureNum = 2;        // 边缘特征点数
@@ -130,6 +112,15 @@ extern const int sectionsTotal = 6;         // 分区域点总数
 extern const float edgeThreshold = 0.1;     // 判断点的阈值c_th
 extern const float surfThreshold = 0.1;
 extern const float nearestFeatureSearchSqDist = 25; // 特征关联里面近邻特征搜索平方距离
+extern const bool projectiveAssociationFlag = false; // 特征关联时把点投影到上一帧的距离图像中查找对应点，代替KD树，见rangeImageIndex.h
+extern const int projectiveSearchRows = 2;      // 投影关联时查找最近点的上下行数
+extern const int projectiveSearchColumns = 20;  // 投影关联时左右各查找的列数(VLP-16约4度)
+
+// LM迭代控制的默认值，各阶段可在lego_loam/convergence/<stage>/下分别设置，见iterationControl.h
+extern const float researchDeltaR = 0.0;    // 位姿自上次查找对应点以来的旋转(度)和平移(cm)变化都小于该值时沿用上次的对应点，0表示按原来的间隔总是重新查找
+extern const float researchDeltaT = 0.0;
+extern const double scanMatchDeadline = 0.0;    // featureAssociation每帧两步LM的时间限制(ms)，0表示不限制
+extern const double scan2MapDeadline = 0.0;     // mapOptimization每帧scan-to-map优化的时间限制(ms)，0表示不限制
 
 
 // Mapping Params
@@ -139,20 +130,47 @@ extern const int   surroundingKeyframeSearchNum = 50; // submap size (when loop
 extern const float historyKeyframeSearchRadius = 7.0; // key frame that is within n meters from current pose will be considerd for loop closure
 extern const int   historyKeyframeSearchNum = 25; // 2n+1 number of hostory key frames will be fused into a submap for loop closure
 extern const float historyKeyframeFitnessScore = 0.3; // the smaller the better alignment
+extern const int   loopRegistrationMaxIterations = 20; // 回环配准时体素金字塔每一层的最大迭代次数
+extern const int   backendWindowSize = 0; // 位姿图中参与增量优化的最近关键帧数，0表示不限制(与原来相同)，长时间运行时可设为200左右，见poseGraphBackend.h
+
+// Scan Context
+extern const int   scanContextRingNum = 20;     // 描述子的环数
+extern const int   scanContextSectorNum = 60;   // 描述子的扇区数
+extern const float scanContextMaxRadius = 80.0; // 描述子覆盖的最大水平距离(m)
+extern const float scanContextLidarHeight = 2.0;        // 激光雷达离地高度，使格子中的高度为正数(m)
+extern const float scanContextHeightResolution = 0.1;   // 高度的量化精度(m)
+extern const int   scanContextTreeRebuildNum = 50;      // 每加入n个关键帧重建一次ring key的KD树
+extern const int   scanContextCandidateNum = 10;        // 计算描述子距离的候选关键帧数
+extern const float scanContextSearchRatio = 0.1;        // 在sector key估计的列平移附近搜索的范围(占扇区数的比例)
+extern const float scanContextDistThreshold = 0.3;      // 描述子距离小于该值才认为是回环候选，之后仍需通过配准得分的检验
 
 extern const float globalMapVisualizationSearchRadius = 500.0; // key frames with in n meters will be visualized
-
-// 粗糙度(曲率)
-struct smoothness_t{ 
-    float value;    // 按照论文公式(1)计算出来的粗糙度值
-    size_t ind;     // 当前点在分割点云中的id
-};
-
-struct by_value{ 
-    bool operator()(smoothness_t const &left, smoothness_t const &right) { 
-        return left.value < right.value;
-    }
-};
+extern const float keyPoseIndexCellSize = 10.0; // 关键帧位置空间索引的网格大小(m)
+
+extern const int keyFrameResidentNum = 200; // 内存中保留的关键帧点云数，其余的压缩保存在fileDirectory下，需要时读回
+extern const float mapExportTileSize = 50.0;  // 后台导出地图时水平方向的分块大小(m)
+extern const double mapExportInterval = 10.0; // 有更新的地图块写入文件的时间间隔(s)
+extern const double globalMapPublishInterval = 5.0; // 有变化的全局地图块发布的时间间隔(s)
+
+extern const double metricsPublishPeriod = 1.0; // 各节点在/diagnostics上发布处理耗时统计的默认周期(s)，见pipelineMetrics.h
+
+extern const int numberOfCores = 4; // scan-to-map特征关联(cornerOptimization/surfOptimization)和点云分割(labelComponents)使用的线程数
+
+// 从参数服务器读取激光雷达参数，需要在创建各节点的类之前调用
+// ang_res_x未设置时按360度/Horizon_SCAN计算
+inline void readSensorParams(){
+    ros::NodeHandle nh("lego_loam/sensor");
+    nh.param<bool>("use_cloud_ring", useCloudRing, useCloudRing);
+    nh.param<int>("N_SCAN", N_SCAN, N_SCAN);
+    nh.param<int>("Horizon_SCAN", Horizon_SCAN, Horizon_SCAN);
+    nh.param<float>("ang_res_x", ang_res_x, 360.0 / float(Horizon_SCAN));
+    nh.param<float>("ang_res_y", ang_res_y, ang_res_y);
+    nh.param<float>("ang_bottom", ang_bottom, ang_bottom);
+    nh.param<int>("groundScanInd", groundScanInd, groundScanInd);
+
+    segmentAlphaX = ang_res_x / 180.0 * M_PI;
+    segmentAlphaY = ang_res_y / 180.0 * M_PI;
+}
 
 /*
     * A point cloud type that has "ring" channel，自定义新的点类型
@@ -0,0 +1,24 @@
+#ifndef _VOXEL_KEY_H_
+#define _VOXEL_KEY_H_
+
+#include <cstddef>
+#include <cstdint>
+
+/*
+    * 整数网格坐标打包成的64位哈希键，LocalVoxelMap、KeyPoseIndex和MapExporter共用
+    * 每个坐标21位(补码截断)，0.2m的体素可以表示约±200km的范围，网格更大时范围相应更大
+    */
+
+inline uint64_t packVoxelKey(int x, int y, int z){
+    return ((uint64_t)(x & 0x1FFFFF) << 42) | ((uint64_t)(y & 0x1FFFFF) << 21) | (uint64_t)(z & 0x1FFFFF);
+}
+
+// 常用的空间哈希，避免打包后的坐标直接作为哈希值时冲突过多
+struct VoxelKeyHash{
+    size_t operator()(const uint64_t &key) const {
+        uint64_t x = key >> 42, y = (key >> 21) & 0x1FFFFF, z = key & 0x1FFFFF;
+        return (size_t)((x * 73856093) ^ (y * 19349663) ^ (z * 83492791));
+    }
+};
+
+#endif
@@ -33,17 +33,44 @@
 //      IEEE/RSJ International Conference on Intelligent Robots and Systems (IROS). October 2018.
 
 #include "utility.h"
+#include "normalEquations.h"
+#include "pointTransform.h"
+#include "stampSynchronizer.h"
+#include "pipelineMetrics.h"
+#include "imuBuffer.h"
+#include "rangeImageIndex.h"
+#include "iterationControl.h"
+#include "cloudPool.h"
+#include "compactCloud.h"
+
+#include <atomic>
+#include <std_msgs/UInt32.h>
+#include <ros/callback_queue.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#ifdef LEGO_LOAM_NODELET
+#include <nodelet/nodelet.h>
+#include <pluginlib/class_list_macros.h>
+#endif
 
 class FeatureAssociation{
 
+    friend class PipelineBenchmark; // src/pipelineBenchmark.cpp中单独调用各处理阶段
+
 private:
 
 	ros::NodeHandle nh;
+    PipelineMetrics metrics;    // 各阶段耗时、特征点数、迭代次数及丢帧统计，发布在/diagnostics上
 
     ros::Subscriber subLaserCloud; // 带有地面点的分割点云： 坐标 + 行列索引 (用fullCloud中的点填充的)
     ros::Subscriber subLaserCloudInfo;
+    ros::Subscriber subCompactCloud; // 紧凑格式时代替以上两个话题，见compactCloud.h
     ros::Subscriber subOutlierCloud;
     ros::Subscriber subImu;
+    ros::Subscriber subBackpressure;
 
     ros::Publisher pubCornerPointsSharp;
     ros::Publisher pubCornerPointsLessSharp;
@@ -58,19 +85,44 @@ private:
     pcl::PointCloud<PointType>::Ptr surfPointsFlat;             // 平面点(均为地面点)
     pcl::PointCloud<PointType>::Ptr surfPointsLessFlat;         // 次平面点(降采样后)，包含了为地面的平面点
 
-    pcl::PointCloud<PointType>::Ptr surfPointsLessFlatScan; // 临时变量
-    pcl::PointCloud<PointType>::Ptr surfPointsLessFlatScanDS;
-
-    pcl::VoxelGrid<PointType> downSizeFilter;
-    // 如果是同一帧点云的话下面四个时间都是相等的
+    // 发布后由订阅者持有的点云，订阅者释放后复用，稳态下不再分配内存
+    CloudPool<PointType> outlierCloudPool;      // outlierCloudHandler中使用
+    CloudPool<PointType> lastCloudPool;         // cornerPointsLessSharp/surfPointsLessFlat，成为last点云后发布给mapOptimization
+
+    // extractFeatures中每个线程一份的临时变量
+    struct FeatureScratch{
+        std::vector<int> candidates;    // 分区中的点序，按曲率cloudCurvature建堆
+        pcl::PointCloud<PointType>::Ptr surfPointsLessFlatScan;
+        pcl::VoxelGrid<PointType> downSizeFilter;
+    };
+    // 每线scan提取的特征点，各线并行提取后按线号顺序合并，与串行提取的顺序相同
+    struct RingFeatures{
+        pcl::PointCloud<PointType> cornerPointsSharp;
+        pcl::PointCloud<PointType> cornerPointsLessSharp;
+        pcl::PointCloud<PointType> surfPointsFlat;
+        pcl::PointCloud<PointType> surfPointsLessFlat;  // 降采样后
+    };
+    std::vector<FeatureScratch, Eigen::aligned_allocator<FeatureScratch> > featureScratch;
+    std::vector<RingFeatures> ringFeatures;
+
+    // 按曲率比较点序，曲率相同时按点序，保证结果确定
+    struct CurvatureLess{
+        const float *curvature;
+        bool operator()(int a, int b) const {
+            return curvature[a] < curvature[b] || (curvature[a] == curvature[b] && a < b);
+        }
+    };
+    struct CurvatureGreater{
+        const float *curvature;
+        bool operator()(int a, int b) const {
+            return curvature[a] > curvature[b] || (curvature[a] == curvature[b] && a > b);
+        }
+    };
     double timeScanCur; // 当前帧sweep扫描时间
-    double timeNewSegmentedCloud; // 新的分割点云到达时间 = timeScanCur
-    double timeNewSegmentedCloudInfo; // 新的点云分割信息到达时间
-    double timeNewOutlierCloud; // 新的界外点云到达时间
 
-    bool newSegmentedCloud; // 接收到当前帧新数据的标志位
-    bool newSegmentedCloudInfo;
-    bool newOutlierCloud;
+    // 分割点云、点云分割信息、界外点云三路消息按时间戳匹配，同一帧的三路都到达时立即处理
+    enum { SegmentedCloudChannel, SegmentedCloudInfoChannel, OutlierCloudChannel };
+    StampSynchronizer<3> cloudSync;
 
     cloud_msgs::cloud_info segInfo; // 点云分割信息
     std_msgs::Header cloudHeader; // 等于当前sweep扫描时间
@@ -78,14 +130,10 @@ private:
     int systemInitCount; // not used
     bool systemInited; // not used
 
-    std::vector<smoothness_t> cloudSmoothness; // 点云的粗糙度(曲率)
     float *cloudCurvature; // 当前分割点云中特征点的曲率
     int *cloudNeighborPicked; // 点筛选标记：1:筛选过 0:未筛选过
     int *cloudLabel; // 点分类标号:2-代表曲率很大，1-代表曲率比较大,-1-代表曲率很小，0-曲率比较小(其中1包含了2,0包含了1,0和1构成了点云全部的点)
 
-    int imuPointerFront;
-    int imuPointerLast; // imu最新收到的消息在数组中的位置，每次接收到imu数据回调时就会更新
-    int imuPointerLastIteration;
     float imuRollStart, imuPitchStart, imuYawStart; // 每一帧sweep开始时imu在世界坐标系下的姿态，在对点云进行非匀速矫正时更新
 
     float cosImuRollStart, cosImuPitchStart, cosImuYawStart, sinImuRollStart, sinImuPitchStart, sinImuYawStart; // 每一帧sweep开始时imu世界姿态对应的正/余弦值
@@ -103,31 +151,10 @@ private:
     float imuAngularRotationXCur, imuAngularRotationYCur, imuAngularRotationZCur; // 每一帧sweep开始时imu角度(在交换坐标轴前的imu坐标系下)
     float imuAngularRotationXLast, imuAngularRotationYLast, imuAngularRotationZLast; // 上一帧sweep开始时的imu角度
     float imuAngularFromStartX, imuAngularFromStartY, imuAngularFromStartZ; // 当前帧sweep开始时距离上一帧imu转动的角度值
-    // IMU信息，只在接收到imu回调时更新
-    double imuTime[imuQueLength];   // 时间戳
-    float imuRoll[imuQueLength];    // 世界坐标下的姿态
-    float imuPitch[imuQueLength];
-    float imuYaw[imuQueLength];
-    // 交换后的左上前imu坐标系(局部)下的加速度，只在接收到imu回调时更新
-    float imuAccX[imuQueLength];
-    float imuAccY[imuQueLength];
-    float imuAccZ[imuQueLength];
-    // imu在世界坐标系下的速度，只在接收到imu回调时更新
-    float imuVeloX[imuQueLength];
-    float imuVeloY[imuQueLength];
-    float imuVeloZ[imuQueLength];
-    // imu在世界坐标系下的坐标，只在接收到imu回调时更新
-    float imuShiftX[imuQueLength];
-    float imuShiftY[imuQueLength];
-    float imuShiftZ[imuQueLength];
-    // imu的三轴角速度(!!!交换前的前左上坐标系下)
-    float imuAngularVeloX[imuQueLength];
-    float imuAngularVeloY[imuQueLength];
-    float imuAngularVeloZ[imuQueLength];
-    // imu的三轴角度(!!!交换前的前左上坐标系下)
-    float imuAngularRotationX[imuQueLength];
-    float imuAngularRotationY[imuQueLength];
-    float imuAngularRotationZ[imuQueLength];
+    // IMU信息，在imu回调中写入，adjustDistortion中不加锁读取
+    ImuBuffer imuBuffer;
+    ImuDeskewTable deskewTable; // 每一帧的去畸变表
+    std::vector<float> pointTime;   // 分割点云中每个点相对于扫描开始的时间
 
 
 
@@ -137,6 +164,7 @@ private:
     ros::Publisher pubOutlierCloudLast;
 
     int skipFrameNum; // 跳帧数
+    std::atomic<int> extraSkipFrameNum; // mapOptimization建图跟不上时请求额外跳过的帧数，里程计仍然每帧输出
     bool systemInitedLM;
 
     int laserCloudCornerLastNum; // 上一帧帧激光雷达点云中边缘特征点(边缘点+次边缘点)数量
@@ -167,6 +195,24 @@ private:
 
     pcl::KdTreeFLANN<PointType>::Ptr kdtreeCornerLast;
     pcl::KdTreeFLANN<PointType>::Ptr kdtreeSurfLast;
+    // projectiveAssociationFlag为true时代替KD树，在上一帧的距离图像中查找对应点
+    RangeImageIndex cornerImageLast;
+    RangeImageIndex surfImageLast;
+
+    // 两步LM各自的迭代次数、收敛条件和重新查找对应点的时机，researchCorrespondences为这次迭代是否重新查找
+    IterationControl surfControl;
+    IterationControl cornerControl;
+    bool researchCorrespondences;
+
+    // updateTransformation中各函数在这一帧所有迭代中的累计耗时(ms)，只在enabled为true时计时(pipelineBenchmark)，
+    // matched为false表示这一帧特征点不够，没有进行匹配
+    struct TransformationTiming{
+        bool enabled, matched;
+        double findSurfMs, calculateSurfMs, findCornerMs, calculateCornerMs;
+        TransformationTiming(): enabled(false), matched(false),
+            findSurfMs(0), calculateSurfMs(0), findCornerMs(0), calculateCornerMs(0) {}
+    };
+    TransformationTiming transformationTiming;
 
     std::vector<int> pointSearchInd;
     std::vector<float> pointSearchSqDis;
@@ -179,29 +225,58 @@ private:
     tf::StampedTransform laserOdometryTrans;
 
     bool isDegenerate; // 退化标志
-    cv::Mat matP;
+    Eigen::Matrix3f matP3;          // 两步优化(calculateTransformationSurf/Corner)的P矩阵
+    Eigen::Matrix<float, 6, 6> matP;// 6自由度优化(calculateTransformation)的P矩阵
+
+    // 法方程累加器，每次迭代清零后复用
+    NormalEquations<3> normalEquations3;
+    NormalEquations<6> normalEquations6;
+
+    // TransformToStart/TransformToEnd的缓存变换，点的相对时间按range image的列数量化
+    InterpolatedTransform transformToStart;
+    InterpolatedTransform transformToEnd;
 
     int frameCount;
 
+    std::atomic<bool> running; // stop()之后spin()退出
+
 public:
 
-    FeatureAssociation():
-        nh("~")
+    // nodelet中传入设置了独立回调队列的NodeHandle
+    FeatureAssociation(ros::NodeHandle nodeHandle = ros::NodeHandle("~")):
+        nh(nodeHandle),
+        metrics(nh, "featureAssociation"),
+        imuBuffer(imuQueLength),
+        cornerImageLast(N_SCAN, Horizon_SCAN, projectiveSearchColumns),
+        surfImageLast(N_SCAN, Horizon_SCAN, projectiveSearchColumns),
+        surfControl("scan2scan_surf", 25, 0.1, 0.1, 5, researchDeltaR, researchDeltaT, scanMatchDeadline),
+        cornerControl("scan2scan_corner", 25, 0.1, 0.1, 5, researchDeltaR, researchDeltaT, scanMatchDeadline),
+        researchCorrespondences(true),
+        transformToStart(Horizon_SCAN),
+        transformToEnd(Horizon_SCAN),
+        running(true)
         {
         // 包含了地面点的分割点云
-        subLaserCloud = nh.subscribe<sensor_msgs::PointCloud2>("/segmented_cloud", 1, &FeatureAssociation::laserCloudHandler, this);
-        subLaserCloudInfo = nh.subscribe<cloud_msgs::cloud_info>("/segmented_cloud_info", 1, &FeatureAssociation::laserCloudInfoHandler, this);
-        subOutlierCloud = nh.subscribe<sensor_msgs::PointCloud2>("/outlier_cloud", 1, &FeatureAssociation::outlierCloudHandler, this);
+        // 节点之间的点云以pcl格式收发，同一进程(nodelet)内只传递共享指针
+        // 分割点云和分割信息的格式与imageProjection由同一参数决定
+        if (compactCloudEnabled() == true){
+            subCompactCloud = nh.subscribe<cloud_msgs::CompactCloud>("/segmented_cloud_compact", 1, &FeatureAssociation::compactCloudHandler, this);
+        }else{
+            subLaserCloud = nh.subscribe<pcl::PointCloud<PointType> >("/segmented_cloud", 1, &FeatureAssociation::laserCloudHandler, this);
+            subLaserCloudInfo = nh.subscribe<cloud_msgs::cloud_info>("/segmented_cloud_info", 1, &FeatureAssociation::laserCloudInfoHandler, this);
+        }
+        subOutlierCloud = nh.subscribe<pcl::PointCloud<PointType> >("/outlier_cloud", 1, &FeatureAssociation::outlierCloudHandler, this);
         subImu = nh.subscribe<sensor_msgs::Imu>(imuTopic, 50, &FeatureAssociation::imuHandler, this);
+        subBackpressure = nh.subscribe<std_msgs::UInt32>("/mapping_backpressure", 1, &FeatureAssociation::backpressureHandler, this);
 
         pubCornerPointsSharp = nh.advertise<sensor_msgs::PointCloud2>("/laser_cloud_sharp", 1);
         pubCornerPointsLessSharp = nh.advertise<sensor_msgs::PointCloud2>("/laser_cloud_less_sharp", 1);
         pubSurfPointsFlat = nh.advertise<sensor_msgs::PointCloud2>("/laser_cloud_flat", 1);
         pubSurfPointsLessFlat = nh.advertise<sensor_msgs::PointCloud2>("/laser_cloud_less_flat", 1);
 
-        pubLaserCloudCornerLast = nh.advertise<sensor_msgs::PointCloud2>("/laser_cloud_corner_last", 2);
-        pubLaserCloudSurfLast = nh.advertise<sensor_msgs::PointCloud2>("/laser_cloud_surf_last", 2);
-        pubOutlierCloudLast = nh.advertise<sensor_msgs::PointCloud2>("/outlier_cloud_last", 2);
+        pubLaserCloudCornerLast = nh.advertise<pcl::PointCloud<PointType> >("/laser_cloud_corner_last", 2);
+        pubLaserCloudSurfLast = nh.advertise<pcl::PointCloud<PointType> >("/laser_cloud_surf_last", 2);
+        pubOutlierCloudLast = nh.advertise<pcl::PointCloud<PointType> >("/outlier_cloud_last", 2);
         pubLaserOdometry = nh.advertise<nav_msgs::Odometry> ("/laser_odom_to_init", 5);
         
         initializationValue();
@@ -222,37 +297,28 @@ public:
         pointSearchSurfInd2 = new float[N_SCAN*Horizon_SCAN];
         pointSearchSurfInd3 = new float[N_SCAN*Horizon_SCAN];
 
-        cloudSmoothness.resize(N_SCAN*Horizon_SCAN);
-
-        downSizeFilter.setLeafSize(0.2, 0.2, 0.2);
+        featureScratch.resize(numberOfCores);
+        for (int t = 0; t < numberOfCores; ++t){
+            featureScratch[t].candidates.reserve(Horizon_SCAN);
+            featureScratch[t].surfPointsLessFlatScan.reset(new pcl::PointCloud<PointType>());
+            featureScratch[t].downSizeFilter.setLeafSize(0.2, 0.2, 0.2);
+        }
+        ringFeatures.resize(N_SCAN);
 
         segmentedCloud.reset(new pcl::PointCloud<PointType>());
         outlierCloud.reset(new pcl::PointCloud<PointType>());
 
         cornerPointsSharp.reset(new pcl::PointCloud<PointType>());
-        cornerPointsLessSharp.reset(new pcl::PointCloud<PointType>());
+        cornerPointsLessSharp = lastCloudPool.acquire();
         surfPointsFlat.reset(new pcl::PointCloud<PointType>());
-        surfPointsLessFlat.reset(new pcl::PointCloud<PointType>());
+        surfPointsLessFlat = lastCloudPool.acquire();
 
-        surfPointsLessFlatScan.reset(new pcl::PointCloud<PointType>());
-        surfPointsLessFlatScanDS.reset(new pcl::PointCloud<PointType>());
 
         timeScanCur = 0;
-        timeNewSegmentedCloud = 0;
-        timeNewSegmentedCloudInfo = 0;
-        timeNewOutlierCloud = 0;
-
-        newSegmentedCloud = false;
-        newSegmentedCloudInfo = false;
-        newOutlierCloud = false;
 
         systemInitCount = 0;
         systemInited = false;
 
-        imuPointerFront = 0;
-        imuPointerLast = -1;
-        imuPointerLastIteration = 0;
-
         imuRollStart = 0; imuPitchStart = 0; imuYawStart = 0;
         cosImuRollStart = 0; cosImuPitchStart = 0; cosImuYawStart = 0;
         sinImuRollStart = 0; sinImuPitchStart = 0; sinImuYawStart = 0;
@@ -271,19 +337,10 @@ public:
         imuAngularRotationXLast = 0; imuAngularRotationYLast = 0; imuAngularRotationZLast = 0;
         imuAngularFromStartX = 0; imuAngularFromStartY = 0; imuAngularFromStartZ = 0;
 
-        for (int i = 0; i < imuQueLength; ++i)
-        {
-            imuTime[i] = 0;
-            imuRoll[i] = 0; imuPitch[i] = 0; imuYaw[i] = 0;
-            imuAccX[i] = 0; imuAccY[i] = 0; imuAccZ[i] = 0;
-            imuVeloX[i] = 0; imuVeloY[i] = 0; imuVeloZ[i] = 0;
-            imuShiftX[i] = 0; imuShiftY[i] = 0; imuShiftZ[i] = 0;
-            imuAngularVeloX[i] = 0; imuAngularVeloY[i] = 0; imuAngularVeloZ[i] = 0;
-            imuAngularRotationX[i] = 0; imuAngularRotationY[i] = 0; imuAngularRotationZ[i] = 0;
-        }
 
 
         skipFrameNum = 1;
+        extraSkipFrameNum = 0;
 
         for (int i = 0; i < 6; ++i){
             transformCur[i] = 0;
@@ -311,7 +368,8 @@ public:
         laserOdometryTrans.child_frame_id_ = "/laser_odom";
         
         isDegenerate = false;
-        matP = cv::Mat(6, 6, CV_32F, cv::Scalar::all(0));
+        matP3.setZero();
+        matP.setZero();
 
         frameCount = skipFrameNum;
     }
@@ -325,43 +383,6 @@ public:
         sinImuYawStart = sin(imuYawStart);
     }
 
-    // 将Lidar位移转到IMU起始坐标系下//计算局部坐标系下点云中的点相对第一个开始点的由于加减速运动产生的位移畸变
-    void ShiftToStartIMU(float pointTime)
-    {
-        //计算相对于第一个点由于加减速产生的畸变位移(全局坐标系下畸变位移量delta_Tg)
-        /*  为什么这样计算???这里假设点云在整个出点(即一个sweep)的过程中，机器人都是匀速运动的，即以第一个点的速度做匀速运动，
-            所以后面每个点对应的imu世界坐标理想情况下应该为： sn = s0 + v0 * pointTime;
-            所以实际对应的imu世界坐标减去理想的坐标就得到了运动的畸变，即 sn' - sn
-        */
-        //imuShiftFromStartCur = imuShiftCur - (imuShiftStart + imuVeloStart * pointTime)
-        imuShiftFromStartXCur = imuShiftXCur - imuShiftXStart - imuVeloXStart * pointTime;
-        imuShiftFromStartYCur = imuShiftYCur - imuShiftYStart - imuVeloYStart * pointTime;
-        imuShiftFromStartZCur = imuShiftZCur - imuShiftZStart - imuVeloZStart * pointTime;
-
-        /********************************************************************************
-         R_b_n = R_ZYX(左乘) = Rx(roll)*Ry(pitch)*Rz(yaw) 这个是未交换轴前的顺序
-        其中，Rx =  |   1       0         0      |  世界坐标系转换到局部坐标系用这个旋转矩阵
-                    |  0   cos(phi)   sin(phi)   |
-                    |  0   -sin(phi)  cos(phi)   |
-        Rz(pitch).inverse * Rx(pitch).inverse * Ry(yaw).inverse * delta_Tg，这句话其实就是(RyRxRz)^-1
-        transfrom from the global frame to the local frame，接下来要将这个畸变从世界坐标系转换到sweep初始时刻的imu坐标系(即点云初始坐标系下)
-        *********************************************************************************/
-        //绕y轴旋转(-imuYawStart)，即Ry(yaw).inverse
-        float x1 = cosImuYawStart * imuShiftFromStartXCur - sinImuYawStart * imuShiftFromStartZCur;
-        float y1 = imuShiftFromStartYCur;
-        float z1 = sinImuYawStart * imuShiftFromStartXCur + cosImuYawStart * imuShiftFromStartZCur;
-
-        //绕x轴旋转(-imuPitchStart)，即Rx(pitch).inverse
-        float x2 = x1;
-        float y2 = cosImuPitchStart * y1 + sinImuPitchStart * z1;
-        float z2 = -sinImuPitchStart * y1 + cosImuPitchStart * z1;
-
-        //绕z轴旋转(-imuRollStart)，即Rz(pitch).inverse
-        imuShiftFromStartXCur = cosImuRollStart * x2 + sinImuRollStart * y2;
-        imuShiftFromStartYCur = -sinImuRollStart * x2 + cosImuRollStart * y2;
-        imuShiftFromStartZCur = z2;
-    }
-
     //计算局部坐标系下点云中的点相对第一个开始点由于加减速产生的的速度畸变（增量）
     void VeloToStartIMU()
     {
@@ -403,159 +424,18 @@ public:
         imuVeloFromStartZCur = z2;
     }
 
-    // 该函数的功能是把点云坐标变换到点云初始时刻，去除点云加减速产生的位移畸变
-    // 先将选定点(激光雷达坐标系下，但不是初始坐标系下)转换到其对应的世界坐标下，然后再转换到点云初始坐标系下，再去除掉由于加减速产生的位移畸变即可
-    void TransformToStartIMU(PointType *p)
-    {
-        /********************************************************************************
-            (变换后的轴)Ry(yaw)*Rx(pitch)*Rz(roll)*Pl,原始R_n_b = Rz(yaw)*Ry(pitch)*Rx(roll), 
-            transform point to the global frame，利用选定点当前的位姿将其从激光雷达坐标系转换到世界坐标系!!!
-        *********************************************************************************/
-        // 因为在adjustDistortion函数中有对xyz的坐标进行交换的过程
-        // 交换的过程是x=原来的y，y=原来的z，z=原来的x
-        // 所以下面其实是绕Z轴(原先的x轴)旋转，对应的是roll角
-        //
-        //     |cosrz  -sinrz  0|
-        //  Rz=|sinrz  cosrz   0|  局部坐标转到到世界坐标，用这个旋转矩阵
-        //     |0       0      1|
-        // [x1,y1,z1]^T=Rz*[x,y,z]
-        //
-        // 因为在imuHandler中进行过坐标变换，
-        // 所以下面的roll其实已经对应于新坐标系中(X-Y-Z)的yaw
-        // 绕z轴旋转(imuRollCur)
-        float x1 = cos(imuRollCur) * p->x - sin(imuRollCur) * p->y;
-        float y1 = sin(imuRollCur) * p->x + cos(imuRollCur) * p->y;
-        float z1 = p->z;
-
-        // 绕X轴(原先的y轴)旋转(imuPitchCur)
-        // 
-        // [x2,y2,z2]^T=Rx*[x1,y1,z1]
-        //    |1     0        0|
-        // Rx=|0   cosrx -sinrx|
-        //    |0   sinrx  cosrx|
-        float x2 = x1;
-        float y2 = cos(imuPitchCur) * y1 - sin(imuPitchCur) * z1;
-        float z2 = sin(imuPitchCur) * y1 + cos(imuPitchCur) * z1;
-
-        // 最后再绕Y轴(原先的Z轴)旋转(imuYawCur)
-        //    |cosry   0   sinry|
-        // Ry=|0       1       0|
-        //    |-sinry  0   cosry|
-        float x3 = cos(imuYawCur) * x2 + sin(imuYawCur) * z2;
-        float y3 = y2;
-        float z3 = -sin(imuYawCur) * x2 + cos(imuYawCur) * z2;
-
-        /********************************************************************************
-            Rz(pitch).inverse * Rx(pitch).inverse * Ry(yaw).inverse * Pg
-            transfrom global points to the local frame，将位于世界坐标下的激光选定点数据转换到第一个点对应的imu坐标系下(即点云初始坐标系下)
-        *********************************************************************************/
-        // 下面部分的代码功能是从imu坐标的原点变换到i=0时imu的初始时刻(从世界坐标系变换到start坐标系)
-        // 变换方式和函数VeloToStartIMU()中的类似
-        // 变换顺序：Cur-->世界坐标系-->Start，这两次变换中，
-        // 前一次是正变换，角度为正，后一次是逆变换，角度应该为负 ////其实就是两次旋转的旋转矩阵不一样而已
-        // 可以参考：
-        // https://blog.csdn.net/wykxwyc/article/details/101712524
-        //绕y轴旋转(-imuYawStart)
-        float x4 = cosImuYawStart * x3 - sinImuYawStart * z3;
-        float y4 = y3;
-        float z4 = sinImuYawStart * x3 + cosImuYawStart * z3;
-
-        //绕x轴旋转(-imuPitchStart)
-        float x5 = x4;
-        float y5 = cosImuPitchStart * y4 + sinImuPitchStart * z4;
-        float z5 = -sinImuPitchStart * y4 + cosImuPitchStart * z4;
-
-        //绕z轴旋转(-imuRollStart)，然后叠加平移量
-        // 绕z轴(原先的x轴)变换角度到初始imu时刻，另外需要加上imu的位移漂移
-        // 后面加上的 imuShiftFromStart.. 表示从start时刻到cur时刻的漂移，(imuShiftFromStart.. 在start坐标系下)
-        p->x = cosImuRollStart * x5 + sinImuRollStart * y5 + imuShiftFromStartXCur;
-        p->y = -sinImuRollStart * x5 + cosImuRollStart * y5 + imuShiftFromStartYCur;
-        p->z = z5 + imuShiftFromStartZCur;
-    }
-
-    // 世界坐标系下积分速度与位移，与交换前前左上坐标系下imu转动的角度
-    void AccumulateIMUShiftAndRotation()
+    // mapOptimization降级到最高级别时请求少发送一些帧，见loadShedder.h
+    void backpressureHandler(const std_msgs::UInt32::ConstPtr& msg)
     {
-        float roll = imuRoll[imuPointerLast]; // 世界坐标下的姿态，最新imu数据
-        float pitch = imuPitch[imuPointerLast];
-        float yaw = imuYaw[imuPointerLast];
-        float accX = imuAccX[imuPointerLast]; // 交换后的左上前imu坐标系(局部)下的加速度(已经去除了重力加速度的影响)
-        float accY = imuAccY[imuPointerLast];
-        float accZ = imuAccZ[imuPointerLast];
-
-        // a_g = R_g_i * a_i 正常来讲 R_g_i = Rz(yaw)*Ry(pitch)*Rx(roll)
-        //将当前时刻的加速度值(交换过的)绕交换过的ZXY固定轴（原XYZ）分别旋转(roll, pitch, yaw)角，转换得到世界坐标系下的加速度值(right hand rule)
-        // 因为交换过后RPY对应fixed axes ZXY(RPY---ZXY)，Now R_n_b = R_ZXY = Ry(yaw)*Rx(pitch)*Rz(roll).
-        // 而且因为现在加速度是交换过后的值，所以要求世界坐标下的值的话按需要照交换前的XYZ顺序来进行转换处理
-        // 这里，由于R_g_i的旋转是按照imu坐标系的轴进行旋转的，也即绕旋转后的轴进行旋转
-        
-        // 先绕Z轴(原x轴)旋转,下方坐标系示意imuHandler()中加速度的坐标轴交换
-        //  z->Y
-        //  ^  
-        //  |    ^ y->X
-        //  |   /
-        //  |  /
-        //  | /
-        //  -----> x->Z
-        //
-        //     |cosrz  -sinrz  0|
-        //  Rz=|sinrz  cosrz   0|   局部坐标系到世界坐标系的位姿变换
-        //     |0       0      1|
-        // [x1,y1,z1]^T=Rz*[accX,accY,accZ]
-        // 因为在imuHandler中进行过坐标变换，所以下面的roll其实已经对应于新坐标系中(X-Y-Z)的yaw
-        float x1 = cos(roll) * accX - sin(roll) * accY;
-        float y1 = sin(roll) * accX + cos(roll) * accY;
-        float z1 = accZ;
-
-        // 绕X轴(原y轴)旋转
-        // [x2,y2,z2]^T=Rx*[x1,y1,z1]
-        //    |1     0        0|
-        // Rx=|0   cosrx -sinrx|
-        //    |0   sinrx  cosrx|
-        float x2 = x1;
-        float y2 = cos(pitch) * y1 - sin(pitch) * z1;
-        float z2 = sin(pitch) * y1 + cos(pitch) * z1;
-
-        // 最后再绕Y轴(原z轴)旋转
-        //    |cosry   0   sinry|
-        // Ry=|0       1       0|
-        //    |-sinry  0   cosry|
-        accX = cos(yaw) * x2 + sin(yaw) * z2;
-        accY = y2;
-        accZ = -sin(yaw) * x2 + cos(yaw) * z2;
-
-        // 最新imu数据的上一个imu点对应数组位置
-        int imuPointerBack = (imuPointerLast + imuQueLength - 1) % imuQueLength; // 加imuQueLength是为了防止imuPointerLast为0时产生误解
-        // 上一个点到当前最新点所经历的时间，即计算imu测量周期
-        double timeDiff = imuTime[imuPointerLast] - imuTime[imuPointerBack];
-        //要求imu的频率至少比lidar高，这样的imu信息才使用，后面校正也才有意义
-        if (timeDiff < scanPeriod) { //（隐含从静止开始运动）
-            //求每个imu时间点的位移(相对于世界坐标原点)与速度(均在世界坐标下),两点之间视为匀/减加速直线运动，类似于惯性导航的样子!!!
-            // IMU第一帧数据时，上一点(虚假的上一点，并不是真的上一个点)的速度，位移都为0
-            imuShiftX[imuPointerLast] = imuShiftX[imuPointerBack] + imuVeloX[imuPointerBack] * timeDiff + accX * timeDiff * timeDiff / 2;
-            imuShiftY[imuPointerLast] = imuShiftY[imuPointerBack] + imuVeloY[imuPointerBack] * timeDiff + accY * timeDiff * timeDiff / 2;
-            imuShiftZ[imuPointerLast] = imuShiftZ[imuPointerBack] + imuVeloZ[imuPointerBack] * timeDiff + accZ * timeDiff * timeDiff / 2;
-            //当前时刻imu在世界坐标下的速度
-            imuVeloX[imuPointerLast] = imuVeloX[imuPointerBack] + accX * timeDiff;
-            imuVeloY[imuPointerLast] = imuVeloY[imuPointerBack] + accY * timeDiff;
-            imuVeloZ[imuPointerLast] = imuVeloZ[imuPointerBack] + accZ * timeDiff;
-            // 当前imu绕轴旋转过的角度(在交换前的前左上坐标系下) /////Q 这里后面应该是当前时刻点的角速度
-            imuAngularRotationX[imuPointerLast] = imuAngularRotationX[imuPointerBack] + imuAngularVeloX[imuPointerBack] * timeDiff;
-            imuAngularRotationY[imuPointerLast] = imuAngularRotationY[imuPointerBack] + imuAngularVeloY[imuPointerBack] * timeDiff;
-            imuAngularRotationZ[imuPointerLast] = imuAngularRotationZ[imuPointerBack] + imuAngularVeloZ[imuPointerBack] * timeDiff;
-        }
+        if ((int)msg->data != extraSkipFrameNum)
+            ROS_INFO("featureAssociation: mapOptimization requested %d extra skipped frames", (int)msg->data);
+        extraSkipFrameNum = msg->data;
     }
 
     // 接收imu消息，imu安装的坐标系为x轴向前，y轴向左，z轴向上的右手坐标系(与激光雷达的安装坐标系相同)
     void imuHandler(const sensor_msgs::Imu::ConstPtr& imuIn)
     {
-        //This will get the roll pitch and yaw from the matrix about fixed axes X, Y, Z respectively. 
-        //Here roll pitch yaw is in the global frame，
-        double roll, pitch, yaw;
-        tf::Quaternion orientation;
-        tf::quaternionMsgToTF(imuIn->orientation, orientation);
-        tf::Matrix3x3(orientation).getRPY(roll, pitch, yaw); // 全局坐标系下的姿态，这里IMU是用的一个现有的模块，可以直接输出姿态角度信息。
-        
+        // 姿态的获取、去除重力与坐标轴交换、速度位移和转角的积分都在ImuBuffer::push中完成
         /*
             旋转矩阵小结：
             如果按照ZYX的航空旋转次序的话，
@@ -581,60 +461,54 @@ public:
         //减去重力的影响,求出xyz方向的加速度实际值，并进行坐标轴交换，统一到z轴向前,x轴向左，y轴向上的右手坐标系(imu局部坐标系), 
         // 这里这样设置坐标轴交换的目的是为了与相机坐标系一致，方便以后进行视觉的融合
         //交换过后RPY对应fixed axes ZXY(RPY---ZXY)。
-        float accX = imuIn->linear_acceleration.y - sin(roll) * cos(pitch) * 9.81;
-        float accY = imuIn->linear_acceleration.z - cos(roll) * cos(pitch) * 9.81;
-        float accZ = imuIn->linear_acceleration.x + sin(pitch) * 9.81;
-        
-        //循环移位效果，形成环形数组  范围0~200
-        imuPointerLast = (imuPointerLast + 1) % imuQueLength;
-        
-        imuTime[imuPointerLast] = imuIn->header.stamp.toSec();
+        imuBuffer.push(*imuIn);
+    }
 
-        imuRoll[imuPointerLast] = roll; // 当前时刻imu的全局姿态，类似于R_w_i
-        imuPitch[imuPointerLast] = pitch;
-        imuYaw[imuPointerLast] = yaw;
+    void laserCloudHandler(const pcl::PointCloud<PointType>::ConstPtr& laserCloudMsg){
 
-        // 当前时刻imu去掉重力后的三轴加速度(交换后的左上前坐标系下，即局部坐标系，注意这里不是世界坐标系)
-        imuAccX[imuPointerLast] = accX;
-        imuAccY[imuPointerLast] = accY;
-        imuAccZ[imuPointerLast] = accZ;
+        cloudHeader = pcl_conversions::fromPCL(laserCloudMsg->header);
 
-        // 当前时刻imu的三轴角速度(!!!交换前的前左上坐标系下，即局部坐标系，注意这里不是世界坐标系)
-        imuAngularVeloX[imuPointerLast] = imuIn->angular_velocity.x;
-        imuAngularVeloY[imuPointerLast] = imuIn->angular_velocity.y;
-        imuAngularVeloZ[imuPointerLast] = imuIn->angular_velocity.z;
+        timeScanCur = cloudHeader.stamp.toSec();
 
-        AccumulateIMUShiftAndRotation(); // 世界坐标系下的积分速度与位移 和 交换前坐标系下imu绕各轴转动的角度
-    }
+        // 收到的点云为只读的共享指针，adjustDistortion()会原地修改点云，所以拷贝一份
+        *segmentedCloud = *laserCloudMsg;
 
-    void laserCloudHandler(const sensor_msgs::PointCloud2ConstPtr& laserCloudMsg){
+        if (cloudSync.add(SegmentedCloudChannel, laserCloudMsg->header.stamp))
+            runFeatureAssociation();
+    }
 
-        cloudHeader = laserCloudMsg->header;
+    // 紧凑格式同时带有分割点云和分割信息，解码后两路一起计入同步
+    void compactCloudHandler(const cloud_msgs::CompactCloudConstPtr& msgIn){
 
+        if (decodeCompactCloud(*msgIn, *segmentedCloud, segInfo) == false){
+            ROS_WARN("Compact cloud with %u points has %zu bytes of data, dropped.", msgIn->pointNum, msgIn->data.size());
+            metrics.increment("invalid compact clouds", 1, true);
+            return;
+        }
+        cloudHeader = pcl_conversions::fromPCL(segmentedCloud->header);
         timeScanCur = cloudHeader.stamp.toSec();
-        timeNewSegmentedCloud = timeScanCur;
-
-        segmentedCloud->clear();
-        pcl::fromROSMsg(*laserCloudMsg, *segmentedCloud);
 
-        newSegmentedCloud = true;
+        cloudSync.add(SegmentedCloudChannel, msgIn->header.stamp);
+        if (cloudSync.add(SegmentedCloudInfoChannel, msgIn->header.stamp))
+            runFeatureAssociation();
     }
 
-    void outlierCloudHandler(const sensor_msgs::PointCloud2ConstPtr& msgIn){
-
-        timeNewOutlierCloud = msgIn->header.stamp.toSec();
+    void outlierCloudHandler(const pcl::PointCloud<PointType>::ConstPtr& msgIn){
 
-        outlierCloud->clear();
-        pcl::fromROSMsg(*msgIn, *outlierCloud);
+        // outlierCloud修改坐标系后会再发布给mapOptimization，发布之后由订阅者持有，因此每帧从池中取出不再被持有的点云
+        outlierCloud = outlierCloudPool.acquire();
+        *outlierCloud = *msgIn;
 
-        newOutlierCloud = true;
+        if (cloudSync.add(OutlierCloudChannel, msgIn->header.stamp))
+            runFeatureAssociation();
     }
 
     void laserCloudInfoHandler(const cloud_msgs::cloud_infoConstPtr& msgIn)
     {
-        timeNewSegmentedCloudInfo = msgIn->header.stamp.toSec();
         segInfo = *msgIn;
-        newSegmentedCloudInfo = true;
+
+        if (cloudSync.add(SegmentedCloudInfoChannel, msgIn->header.stamp))
+            runFeatureAssociation();
     }
 
     void adjustDistortion()
@@ -642,9 +516,11 @@ public:
         bool halfPassed = false;
         // 分割点云中去除了原始点云中的离群点以及大部分地面点，该数量远远小于原始点云的点数(16*1800 = 28800)
         int cloudSize = segmentedCloud->points.size();
+        pointTime.resize(cloudSize);
 
         PointType point;
 
+        // 点的相对时间依赖于扫描线是否旋转过半(halfPassed)，需要按点的顺序计算
         for (int i = 0; i < cloudSize; i++) {
             // 坐标轴交换，安装好的velodyne lidar的坐标系(前左上)转换到z轴向前，x轴向左，y轴向上(左上前)的右手坐标系
             point.x = segmentedCloud->points[i].y;
@@ -690,122 +566,73 @@ public:
             point.intensity = int(segmentedCloud->points[i].intensity) + scanPeriod * relTime;
 
             //相对时间relTime用来和IMU数据一起近似去除激光的非匀速运动，构建匀速运动模型(即假设激光雷达在一次sweep期间都是匀速运动的)。
-            //当前点时间 = 点云开始时间 + 周期时间(点在一次sweep周期中的相对时间) ，imuPointerLast 是imu当前最新点，变量只在imu中改变
-            if (imuPointerLast >= 0) { // 如果收到IMU数据,则使用IMU矫正点云在一次sweep过程中因为加减速产生的畸变
-                float pointTime = relTime * scanPeriod; //计算点的周期时间(其实就是当前点相对于点云起始点的时间)
-                imuPointerFront = imuPointerLastIteration; // 增加这个变量是为了快速找到与当前点云相对应的imu时间戳
-                // while循环内进行时间轴对齐，产生两种结果： 
-                // 1.imu数据充足，找到点在点云中时间最近的一个imu时间，走break流程退出，接下来可利用imu数据进行插值等工作；
-                // 2.imu数据不够，没有找到imu时刻，循环条件不满足退出，此时imuPointerFront = imuPointerLast，无法利用imu数据进行插值。
-                while (imuPointerFront != imuPointerLast) { //寻找是否有点云的时间戳刚好小于IMU的时间戳的IMU位置:imuPointerFront
-                    if (timeScanCur + pointTime < imuTime[imuPointerFront]) { //找到ti(点云中该点的时间)后的最近一个imu时刻，此时imu数据充足
-                        break;
-                    }
-                    imuPointerFront = (imuPointerFront + 1) % imuQueLength;
-                }
+            pointTime[i] = relTime * scanPeriod; //计算点的周期时间(其实就是当前点相对于点云起始点的时间)
+            segmentedCloud->points[i] = point;
+        }
 
-                // 这里是直接把imu的位姿，速度等拿来当做当前lidar的位姿等，没有像vins等框架使用外参计算出lidar真正的位姿，速度等。
-                //timeScanCur + pointTime是ti时刻(第i个点扫描的时间;imuPointerFront是ti后一时刻的imu时间,imuPointerBack是ti前一时刻的imu时间
-                if (timeScanCur + pointTime > imuTime[imuPointerFront]) {//上面while循环没找到合适的imu时间,只能以当前收到的最新的IMU的速度，位移，欧拉角作为当前点的速度，位移，欧拉角使用
-                    // 该条件内imu数据比激光数据早，但是没有更后面的数据
-                    // (打个比方,激光在9点时出现，imu现在只有8点的)
-                    // 这种情况上面while循环是以imuPointerFront == imuPointerLast结束的
-                    imuRollCur = imuRoll[imuPointerFront]; // 点云中选定点对应当前最新时刻的imu的世界姿态，imu模块直接输出的结果
-                    imuPitchCur = imuPitch[imuPointerFront];
-                    imuYawCur = imuYaw[imuPointerFront];
-
-                    imuVeloXCur = imuVeloX[imuPointerFront]; // 选定点对应当前最新时刻imu在世界坐标下的速度
-                    imuVeloYCur = imuVeloY[imuPointerFront];
-                    imuVeloZCur = imuVeloZ[imuPointerFront];
-
-                    imuShiftXCur = imuShiftX[imuPointerFront]; // 选定点对应当前最新时刻imu在世界坐标下的位移
-                    imuShiftYCur = imuShiftY[imuPointerFront];
-                    imuShiftZCur = imuShiftZ[imuPointerFront];   
-                } else {//找到了点云时间戳小于IMU时间戳的IMU位置,则该点必处于imuPointerBack和imuPointerFront之间，据此线性插值，计算点云点的速度，位移和欧拉角
-                    // 在imu数据充足的情况下可以进行插补， 当前timeScanCur + pointTime < imuTime[imuPointerFront]，
-                    // 而且imuPointerFront是最早一个时间大于timeScanCur + pointTime的imu数据指针
-                    //按时间距离计算权重分配比率,也即线性插值
-                    int imuPointerBack = (imuPointerFront + imuQueLength - 1) % imuQueLength;
-                    float ratioFront = (timeScanCur + pointTime - imuTime[imuPointerBack]) 
-                                                     / (imuTime[imuPointerFront] - imuTime[imuPointerBack]);
-                    float ratioBack = (imuTime[imuPointerFront] - timeScanCur - pointTime) 
-                                                    / (imuTime[imuPointerFront] - imuTime[imuPointerBack]);
-
-                    // 通过上面计算的ratioFront以及ratioBack进行插补
-                    // 因为imuRollCur和imuPitchCur通常都在0度左右，变化不会很大，因此不需要考虑超过2M_PI的情况
-                    // imuYaw转的角度比较大，需要考虑超过2*M_PI的情况
-                    imuRollCur = imuRoll[imuPointerFront] * ratioFront + imuRoll[imuPointerBack] * ratioBack;// 用ti时间前后的两个imu数据进行插值
-                    imuPitchCur = imuPitch[imuPointerFront] * ratioFront + imuPitch[imuPointerBack] * ratioBack;
-                    if (imuYaw[imuPointerFront] - imuYaw[imuPointerBack] > M_PI) {// 个人理解这里是对imu两个时间跨越正负pi的角度作处理，因为偏航角范围为[-pi,+pi]
-                        imuYawCur = imuYaw[imuPointerFront] * ratioFront + (imuYaw[imuPointerBack] + 2 * M_PI) * ratioBack;
-                    } else if (imuYaw[imuPointerFront] - imuYaw[imuPointerBack] < -M_PI) {
-                        imuYawCur = imuYaw[imuPointerFront] * ratioFront + (imuYaw[imuPointerBack] - 2 * M_PI) * ratioBack;
-                    } else {
-                        imuYawCur = imuYaw[imuPointerFront] * ratioFront + imuYaw[imuPointerBack] * ratioBack;
-                    }
-                    
-                    // imu速度插补 //本质:imuVeloXCur = imuVeloX[imuPointerback] + (imuVelX[imuPointerFront]-imuVelX[imuPoniterBack])*ratioFront
-                    imuVeloXCur = imuVeloX[imuPointerFront] * ratioFront + imuVeloX[imuPointerBack] * ratioBack;
-                    imuVeloYCur = imuVeloY[imuPointerFront] * ratioFront + imuVeloY[imuPointerBack] * ratioBack;
-                    imuVeloZCur = imuVeloZ[imuPointerFront] * ratioFront + imuVeloZ[imuPointerBack] * ratioBack;
-
-                    // imu位置插补
-                    imuShiftXCur = imuShiftX[imuPointerFront] * ratioFront + imuShiftX[imuPointerBack] * ratioBack;
-                    imuShiftYCur = imuShiftY[imuPointerFront] * ratioFront + imuShiftY[imuPointerBack] * ratioBack;
-                    imuShiftZCur = imuShiftZ[imuPointerFront] * ratioFront + imuShiftZ[imuPointerBack] * ratioBack;
-                }
+        // 如果收到IMU数据,则使用IMU矫正点云在一次sweep过程中因为加减速产生的畸变
+        // 这里是直接把imu的位姿，速度等拿来当做当前lidar的位姿等，没有像vins等框架使用外参计算出lidar真正的位姿，速度等。
+        // imuBuffer.at()按时间二分查找ti(第i个点扫描的时间)前后的两个imu时刻并线性插值，
+        // ti晚于最新的imu数据时以最新的IMU的速度，位移，欧拉角作为当前点的速度，位移，欧拉角使用
+        ImuSample imuStart, imuCur;
+        if (cloudSize == 0 || !imuBuffer.at(timeScanCur + pointTime[0], imuStart))
+            return;
 
-                if (i == 0) { //如果是第一个点,记住点云起始位置对应的imu的速度，位移，欧拉角
-                    // 此处更新过的角度值主要用在updateImuRollPitchYawStartSinCos()中, 更新每个角的正余弦值
-                    imuRollStart = imuRollCur; // 每一帧sweep初始时刻imu的世界姿态，imu模块直接输出的结果
-                    imuPitchStart = imuPitchCur;
-                    imuYawStart = imuYawCur;
-
-                    imuVeloXStart = imuVeloXCur; // 每一帧sweep初始时刻imu在世界坐标下的速度
-                    imuVeloYStart = imuVeloYCur;
-                    imuVeloZStart = imuVeloZCur;
-
-                    imuShiftXStart = imuShiftXCur; // 每一帧sweep初始时刻imu在世界坐标下的位移
-                    imuShiftYStart = imuShiftYCur;
-                    imuShiftZStart = imuShiftZCur;
-
-                    if (timeScanCur + pointTime > imuTime[imuPointerFront]) { // 该条件内imu数据比激光数据早，但是没有更后面的数据
-                        imuAngularRotationXCur = imuAngularRotationX[imuPointerFront];
-                        imuAngularRotationYCur = imuAngularRotationY[imuPointerFront];
-                        imuAngularRotationZCur = imuAngularRotationZ[imuPointerFront];
-                    }else{ // 在imu数据充足的情况下可以进行插值
-                        int imuPointerBack = (imuPointerFront + imuQueLength - 1) % imuQueLength;
-                        float ratioFront = (timeScanCur + pointTime - imuTime[imuPointerBack]) 
-                                                         / (imuTime[imuPointerFront] - imuTime[imuPointerBack]);
-                        float ratioBack = (imuTime[imuPointerFront] - timeScanCur - pointTime) 
-                                                        / (imuTime[imuPointerFront] - imuTime[imuPointerBack]);
-                        imuAngularRotationXCur = imuAngularRotationX[imuPointerFront] * ratioFront + imuAngularRotationX[imuPointerBack] * ratioBack;
-                        imuAngularRotationYCur = imuAngularRotationY[imuPointerFront] * ratioFront + imuAngularRotationY[imuPointerBack] * ratioBack;
-                        imuAngularRotationZCur = imuAngularRotationZ[imuPointerFront] * ratioFront + imuAngularRotationZ[imuPointerBack] * ratioBack;
-                    }
+        //记住点云起始位置对应的imu的速度，位移，欧拉角
+        imuRollStart = imuStart.roll; // 每一帧sweep初始时刻imu的世界姿态，imu模块直接输出的结果
+        imuPitchStart = imuStart.pitch;
+        imuYawStart = imuStart.yaw;
 
-                    // 距离上一帧sweep，旋转过的角度变化值
-                    imuAngularFromStartX = imuAngularRotationXCur - imuAngularRotationXLast;
-                    imuAngularFromStartY = imuAngularRotationYCur - imuAngularRotationYLast;
-                    imuAngularFromStartZ = imuAngularRotationZCur - imuAngularRotationZLast;
-
-                    imuAngularRotationXLast = imuAngularRotationXCur;
-                    imuAngularRotationYLast = imuAngularRotationYCur;
-                    imuAngularRotationZLast = imuAngularRotationZCur;
-
-                    // 这里更新的是i=0时刻的rpy角(imu的世界姿态)，后面将速度坐标投影过来会用到i=0时刻的值
-                    updateImuRollPitchYawStartSinCos();
-                } else { // 计算除了第一个点之外其他每个点相对于第一个点的由于非匀速(加减速)运动产生的位移速度畸变，并对点云中的每个点位置信息重新补偿矫正
-                    // ShiftToStartIMU(pointTime);// 将Lidar位移转到IMU起始坐标系下//计算局部坐标系(点云初始坐标)下点云中的点相对第一个开始点的由于加减速运动产生的位移畸变
-                    VeloToStartIMU(); // 速度投影到初始i=0时刻 // 计算局部坐标系下点云中的点相对第一个开始点由于加减速产生的的速度畸变（增量）
-                    TransformToStartIMU(&point); // 将点的坐标变换到初始i=0时刻
-                }
-            }
-            // 去掉非匀速运动畸变的点(强度值换成了线号+点相对时间的形式进行填充)重新保存，现在所有点都位于点云初始坐标系下了
-            segmentedCloud->points[i] = point;
-        }
+        imuVeloXStart = imuStart.veloX; // 每一帧sweep初始时刻imu在世界坐标下的速度
+        imuVeloYStart = imuStart.veloY;
+        imuVeloZStart = imuStart.veloZ;
+
+        imuShiftXStart = imuStart.shiftX; // 每一帧sweep初始时刻imu在世界坐标下的位移
+        imuShiftYStart = imuStart.shiftY;
+        imuShiftZStart = imuStart.shiftZ;
+
+        imuAngularRotationXCur = imuStart.angularRotationX;
+        imuAngularRotationYCur = imuStart.angularRotationY;
+        imuAngularRotationZCur = imuStart.angularRotationZ;
 
-        imuPointerLastIteration = imuPointerLast;
+        // 距离上一帧sweep，旋转过的角度变化值
+        imuAngularFromStartX = imuAngularRotationXCur - imuAngularRotationXLast;
+        imuAngularFromStartY = imuAngularRotationYCur - imuAngularRotationYLast;
+        imuAngularFromStartZ = imuAngularRotationZCur - imuAngularRotationZLast;
+
+        imuAngularRotationXLast = imuAngularRotationXCur;
+        imuAngularRotationYLast = imuAngularRotationYCur;
+        imuAngularRotationZLast = imuAngularRotationZCur;
+
+        // 这里更新的是i=0时刻的rpy角(imu的世界姿态)，后面将速度坐标投影过来会用到i=0时刻的值
+        updateImuRollPitchYawStartSinCos();
+
+        if (cloudSize < 2 || !imuBuffer.at(timeScanCur + pointTime[cloudSize - 1], imuCur))
+            return;
+
+        // 最后一个点对应的imu姿态和速度畸变，在updateInitialGuess()中作为帧间变换的初值
+        imuRollCur = imuCur.roll;
+        imuPitchCur = imuCur.pitch;
+        imuYawCur = imuCur.yaw;
+
+        imuVeloXCur = imuCur.veloX;
+        imuVeloYCur = imuCur.veloY;
+        imuVeloZCur = imuCur.veloZ;
+
+        imuShiftXCur = imuCur.shiftX;
+        imuShiftYCur = imuCur.shiftY;
+        imuShiftZCur = imuCur.shiftZ;
+
+        VeloToStartIMU(); // 速度投影到初始i=0时刻 // 计算局部坐标系下点云中的点相对第一个开始点由于加减速产生的的速度畸变（增量）
+
+        // 除了第一个点之外其他每个点变换到初始i=0时刻：在点云覆盖的时间范围内建立去畸变表，一次遍历完成所有点的插值与变换
+        // 变换顺序：Cur-->世界坐标系-->Start，表中每个节点保存R_start^T * R(t)，前一次是正变换，后一次是逆变换，
+        // 再加上start坐标系下从start时刻到cur时刻的位移漂移imuShiftFromStart..(见include/imuBuffer.h中的ImuDeskewTable)
+        float timeBegin = *std::min_element(pointTime.begin() + 1, pointTime.begin() + cloudSize);
+        float timeEnd = *std::max_element(pointTime.begin() + 1, pointTime.begin() + cloudSize);
+        float shiftFromStart[3] = {imuShiftFromStartXCur, imuShiftFromStartYCur, imuShiftFromStartZCur};
+        deskewTable.build(imuBuffer, timeScanCur, timeBegin, timeEnd, imuStart, shiftFromStart);
+        deskewTable.apply(*segmentedCloud, pointTime, 1);
     }
 
     // 计算光滑性，这里的计算没有完全按照公式进行， 缺少除以总点数i和r[i]
@@ -829,9 +656,6 @@ public:
 			// 初始化为0，surfPointsFlat标记为-1，surfPointsLessFlatScan为不大于0的标签
 			// cornerPointsSharp标记为2，cornerPointsLessSharp标记为1
             cloudLabel[i] = 0;
-
-            cloudSmoothness[i].value = cloudCurvature[i];
-            cloudSmoothness[i].ind = i;
         }
     }
 
@@ -877,6 +701,16 @@ public:
         }
     }
 
+    int threadIndex(){
+#ifdef _OPENMP
+        return omp_get_thread_num();
+#else
+        return 0;
+#endif
+    }
+
+    // 每线scan的特征提取只读写本线范围内的点(防止聚集的标记最多越过边界5个点，落在相邻线不参与提取的首尾5个点上)，
+    // 各线之间相互独立，多线程并行处理
     void extractFeatures()
     {
         cornerPointsSharp->clear();
@@ -884,115 +718,140 @@ public:
         surfPointsFlat->clear();
         surfPointsLessFlat->clear();
 
+        #pragma omp parallel for num_threads(numberOfCores) schedule(dynamic)
         for (int i = 0; i < N_SCAN; i++) {
+            extractRingFeatures(i, featureScratch[threadIndex()], ringFeatures[i]);
+        }
 
-            surfPointsLessFlatScan->clear();
-
-            for (int j = 0; j < 6; j++) { // 将每线scan平均分成6等份(分区)处理
-                // 六等份起点：sp = scanStartInd + (scanEndInd - scanStartInd)*j/6
-                int sp = (segInfo.startRingIndex[i] * (6 - j)    + segInfo.endRingIndex[i] * j) / 6;
-                // 六等份终点：ep = scanStartInd - 1 + (scanEndInd - scanStartInd)*(j+1)/6
-                int ep = (segInfo.startRingIndex[i] * (5 - j)    + segInfo.endRingIndex[i] * (j + 1)) / 6 - 1;
-
-                if (sp >= ep)
-                    continue;
-
-                // 按照粗糙度(曲率)cloudSmoothness.value从小到大排序
-                std::sort(cloudSmoothness.begin()+sp, cloudSmoothness.begin()+ep, by_value());
-
-                // 因为前面对曲率用了从小到大的排序，曲率最大的点的id肯定保存在cloudSortInd[ep]处，相反曲率最小的点的id肯定保存在cloudSortInd[sp]处
-                // 1.先选取曲率比较大的特征点：提取2个边缘点 + 20个次边缘点(包含了边缘点)
-                int largestPickedNum = 0;
-                for (int k = ep; k >= sp; k--) {
-                    int ind = cloudSmoothness[k].ind; // 最开始进入那就是当前分区中曲率最大点在分割点云中的点序(id)
-                    // 该点需要满足三个特征：未被筛选过，曲率大于阈值，并且不是地面特征点
-                    if (cloudNeighborPicked[ind] == 0 &&
-                        cloudCurvature[ind] > edgeThreshold &&
-                        segInfo.segmentedCloudGroundFlag[ind] == false) {
-                        //点分类标号:2-代表曲率很大，1-代表曲率比较大,-1-代表曲率很小，0-曲率比较小(其中1包含了2,0包含了1,0和1构成了点云全部的点)
-                        largestPickedNum++;
-                        if (largestPickedNum <= 2) { // 挑选曲率最大的前2个点放入sharp边缘点集合
-                            cloudLabel[ind] = 2;
-                            cornerPointsSharp->push_back(segmentedCloud->points[ind]); // 边缘点点云
-                            cornerPointsLessSharp->push_back(segmentedCloud->points[ind]); //cornerPointsLessSharp包含了label为2和1的点
-                        } else if (largestPickedNum <= 20) { // 挑选曲率最大的前20个点放入less sharp点集合
-                            cloudLabel[ind] = 1;
-                            cornerPointsLessSharp->push_back(segmentedCloud->points[ind]); // 次边缘点点云
-                        } else {
-                            break;
-                        }
+        for (int i = 0; i < N_SCAN; i++) {
+            *cornerPointsSharp += ringFeatures[i].cornerPointsSharp;
+            *cornerPointsLessSharp += ringFeatures[i].cornerPointsLessSharp;
+            *surfPointsFlat += ringFeatures[i].surfPointsFlat;
+            *surfPointsLessFlat += ringFeatures[i].surfPointsLessFlat;
+        }
+    }
 
-                        cloudNeighborPicked[ind] = 1; // 进行到这一步表明前面已经把该点加入到点云中去了，置标志位
-                        // 将曲率比较大的所选点的前后各5个连续距离比较近的点筛选出去，防止特征点聚集，使得特征点在每个方向上尽量分布均匀
-                        for (int l = 1; l <= 5; l++) {
-                            int columnDiff = std::abs(int(segInfo.segmentedCloudColInd[ind + l] - segInfo.segmentedCloudColInd[ind + l - 1]));
-                            // 第一眼看起来像是有问题??? 对选定点周围一定距离的一些点才做防止聚集的处理，如果大于这个值了，就不用管它了。这语句没错。
-                            if (columnDiff > 10)
-                                break;
-                            cloudNeighborPicked[ind + l] = 1;
-                        }
-                        for (int l = -1; l >= -5; l--) {
-                            int columnDiff = std::abs(int(segInfo.segmentedCloudColInd[ind + l] - segInfo.segmentedCloudColInd[ind + l + 1]));
-                            if (columnDiff > 10)
-                                break;
-                            cloudNeighborPicked[ind + l] = 1;
-                        }
-                    }
-                }
+    // 原来对每个分区的cloudSmoothness整体排序，再从两端各取出几十个点；这里只对分区内的点序建堆(O(n))，
+    // 按曲率从大到小(或从小到大)逐个弹出，取够所需的特征点就停止，访问顺序与排序后相同
+    void extractRingFeatures(int i, FeatureScratch &scratch, RingFeatures &features)
+    {
+        features.cornerPointsSharp.clear();
+        features.cornerPointsLessSharp.clear();
+        features.surfPointsFlat.clear();
+        features.surfPointsLessFlat.clear();
 
-                // 2.再选取4个曲率特别小的地面特征点  注意!!! 这里提取的是地面特征点(与loam区别)
-                int smallestPickedNum = 0;
-                for (int k = sp; k <= ep; k++) {
-                    int ind = cloudSmoothness[k].ind; // 刚开始进入时为曲率最小点在点云中的点序(id)
-                    // 该点需要满足三个特征：未被筛选过，曲率小于阈值，必须是地面特征点
-                    if (cloudNeighborPicked[ind] == 0 &&
-                        cloudCurvature[ind] < surfThreshold &&
-                        segInfo.segmentedCloudGroundFlag[ind] == true) {
+        scratch.surfPointsLessFlatScan->clear();
 
-                        cloudLabel[ind] = -1;
-                        surfPointsFlat->push_back(segmentedCloud->points[ind]); // 地面特征点点云
+        std::vector<int> &candidates = scratch.candidates;
+        CurvatureLess curvatureLess = {cloudCurvature};
+        CurvatureGreater curvatureGreater = {cloudCurvature};
 
-                        smallestPickedNum++;
-                        if (smallestPickedNum >= 4) { //只选最小的四个，剩下的Label==0,就都是曲率比较小的
-                            break;
-                        }
+        for (int j = 0; j < 6; j++) { // 将每线scan平均分成6等份(分区)处理
+            // 六等份起点：sp = scanStartInd + (scanEndInd - scanStartInd)*j/6
+            int sp = (segInfo.startRingIndex[i] * (6 - j)    + segInfo.endRingIndex[i] * j) / 6;
+            // 六等份终点：ep = scanStartInd - 1 + (scanEndInd - scanStartInd)*(j+1)/6
+            int ep = (segInfo.startRingIndex[i] * (5 - j)    + segInfo.endRingIndex[i] * (j + 1)) / 6 - 1;
+
+            if (sp >= ep)
+                continue;
 
-                        cloudNeighborPicked[ind] = 1; // 置标志位
-                        // 同样防止特征点聚集
-                        for (int l = 1; l <= 5; l++) {
+            // 原来的排序范围是[sp, ep)，ep处的点没有参与排序，从大到小访问时总是第一个，从小到大访问时总是最后一个，这里保持一致
+            candidates.clear();
+            for (int k = sp; k < ep; k++)
+                candidates.push_back(k);
+            int candidateNum = ep - sp;
+
+            // 1.先选取曲率比较大的特征点：提取2个边缘点 + 20个次边缘点(包含了边缘点)
+            // 大顶堆，每次pop_heap把剩余点中曲率最大的点移到堆的末尾
+            std::make_heap(candidates.begin(), candidates.end(), curvatureLess);
+            int largestPickedNum = 0;
+            for (int n = 0; n <= candidateNum; n++) {
+                int ind = ep;
+                if (n > 0) {
+                    std::pop_heap(candidates.begin(), candidates.end() - (n - 1), curvatureLess);
+                    ind = *(candidates.end() - n); // 剩余点中曲率最大的点在分割点云中的点序(id)
+                }
+                // 该点需要满足三个特征：未被筛选过，曲率大于阈值，并且不是地面特征点
+                if (cloudNeighborPicked[ind] == 0 &&
+                    cloudCurvature[ind] > edgeThreshold &&
+                    segInfo.segmentedCloudGroundFlag[ind] == false) {
+                    //点分类标号:2-代表曲率很大，1-代表曲率比较大,-1-代表曲率很小，0-曲率比较小(其中1包含了2,0包含了1,0和1构成了点云全部的点)
+                    largestPickedNum++;
+                    if (largestPickedNum <= 2) { // 挑选曲率最大的前2个点放入sharp边缘点集合
+                        cloudLabel[ind] = 2;
+                        features.cornerPointsSharp.push_back(segmentedCloud->points[ind]); // 边缘点点云
+                        features.cornerPointsLessSharp.push_back(segmentedCloud->points[ind]); //cornerPointsLessSharp包含了label为2和1的点
+                    } else if (largestPickedNum <= 20) { // 挑选曲率最大的前20个点放入less sharp点集合
+                        cloudLabel[ind] = 1;
+                        features.cornerPointsLessSharp.push_back(segmentedCloud->points[ind]); // 次边缘点点云
+                    } else {
+                        break;
+                    }
 
-                            int columnDiff = std::abs(int(segInfo.segmentedCloudColInd[ind + l] - segInfo.segmentedCloudColInd[ind + l - 1]));
-                            if (columnDiff > 10)
-                                break;
+                    cloudNeighborPicked[ind] = 1; // 进行到这一步表明前面已经把该点加入到点云中去了，置标志位
+                    // 将曲率比较大的所选点的前后各5个连续距离比较近的点筛选出去，防止特征点聚集，使得特征点在每个方向上尽量分布均匀
+                    markNeighborPicked(ind);
+                }
+            }
 
-                            cloudNeighborPicked[ind + l] = 1;
-                        }
-                        for (int l = -1; l >= -5; l--) {
+            // 2.再选取4个曲率特别小的地面特征点  注意!!! 这里提取的是地面特征点(与loam区别)
+            // 小顶堆，candidates中仍然是[sp, ep)的全部点序
+            std::make_heap(candidates.begin(), candidates.end(), curvatureGreater);
+            int smallestPickedNum = 0;
+            for (int n = 0; n <= candidateNum; n++) {
+                int ind = ep;
+                if (n < candidateNum) {
+                    std::pop_heap(candidates.begin(), candidates.end() - n, curvatureGreater);
+                    ind = *(candidates.end() - n - 1); // 剩余点中曲率最小的点在分割点云中的点序(id)
+                }
+                // 该点需要满足三个特征：未被筛选过，曲率小于阈值，必须是地面特征点
+                if (cloudNeighborPicked[ind] == 0 &&
+                    cloudCurvature[ind] < surfThreshold &&
+                    segInfo.segmentedCloudGroundFlag[ind] == true) {
 
-                            int columnDiff = std::abs(int(segInfo.segmentedCloudColInd[ind + l] - segInfo.segmentedCloudColInd[ind + l + 1]));
-                            if (columnDiff > 10)
-                                break;
+                    cloudLabel[ind] = -1;
+                    features.surfPointsFlat.push_back(segmentedCloud->points[ind]); // 地面特征点点云
 
-                            cloudNeighborPicked[ind + l] = 1;
-                        }
+                    smallestPickedNum++;
+                    if (smallestPickedNum >= 4) { //只选最小的四个，剩下的Label==0,就都是曲率比较小的
+                        break;
                     }
+
+                    cloudNeighborPicked[ind] = 1; // 置标志位
+                    // 同样防止特征点聚集
+                    markNeighborPicked(ind);
                 }
+            }
 
-                // 3.将剩余曲率较小的点（包括之前被标记的地面特征平面点）全部归入次平面点中less flat类别中
-                for (int k = sp; k <= ep; k++) {
-                    if (cloudLabel[k] <= 0) {
-                        surfPointsLessFlatScan->push_back(segmentedCloud->points[k]);
-                    }
+            // 3.将剩余曲率较小的点（包括之前被标记的地面特征平面点）全部归入次平面点中less flat类别中
+            for (int k = sp; k <= ep; k++) {
+                if (cloudLabel[k] <= 0) {
+                    scratch.surfPointsLessFlatScan->push_back(segmentedCloud->points[k]);
                 }
             }
+        }
 
-            // surfPointsLessFlatScan中有过多的点云，如果点云太多，计算量太大
-            // 进行下采样，可以大大减少计算量
-            surfPointsLessFlatScanDS->clear();
-            downSizeFilter.setInputCloud(surfPointsLessFlatScan);
-            downSizeFilter.filter(*surfPointsLessFlatScanDS);
+        // surfPointsLessFlatScan中有过多的点云，如果点云太多，计算量太大
+        // 进行下采样，可以大大减少计算量
+        scratch.downSizeFilter.setInputCloud(scratch.surfPointsLessFlatScan);
+        scratch.downSizeFilter.filter(features.surfPointsLessFlat);
+    }
 
-            *surfPointsLessFlat += *surfPointsLessFlatScanDS;
+    // 将所选特征点前后各5个连续距离比较近的点筛选出去
+    void markNeighborPicked(int ind)
+    {
+        for (int l = 1; l <= 5; l++) {
+            int columnDiff = std::abs(int(segInfo.segmentedCloudColInd[ind + l] - segInfo.segmentedCloudColInd[ind + l - 1]));
+            // 第一眼看起来像是有问题??? 对选定点周围一定距离的一些点才做防止聚集的处理，如果大于这个值了，就不用管它了。这语句没错。
+            if (columnDiff > 10)
+                break;
+            cloudNeighborPicked[ind + l] = 1;
+        }
+        for (int l = -1; l >= -5; l--) {
+            int columnDiff = std::abs(int(segInfo.segmentedCloudColInd[ind + l] - segInfo.segmentedCloudColInd[ind + l + 1]));
+            if (columnDiff > 10)
+                break;
+            cloudNeighborPicked[ind + l] = 1;
         }
     }
 
@@ -1077,16 +936,12 @@ public:
         // 在adjustDistortion() 函数中，对intensity属性进行了如下修改
         // 点强度 = 线号 + 点相对时间（即一个整数+一个小数，整数部分是线号，小数部分是该点相对初始点的时间）
         // point.intensity = int(segmentedCloud->points[i].intensity) + scanPeriod * relTime;
-        float s = 10 * (pi->intensity - int(pi->intensity));
+        // s = 10 * (pi->intensity - int(pi->intensity));
 
         // 首先transformCur这个值是根据上一次位姿变换预测出来的的一帧点云初始时刻跟结束时刻的位姿变化关系
         //线性插值得到选定点(ti时刻)与sweep初始点的位姿变换关系T_i_start：根据每个点在点云中的相对位置关系(或者说是时间关系)，乘以相应的旋转平移系数
-        float rx = s * transformCur[0];     // pitch 
-        float ry = s * transformCur[1];     // yaw
-        float rz = s * transformCur[2];     // roll
-        float tx = s * transformCur[3];     // tx
-        float ty = s * transformCur[4];     // ty
-        float tz = s * transformCur[5];     // tz
+        // rx = s * transformCur[0] (pitch), ry = s * transformCur[1] (yaw), rz = s * transformCur[2] (roll)
+        // tx = s * transformCur[3], ty = s * transformCur[4], tz = s * transformCur[5]
 
         // | cos(-rz)   -sin(-rz)    0 |    | cos(rz)    sin(rz)     0 |
         // | sin(-rz)   cos(-rz)     0 | =  | -sin(rz)   cos(rz)     0 |  运用了三角函数的一些性质
@@ -1102,110 +957,40 @@ public:
             R_b_n = R_ZYX(左乘) = Rx(roll)*Ry(pitch)*Rz(yaw)
             R_n_b = R_ZYX(右乘) = Rz(yaw)*Ry(pitch)*Rx(roll) 
         */
-        //平移后绕z轴旋转（-rz）
-        float x1 = cos(rz) * (pi->x - tx) + sin(rz) * (pi->y - ty); // 先去掉平移
-        float y1 = -sin(rz) * (pi->x - tx) + cos(rz) * (pi->y - ty);
-        float z1 = (pi->z - tz);
+        // 平移后依次绕z轴旋转（-rz）、绕x轴旋转（-rx）、绕y轴旋转（-ry）
+        // 由transformToStart按s量化后缓存成矩阵，reset见updateTransformToStart()
+        transformToStart.apply(*pi, *po);
+    }
 
-        //绕x轴旋转（-rx）
-        float x2 = x1;
-        float y2 = cos(rx) * y1 + sin(rx) * z1;
-        float z2 = -sin(rx) * y1 + cos(rx) * z1;
-
-        //绕y轴旋转（-ry）
-        po->x = cos(ry) * x2 - sin(ry) * z2;
-        po->y = y2;
-        po->z = sin(ry) * x2 + cos(ry) * z2;
-        po->intensity = pi->intensity;
+    // transformCur改变之后调用(每次findCorresponding*之前)
+    void updateTransformToStart(){
+        transformToStart.reset(transformCur);
+    }
+
+    // 每帧在publishCloudsLast中调用一次，之后所有less特征点共用
+    void updateTransformToEnd(){
+        // 点云开始相对于点云结束的位姿变换T_end_start，绕y轴旋转（ry）、绕x轴旋转（rx）、绕z轴旋转（rz），再平移
+        // 转移到点云结束的局部坐标系下 p_e = R_e_s * p_s + t_e_s
+        Eigen::Matrix4f endFromStart = poseToMatrixZXY(transformCur[0], transformCur[1], transformCur[2],
+                                                       transformCur[3], transformCur[4], transformCur[5]);
+
+        // 先去掉加减速的畸变位移，再绕z轴(imuRollStart)、x轴(imuPitchStart)、y轴(imuYawStart)旋转至sweep的初始世界坐标下
+        Eigen::Matrix4f shift = Eigen::Matrix4f::Identity();
+        shift.topRightCorner<3, 1>() << -imuShiftFromStartX, -imuShiftFromStartY, -imuShiftFromStartZ;
+        Eigen::Matrix4f worldFromStart = poseToMatrixYXZ(imuPitchStart, imuYawStart, imuRollStart, 0, 0, 0);
+
+        // 从世界坐标系下转换到sweep结束坐标系下：绕y轴(-imuYawLast)、x轴(-imuPitchLast)、z轴(-imuRollLast)旋转
+        Eigen::Matrix4f lastFromWorld = poseToMatrixYXZ(imuPitchLast, imuYawLast, imuRollLast, 0, 0, 0).transpose();
+
+        transformToEnd.reset(transformCur, lastFromWorld * worldFromStart * shift * endFromStart);
     }
 
     //将上一帧点云中的点相对结束位置去除因匀速运动产生的畸变，效果相当于得到在点云扫描结束位置静止扫描得到的点云
+    // 先按插值系数s转换到点云初始坐标系下(同TransformToStart)，再转移到点云结束的局部坐标系下，
+    // 最后利用IMU去掉加减速的畸变并对齐到sweep结束时的姿态，后面这些变换对一帧中所有点相同，已在updateTransformToEnd()中合成
     void TransformToEnd(PointType const * const pi, PointType * const po)
     {
-        //根据不同点所处位置计算插值系数
-        float s = 10 * (pi->intensity - int(pi->intensity));
-        // 点云开始相对于点云结束的位姿变换T_end_start，乘以系数则成为选定点(ti时刻)相对点云sweep开始的位姿变换T_i_start
-        float rx = s * transformCur[0];
-        float ry = s * transformCur[1];
-        float rz = s * transformCur[2];
-        float tx = s * transformCur[3];
-        float ty = s * transformCur[4];
-        float tz = s * transformCur[5];
-
-        // p_i = R_i_s*p_start + t_i_s ====> p_start = R_i_s^-1(p_i - t_i_s)
-        // 转换得到点云初始坐标系下的坐标，解释见上面的函数
-        //平移后绕z轴旋转（-rz）
-        float x1 = cos(rz) * (pi->x - tx) + sin(rz) * (pi->y - ty);
-        float y1 = -sin(rz) * (pi->x - tx) + cos(rz) * (pi->y - ty);
-        float z1 = (pi->z - tz);
-
-        //绕x轴旋转（-rx）
-        float x2 = x1;
-        float y2 = cos(rx) * y1 + sin(rx) * z1;
-        float z2 = -sin(rx) * y1 + cos(rx) * z1;
-
-        //绕y轴旋转（-ry）
-        float x3 = cos(ry) * x2 - sin(ry) * z2;
-        float y3 = y2;
-        float z3 = sin(ry) * x2 + cos(ry) * z2; //求出了相对于起始点校正的坐标
-
-        // 点云开始相对于点云结束的位姿变换T_end_start
-        rx = transformCur[0];
-        ry = transformCur[1];
-        rz = transformCur[2];
-        tx = transformCur[3];
-        ty = transformCur[4];
-        tz = transformCur[5];
-
-        //转移到点云结束的局部坐标系下 p_e = R_e_s * p_s + t_e_s
-        //绕y轴旋转（ry）
-        float x4 = cos(ry) * x3 + sin(ry) * z3;
-        float y4 = y3;
-        float z4 = -sin(ry) * x3 + cos(ry) * z3;
-
-        //绕x轴旋转（rx）
-        float x5 = x4;
-        float y5 = cos(rx) * y4 - sin(rx) * z4;
-        float z5 = sin(rx) * y4 + cos(rx) * z4;
-
-        //绕z轴旋转（rz），再平移
-        float x6 = cos(rz) * x5 - sin(rz) * y5 + tx;
-        float y6 = sin(rz) * x5 + cos(rz) * y5 + ty;
-        float z6 = z5 + tz;
-
-        // 先去掉加减速的畸变位移，再旋转至sweep的初始世界坐标下
-        //平移后绕z轴旋转（imuRollStart）
-        float x7 = cosImuRollStart * (x6 - imuShiftFromStartX) 
-                 - sinImuRollStart * (y6 - imuShiftFromStartY);
-        float y7 = sinImuRollStart * (x6 - imuShiftFromStartX) 
-                 + cosImuRollStart * (y6 - imuShiftFromStartY);
-        float z7 = z6 - imuShiftFromStartZ;
-
-        //绕x轴旋转（imuPitchStart）
-        float x8 = x7;
-        float y8 = cosImuPitchStart * y7 - sinImuPitchStart * z7;
-        float z8 = sinImuPitchStart * y7 + cosImuPitchStart * z7;
-
-        //绕y轴旋转（imuYawStart）
-        float x9 = cosImuYawStart * x8 + sinImuYawStart * z8;
-        float y9 = y8;
-        float z9 = -sinImuYawStart * x8 + cosImuYawStart * z8;
-
-        // 从世界坐标系下转换到sweep结束坐标系下
-        //绕y轴旋转（-imuYawLast）
-        float x10 = cos(imuYawLast) * x9 - sin(imuYawLast) * z9;
-        float y10 = y9;
-        float z10 = sin(imuYawLast) * x9 + cos(imuYawLast) * z9;
-
-        //绕x轴旋转（-imuPitchLast）
-        float x11 = x10;
-        float y11 = cos(imuPitchLast) * y10 + sin(imuPitchLast) * z10;
-        float z11 = -sin(imuPitchLast) * y10 + cos(imuPitchLast) * z10;
-
-        //绕z轴旋转（-imuRollLast）
-        po->x = cos(imuRollLast) * x11 + sin(imuRollLast) * y11;
-        po->y = -sin(imuRollLast) * x11 + cos(imuRollLast) * y11;
-        po->z = z11;
+        transformToEnd.apply(*pi, *po);
         po->intensity = int(pi->intensity); //只保留线号
     }
 
@@ -1326,6 +1111,8 @@ public:
         //处理当前点云中的曲率最大的特征点(边缘点),从上个点云中曲率比较大的特征点中找两个最近距离点，一个点使用kd-tree查找，另一个根据找到的点在其相邻线找另外一个最近距离的点
         int cornerPointsSharpNum = cornerPointsSharp->points.size();
 
+        updateTransformToStart();
+
         for (int i = 0; i < cornerPointsSharpNum; i++) {
             //TODO 利用前一次位姿的计算结果，按照匀速模型内插消除畸变，将每个点转换到点云起始坐标系并去除畸变，并保存在pointSel中
             // 每一次迭代都将特征点都要利用当前预测的坐标转换转换至k+1 sweep的初始位置处对应于函数 TransformToStart()
@@ -1333,8 +1120,14 @@ public:
             // pointSel是当前时刻t+1的cornerPointsSharp转换到初始点云坐标系后的点坐标，对角点一个一个做处理，设为i点
             TransformToStart(&cornerPointsSharp->points[i], &pointSel);
             
-            // 优化算法每迭代五次，就重新查找最近点，否则沿用上次迭代的最近点
-            if (iterCount % 5 == 0) {
+            // 优化算法每迭代五次(research_interval)，就重新查找最近点，否则沿用上次迭代的最近点
+            if (researchCorrespondences && projectiveAssociationFlag) {
+                // 投影到上一帧的距离图像中，在附近的像素窗口里查找点j和相邻线上的点l
+                int closestPointInd, minPointInd2;
+                cornerImageLast.findCorner(pointSel, closestPointInd, minPointInd2);
+                pointSearchCornerInd1[i] = closestPointInd;
+                pointSearchCornerInd2[i] = minPointInd2;
+            } else if (researchCorrespondences) {
                 // std::vector<int> indices;
                 // pcl::removeNaNFromPointCloud(*laserCloudCornerLast,*laserCloudCornerLast, indices); // 上一帧的边缘点剔除异常值
 
@@ -1486,6 +1279,8 @@ public:
 
         int surfPointsFlatNum = surfPointsFlat->points.size(); // 当前帧平面特征点(其实就是地面点)个数
 
+        updateTransformToStart();
+
         for (int i = 0; i < surfPointsFlatNum; i++) {
             // 利用前一次位姿的计算结果，按照匀速模型内插消除畸变，将每个点转换到点云起始坐标系并去除畸变，并保存在pointSel中
             // 每一次迭代都将特征点利用当前预测的坐标转换 转换至k+1 sweep的初始位置处，对应于函数 TransformToStart()
@@ -1494,8 +1289,15 @@ public:
             // 当前时刻K+1转换到点云初始坐标系下(利用匀速模型去掉畸变)，对平面点做处理，设为点i
             TransformToStart(&surfPointsFlat->points[i], &pointSel);
 
-            // 优化算法每迭代五次，就重新查找最近点，否则沿用上次迭代的最近点
-            if (iterCount % 5 == 0) {
+            // 优化算法每迭代五次(research_interval)，就重新查找最近点，否则沿用上次迭代的最近点
+            if (researchCorrespondences && projectiveAssociationFlag) {
+                // 投影到上一帧的距离图像中，在附近的像素窗口里查找点j、同一线上的点l和相邻线上的点m
+                int closestPointInd, minPointInd2, minPointInd3;
+                surfImageLast.findSurf(pointSel, closestPointInd, minPointInd2, minPointInd3);
+                pointSearchSurfInd1[i] = closestPointInd;
+                pointSearchSurfInd2[i] = minPointInd2;
+                pointSearchSurfInd3[i] = minPointInd3;
+            } else if (researchCorrespondences) {
                 
                 // nearestKSearch是PCL中的K近邻域搜索，搜索上一时刻kdtreeSurfLast的K邻域点
                 // 搜索结果: pointSearchInd是搜索到的最近点在kdtreeCornerLast的索引; pointSearchSqDis是近邻对应的平方距离
@@ -1654,12 +1456,9 @@ public:
         // pointSelNum是有多少个对应约束(加入了多少个特征点)
         int pointSelNum = laserCloudOri->points.size();
 
-        cv::Mat matA(pointSelNum, 3, CV_32F, cv::Scalar::all(0)); // 因为是两步优化，现在这一步只是优化[tz,roll,pitch]三个量，所以列数是3
-        cv::Mat matAt(3, pointSelNum, CV_32F, cv::Scalar::all(0));
-        cv::Mat matAtA(3, 3, CV_32F, cv::Scalar::all(0));
-        cv::Mat matB(pointSelNum, 1, CV_32F, cv::Scalar::all(0));
-        cv::Mat matAtB(3, 1, CV_32F, cv::Scalar::all(0));
-        cv::Mat matX(3, 1, CV_32F, cv::Scalar::all(0));
+        // 因为是两步优化，现在这一步只是优化[tz,roll,pitch]三个量，所以雅克比行是3维的
+        normalEquations3.reset();
+        Eigen::Vector3f matA;
 
         float srx = sin(transformCur[0]); //pitch, X axis
         float crx = cos(transformCur[0]);
@@ -1719,51 +1518,27 @@ public:
 
             float d2 = coeff.intensity;
             // A=[J的偏导]; B=[权重系数*(点到直线的距离 or 点到平面的距离)] 求解公式: AX=B
-            // 为了让左边满秩，同乘At-> At*A*X = At*B
-            matA.at<float>(i, 0) = arx;
-            matA.at<float>(i, 1) = arz;
-            matA.at<float>(i, 2) = aty;
-            matB.at<float>(i, 0) = -0.05 * d2;//matB是代价向量  //-0.05 :猜测：防止求得的增量过大，使得算法震荡
+            // 为了让左边满秩，同乘At-> At*A*X = At*B，这里直接逐点累加At*A和At*B
+            matA << arx, arz, aty;
+            normalEquations3.add(matA, -0.05 * d2);//-0.05*d2是代价  //-0.05 :猜测：防止求得的增量过大，使得算法震荡
         }
 
-        cv::transpose(matA, matAt);
-        matAtA = matAt * matA;
-        matAtB = matAt * matB;
         //求解matAtA * matX = matAtB
-        cv::solve(matAtA, matAtB, matX, cv::DECOMP_QR);//QR分解得到X
+        Eigen::Vector3f matX = normalEquations3.solve();//QR分解得到X
         
         //接下来有一个迭代第一步的处理，猜测是出现退化进行修正，然后更新位姿之后进行收敛判断
         if (iterCount == 0) {
-            cv::Mat matE(1, 3, CV_32F, cv::Scalar::all(0)); //特征值1*3矩阵
-            cv::Mat matV(3, 3, CV_32F, cv::Scalar::all(0)); //特征向量3*3矩阵
-            cv::Mat matV2(3, 3, CV_32F, cv::Scalar::all(0));
-
-            cv::eigen(matAtA, matE, matV); //求解特征值/特征向量
-            matV.copyTo(matV2);
-
-            isDegenerate = false;
-            float eignThre[3] = {10, 10, 10}; //特征值取值门槛
-            for (int i = 2; i >= 0; i--) { //从小到大查找
-                if (matE.at<float>(0, i) < eignThre[i]) { //特征值太小，则认为处在兼并环境中，发生了退化
-                    for (int j = 0; j < 3; j++) { //对应的特征向量置为0
-                        matV2.at<float>(i, j) = 0;
-                    }
-                    isDegenerate = true;
-                } else {
-                    break;
-                }
-            }
-            matP = matV.inv() * matV2; //计算P矩阵
+            //特征值太小，则认为处在兼并环境中，发生了退化，对应的特征向量置为0后计算P矩阵
+            isDegenerate = normalEquations3.computeDegeneracy(10, matP3); //特征值取值门槛10
         }
 
         //如果发生退化，只使用预测矩阵P计算
         if (isDegenerate) {
-            cv::Mat matX2(3, 1, CV_32F, cv::Scalar::all(0));
-            matX.copyTo(matX2);
-            matX = matP * matX2;
+            Eigen::Vector3f matX2 = matX;
+            matX = matP3 * matX2;
         }
         //------- (bug fix: sometime the L-M optimization result matX contains NaN, which will break the whole node)
-        /*if (isnan(matX.at<float>(0, 0)) || isnan(matX.at<float>(1, 0)) || isnan(matX.at<float>(2, 0)) || isnan(matX.at<float>(3, 0)) || isnan(matX.at<float>(4, 0)) || isnan(matX.at<float>(5, 0)))
+        /*if (isnan(matX(0)) || isnan(matX(1)) || isnan(matX(2)) || isnan(matX(3)) || isnan(matX(4)) || isnan(matX(5)))
         {
         printf("[USER WARN]laser Odometry: NaN found in var \"matX\", this L-M optimization step is going to be ignored.\n");
         }
@@ -1771,9 +1546,9 @@ public:
 
         // 更新第一步优化的结果[tz,roll,pitch]
         /*—————— matX代表的是每一次迭代的变化值detX,tranform代表累计后的迭代最新结果 ——————*/
-        transformCur[0] += matX.at<float>(0, 0);    //pitch 
-        transformCur[2] += matX.at<float>(1, 0);    // roll 
-        transformCur[4] += matX.at<float>(2, 0);    // tz
+        transformCur[0] += matX(0);    //pitch 
+        transformCur[2] += matX(1);    // roll 
+        transformCur[4] += matX(2);    // tz
 
         for(int i=0; i<6; i++){
             if(isnan(transformCur[i]))//判断是否非数字
@@ -1781,12 +1556,12 @@ public:
         }
         //计算旋转平移量，如果很小就停止迭代
         float deltaR = sqrt(
-                            pow(rad2deg(matX.at<float>(0, 0)), 2) +
-                            pow(rad2deg(matX.at<float>(1, 0)), 2));
+                            pow(rad2deg(matX(0)), 2) +
+                            pow(rad2deg(matX(1)), 2));
         float deltaT = sqrt(
-                            pow(matX.at<float>(2, 0) * 100, 2));
+                            pow(matX(2) * 100, 2));
 
-        if (deltaR < 0.1 && deltaT < 0.1) {//迭代终止条件
+        if (surfControl.converged(deltaR, deltaT)) {//迭代终止条件
             return false;
         }
         return true;
@@ -1796,12 +1571,8 @@ public:
 
         int pointSelNum = laserCloudOri->points.size();
 
-        cv::Mat matA(pointSelNum, 3, CV_32F, cv::Scalar::all(0));
-        cv::Mat matAt(3, pointSelNum, CV_32F, cv::Scalar::all(0));
-        cv::Mat matAtA(3, 3, CV_32F, cv::Scalar::all(0));
-        cv::Mat matB(pointSelNum, 1, CV_32F, cv::Scalar::all(0));
-        cv::Mat matAtB(3, 1, CV_32F, cv::Scalar::all(0));
-        cv::Mat matX(3, 1, CV_32F, cv::Scalar::all(0));
+        normalEquations3.reset();
+        Eigen::Vector3f matA;
 
         float srx = sin(transformCur[0]); // pitch 
         float crx = cos(transformCur[0]);
@@ -1832,49 +1603,24 @@ public:
 
             float d2 = coeff.intensity;
 
-            matA.at<float>(i, 0) = ary;
-            matA.at<float>(i, 1) = atx;
-            matA.at<float>(i, 2) = atz;
-            matB.at<float>(i, 0) = -0.05 * d2;
+            matA << ary, atx, atz;
+            normalEquations3.add(matA, -0.05 * d2);
         }
 
-        cv::transpose(matA, matAt);
-        matAtA = matAt * matA;
-        matAtB = matAt * matB;
-        cv::solve(matAtA, matAtB, matX, cv::DECOMP_QR);
+        Eigen::Vector3f matX = normalEquations3.solve();
 
         if (iterCount == 0) {
-            cv::Mat matE(1, 3, CV_32F, cv::Scalar::all(0));
-            cv::Mat matV(3, 3, CV_32F, cv::Scalar::all(0));
-            cv::Mat matV2(3, 3, CV_32F, cv::Scalar::all(0));
-
-            cv::eigen(matAtA, matE, matV);
-            matV.copyTo(matV2);
-
-            isDegenerate = false;
-            float eignThre[3] = {10, 10, 10};
-            for (int i = 2; i >= 0; i--) {
-                if (matE.at<float>(0, i) < eignThre[i]) {
-                    for (int j = 0; j < 3; j++) {
-                        matV2.at<float>(i, j) = 0;
-                    }
-                    isDegenerate = true;
-                } else {
-                    break;
-                }
-            }
-            matP = matV.inv() * matV2;
+            isDegenerate = normalEquations3.computeDegeneracy(10, matP3);
         }
 
         if (isDegenerate) {
-            cv::Mat matX2(3, 1, CV_32F, cv::Scalar::all(0));
-            matX.copyTo(matX2);
-            matX = matP * matX2;
+            Eigen::Vector3f matX2 = matX;
+            matX = matP3 * matX2;
         }
 
-        transformCur[1] += matX.at<float>(0, 0); // yaw 
-        transformCur[3] += matX.at<float>(1, 0); // tx
-        transformCur[5] += matX.at<float>(2, 0); // tz
+        transformCur[1] += matX(0); // yaw 
+        transformCur[3] += matX(1); // tx
+        transformCur[5] += matX(2); // tz
 
         for(int i=0; i<6; i++){
             if(isnan(transformCur[i]))
@@ -1882,12 +1628,12 @@ public:
         }
 
         float deltaR = sqrt(
-                            pow(rad2deg(matX.at<float>(0, 0)), 2));
+                            pow(rad2deg(matX(0)), 2));
         float deltaT = sqrt(
-                            pow(matX.at<float>(1, 0) * 100, 2) +
-                            pow(matX.at<float>(2, 0) * 100, 2));
+                            pow(matX(1) * 100, 2) +
+                            pow(matX(2) * 100, 2));
 
-        if (deltaR < 0.1 && deltaT < 0.1) {
+        if (cornerControl.converged(deltaR, deltaT)) {
             return false;
         }
         return true;
@@ -1897,12 +1643,8 @@ public:
 
         int pointSelNum = laserCloudOri->points.size();
 
-        cv::Mat matA(pointSelNum, 6, CV_32F, cv::Scalar::all(0));
-        cv::Mat matAt(6, pointSelNum, CV_32F, cv::Scalar::all(0));
-        cv::Mat matAtA(6, 6, CV_32F, cv::Scalar::all(0));
-        cv::Mat matB(pointSelNum, 1, CV_32F, cv::Scalar::all(0));
-        cv::Mat matAtB(6, 1, CV_32F, cv::Scalar::all(0));
-        cv::Mat matX(6, 1, CV_32F, cv::Scalar::all(0));
+        normalEquations6.reset();
+        Eigen::Matrix<float, 6, 1> matA;
 
         float srx = sin(transformCur[0]);
         float crx = cos(transformCur[0]);
@@ -1948,55 +1690,27 @@ public:
 
             float d2 = coeff.intensity;
 
-            matA.at<float>(i, 0) = arx;
-            matA.at<float>(i, 1) = ary;
-            matA.at<float>(i, 2) = arz;
-            matA.at<float>(i, 3) = atx;
-            matA.at<float>(i, 4) = aty;
-            matA.at<float>(i, 5) = atz;
-            matB.at<float>(i, 0) = -0.05 * d2;
+            matA << arx, ary, arz, atx, aty, atz;
+            normalEquations6.add(matA, -0.05 * d2);
         }
 
-        cv::transpose(matA, matAt);
-        matAtA = matAt * matA;
-        matAtB = matAt * matB;
-        cv::solve(matAtA, matAtB, matX, cv::DECOMP_QR);
+        Eigen::Matrix<float, 6, 1> matX = normalEquations6.solve();
 
         if (iterCount == 0) {
-            cv::Mat matE(1, 6, CV_32F, cv::Scalar::all(0));
-            cv::Mat matV(6, 6, CV_32F, cv::Scalar::all(0));
-            cv::Mat matV2(6, 6, CV_32F, cv::Scalar::all(0));
-
-            cv::eigen(matAtA, matE, matV);
-            matV.copyTo(matV2);
-
-            isDegenerate = false;
-            float eignThre[6] = {10, 10, 10, 10, 10, 10};
-            for (int i = 5; i >= 0; i--) {
-                if (matE.at<float>(0, i) < eignThre[i]) {
-                    for (int j = 0; j < 6; j++) {
-                        matV2.at<float>(i, j) = 0;
-                    }
-                    isDegenerate = true;
-                } else {
-                    break;
-                }
-            }
-            matP = matV.inv() * matV2;
+            isDegenerate = normalEquations6.computeDegeneracy(10, matP);
         }
 
         if (isDegenerate) {
-            cv::Mat matX2(6, 1, CV_32F, cv::Scalar::all(0));
-            matX.copyTo(matX2);
+            Eigen::Matrix<float, 6, 1> matX2 = matX;
             matX = matP * matX2;
         }
 
-        transformCur[0] += matX.at<float>(0, 0);
-        transformCur[1] += matX.at<float>(1, 0);
-        transformCur[2] += matX.at<float>(2, 0);
-        transformCur[3] += matX.at<float>(3, 0);
-        transformCur[4] += matX.at<float>(4, 0);
-        transformCur[5] += matX.at<float>(5, 0);
+        transformCur[0] += matX(0);
+        transformCur[1] += matX(1);
+        transformCur[2] += matX(2);
+        transformCur[3] += matX(3);
+        transformCur[4] += matX(4);
+        transformCur[5] += matX(5);
 
         for(int i=0; i<6; i++){
             if(isnan(transformCur[i]))
@@ -2004,13 +1718,13 @@ public:
         }
 
         float deltaR = sqrt(
-                            pow(rad2deg(matX.at<float>(0, 0)), 2) +
-                            pow(rad2deg(matX.at<float>(1, 0)), 2) +
-                            pow(rad2deg(matX.at<float>(2, 0)), 2));
+                            pow(rad2deg(matX(0)), 2) +
+                            pow(rad2deg(matX(1)), 2) +
+                            pow(rad2deg(matX(2)), 2));
         float deltaT = sqrt(
-                            pow(matX.at<float>(3, 0) * 100, 2) +
-                            pow(matX.at<float>(4, 0) * 100, 2) +
-                            pow(matX.at<float>(5, 0) * 100, 2));
+                            pow(matX(3) * 100, 2) +
+                            pow(matX(4) * 100, 2) +
+                            pow(matX(5) * 100, 2));
 
         if (deltaR < 0.1 && deltaT < 0.1) {
             return false;
@@ -2020,15 +1734,14 @@ public:
 
     void checkSystemInitialization(){ //将第一个点云数据集发送给laserMapping,从下一个点云数据开始处理
 
-        //将cornerPointsLessSharp与laserCloudCornerLast交换,目的保存cornerPointsLessSharp的值下轮使用
-        pcl::PointCloud<PointType>::Ptr laserCloudTemp = cornerPointsLessSharp; // 包含了边缘点的次边缘点
-        cornerPointsLessSharp = laserCloudCornerLast; // 初始化时该指针没有指向的对象
-        laserCloudCornerLast = laserCloudTemp; // 保存初始时刻的边缘点+次边缘点
+        //保存cornerPointsLessSharp的值下轮使用
+        //laserCloudCornerLast会以共享指针发布给mapOptimization，不能再与cornerPointsLessSharp交换复用，cornerPointsLessSharp使用新的点云
+        laserCloudCornerLast = cornerPointsLessSharp; // 保存初始时刻的边缘点+次边缘点
+        cornerPointsLessSharp = lastCloudPool.acquire();
 
-        //将surfPointLessFlat与laserCloudSurfLast交换，目的保存surfPointsLessFlat的值下轮使用
-        laserCloudTemp = surfPointsLessFlat; // 包含了地面平面点的次平面点
-        surfPointsLessFlat = laserCloudSurfLast;
-        laserCloudSurfLast = laserCloudTemp; // 保存初始时刻的地面平面点+次平面点
+        //保存surfPointsLessFlat的值下轮使用
+        laserCloudSurfLast = surfPointsLessFlat; // 保存初始时刻的地面平面点+次平面点
+        surfPointsLessFlat = lastCloudPool.acquire();
 
         //初始化时使用第一帧的特征点构建kd-tree，为了方便寻找最近的点
         kdtreeCornerLast->setInputCloud(laserCloudCornerLast); //所有的边缘点+次边缘点集合
@@ -2038,17 +1751,8 @@ public:
         laserCloudSurfLastNum = laserCloudSurfLast->points.size();
 
         //将cornerPointsLessSharp和surfPointLessFlat点也即边缘点+次边缘点和地面平面点+次平面点分别发送给laserMapping
-        sensor_msgs::PointCloud2 laserCloudCornerLast2;
-        pcl::toROSMsg(*laserCloudCornerLast, laserCloudCornerLast2);
-        laserCloudCornerLast2.header.stamp = cloudHeader.stamp; //这个时间是接收到点云的时间
-        laserCloudCornerLast2.header.frame_id = "/camera";
-        pubLaserCloudCornerLast.publish(laserCloudCornerLast2);
-
-        sensor_msgs::PointCloud2 laserCloudSurfLast2;
-        pcl::toROSMsg(*laserCloudSurfLast, laserCloudSurfLast2);
-        laserCloudSurfLast2.header.stamp = cloudHeader.stamp;
-        laserCloudSurfLast2.header.frame_id = "/camera";
-        pubLaserCloudSurfLast.publish(laserCloudSurfLast2);
+        publishCloudLast(pubLaserCloudCornerLast, laserCloudCornerLast); //这个时间是接收到点云的时间
+        publishCloudLast(pubLaserCloudSurfLast, laserCloudSurfLast);
 
         //记录第一帧的翻滚角和俯仰角，位于世界坐标系下
         transformSum[0] += imuPitchStart;
@@ -2090,45 +1794,85 @@ public:
         }
     }
 
+    PipelineMetrics::Clock::time_point transformationStageStart() const {
+        return transformationTiming.enabled ? PipelineMetrics::Clock::now() : PipelineMetrics::Clock::time_point();
+    }
+
+    void addTransformationStageTime(double &ms, PipelineMetrics::Clock::time_point start) const {
+        if (transformationTiming.enabled)
+            ms += std::chrono::duration<double, std::milli>(PipelineMetrics::Clock::now() - start).count();
+    }
+
     void updateTransformation(){
 
+        transformationTiming.matched = false;
+        transformationTiming.findSurfMs = transformationTiming.calculateSurfMs = 0;
+        transformationTiming.findCornerMs = transformationTiming.calculateCornerMs = 0;
+
         // 上一帧激光雷达点云数据中特征点的数量足够多再开始匹配
         if (laserCloudCornerLastNum < 10 || laserCloudSurfLastNum < 100)
             return;
+        transformationTiming.matched = true;
 
         //Levenberg-Marquardt算法(L-M method)，非线性最小二乘算法迭代求解前后两帧的位姿变化
         // 这里采用的是两步LM优化方法：
         // 1. 通过匹配平面特征来估计出[tz,roll,pitch];
         // 2. 使用第一步估计值作为约束，匹配边缘特征来估计剩下的[tx,ty,yaw]
+        // 迭代次数、收敛条件、重新查找对应点的时机和这一帧的时间限制见iterationControl.h
 
-        for (int iterCount1 = 0; iterCount1 < 25; iterCount1++) {
+        IterationControl::Clock::time_point frameStart = IterationControl::Clock::now();
+        surfControl.start(frameStart);
+        cornerControl.start(frameStart);
+
+        int iterCount1 = 0;
+        for (; surfControl.running(iterCount1); iterCount1++) {
             laserCloudOri->clear();
             coeffSel->clear();
+            researchCorrespondences = surfControl.research();
 
             // 找到对应的特征平面
             // 然后计算协方差矩阵，保存在coeffSel队列中
             // laserCloudOri中保存的是对应于coeffSel的未转换到开始时刻的原始点云数据
+            PipelineMetrics::Clock::time_point start = transformationStageStart();
             findCorrespondingSurfFeatures(iterCount1);
+            addTransformationStageTime(transformationTiming.findSurfMs, start);
 
             if (laserCloudOri->points.size() < 10)
                 continue;
             // 通过面特征的匹配，计算变换矩阵
-            if (calculateTransformationSurf(iterCount1) == false)
+            start = transformationStageStart();
+            bool updated = calculateTransformationSurf(iterCount1);
+            addTransformationStageTime(transformationTiming.calculateSurfMs, start);
+            if (updated == false)
                 break;
         }
 
-        for (int iterCount2 = 0; iterCount2 < 25; iterCount2++) {
+        int iterCount2 = 0;
+        for (; cornerControl.running(iterCount2); iterCount2++) {
 
             laserCloudOri->clear();
             coeffSel->clear();
+            researchCorrespondences = cornerControl.research();
 
+            PipelineMetrics::Clock::time_point start = transformationStageStart();
             findCorrespondingCornerFeatures(iterCount2);
+            addTransformationStageTime(transformationTiming.findCornerMs, start);
 
             if (laserCloudOri->points.size() < 10)
                 continue;
-            if (calculateTransformationCorner(iterCount2) == false)
+            start = transformationStageStart();
+            bool updated = calculateTransformationCorner(iterCount2);
+            addTransformationStageTime(transformationTiming.calculateCornerMs, start);
+            if (updated == false)
                 break;
         }
+
+        metrics.addValue("surf iterations", surfControl.iterations());
+        metrics.addValue("corner iterations", cornerControl.iterations());
+        metrics.addValue("surf researches", surfControl.researches());
+        metrics.addValue("corner researches", cornerControl.researches());
+        if (surfControl.isDeadlineHit() || cornerControl.isDeadlineHit())
+            metrics.increment("scan2scan deadline hits", 1, true);
     }
 
     void integrateTransformation(){
@@ -2235,9 +1979,16 @@ public:
         }
     }
 
+    // 以共享指针发布给mapOptimization，发布之后该点云不再修改
+    void publishCloudLast(ros::Publisher &pub, pcl::PointCloud<PointType>::Ptr cloud){
+        cloud->header = pcl_conversions::toPCL(cloudHeader);
+        cloud->header.frame_id = "/camera";
+        pub.publish(cloud);
+    }
+
     void publishCloudsLast(){
 
-        updateImuRollPitchYawStartSinCos();
+        updateTransformToEnd();
 
         //对点云的曲率比较大和比较小的点投影到扫描结束位置
         int cornerPointsLessSharpNum = cornerPointsLessSharp->points.size();
@@ -2253,85 +2004,93 @@ public:
         }
 
         //畸变校正之后的点(投影至扫描终点)作为last点保存等下个点云进来进行匹配
-        pcl::PointCloud<PointType>::Ptr laserCloudTemp = cornerPointsLessSharp;
-        cornerPointsLessSharp = laserCloudCornerLast;
-        laserCloudCornerLast = laserCloudTemp;
+        //上一帧的last点云可能已经发布给mapOptimization，不再交换复用
+        laserCloudCornerLast = cornerPointsLessSharp;
+        cornerPointsLessSharp = lastCloudPool.acquire();
 
-        laserCloudTemp = surfPointsLessFlat;
-        surfPointsLessFlat = laserCloudSurfLast;
-        laserCloudSurfLast = laserCloudTemp;
+        laserCloudSurfLast = surfPointsLessFlat;
+        surfPointsLessFlat = lastCloudPool.acquire();
 
         laserCloudCornerLastNum = laserCloudCornerLast->points.size();
         laserCloudSurfLastNum = laserCloudSurfLast->points.size();
         
-        //点足够多就构建kd-tree，否则弃用此帧，沿用上一帧数据的kd-tree
+        //点足够多就构建kd-tree(或距离图像索引)，否则弃用此帧，沿用上一帧数据的kd-tree
         if (laserCloudCornerLastNum > 10 && laserCloudSurfLastNum > 100) {
-            kdtreeCornerLast->setInputCloud(laserCloudCornerLast);
-            kdtreeSurfLast->setInputCloud(laserCloudSurfLast);
+            if (projectiveAssociationFlag){
+                cornerImageLast.build(laserCloudCornerLast);
+                surfImageLast.build(laserCloudSurfLast);
+            }else{
+                kdtreeCornerLast->setInputCloud(laserCloudCornerLast);
+                kdtreeSurfLast->setInputCloud(laserCloudSurfLast);
+            }
         }
 
         frameCount++;
         //按照跳帧数publich边缘点，平面点以及全部点给laserMapping(每隔一帧发一次)
-        if (frameCount >= skipFrameNum + 1) {
+        if (frameCount >= skipFrameNum + extraSkipFrameNum + 1) {
 
             frameCount = 0;
             // 调整坐标系，调整回来原始的样子
             adjustOutlierCloud();
-            sensor_msgs::PointCloud2 outlierCloudLast2;
-            pcl::toROSMsg(*outlierCloud, outlierCloudLast2);
-            outlierCloudLast2.header.stamp = cloudHeader.stamp;
-            outlierCloudLast2.header.frame_id = "/camera";
-            pubOutlierCloudLast.publish(outlierCloudLast2);
-
-            sensor_msgs::PointCloud2 laserCloudCornerLast2;
-            pcl::toROSMsg(*laserCloudCornerLast, laserCloudCornerLast2);
-            laserCloudCornerLast2.header.stamp = cloudHeader.stamp;
-            laserCloudCornerLast2.header.frame_id = "/camera";
-            pubLaserCloudCornerLast.publish(laserCloudCornerLast2);
-
-            sensor_msgs::PointCloud2 laserCloudSurfLast2;
-            pcl::toROSMsg(*laserCloudSurfLast, laserCloudSurfLast2);
-            laserCloudSurfLast2.header.stamp = cloudHeader.stamp;
-            laserCloudSurfLast2.header.frame_id = "/camera";
-            pubLaserCloudSurfLast.publish(laserCloudSurfLast2);
+            publishCloudLast(pubOutlierCloudLast, outlierCloud);
+            publishCloudLast(pubLaserCloudCornerLast, laserCloudCornerLast);
+            publishCloudLast(pubLaserCloudSurfLast, laserCloudSurfLast);
         }
     }
 
+    // 同一帧的分割点云、分割信息和界外点云都到达后由回调调用
     void runFeatureAssociation()
     {
-        // 如果有新数据进来则执行，否则不执行任何操作
-        if (newSegmentedCloud && newSegmentedCloudInfo && newOutlierCloud &&
-            std::abs(timeNewSegmentedCloudInfo - timeNewSegmentedCloud) < 0.05 &&
-            std::abs(timeNewOutlierCloud - timeNewSegmentedCloud) < 0.05){ //同步作用，确保同时收到同一个点云的特征点信息才进入
-
-            newSegmentedCloud = false;
-            newSegmentedCloudInfo = false;
-            newOutlierCloud = false;
-        }else{
-            return;
-        }
+        ROS_DEBUG_THROTTLE(5.0, "featureAssociation: %d frames matched, unmatched messages %d",
+                           (int)cloudSync.matchedNum(), (int)cloudSync.droppedNum());
+        // 三路消息中某一路丢失时这一帧不会被处理，imageProjection每帧都发布三路，被覆盖的时间戳都是真正的丢帧
+        metrics.setCounter("unmatched messages", cloudSync.droppedNum(), true);
+        metrics.publishIfDue();
+        ScopedTimer timer(metrics, "runFeatureAssociation", timeScanCur);
+
         /**
         	1. Feature Extraction
         */
         // 主要进行的处理去除点云数据由于非匀速运动产生的畸变，并且将所有点都投影至sweep初始时刻
         // 注意!!! 这里去掉的只是因为不满足匀速模型(加减速运动)而产生的畸变，在后面TransformToStart()才会利用匀速模型去掉每个点的畸变 
-        adjustDistortion();
+        {
+            ScopedTimer timer(metrics, "adjustDistortion", timeScanCur);
+            adjustDistortion();
+        }
 
         // 不完全按照公式进行光滑性计算，并保存结果
-        calculateSmoothness();
+        {
+            ScopedTimer timer(metrics, "calculateSmoothness", timeScanCur);
+            calculateSmoothness();
+        }
 
         // 标记阻塞点??? 阻塞点是什么点???
         // 参考了csdn若愚maimai大佬的博客，这里的阻塞点指过近的点
         // 指在点云中可能出现的互相遮挡的情况
-        markOccludedPoints();
+        {
+            ScopedTimer timer(metrics, "markOccludedPoints", timeScanCur);
+            markOccludedPoints();
+        }
 
         // 特征抽取，然后分别保存到cornerPointsSharp等等队列中去
         // 保存到不同的队列是不同类型的点云，进行了标记的工作，
         // 这一步中减少了点云数量，使计算量减少
-        extractFeatures();
+        {
+            ScopedTimer timer(metrics, "extractFeatures", timeScanCur);
+            extractFeatures();
+        }
+        metrics.addValue("segmented points", segmentedCloud->points.size());
+        metrics.addValue("corner sharp points", cornerPointsSharp->points.size());
+        metrics.addValue("corner less sharp points", cornerPointsLessSharp->points.size());
+        metrics.addValue("surf flat points", surfPointsFlat->points.size());
+        metrics.addValue("surf less flat points", surfPointsLessFlat->points.size());
+        metrics.setCounter("cloud pool allocations", outlierCloudPool.allocations() + lastCloudPool.allocations());
 
         // 发布cornerPointsSharp等4种类型的点云数据
-        publishCloud(); // cloud for visualization
+        {
+            ScopedTimer timer(metrics, "publishCloud", timeScanCur);
+            publishCloud(); // cloud for visualization
+        }
 	
         /**
 		2. Feature Association
@@ -2345,18 +2104,82 @@ public:
         updateInitialGuess();
 
         // 更新变换
-        updateTransformation();
+        {
+            ScopedTimer timer(metrics, "updateTransformation", timeScanCur);
+            updateTransformation();
+        }
 
         // 积分总变换
         integrateTransformation();
 
         publishOdometry();
 
-        publishCloudsLast(); // cloud to mapOptimization
+        {
+            ScopedTimer timer(metrics, "publishCloudsLast", timeScanCur);
+            publishCloudsLast(); // cloud to mapOptimization
+        }
+        // 下一帧特征匹配使用的KD树大小
+        metrics.addValue("corner last tree size", laserCloudCornerLastNum);
+        metrics.addValue("surf last tree size", laserCloudSurfLastNum);
+    }
+
+    // 主循环，独立进程和nodelet共用
+    // queue为NULL时处理全局回调队列，否则处理nodelet中设置的独立回调队列
+    // 没有消息时阻塞在回调队列上，同一帧的消息到齐后在回调中直接执行runFeatureAssociation，不再以200Hz轮询
+    // 超时只用于检查running
+    void spin(ros::CallbackQueue *queue){
+        if (queue == NULL)
+            queue = ros::getGlobalCallbackQueue();
+        while (ros::ok() && running)
+            queue->callAvailable(ros::WallDuration(0.1));
+    }
+
+    void stop(){
+        running = false;
+    }
+};
+
+
+
+#ifdef LEGO_LOAM_NODELET
+
+namespace lego_loam{
+
+// nodelet版本，回调放入独立的回调队列，由工作线程处理，与独立进程时的执行顺序相同
+class FeatureAssociationNodelet : public nodelet::Nodelet{
+
+private:
+
+    ros::CallbackQueue queue;
+    boost::shared_ptr<FeatureAssociation> FA;
+    std::thread worker;
+
+    virtual void onInit(){
+        readSensorParams();
+        ros::NodeHandle nh(getPrivateNodeHandle());
+        nh.setCallbackQueue(&queue);
+        FA.reset(new FeatureAssociation(nh));
+        worker = std::thread(&FeatureAssociation::spin, FA.get(), &queue);
+        NODELET_INFO("\033[1;32m---->\033[0m Feature Association Nodelet Started.");
+    }
+
+public:
+
+    ~FeatureAssociationNodelet(){
+        if (FA){
+            FA->stop();
+            worker.join();
+        }
     }
 };
 
+}
+
+PLUGINLIB_EXPORT_CLASS(lego_loam::FeatureAssociationNodelet, nodelet::Nodelet)
 
+#elif !defined(LEGO_LOAM_OFFLINE)
+
+// offlineReplay.cpp把四个节点编译进同一个程序，由它提供main
 
 // 该节点只接收分割后的点云、离群点、及imu信息，然后对其进行处理
 int main(int argc, char** argv)
@@ -2365,18 +2188,13 @@ int main(int argc, char** argv)
 
     ROS_INFO("\033[1;32m---->\033[0m Feature Association Started.");
 
-    FeatureAssociation FA;
+    readSensorParams();
 
-    ros::Rate rate(200);
-    while (ros::ok())
-    {
-        ros::spinOnce();
+    FeatureAssociation FA;
 
-        FA.runFeatureAssociation();
+    FA.spin(NULL);
 
-        rate.sleep();
-    }
-    
-    ros::spin();
     return 0;
 }
+
+#endif
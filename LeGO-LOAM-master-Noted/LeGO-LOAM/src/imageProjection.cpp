@@ -33,11 +33,28 @@
 //      IEEE/RSJ International Conference on Intelligent Robots and Systems (IROS). October 2018.
 
 #include "utility.h"
+#include "pointCloud2Reader.h"
+#include "pipelineMetrics.h"
+#include "cloudPool.h"
+#include "compactCloud.h"
+
+#ifdef LEGO_LOAM_CUDA
+#include "rangeImageGpu.h"
+#endif
+
+#ifdef LEGO_LOAM_NODELET
+#include <nodelet/nodelet.h>
+#include <pluginlib/class_list_macros.h>
+#endif
 
 class ImageProjection{
+
+    friend class PipelineBenchmark; // src/pipelineBenchmark.cpp中单独调用各处理阶段
+
 private:
 
     ros::NodeHandle nh;
+    PipelineMetrics metrics;    // 各阶段耗时及点数统计，发布在/diagnostics上
 
     ros::Subscriber subLaserCloud;
     
@@ -49,9 +66,15 @@ private:
     ros::Publisher pubSegmentedCloudPure;
     ros::Publisher pubSegmentedCloudInfo;
     ros::Publisher pubOutlierCloud;
+    ros::Publisher pubCompactCloud;
+
+    bool compactCloud; // 以紧凑格式发布分割点云和分割信息(/segmented_cloud_compact)，原来的两个话题只在有订阅者时发布
+    cloud_msgs::CompactCloud compactMsg;
 
-    pcl::PointCloud<PointType>::Ptr laserCloudIn; // ros转化为pcl格式的原始点云
-    pcl::PointCloud<PointXYZIR>::Ptr laserCloudInRing;
+    sensor_msgs::PointCloud2ConstPtr laserCloudMsgIn; // 原始点云消息，直接从其字节缓存中读取点，不转换为pcl格式
+    PointCloud2Reader cloudReader;
+    PointType cloudFirstPoint;  // 原始点云中第一个和最后一个有效点，用于计算起始和结束方位角
+    PointType cloudLastPoint;
     
     // 点云以一维数组的形式存储，按行存储，且按照线号从小到大方式进行排列，其point强度值为行列索引的组合(与loam中使用的方法类似)，位于右上前雷达坐标系下
     pcl::PointCloud<PointType>::Ptr fullCloud; // projected velodyne raw cloud, but saved in the form of 1-D matrix
@@ -61,6 +84,7 @@ private:
     pcl::PointCloud<PointType>::Ptr segmentedCloud; // 分割点云，去除了原始点云中的离群点以及大部分地面点
     pcl::PointCloud<PointType>::Ptr segmentedCloudPure;
     pcl::PointCloud<PointType>::Ptr outlierCloud;
+    CloudPool<PointType> publishedCloudPool; // segmentedCloud和outlierCloud发布后由订阅者持有，订阅者释放后复用
 
     PointType nanPoint; // fill in fullCloud at each iteration
 
@@ -74,18 +98,25 @@ private:
 
     cloud_msgs::cloud_info segMsg; // info of segmented cloud
     std_msgs::Header cloudHeader;
+    double stamp; // 当前点云的时间戳，用于trace中对应同一帧
 
-    std::vector<std::pair<int8_t, int8_t> > neighborIterator; // neighbor iterator for segmentaiton process
-
-    uint16_t *allPushedIndX; // array for tracking points of a segmented object
-    uint16_t *allPushedIndY;
+    // 点云分割的并查集，下标为距离图像中的一维索引(j + i*Horizon_SCAN)
+    std::vector<int> segParent;     // 父节点，根节点总是聚类中按行优先顺序的第一个点
+    std::vector<int> segSize;       // 以下三项只在根节点处有效：聚类点数
+    std::vector<int> segLastRow;    // 统计线数时最近一次计入的线号
+    std::vector<int> segLineCount;  // 聚类在竖直方向上跨过的线数
+    std::vector<int> segLabel;      // 聚类的最终标签(labelCount或999999)
 
-    uint16_t *queueIndX; // array for breadth-first search(广度优先搜索，BFS) process of segmentation, for speed
-    uint16_t *queueIndY;
+#ifdef LEGO_LOAM_CUDA
+    boost::shared_ptr<RangeImageGpu> rangeImageGpu; // 投影、地面标记和连通域合并的CUDA后端，为空时在CPU上计算
+#endif
+    bool rangeImageOnGpu; // 本帧的距离图像由GPU整幅写入，下一帧同样会被整幅覆盖，重置时不需要填充初值
 
 public:
-    ImageProjection(): // 构造函数
-        nh("~"){
+    // 构造函数，nodelet中传入nodelet的私有NodeHandle
+    ImageProjection(ros::NodeHandle nodeHandle = ros::NodeHandle("~")):
+        nh(nodeHandle),
+        metrics(nh, "imageProjection"){
         // 订阅来自velodyne雷达驱动的topic ("/velodyne_points")
         subLaserCloud = nh.subscribe<sensor_msgs::PointCloud2>(pointCloudTopic, 1, &ImageProjection::cloudHandler, this);
 
@@ -93,37 +124,74 @@ public:
         pubFullInfoCloud = nh.advertise<sensor_msgs::PointCloud2> ("/full_cloud_info", 1);  // 发布完整点云信息：坐标 + 距离
 
         pubGroundCloud = nh.advertise<sensor_msgs::PointCloud2> ("/ground_cloud", 1);   // 发布地面特征
-        pubSegmentedCloud = nh.advertise<sensor_msgs::PointCloud2> ("/segmented_cloud", 1); // 分割后的点云，包含了地面点
+        // 发给featureAssociation的点云直接以pcl格式发布，同一进程(nodelet)内只传递共享指针，不进行序列化；
+        // 跨进程时pcl_ros将其序列化为sensor_msgs::PointCloud2，与原来的消息格式相同
+        pubSegmentedCloud = nh.advertise<pcl::PointCloud<PointType> > ("/segmented_cloud", 1); // 分割后的点云，包含了地面点
         pubSegmentedCloudPure = nh.advertise<sensor_msgs::PointCloud2> ("/segmented_cloud_pure", 1); // 分割后的点云，不包含地面点
         pubSegmentedCloudInfo = nh.advertise<cloud_msgs::cloud_info> ("/segmented_cloud_info", 1); // 点云的分割信息
-        pubOutlierCloud = nh.advertise<sensor_msgs::PointCloud2> ("/outlier_cloud", 1); // 界外点云
+        pubOutlierCloud = nh.advertise<pcl::PointCloud<PointType> > ("/outlier_cloud", 1); // 界外点云
+        compactCloud = compactCloudEnabled();
+        if (compactCloud == true)
+            pubCompactCloud = nh.advertise<cloud_msgs::CompactCloud> ("/segmented_cloud_compact", 1); // 分割点云和分割信息的紧凑格式
 
         nanPoint.x = std::numeric_limits<float>::quiet_NaN();
         nanPoint.y = std::numeric_limits<float>::quiet_NaN();
         nanPoint.z = std::numeric_limits<float>::quiet_NaN();
         nanPoint.intensity = -1;
 
+        rangeImageOnGpu = false;
         allocateMemory();
         resetParameters();
+        initGpuBackend();
+    }
+
+    // lego_loam/gpu/enable为true且编译时打开了USE_CUDA时使用CUDA后端，没有可用的设备时回退到CPU
+    void initGpuBackend(){
+        ros::NodeHandle pnh("lego_loam/gpu");
+        bool enable;
+        pnh.param<bool>("enable", enable, gpuBackendFlag);
+        if (enable == false)
+            return;
+#ifdef LEGO_LOAM_CUDA
+        RangeImageGpu::Params params;
+        params.rows = N_SCAN;
+        params.cols = Horizon_SCAN;
+        params.useRing = useCloudRing;
+        params.angBottom = ang_bottom;
+        params.angResX = ang_res_x;
+        params.angResY = ang_res_y;
+        params.minRange = sensorMinimumRange;
+        params.groundScanInd = groundScanInd;
+        params.mountAngle = sensorMountAngle;
+        params.segmentTheta = segmentTheta;
+        params.alphaX = segmentAlphaX;
+        params.alphaY = segmentAlphaY;
+        rangeImageGpu.reset(new RangeImageGpu(params));
+        if (rangeImageGpu->ok() == false){
+            ROS_WARN("CUDA backend unavailable (%s), range image is computed on CPU.", rangeImageGpu->error().c_str());
+            rangeImageGpu.reset();
+        }
+#else
+        ROS_WARN("lego_loam/gpu/enable is set but this build has no CUDA support (USE_CUDA=OFF), range image is computed on CPU.");
+#endif
     }
 
     // 初始化各类参数以及分配内存
     void allocateMemory(){
 
-        laserCloudIn.reset(new pcl::PointCloud<PointType>());
-        laserCloudInRing.reset(new pcl::PointCloud<PointXYZIR>());
-
         fullCloud.reset(new pcl::PointCloud<PointType>());
         fullInfoCloud.reset(new pcl::PointCloud<PointType>());
 
         groundCloud.reset(new pcl::PointCloud<PointType>());
-        segmentedCloud.reset(new pcl::PointCloud<PointType>());
         segmentedCloudPure.reset(new pcl::PointCloud<PointType>());
-        outlierCloud.reset(new pcl::PointCloud<PointType>());
 
         fullCloud->points.resize(N_SCAN*Horizon_SCAN);      // 每一帧激光雷达点云的总点数 = 激光雷达线数 * 每线激光点数 
         fullInfoCloud->points.resize(N_SCAN*Horizon_SCAN);  // 16 * 1800 = 28800
 
+        rangeMat.create(N_SCAN, Horizon_SCAN, CV_32F);
+        groundMat.create(N_SCAN, Horizon_SCAN, CV_8S);
+        labelMat.create(N_SCAN, Horizon_SCAN, CV_32S);
+
         segMsg.startRingIndex.assign(N_SCAN, 0); // 里面存储的是在分割点云中每线scan激光开始的索引，因为完整的一帧点云现在是一维形式表示
         segMsg.endRingIndex.assign(N_SCAN, 0);   // 里面存储的是在分割点云中每线scan激光结束的索引
 
@@ -131,75 +199,114 @@ public:
         segMsg.segmentedCloudColInd.assign(N_SCAN*Horizon_SCAN, 0); // 点在距离图像中的列索引
         segMsg.segmentedCloudRange.assign(N_SCAN*Horizon_SCAN, 0);
 
-		// labelComponents函数中用到了这个矩阵
-		// 该矩阵用于求某个点的上下左右4个邻接点
-        std::pair<int8_t, int8_t> neighbor;
-        neighbor.first = -1; neighbor.second =  0; neighborIterator.push_back(neighbor);
-        neighbor.first =  0; neighbor.second =  1; neighborIterator.push_back(neighbor);
-        neighbor.first =  0; neighbor.second = -1; neighborIterator.push_back(neighbor);
-        neighbor.first =  1; neighbor.second =  0; neighborIterator.push_back(neighbor);
-
-        allPushedIndX = new uint16_t[N_SCAN*Horizon_SCAN];
-        allPushedIndY = new uint16_t[N_SCAN*Horizon_SCAN];
-
-        queueIndX = new uint16_t[N_SCAN*Horizon_SCAN];
-        queueIndY = new uint16_t[N_SCAN*Horizon_SCAN];
+        segParent.resize(N_SCAN*Horizon_SCAN);
+        segSize.resize(N_SCAN*Horizon_SCAN);
+        segLastRow.resize(N_SCAN*Horizon_SCAN);
+        segLineCount.resize(N_SCAN*Horizon_SCAN);
+        segLabel.resize(N_SCAN*Horizon_SCAN);
     }
 
     // 初始化/重置各类参数内容
     void resetParameters(){
-        laserCloudIn->clear();
+        laserCloudMsgIn.reset();
         groundCloud->clear();
-        segmentedCloud->clear();
         segmentedCloudPure->clear();
-        outlierCloud->clear();
+        // segmentedCloud和outlierCloud发布后由订阅者持有，下一帧从池中取出订阅者已经释放的点云
+        segmentedCloud = publishedCloudPool.acquire();
+        outlierCloud = publishedCloudPool.acquire();
 
-        rangeMat = cv::Mat(N_SCAN, Horizon_SCAN, CV_32F, cv::Scalar::all(FLT_MAX));
-        groundMat = cv::Mat(N_SCAN, Horizon_SCAN, CV_8S, cv::Scalar::all(0));
-        labelMat = cv::Mat(N_SCAN, Horizon_SCAN, CV_32S, cv::Scalar::all(0));
         labelCount = 1;
 
+        if (rangeImageOnGpu == false)
+            resetRangeImage();
+        rangeImageOnGpu = false;
+    }
+
+    // 距离图像和投影点云填充初值，矩阵在allocateMemory中分配，这里只重置内容
+    void resetRangeImage(){
+        rangeMat.setTo(cv::Scalar::all(FLT_MAX));
+        groundMat.setTo(cv::Scalar::all(0));
+        labelMat.setTo(cv::Scalar::all(0));
+
         std::fill(fullCloud->points.begin(), fullCloud->points.end(), nanPoint);    // 分配初值
         std::fill(fullInfoCloud->points.begin(), fullInfoCloud->points.end(), nanPoint);
     }
 
     ~ImageProjection(){}
 
-    void copyPointCloud(const sensor_msgs::PointCloud2ConstPtr& laserCloudMsg){
+    // 不再调用pcl::fromROSMsg，只解析字段偏移并找到首尾有效点，点的读取在projectPointCloud中完成
+    // 点云中没有有效点或消息格式不对时返回false
+    bool copyPointCloud(const sensor_msgs::PointCloud2ConstPtr& laserCloudMsg){
         
         cloudHeader = laserCloudMsg->header;
         // cloudHeader.stamp = ros::Time::now(); // Ouster lidar users may need to uncomment this line
-        // 将ROS中的sensor_msgs::PointCloud2ConstPtr类型转换到pcl点云库指针
-        pcl::fromROSMsg(*laserCloudMsg, *laserCloudIn);
-        // Remove Nan points
-        std::vector<int> indices;
-        pcl::removeNaNFromPointCloud(*laserCloudIn, *laserCloudIn, indices);
+        laserCloudMsgIn = laserCloudMsg;
+
+        if (cloudReader.resolve(*laserCloudMsgIn) == false){
+            ROS_ERROR("Point cloud has no x/y/z fields!");
+            ros::shutdown();
+            return false;
+        }
         // have "ring" channel in the cloud
-        if (useCloudRing == true){
-            pcl::fromROSMsg(*laserCloudMsg, *laserCloudInRing);
-            if (laserCloudInRing->is_dense == false) { // 是否有无效点
-                ROS_ERROR("Point cloud is not in dense format, please remove NaN points first!");
-                ros::shutdown();
-            }  
+        if (useCloudRing == true && cloudReader.hasRing() == false){
+            ROS_ERROR("Point cloud has no \"ring\" field, please set useCloudRing to false!");
+            ros::shutdown();
+            return false;
         }
+        // 截断或格式不对的消息只丢弃这一帧
+        if (cloudReader.validate(*laserCloudMsgIn) == false)
+            return false;
+
+        // NaN点在投影时直接跳过(等价于removeNaNFromPointCloud)，ring与坐标取自同一个点，不存在索引错位
+        size_t cloudSize = cloudReader.size(*laserCloudMsgIn);
+        size_t first = 0;
+        while (first < cloudSize && !cloudReader.getPoint(cloudReader.pointData(*laserCloudMsgIn, first), cloudFirstPoint))
+            ++first;
+        if (first == cloudSize)
+            return false;
+        size_t last = cloudSize - 1;
+        while (last > first && !cloudReader.getPoint(cloudReader.pointData(*laserCloudMsgIn, last), cloudLastPoint))
+            --last;
+        if (last == first)
+            cloudLastPoint = cloudFirstPoint;
+        return true;
     }
     
     void cloudHandler(const sensor_msgs::PointCloud2ConstPtr& laserCloudMsg){
 
-        // 1. Convert ros message to pcl point cloud，将ROS信息转化为pcl点云
-        copyPointCloud(laserCloudMsg);
+        metrics.publishIfDue();
+        stamp = laserCloudMsg->header.stamp.toSec();
+        ScopedTimer timer(metrics, "cloudHandler", stamp);
+
+        // 1. Convert ros message to pcl point cloud，解析ROS点云消息
+        bool valid;
+        {
+            ScopedTimer timer(metrics, "copyPointCloud", stamp);
+            valid = copyPointCloud(laserCloudMsg);
+        }
+        if (valid == false){
+            metrics.increment("empty clouds", 1, true);
+            resetParameters();
+            return;
+        }
         // 2. Start and end angle of a scan，计算扫描的初始和结束的方位角
         findStartEndAngle();
-        // 3. Range image projection，投影至距离图像
-        projectPointCloud();
-        // 4. Mark ground points，标记地面点
-        groundRemoval();
-        // 5. Point cloud segmentation，点云分割
-        cloudSegmentation();
+        // 3-5. 投影至距离图像、标记地面点、点云分割
+        processRangeImage();
         // 6. Publish all clouds，发布所有点云信息
-        publishCloud();
+        {
+            ScopedTimer timer(metrics, "publishCloud", stamp);
+            publishCloud();
+        }
+        metrics.addValue("input points", cloudReader.size(*laserCloudMsgIn));
+        metrics.addValue("segmented points", segmentedCloud->points.size());
+        metrics.addValue("outlier points", outlierCloud->points.size());
+        metrics.setCounter("cloud pool allocations", publishedCloudPool.allocations());
         // 7. Reset parameters for next iteration，重置参数
-        resetParameters();
+        {
+            ScopedTimer timer(metrics, "resetParameters", stamp);
+            resetParameters();
+        }
     }
 
     void findStartEndAngle(){
@@ -210,9 +317,9 @@ public:
         // 因为内部雷达旋转方向(顺时针)原因，所以atan2(..)函数前面需要加一个负号，转化为逆时针方向
 
         // start and end orientation of this cloud
-        segMsg.startOrientation = -atan2(laserCloudIn->points[0].y, laserCloudIn->points[0].x);
-        segMsg.endOrientation   = -atan2(laserCloudIn->points[laserCloudIn->points.size() - 1].y,// +2pi与初始角区别
-                                                     laserCloudIn->points[laserCloudIn->points.size() - 1].x) + 2 * M_PI;
+        segMsg.startOrientation = -atan2(cloudFirstPoint.y, cloudFirstPoint.x);
+        segMsg.endOrientation   = -atan2(cloudLastPoint.y,// +2pi与初始角区别
+                                         cloudLastPoint.x) + 2 * M_PI;
 		// 开始和结束的角度差一般是多少？
 		// 一个velodyne 雷达数据包转过的角度多大？
         // 雷达一般包含的是一圈的数据，所以角度差一般是2*PI，一个数据包转过360度
@@ -229,22 +336,115 @@ public:
         segMsg.orientationDiff = segMsg.endOrientation - segMsg.startOrientation;
     }
 
+    // 距离图像的尺寸在启动时从参数读取，常见雷达的尺寸在编译期实例化，
+    // 循环边界和行列索引(j + i*cols)成为常量，编译器可以展开和向量化；其他尺寸使用<0, 0>的运行时版本
+    void processRangeImage(){
+        if (N_SCAN == 16 && Horizon_SCAN == 1800)         // VLP-16
+            processRangeImage<16, 1800>();
+        else if (N_SCAN == 32 && Horizon_SCAN == 1800)    // HDL-32E
+            processRangeImage<32, 1800>();
+        else if (N_SCAN == 128 && Horizon_SCAN == 1800)   // VLS-128
+            processRangeImage<128, 1800>();
+        else if (N_SCAN == 16 && Horizon_SCAN == 1024)    // Ouster OS1-16
+            processRangeImage<16, 1024>();
+        else if (N_SCAN == 64 && Horizon_SCAN == 1024)    // Ouster OS1-64
+            processRangeImage<64, 1024>();
+        else
+            processRangeImage<0, 0>();
+    }
+
+    template <int Rows, int Cols>
+    void processRangeImage(){
+#ifdef LEGO_LOAM_CUDA
+        if (rangeImageGpu && processRangeImageGpu<Rows, Cols>())
+            return;
+#endif
+        // 3. Range image projection，投影至距离图像
+        {
+            ScopedTimer timer(metrics, "projectPointCloud", stamp);
+            projectPointCloud<Rows, Cols>();
+        }
+        // 4. Mark ground points，标记地面点
+        {
+            ScopedTimer timer(metrics, "groundRemoval", stamp);
+            groundRemoval<Rows, Cols>();
+        }
+        // 5. Point cloud segmentation，点云分割
+        {
+            ScopedTimer timer(metrics, "cloudSegmentation", stamp);
+            cloudSegmentation<Rows, Cols>();
+        }
+    }
+
+#ifdef LEGO_LOAM_CUDA
+    // 3-5在GPU上完成投影、地面标记和连通域合并(见rangeImageGpu.h)，聚类的取舍、标签分配和分割点云的提取与CPU版本共用
+    // 设备出错时重置距离图像并返回false，本帧及之后的帧都回退到CPU
+    template <int Rows, int Cols>
+    bool processRangeImageGpu(){
+        static_assert(sizeof(PointType) == 8 * sizeof(float), "RangeImageGpu writes each point as 8 floats");
+
+        RangeImageGpu::Layout layout;
+        cloudReader.getLayout(layout.offset, layout.datatype);
+        layout.width = laserCloudMsgIn->width;
+        layout.height = laserCloudMsgIn->height;
+        layout.pointStep = laserCloudMsgIn->point_step;
+        layout.rowStep = laserCloudMsgIn->row_step;
+
+        RangeImageGpu::Output output;
+        output.range = rangeMat.ptr<float>(0);
+        output.ground = groundMat.ptr<int8_t>(0);
+        output.label = labelMat.ptr<int>(0);
+        output.component = segParent.data();
+        output.fullCloud = reinterpret_cast<float*>(fullCloud->points.data());
+        output.fullInfoCloud = reinterpret_cast<float*>(fullInfoCloud->points.data());
+
+        bool success;
+        int iterations = 0;
+        {
+            ScopedTimer timer(metrics, "gpuRangeImage", stamp);
+            success = rangeImageGpu->process(laserCloudMsgIn->data.data(), laserCloudMsgIn->data.size(),
+                                             layout, output, iterations);
+        }
+        if (success == false){
+            ROS_ERROR("CUDA backend failed (%s), falling back to CPU.", rangeImageGpu->error().c_str());
+            metrics.increment("gpu failures", 1, true);
+            rangeImageGpu.reset();
+            resetRangeImage();
+            return false;
+        }
+        rangeImageOnGpu = true;
+        metrics.addValue("gpu segmentation iterations", iterations);
+
+        extractGroundCloud<Rows, Cols>();
+        {
+            ScopedTimer timer(metrics, "cloudSegmentation", stamp);
+            assignSegmentLabels<Rows, Cols>();
+            extractSegmentedCloud<Rows, Cols>();
+        }
+        return true;
+    }
+#endif
+
+    template <int Rows, int Cols>
     void projectPointCloud(){
+        const int rows = Rows > 0 ? Rows : N_SCAN;
+        const int cols = Cols > 0 ? Cols : Horizon_SCAN;
         // range image projection
         float verticalAngle, horizonAngle, range;
         size_t rowIdn, columnIdn, index, cloudSize; 
         PointType thisPoint;
 
-        cloudSize = laserCloudIn->points.size(); // 原始点云中点的数目
+        cloudSize = cloudReader.size(*laserCloudMsgIn); // 原始点云中点的数目
 
         for (size_t i = 0; i < cloudSize; ++i){
+            // 直接从消息的字节缓存中读取，跳过NaN点
             // 这里还处于前左上的右手坐标系(安装好的雷达坐标系)
-            thisPoint.x = laserCloudIn->points[i].x;
-            thisPoint.y = laserCloudIn->points[i].y;
-            thisPoint.z = laserCloudIn->points[i].z;
+            const uint8_t *pointPtr = cloudReader.pointData(*laserCloudMsgIn, i);
+            if (cloudReader.getPoint(pointPtr, thisPoint) == false)
+                continue;
             // find the row and column index in the iamge for this point
             if (useCloudRing == true){
-                rowIdn = laserCloudInRing->points[i].ring; // VLP-16 数据格式中的ring值，即第几根线(从下至上)
+                rowIdn = cloudReader.getRing(pointPtr); // VLP-16 数据格式中的ring值，即第几根线(从下至上)
             }
             else{
                 // 计算竖直方向上的角度，雷达的第几线
@@ -253,7 +453,7 @@ public:
                 verticalAngle = atan2(thisPoint.z, sqrt(thisPoint.x * thisPoint.x + thisPoint.y * thisPoint.y)) * 180 / M_PI;
                 rowIdn = (verticalAngle + ang_bottom) / ang_res_y;
             }
-            if (rowIdn < 0 || rowIdn >= N_SCAN)
+            if (rowIdn < 0 || rowIdn >= rows)
                 continue;
             
             // atan2(y,x)函数的返回值范围(-PI,PI],表示复数x+yi的幅角
@@ -277,9 +477,9 @@ public:
             //             | y-
             // (-pi) 5/4*H   H/4  (pi)
             //
-            columnIdn = -round((horizonAngle-90.0)/ang_res_x) + Horizon_SCAN/2;
-            if (columnIdn >= Horizon_SCAN) 
-                columnIdn -= Horizon_SCAN;
+            columnIdn = -round((horizonAngle-90.0)/ang_res_x) + cols/2;
+            if (columnIdn >= cols) 
+                columnIdn -= cols;
             // 经过上面columnIdn -= Horizon_SCAN的变换后的columnIdn分布：
             //          3/4*H
             //          | y+
@@ -289,7 +489,7 @@ public:
             //          | y-
             //         H/4
             //
-            if (columnIdn < 0 || columnIdn >= Horizon_SCAN)
+            if (columnIdn < 0 || columnIdn >= cols)
                 continue;
             // 激光雷达测得的距离值
             range = sqrt(thisPoint.x * thisPoint.x + thisPoint.y * thisPoint.y + thisPoint.z * thisPoint.z);
@@ -301,7 +501,7 @@ public:
             // columnIdn:[0,H] (H:Horizon_SCAN)==>[0,1800] 用行列号的组合代替强度值
             thisPoint.intensity = (float)rowIdn + (float)columnIdn / 10000.0;
 
-            index = columnIdn  + rowIdn * Horizon_SCAN; // 当前点在一维点云中的索引(按行存储，且按照线号从小到大排)
+            index = columnIdn  + rowIdn * cols; // 当前点在一维点云中的索引(按行存储，且按照线号从小到大排)
             fullCloud->points[index] = thisPoint;
             fullInfoCloud->points[index] = thisPoint;
             fullInfoCloud->points[index].intensity = range; // the corresponding range of a point is saved as "intensity"
@@ -309,18 +509,21 @@ public:
     }
 
 
+    template <int Rows, int Cols>
     void groundRemoval(){
+        const int rows = Rows > 0 ? Rows : N_SCAN;
+        const int cols = Cols > 0 ? Cols : Horizon_SCAN;
         size_t lowerInd, upperInd;
         float diffX, diffY, diffZ, angle;
         // groundMat
         // -1, no valid info to check if ground of not
         //  0, initial value, after validation, means not ground ，这里是初始化参数的时候赋值的
         //  1, ground
-        for (size_t j = 0; j < Horizon_SCAN; ++j){
+        for (size_t j = 0; j < cols; ++j){
             for (size_t i = 0; i < groundScanInd; ++i){
 
-                lowerInd = j + ( i )*Horizon_SCAN; // 当前层的点
-                upperInd = j + (i+1)*Horizon_SCAN; // 上一层的点
+                lowerInd = j + ( i )*cols; // 当前层的点
+                upperInd = j + (i+1)*cols; // 上一层的点
 
                 // 初始化的时候用nanPoint.intensity = -1 填充，进入该语句则证明是空点nanPoint，即没有测量值
                 if (fullCloud->points[lowerInd].intensity == -1 ||
@@ -350,42 +553,53 @@ public:
         // note that ground remove is from 0~N_SCAN-1, need rangeMat for mark label matrix for the 16th scan
 		// 找到所有点中的地面点或者距离为FLT_MAX(rangeMat的初始值)的点，并将他们标记为-1
 		// rangeMat[i][j]==FLT_MAX，代表的含义是什么？ 无效点
-        for (size_t i = 0; i < N_SCAN; ++i){
-            for (size_t j = 0; j < Horizon_SCAN; ++j){
+        for (size_t i = 0; i < rows; ++i){
+            for (size_t j = 0; j < cols; ++j){
                 if (groundMat.at<int8_t>(i,j) == 1 || rangeMat.at<float>(i,j) == FLT_MAX){
                     labelMat.at<int>(i,j) = -1; // 地面点和无效点不用于下一步的分割
                 }
             }
         }
 
+        extractGroundCloud<Rows, Cols>();
+    }
+
+    template <int Rows, int Cols>
+    void extractGroundCloud(){
+        const int cols = Cols > 0 ? Cols : Horizon_SCAN;
 		// 如果有节点订阅groundCloud，那么就需要把地面点发布出来
 		// 具体实现过程：把点放到groundCloud队列中去
         if (pubGroundCloud.getNumSubscribers() != 0){ // 可以略去这个条件直接发布
             for (size_t i = 0; i <= groundScanInd; ++i){
-                for (size_t j = 0; j < Horizon_SCAN; ++j){
+                for (size_t j = 0; j < cols; ++j){
                     if (groundMat.at<int8_t>(i,j) == 1)
-                        groundCloud->push_back(fullCloud->points[j + i*Horizon_SCAN]);
+                        groundCloud->push_back(fullCloud->points[j + i*cols]);
                 }
             }
         }
     }
 
+    template <int Rows, int Cols>
     void cloudSegmentation(){
         // segmentation process
-        for (size_t i = 0; i < N_SCAN; ++i)
-            for (size_t j = 0; j < Horizon_SCAN; ++j)
-				// 如果labelMat[i][j]=0,表示没有对该点进行过分类，需要对该点进行聚类
-                if (labelMat.at<int>(i,j) == 0) // 因为上一步提取地面特征的时候，对地面点和无效点作了标记，不用于点云分割
-                    labelComponents(i, j);
+        // 对labelMat[i][j]=0的点进行聚类，上一步提取地面特征的时候，对地面点和无效点作了标记(-1)，不用于点云分割
+        labelComponents<Rows, Cols>();
+
+        extractSegmentedCloud<Rows, Cols>();
+    }
 
+    template <int Rows, int Cols>
+    void extractSegmentedCloud(){
+        const int rows = Rows > 0 ? Rows : N_SCAN;
+        const int cols = Cols > 0 ? Cols : Horizon_SCAN;
         int sizeOfSegCloud = 0;
         // extract segmented cloud for lidar odometry
-        for (size_t i = 0; i < N_SCAN; ++i) {
+        for (size_t i = 0; i < rows; ++i) {
 			// segMsg.startRingIndex[i]， segMsg.endRingIndex[i] 分别表示一帧点云中第i线的起始序列和终止序列(id)
 			// 以开始线后的第5个点为开始，以结束线前的第5个点为结束，这是因为后面要计算粗糙度(曲率)来进行特征(边缘点或者平面点)提取
             segMsg.startRingIndex[i] = sizeOfSegCloud-1 + 5;
 
-            for (size_t j = 0; j < Horizon_SCAN; ++j) {
+            for (size_t j = 0; j < cols; ++j) {
                 // 找到可用的特征点或者地面点(不选择labelMat[i][j]=0的点)
                 if (labelMat.at<int>(i,j) > 0 || groundMat.at<int8_t>(i,j) == 1){
 					// labelMat数值为999999表示这个点是因为聚类数量不够30而被舍弃的点
@@ -394,7 +608,7 @@ public:
                     // outliers that will not be used for optimization (always continue)，离群点不参与优化
                     if (labelMat.at<int>(i,j) == 999999){
                         if (i > groundScanInd && j % 5 == 0){
-                            outlierCloud->push_back(fullCloud->points[j + i*Horizon_SCAN]);
+                            outlierCloud->push_back(fullCloud->points[j + i*cols]);
                             continue;
                         }else{
                             continue;
@@ -403,7 +617,7 @@ public:
                     // 如果是地面点,对于列数不为5的倍数的，直接跳过不处理
                     // majority of ground points are skipped ，只保留小部分的地面点
                     if (groundMat.at<int8_t>(i,j) == 1){
-                        if (j%5!=0 && j>5 && j<Horizon_SCAN-5)
+                        if (j%5!=0 && j>5 && j<cols-5)
                             continue;
                     }
 					
@@ -419,7 +633,7 @@ public:
                     // save range info
                     segMsg.segmentedCloudRange[sizeOfSegCloud]  = rangeMat.at<float>(i,j);
                     // save seg cloud
-                    segmentedCloud->push_back(fullCloud->points[j + i*Horizon_SCAN]);
+                    segmentedCloud->push_back(fullCloud->points[j + i*cols]);
                     // size of seg cloud
                     ++sizeOfSegCloud;
                 }
@@ -430,11 +644,11 @@ public:
 		// 如果有节点订阅SegmentedCloudPure, 那么把点云数据保存到segmentedCloudPure中去        
         // extract segmented cloud for visualization
         if (pubSegmentedCloudPure.getNumSubscribers() != 0){
-            for (size_t i = 0; i < N_SCAN; ++i){
-                for (size_t j = 0; j < Horizon_SCAN; ++j){
+            for (size_t i = 0; i < rows; ++i){
+                for (size_t j = 0; j < cols; ++j){
                     // 选择非地面点(labelMat[i][j]!=-1)和没被舍弃的点
                     if (labelMat.at<int>(i,j) > 0 && labelMat.at<int>(i,j) != 999999){
-                        segmentedCloudPure->push_back(fullCloud->points[j + i*Horizon_SCAN]);
+                        segmentedCloudPure->push_back(fullCloud->points[j + i*cols]);
                         segmentedCloudPure->points.back().intensity = labelMat.at<int>(i,j);// 聚类标签
                     }
                 }
@@ -442,133 +656,175 @@ public:
         }
     }
 
-    void labelComponents(int row, int col){
-        // use std::queue std::vector std::deque will slow the program down greatly
-        float d1, d2, alpha, angle;
-        int fromIndX, fromIndY, thisIndX, thisIndY; 
-        bool lineCountFlag[N_SCAN] = {false};
-
-        queueIndX[0] = row;
-        queueIndY[0] = col;
-        int queueSize = 1;
-        int queueStartInd = 0;
-        int queueEndInd = 1;
-
-        allPushedIndX[0] = row;
-        allPushedIndY[0] = col;
-        int allPushedIndSize = 1;
-
-        // 标准的BFS(广度优先搜索)
-        // BFS的作用是以(row，col)为中心向外面扩散，判断(row,col)是否是这个平面中一点        
-        while(queueSize > 0){
-            // Pop point
-            fromIndX = queueIndX[queueStartInd]; // 当前选定点
-            fromIndY = queueIndY[queueStartInd];
-            --queueSize;
-            ++queueStartInd;
-            // Mark popped point，labelCount的初始值为1，后面会递增
-            labelMat.at<int>(fromIndX, fromIndY) = labelCount;
-
-			// neighbor=[[-1,0];[0,1];[0,-1];[1,0]] ， 遍历点[fromIndX,fromIndY]边上的四个邻点
-            // Loop through all the neighboring grids of popped grid，neighborIterator的格式为 std::vector<std::pair<int8_t, int8_t> >
-            for (auto iter = neighborIterator.begin(); iter != neighborIterator.end(); ++iter){
-                // new index，选定点附近近邻点的索引
-                thisIndX = fromIndX + (*iter).first;
-                thisIndY = fromIndY + (*iter).second;
-                // index should be within the boundary
-                if (thisIndX < 0 || thisIndX >= N_SCAN)
+    // 并查集：查找根节点，同时进行路径减半
+    int findSegment(int ind){
+        while (segParent[ind] != ind){
+            segParent[ind] = segParent[segParent[ind]];
+            ind = segParent[ind];
+        }
+        return ind;
+    }
+
+    // 合并两个聚类，索引较小的根节点作为新的根节点
+    void uniteSegment(int indA, int indB){
+        int rootA = findSegment(indA);
+        int rootB = findSegment(indB);
+        if (rootA < rootB)
+            segParent[rootB] = rootA;
+        else if (rootB < rootA)
+            segParent[rootA] = rootB;
+    }
+
+    // 判断两个相邻点是否属于同一个聚类
+    // alpha代表角度分辨率，同一线上的相邻点为segmentAlphaX(rad)，上下两线的相邻点为segmentAlphaY(rad)
+    // atan2(y,x)的值越大，d1，d2之间的差距越小,越平坦，大于segmentTheta(60度)则认为是同一个平面
+    bool isSameSegment(float rangeA, float rangeB, float alpha) const {
+        float d1 = std::max(rangeA, rangeB);
+        float d2 = std::min(rangeA, rangeB);
+        float angle = atan2(d2*sin(alpha), (d1 -d2*cos(alpha)));
+        return angle > segmentTheta;
+    }
+
+    // 距离图像的连通域标记
+    // 原来对每个未标记的点做一次BFS，只能串行执行；这里把距离图像按线分成numberOfCores段，每个线程在段内用并查集合并相邻点，
+    // 再串行合并段与段之间的边界，最后按行优先顺序统计每个聚类并分配标签
+    // 连通条件(isSameSegment)、距离图像左右连通、聚类的取舍条件和标签顺序都与原来的BFS相同，得到的labelMat完全一致
+    template <int Rows, int Cols>
+    void labelComponents(){
+        unionSegments<Rows, Cols>();
+        assignSegmentLabels<Rows, Cols>();
+    }
+
+    // 第1、2步：合并相连的点，CUDA后端在设备上完成这一步，直接写入segParent
+    template <int Rows, int Cols>
+    void unionSegments(){
+        const int rows = Rows > 0 ? Rows : N_SCAN;
+        const int cols = Cols > 0 ? Cols : Horizon_SCAN;
+        const int bands = std::min(numberOfCores, rows);
+
+        // 1. 段内合并：每一段只访问自己的点，根节点也在段内，线程之间没有数据竞争
+        #pragma omp parallel for num_threads(numberOfCores) schedule(static)
+        for (int b = 0; b < bands; ++b){
+            const int rowStart = b * rows / bands;
+            const int rowEnd = (b + 1) * rows / bands;
+
+            for (int ind = rowStart * cols; ind < rowEnd * cols; ++ind)
+                segParent[ind] = ind;
+
+            for (int i = rowStart; i < rowEnd; ++i){
+                const int *labelRow = labelMat.ptr<int>(i);
+                const float *rangeRow = rangeMat.ptr<float>(i);
+                for (int j = 0; j < cols; ++j){
+                    if (labelRow[j] != 0)
+                        continue;
+                    // 同一线上右侧的邻点，距离图像是环状的，左右连通
+                    int right = (j + 1 == cols) ? 0 : j + 1;
+                    if (labelRow[right] == 0 && isSameSegment(rangeRow[j], rangeRow[right], segmentAlphaX))
+                        uniteSegment(j + i*cols, right + i*cols);
+                    // 上一线的邻点，段的最后一线留到第2步处理
+                    if (i + 1 < rowEnd && labelMat.ptr<int>(i+1)[j] == 0 &&
+                        isSameSegment(rangeRow[j], rangeMat.ptr<float>(i+1)[j], segmentAlphaY))
+                        uniteSegment(j + i*cols, j + (i+1)*cols);
+                }
+            }
+        }
+
+        // 2. 合并段与段之间的边界
+        for (int b = 1; b < bands; ++b){
+            const int i = b * rows / bands - 1;
+            const int *labelRow = labelMat.ptr<int>(i);
+            const int *labelRowUp = labelMat.ptr<int>(i+1);
+            const float *rangeRow = rangeMat.ptr<float>(i);
+            const float *rangeRowUp = rangeMat.ptr<float>(i+1);
+            for (int j = 0; j < cols; ++j)
+                if (labelRow[j] == 0 && labelRowUp[j] == 0 && isSameSegment(rangeRow[j], rangeRowUp[j], segmentAlphaY))
+                    uniteSegment(j + i*cols, j + (i+1)*cols);
+        }
+    }
+
+    // 第3、4步：统计聚类、分配标签并写回labelMat，segParent中labelMat为0的点的根节点是聚类中按行优先顺序的第一个点
+    template <int Rows, int Cols>
+    void assignSegmentLabels(){
+        const int rows = Rows > 0 ? Rows : N_SCAN;
+        const int cols = Cols > 0 ? Cols : Horizon_SCAN;
+
+        // 3. 按行优先顺序统计每个聚类的点数和线数，根节点是聚类中第一个被访问的点(即原来BFS的起始点)
+        // 原来的BFS只对新加入的点标记所在的线，起始点所在的线只有在同一线上还有其他点时才计入，这里保持一致
+        for (int i = 0; i < rows; ++i){
+            const int *labelRow = labelMat.ptr<int>(i);
+            for (int j = 0; j < cols; ++j){
+                if (labelRow[j] != 0)
                     continue;
-                // at range image margin (left or right side)，是个环状的图片，左右连通 ，类似于卷纸的原理
-                if (thisIndY < 0)
-                    thisIndY = Horizon_SCAN - 1;
-                if (thisIndY >= Horizon_SCAN)
-                    thisIndY = 0;
-
-				// 如果点[thisIndX,thisIndY]已经标记过
-				// labelMat中，-1代表无效点，0代表未进行标记过，其余为其他的标记
-				// 如果当前的邻点已经标记过，则跳过该点。
-				// 如果labelMat已经标记为正整数，则已经聚类完成，不需要再次对该点聚类
-                // prevent infinite loop (caused by put already examined point back)
-                if (labelMat.at<int>(thisIndX, thisIndY) != 0)
+                int ind = j + i*cols;
+                int root = findSegment(ind);
+                segParent[ind] = root; // 压缩成一层，第4步中只读
+                if (root == ind){
+                    segSize[root] = 1;
+                    segLastRow[root] = -1;
+                    segLineCount[root] = 0;
                     continue;
-
-                d1 = std::max(rangeMat.at<float>(fromIndX, fromIndY), 
-                              rangeMat.at<float>(thisIndX, thisIndY));
-                d2 = std::min(rangeMat.at<float>(fromIndX, fromIndY), 
-                              rangeMat.at<float>(thisIndX, thisIndY));
-
-
-				// alpha代表角度分辨率，
-				// X方向上角度分辨率是segmentAlphaX(rad)
-				// Y方向上角度分辨率是segmentAlphaY(rad)
-                if ((*iter).first == 0) // 此时是查询同一线上的相邻点
-                    alpha = segmentAlphaX;
-                else
-                    alpha = segmentAlphaY;
-
-				// 通过下面的公式计算这两点之间是否有平面特征
-				// atan2(y,x)的值越大，d1，d2之间的差距越小,越平坦
-                angle = atan2(d2*sin(alpha), (d1 -d2*cos(alpha)));
-
-                if (angle > segmentTheta){
-					// segmentTheta=1.0472<==>60度
-					// 如果算出角度大于60度，则假设这是个平面
-                    queueIndX[queueEndInd] = thisIndX;
-                    queueIndY[queueEndInd] = thisIndY;
-                    ++queueSize;
-                    ++queueEndInd;
-
-                    labelMat.at<int>(thisIndX, thisIndY) = labelCount;
-                    lineCountFlag[thisIndX] = true;
-
-                    allPushedIndX[allPushedIndSize] = thisIndX;
-                    allPushedIndY[allPushedIndSize] = thisIndY;
-                    ++allPushedIndSize;
+                }
+                ++segSize[root];
+                if (segLastRow[root] != i){
+                    segLastRow[root] = i;
+                    ++segLineCount[root];
                 }
             }
         }
 
         // check if this segment is valid
-        bool feasibleSegment = false;
         // 如果聚类超过30个点，直接标记为一个可用聚类，labelCount需要递增
-        if (allPushedIndSize >= 30)
-            feasibleSegment = true;
-        else if (allPushedIndSize >= segmentValidPointNum){
-            // 如果聚类点数小于30大于等于5，统计竖直方向上的聚类点数
-            int lineCount = 0;
-            for (size_t i = 0; i < N_SCAN; ++i)
-                if (lineCountFlag[i] == true)
-                    ++lineCount;
-            if (lineCount >= segmentValidLineNum) // 竖直方向上超过3个也将它标记为有效聚类
-                feasibleSegment = true;            
-        }
-        // segment is valid, mark these points
-        if (feasibleSegment == true){
-            ++labelCount;
-        }else{ // segment is invalid, mark these points
-            for (size_t i = 0; i < allPushedIndSize; ++i){
-                labelMat.at<int>(allPushedIndX[i], allPushedIndY[i]) = 999999; // 标记为999999的是需要舍弃的聚类的点，因为他们的数量小于30个
+        // 如果聚类点数小于30大于等于5，竖直方向上超过3个也将它标记为有效聚类
+        // 否则标记为999999，是需要舍弃的聚类的点
+        // 按根节点的顺序分配标签，与原来逐个起始点进行BFS得到的标签相同
+        for (int i = 0; i < rows; ++i){
+            const int *labelRow = labelMat.ptr<int>(i);
+            for (int j = 0; j < cols; ++j){
+                int ind = j + i*cols;
+                if (labelRow[j] != 0 || segParent[ind] != ind)
+                    continue;
+                bool feasibleSegment = false;
+                if (segSize[ind] >= 30)
+                    feasibleSegment = true;
+                else if (segSize[ind] >= segmentValidPointNum && segLineCount[ind] >= segmentValidLineNum)
+                    feasibleSegment = true;
+                segLabel[ind] = feasibleSegment ? labelCount++ : 999999;
             }
         }
+
+        // 4. 写回labelMat
+        #pragma omp parallel for num_threads(numberOfCores) schedule(static)
+        for (int i = 0; i < rows; ++i){
+            int *labelRow = labelMat.ptr<int>(i);
+            for (int j = 0; j < cols; ++j)
+                if (labelRow[j] == 0)
+                    labelRow[j] = segLabel[segParent[j + i*cols]];
+        }
     }
 
     
     void publishCloud(){
         // 1. Publish Seg Cloud Info
         segMsg.header = cloudHeader;
-        pubSegmentedCloudInfo.publish(segMsg);
+        if (compactCloud == true){
+            encodeCompactCloud(*segmentedCloud, segMsg, compactMsg);
+            pubCompactCloud.publish(compactMsg);
+            metrics.addValue("compact cloud bytes", compactMsg.data.size());
+        }
+        if (compactCloud == false || pubSegmentedCloudInfo.getNumSubscribers() != 0)
+            pubSegmentedCloudInfo.publish(segMsg);
         // 2. Publish clouds
         sensor_msgs::PointCloud2 laserCloudTemp;
 
-        pcl::toROSMsg(*outlierCloud, laserCloudTemp); // 发布界外点云(用fullCloud中的点填充的)
-        laserCloudTemp.header.stamp = cloudHeader.stamp;
-        laserCloudTemp.header.frame_id = "base_link";
-        pubOutlierCloud.publish(laserCloudTemp);
+        // 发布界外点云(用fullCloud中的点填充的)，以共享指针发布，发布之后不再修改
+        outlierCloud->header = pcl_conversions::toPCL(cloudHeader);
+        outlierCloud->header.frame_id = "base_link";
+        pubOutlierCloud.publish(outlierCloud);
         // segmented cloud with ground 包含地面点的分割点云： 坐标 + 行列索引 (用fullCloud中的点填充的)
-        pcl::toROSMsg(*segmentedCloud, laserCloudTemp);
-        laserCloudTemp.header.stamp = cloudHeader.stamp;
-        laserCloudTemp.header.frame_id = "base_link";
-        pubSegmentedCloud.publish(laserCloudTemp);
+        segmentedCloud->header = pcl_conversions::toPCL(cloudHeader);
+        segmentedCloud->header.frame_id = "base_link";
+        if (compactCloud == false || pubSegmentedCloud.getNumSubscribers() != 0)
+            pubSegmentedCloud.publish(segmentedCloud);
         // projected full cloud ，完整的投影点云： 坐标 + 在距离图像中的行列索引
         if (pubFullCloud.getNumSubscribers() != 0){
             pcl::toROSMsg(*fullCloud, laserCloudTemp);
@@ -602,11 +858,40 @@ public:
 
 
 
+#ifdef LEGO_LOAM_NODELET
+
+namespace lego_loam{
+
+// nodelet版本，与其他节点加载到同一个nodelet manager中，点云以共享指针在节点之间传递
+class ImageProjectionNodelet : public nodelet::Nodelet{
+
+private:
+
+    boost::shared_ptr<ImageProjection> IP;
+
+    virtual void onInit(){
+        readSensorParams();
+        // 纯回调驱动，直接使用nodelet的回调队列
+        IP.reset(new ImageProjection(getPrivateNodeHandle()));
+        NODELET_INFO("\033[1;32m---->\033[0m Image Projection Nodelet Started.");
+    }
+};
+
+}
+
+PLUGINLIB_EXPORT_CLASS(lego_loam::ImageProjectionNodelet, nodelet::Nodelet)
+
+#elif !defined(LEGO_LOAM_OFFLINE)
+
+// offlineReplay.cpp把四个节点编译进同一个程序，由它提供main
+
 // imageProjecion.cpp进行的数据处理是图像映射，将得到的激光数据分割，并在得到的激光数据上进行坐标变换。
 int main(int argc, char** argv){
 
     ros::init(argc, argv, "lego_loam");
-    
+
+    readSensorParams();
+
     ImageProjection IP;
 
     ROS_INFO("\033[1;32m---->\033[0m Image Projection Started.");
@@ -614,3 +899,5 @@ int main(int argc, char** argv){
     ros::spin();
     return 0;
 }
+
+#endif
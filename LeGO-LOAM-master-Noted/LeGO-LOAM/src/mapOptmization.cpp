@@ -32,6 +32,33 @@
 //   T. Shan and B. Englot. LeGO-LOAM: Lightweight and Ground-Optimized Lidar Odometry and Mapping on Variable Terrain
 //      IEEE/RSJ International Conference on Intelligent Robots and Systems (IROS). October 2018.
 #include "utility.h"
+#include "localVoxelMap.h"
+#include "keyFrameStore.h"
+#include "mapExporter.h"
+#include "keyPoseIndex.h"
+#include "loopRegistration.h"
+#include "scanContext.h"
+#include "boundedQueue.h"
+#include "stampSynchronizer.h"
+#include "normalEquations.h"
+#include "pointTransform.h"
+#include "pipelineMetrics.h"
+#include "poseGraphBackend.h"
+#include "imuBuffer.h"
+#include "iterationControl.h"
+#include "loadShedder.h"
+#include "localizationMap.h"
+#include "cloudPool.h"
+
+#include <atomic>
+#include <ros/callback_queue.h>
+#include <std_msgs/UInt32.h>
+#include <cloud_msgs/MapTile.h>
+#include <map>
+#include <tuple>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 #include <gtsam/geometry/Rot3.h>
 #include <gtsam/geometry/Pose3.h>
@@ -44,25 +71,28 @@
 
 #include <gtsam/nonlinear/ISAM2.h>
 
+#ifdef LEGO_LOAM_NODELET
+#include <nodelet/nodelet.h>
+#include <pluginlib/class_list_macros.h>
+#endif
+
 using namespace gtsam;
 
 class mapOptimization{
 
-private:
+    friend class PipelineBenchmark; // src/pipelineBenchmark.cpp中单独调用各处理阶段
 
-    NonlinearFactorGraph gtSAMgraph;
-    Values initialEstimate;
-    Values optimizedEstimate;
-    ISAM2 *isam;
-    Values isamCurrentEstimate;
+private:
 
     noiseModel::Diagonal::shared_ptr priorNoise;        // 先验噪声
     noiseModel::Diagonal::shared_ptr odometryNoise;     // 里程计噪声
     noiseModel::Diagonal::shared_ptr constraintNoise;   // 约束噪声
 
     ros::NodeHandle nh;
+    PipelineMetrics metrics;    // 各线程处理阶段的耗时、局部地图大小、迭代次数及丢帧统计，发布在/diagnostics上
 
     ros::Publisher pubLaserCloudSurround;
+    ros::Publisher pubMapTiles;         // 有变化的全局地图块(cloud_msgs/MapTile)，见mapExporter.h
     ros::Publisher pubOdomAftMapped;
     ros::Publisher pubKeyPoses;
 
@@ -70,6 +100,7 @@ private:
     ros::Publisher pubIcpKeyFrames;
     ros::Publisher pubRecentKeyFrames;
     ros::Publisher pubRegisteredCloud;
+    ros::Publisher pubBackpressure;     // 请求featureAssociation额外跳过的帧数，见loadShedder.h
 
     ros::Subscriber subLaserCloudCornerLast;
     ros::Subscriber subLaserCloudSurfLast;
@@ -80,21 +111,20 @@ private:
     nav_msgs::Odometry odomAftMapped;
     tf::StampedTransform aftMappedTrans;
     tf::TransformBroadcaster tfBroadcaster;
-    // 所有的各种不同特征类型的关键帧，保存的是局部坐标
-    vector<pcl::PointCloud<PointType>::Ptr> cornerCloudKeyFrames;
-    vector<pcl::PointCloud<PointType>::Ptr> surfCloudKeyFrames;
-    vector<pcl::PointCloud<PointType>::Ptr> outlierCloudKeyFrames;
-    // 有回环时，当前关键帧附近的关键帧队列，位于世界坐标下，相当于局部子图submap
-    deque<pcl::PointCloud<PointType>::Ptr> recentCornerCloudKeyFrames;
-    deque<pcl::PointCloud<PointType>::Ptr> recentSurfCloudKeyFrames;
-    deque<pcl::PointCloud<PointType>::Ptr> recentOutlierCloudKeyFrames;
-    int latestFrameID;
-
-    vector<int> surroundingExistingKeyPosesID; // 当前帧附近已经存在的关键帧ID
-    deque<pcl::PointCloud<PointType>::Ptr> surroundingCornerCloudKeyFrames;  // 当前帧附近的边缘点云关键帧集合(保存的是点云的世界坐标)
-    deque<pcl::PointCloud<PointType>::Ptr> surroundingSurfCloudKeyFrames;    // 当前帧附近的平面点云关键帧集合(保存的是点云的世界坐标)
-    deque<pcl::PointCloud<PointType>::Ptr> surroundingOutlierCloudKeyFrames; // 当前帧附近的outlier点云关键帧集合(保存的是点云的世界坐标)
-    
+    // 所有关键帧的各种不同特征类型的点云，保存的是局部坐标，只有最近使用的keyFrameResidentNum个在内存中
+    KeyFrameStore keyFrameStore;
+    // /laser_cloud_surround有订阅者时缓存的全局地图块，key为(layer, x, z)，由地图导出线程更新
+    // 声明在mapExporter之前，保证导出线程退出之前不会被析构
+    std::mutex globalMapMtx;
+    std::map<std::tuple<int, int, int>, MapExporter::TileUpdate> globalMapTiles;
+    bool globalMapChanged;
+    // 后台增量导出全局地图，退出时只需写入剩余部分，同时增量维护发布的全局地图
+    MapExporter mapExporter;
+    // 当前帧附近的局部地图(世界坐标)，新关键帧增量插入，离开搜索半径的体素被移除
+    // 边缘点地图体素0.2m，平面点(含outlier)地图体素0.4m，与原downSizeFilterCorner/Surf一致
+    LocalVoxelMap localCornerMap;
+    LocalVoxelMap localSurfMap;
+
     PointType previousRobotPosPoint; // 上一帧保存的机器人的世界坐标
     PointType currentRobotPosPoint;  // 当前帧机器人的世界坐标
 
@@ -106,12 +136,13 @@ private:
     pcl::PointCloud<PointType>::Ptr surroundingKeyPoses;    // 未开启回环检测时查询到的当前帧附近的3Dpose集合
     pcl::PointCloud<PointType>::Ptr surroundingKeyPosesDS;  // 降采样的附近pose集合
 
-    pcl::PointCloud<PointType>::Ptr laserCloudCornerLast; // corner feature set from odoOptimization
-    pcl::PointCloud<PointType>::Ptr laserCloudSurfLast; // surf feature set from odoOptimization
+    // 回调中收到的只读点云，直接持有featureAssociation发布的共享指针
+    pcl::PointCloud<PointType>::ConstPtr laserCloudCornerLast; // corner feature set from odoOptimization
+    pcl::PointCloud<PointType>::ConstPtr laserCloudSurfLast; // surf feature set from odoOptimization
     pcl::PointCloud<PointType>::Ptr laserCloudCornerLastDS; // downsampled corner featuer set from odoOptimization
     pcl::PointCloud<PointType>::Ptr laserCloudSurfLastDS; // downsampled surf featuer set from odoOptimization
 
-    pcl::PointCloud<PointType>::Ptr laserCloudOutlierLast; // corner feature set from odoOptimization
+    pcl::PointCloud<PointType>::ConstPtr laserCloudOutlierLast; // corner feature set from odoOptimization
     pcl::PointCloud<PointType>::Ptr laserCloudOutlierLastDS; // corner feature set from odoOptimization
 
     pcl::PointCloud<PointType>::Ptr laserCloudSurfTotalLast; // surf feature + outlier feature set from odoOptimization
@@ -120,16 +151,13 @@ private:
     pcl::PointCloud<PointType>::Ptr laserCloudOri;  // 可以优化的特征点(边缘点+平面点，保存的是局部坐标)
     pcl::PointCloud<PointType>::Ptr coeffSel;       // 特征点到边缘线或平面的方向向量和距离(带权重系数)
 
-    pcl::PointCloud<PointType>::Ptr laserCloudCornerFromMap; // 保存的是当前帧附近所有关键帧的点云地图，世界坐标
-    pcl::PointCloud<PointType>::Ptr laserCloudSurfFromMap;
-    pcl::PointCloud<PointType>::Ptr laserCloudCornerFromMapDS;
-    pcl::PointCloud<PointType>::Ptr laserCloudSurfFromMapDS;
+    pcl::PointCloud<PointType>::Ptr laserCloudSurfFromMapDS; // 局部平面点地图的导出，仅用于发布/recent_cloud
 
-    pcl::KdTreeFLANN<PointType>::Ptr kdtreeCornerFromMap;
-    pcl::KdTreeFLANN<PointType>::Ptr kdtreeSurfFromMap;
+    // 所有关键帧位置的空间索引，回环检测、局部地图重建和全局地图可视化共用，不再每次重建KD树
+    KeyPoseIndex keyPoseIndex;
 
-    pcl::KdTreeFLANN<PointType>::Ptr kdtreeSurroundingKeyPoses;
-    pcl::KdTreeFLANN<PointType>::Ptr kdtreeHistoryKeyPoses;
+    // 关键帧位姿图，backendWindowSize大于0时只对最近的关键帧做增量优化
+    PoseGraphBackend backend;
 
     
     pcl::PointCloud<PointType>::Ptr nearHistoryCornerKeyFrameCloud;
@@ -141,12 +169,6 @@ private:
     pcl::PointCloud<PointType>::Ptr latestSurfKeyFrameCloud;    // 回环帧特征点云(边缘点+平面点)的世界坐标
     pcl::PointCloud<PointType>::Ptr latestSurfKeyFrameCloudDS;
 
-    pcl::KdTreeFLANN<PointType>::Ptr kdtreeGlobalMap;
-    pcl::PointCloud<PointType>::Ptr globalMapKeyPoses;
-    pcl::PointCloud<PointType>::Ptr globalMapKeyPosesDS;
-    pcl::PointCloud<PointType>::Ptr globalMapKeyFrames;
-    pcl::PointCloud<PointType>::Ptr globalMapKeyFramesDS;
-
     std::vector<int> pointSearchInd;
     std::vector<float> pointSearchSqDis;
 
@@ -155,24 +177,17 @@ private:
     pcl::VoxelGrid<PointType> downSizeFilterOutlier;
     pcl::VoxelGrid<PointType> downSizeFilterHistoryKeyFrames; // for histor key frames of loop closure
     pcl::VoxelGrid<PointType> downSizeFilterSurroundingKeyPoses; // for surrounding key poses of scan-to-map optimization
-    pcl::VoxelGrid<PointType> downSizeFilterGlobalMapKeyPoses; // for global map visualization
-    pcl::VoxelGrid<PointType> downSizeFilterGlobalMapKeyFrames; // for global map visualization
 
     // 时间戳
-    double timeLaserCloudCornerLast;
-    double timeLaserCloudSurfLast;
     double timeLaserOdometry;
-    double timeLaserCloudOutlierLast;
     double timeLastGloalMapPublish;
 
-    // 接收标志
-    bool newLaserCloudCornerLast;
-    bool newLaserCloudSurfLast;
-    bool newLaserOdometry;
-    bool newLaserCloudOutlierLast;
+    // featureAssociation发布的边缘点、平面点、界外点和odometry四路消息按时间戳匹配，同一帧的四路都到达时立即送入流水线
+    enum { CornerLastChannel, SurfLastChannel, OutlierLastChannel, LaserOdometryChannel };
+    StampSynchronizer<4> frameSync;
 
     /*************高频转换量**************/
-    float transformLast[6];   // gtsam优化后的上一次位姿
+    float transformLast[6];   // 上一关键帧的位姿(scan-to-map线程维护，回环修正后与gtsam优化结果同步)
     float transformSum[6];    //odometry计算得到的到世界坐标系下的位姿 // -pitch, -yaw, roll; x, y, z
     float transformIncre[6];  //转移增量，只使用了后三个平移增量，位于激光雷达坐标系下
 
@@ -182,29 +197,120 @@ private:
     float transformAftMapped[6];  //存放mapping之后的经过mapping微调之后的转换矩阵(经过了gtsam优化后)
 
 
-    int imuPointerFront;
-    int imuPointerLast; // 当前接收到的imu在数组中的位置
-    // 接收到的imu信息：时间戳，翻滚角，俯仰角(世界坐标系下的姿态R_w_l)
-    double imuTime[imuQueLength];
-    float imuRoll[imuQueLength];
-    float imuPitch[imuQueLength];
+    // 接收到的imu信息，只使用翻滚角和俯仰角(世界坐标系下的姿态R_w_l)，在主线程中写入，在scan-to-map线程中不加锁读取
+    ImuBuffer imuBuffer;
 
-    std::mutex mtx;
+    std::mutex mtx;     // 保护因子图、关键帧位姿及关键帧点云，由图优化线程、回环线程和可视化线程共享
 
     double timeLastProcessing;
 
-    PointType pointOri, pointSel, pointProj, coeff;
+    /*************流水线**************/
+    // 主线程完成时间同步后将一帧数据送入流水线：
+    // 降采样线程(第N+1帧) -> scan-to-map线程(第N帧) -> 图优化线程(ISAM2更新)
+    struct MappingFrame{
+        double time;
+        float transformSum[6];
+        pcl::PointCloud<PointType>::ConstPtr cornerLast;
+        pcl::PointCloud<PointType>::ConstPtr surfLast;
+        pcl::PointCloud<PointType>::ConstPtr outlierLast;
+        pcl::PointCloud<PointType>::Ptr cornerLastDS;
+        pcl::PointCloud<PointType>::Ptr surfLastDS;
+        pcl::PointCloud<PointType>::Ptr outlierLastDS;
+        pcl::PointCloud<PointType>::Ptr surfTotalLast;
+        pcl::PointCloud<PointType>::Ptr surfTotalLastDS;
+        LoadShedder::Settings load;     // 送入流水线时的降级设置
+    };
+
+    // scan-to-map线程选出的关键帧，交给图优化线程加入因子图
+    // last和transform是同一条scan-to-map轨迹上的上一关键帧和当前关键帧位姿，两者之差作为里程计约束
+    struct KeyFrameJob{
+        double time;
+        float last[6];
+        float transform[6];
+        pcl::PointCloud<PointType>::Ptr corner;
+        pcl::PointCloud<PointType>::Ptr surf;
+        pcl::PointCloud<PointType>::Ptr outlier;
+    };
+
+    BoundedQueue<boost::shared_ptr<MappingFrame> > prepQueue;       // 主线程 -> 降采样线程
+    BoundedQueue<boost::shared_ptr<MappingFrame> > mappingQueue;    // 降采样线程 -> scan-to-map线程
+    BoundedQueue<boost::shared_ptr<KeyFrameJob> > graphQueue;       // scan-to-map线程 -> 图优化线程
+
+    // 随流水线传递的点云在下游阶段释放后复用，稳态下不再分配内存
+    CloudPool<PointType> frameCloudPool;    // 降采样线程：MappingFrame中降采样后的点云
+    CloudPool<PointType> keyFrameCloudPool; // scan-to-map线程：KeyFrameJob中的关键帧点云
+
+    int keyFrameNum;                        // scan-to-map线程已提交的关键帧数
+    std::atomic<int> keyFrameProcessedNum;  // 图优化线程已加入因子图的关键帧数
+    std::atomic<bool> loopCorrectionPending;// 图优化线程已按回环结果修正关键帧位姿，scan-to-map线程需要同步
+    int framesQueued;                       // 主线程送入流水线的帧数
+    std::atomic<int> framesMapped;          // scan-to-map线程处理完的帧数
+
+    LoadShedder loadShedder;                // 建图跟不上输入时逐级降低计算量
+
+    // 纯定位模式下局部地图由预先建好的分块地图构成，scan-to-map之后不插入关键帧
+    bool localizationMode;
+    LocalizationMap localizationMap;
+    std::vector<int> addedTiles;
+    float submapRadius;                     // 当前帧的局部地图半径和关键帧数，降级时小于surroundingKeyframeSearchRadius/Num
+    int submapKeyFrameNum;
+    bool submapGrown;                       // 降级恢复后局部地图半径变大，之前移出的关键帧需要重新插入
+
+    // framesMapped、keyFrameProcessedNum或running变化时在持有progressMtx的情况下修改并通知progressCond，
+    // 回环检测、全局地图可视化等线程空闲时阻塞在上面，不再按固定频率轮询
+    std::mutex progressMtx;
+    std::condition_variable progressCond;
+
+    std::thread downsampleWorker;
+    std::thread mappingWorker;
+    std::thread graphWorker;
+
+    std::atomic<bool> running; // stop()之后spin()及各工作线程退出
+
+    // 主线程接收的最新odometry，时间同步后拷贝进MappingFrame
+    double timeLaserOdometryNew;
+    float transformSumNew[6];
 
-    cv::Mat matA0;
-    cv::Mat matB0;
-    cv::Mat matX0;
+    PointType pointOri, pointSel, pointProj, coeff;
 
-    cv::Mat matA1;
-    cv::Mat matD1;
-    cv::Mat matV1;
+    // 每个线程独立的近邻搜索和矩阵运算缓存，以及该线程找到的特征点和系数
+    struct CorrespondenceScratch{
+        std::vector<int> pointSearchInd;
+        std::vector<float> pointSearchSqDis;
+        std::vector<std::pair<float, int> > candidates;
+        cv::Mat matA0;
+        cv::Mat matB0;
+        cv::Mat matX0;
+        cv::Mat matA1;
+        cv::Mat matD1;
+        cv::Mat matV1;
+        pcl::PointCloud<PointType> laserCloudOri;
+        pcl::PointCloud<PointType> coeffSel;
+    };
+
+    std::vector<CorrespondenceScratch> correspondenceScratch; // cornerOptimization/surfOptimization中每个线程一份
+
+    // 每个特征点在局部地图中拟合的直线(中心点c和方向v)或平面(单位法向量和pd)，不重新查找对应点的迭代中直接复用
+    // 同一帧的迭代过程中局部地图不变
+    struct CornerFeature{
+        bool valid;
+        float cx, cy, cz;
+        float vx, vy, vz;
+    };
+    struct SurfFeature{
+        bool valid;
+        float pa, pb, pc, pd;
+    };
+    std::vector<CornerFeature> cornerFeatures;
+    std::vector<SurfFeature> surfFeatures;
+
+    IterationControl scan2MapControl; // scan-to-map的迭代次数、收敛条件、重新查找对应点的时机和时间限制
+    bool researchCorrespondences;     // 这次迭代是否重新查找对应点
 
     bool isDegenerate;
-    cv::Mat matP;
+    Eigen::Matrix<float, 6, 6> matP;
+
+    NormalEquations<6> normalEquations; // LMOptimization中的法方程，每次迭代清零后复用
 
     int laserCloudCornerFromMapDSNum;
     int laserCloudSurfFromMapDSNum;
@@ -214,37 +320,67 @@ private:
     int laserCloudSurfTotalLastDSNum;
 
     bool potentialLoopFlag; // 发生潜在回环标志
-    double timeSaveFirstCurrentScanForLoopClosure; // not used
+    double timeSaveFirstCurrentScanForLoopClosure; // 回环帧的时间戳，用于发布回环相关的点云
     int closestHistoryFrameID;   // 与当前帧最近的历史关键帧ID
     int latestFrameIDLoopCloure; // 检测出回环最近的关键帧ID，即回环帧ID
 
+    ScanContext scanContext;     // 关键帧的全局描述子，用于漂移较大时寻找回环候选
+    PointTypePose loopSourcePose; // 把回环帧点云变换到世界坐标系时使用的位姿(配准的初值)
+
+    LoopRegistration loopRegistration; // 回环配准，待回环子图不变时复用其KD树和平面参数
+    int historyTargetFrameID;    // 当前loopRegistration目标子图的中心关键帧ID，-1表示没有
+    int historyTargetEndID;      // 目标子图包含的最后一个关键帧ID
+    int historyTargetRevision;   // 建立目标子图时的keyPoseRevision
+    int keyPoseRevision;         // 关键帧位姿每被回环修正一次加1
+    bool historyTargetChanged;   // detectLoopClosure重新拼接了目标子图，需要重新setTarget
+
     bool aLoopIsClosed;
 
-    float cRoll, sRoll, cPitch, sPitch, cYaw, sYaw, tX, tY, tZ;
-    float ctRoll, stRoll, ctPitch, stPitch, ctYaw, stYaw, tInX, tInY, tInZ;
+    Eigen::Matrix4f transformTobeMappedMatrix; // pointAssociateToMap使用的变换，由updatePointAssociateToMapSinCos()计算
+    pcl::PointCloud<PointType>::Ptr keyFrameWorldCloud; // insertKeyFrameToLocalMap中转换到世界坐标系下的关键帧点云，复用内存
+    pcl::PointCloud<PointType>::Ptr registeredCloud;    // publishKeyPosesAndFrames中发布的当前帧世界坐标点云，复用内存
 
 public:
 
     
 
-    mapOptimization():
-        nh("~")
+    // nodelet中传入设置了独立回调队列的NodeHandle
+    mapOptimization(ros::NodeHandle nodeHandle = ros::NodeHandle("~")):
+        nh(nodeHandle),
+        metrics(nh, "mapOptimization"),
+        keyFrameStore(fileDirectory + "keyFrames.bin", keyFrameResidentNum),
+        globalMapChanged(false),
+        mapExporter(keyFrameStore, fileDirectory),
+        localCornerMap(0.2, 1.0),
+        localSurfMap(0.4, 1.0),
+        keyPoseIndex(keyPoseIndexCellSize),
+        backend(backendWindowSize),
+        imuBuffer(imuQueLength),
+        prepQueue(2),
+        mappingQueue(2),
+        graphQueue(10),
+        running(true),
+        scan2MapControl("scan2map", 10, 0.05, 0.05, 1, researchDeltaR, researchDeltaT, scan2MapDeadline),
+        researchCorrespondences(true)
     {
-        // 用于闭环图优化的参数设置，使用gtsam库
-        ISAM2Params parameters;
-		parameters.relinearizeThreshold = 0.01;
-		parameters.relinearizeSkip = 1;
-    	isam = new ISAM2(parameters);
-
         pubKeyPoses = nh.advertise<sensor_msgs::PointCloud2>("/key_pose_origin", 2);
-        pubLaserCloudSurround = nh.advertise<sensor_msgs::PointCloud2>("/laser_cloud_surround", 2);
+        // 全局地图的新订阅者连接时请求地图导出线程重新发送全部的块
+        ros::SubscriberStatusCallback onGlobalMapSubscriber = [this](const ros::SingleSubscriberPublisher &){
+            mapExporter.requestFullUpdate();
+        };
+        pubLaserCloudSurround = nh.advertise<sensor_msgs::PointCloud2>("/laser_cloud_surround", 2, onGlobalMapSubscriber);
+        pubMapTiles = nh.advertise<cloud_msgs::MapTile>("/map_tiles", 100, onGlobalMapSubscriber);
         pubOdomAftMapped = nh.advertise<nav_msgs::Odometry> ("/aft_mapped_to_init", 5); // 发布优化后的pose
+        pubBackpressure = nh.advertise<std_msgs::UInt32>("/mapping_backpressure", 1, true);
 
         // 去掉畸变后的点云，投影至点云结束坐标系
-        subLaserCloudCornerLast = nh.subscribe<sensor_msgs::PointCloud2>("/laser_cloud_corner_last", 2, &mapOptimization::laserCloudCornerLastHandler, this);
-        subLaserCloudSurfLast = nh.subscribe<sensor_msgs::PointCloud2>("/laser_cloud_surf_last", 2, &mapOptimization::laserCloudSurfLastHandler, this);
-        subOutlierCloudLast = nh.subscribe<sensor_msgs::PointCloud2>("/outlier_cloud_last", 2, &mapOptimization::laserCloudOutlierLastHandler, this);
+        // 以pcl格式订阅，同一进程(nodelet)内只传递共享指针，不进行反序列化
+        subLaserCloudCornerLast = nh.subscribe<pcl::PointCloud<PointType> >("/laser_cloud_corner_last", 2, &mapOptimization::laserCloudCornerLastHandler, this);
+        subLaserCloudSurfLast = nh.subscribe<pcl::PointCloud<PointType> >("/laser_cloud_surf_last", 2, &mapOptimization::laserCloudSurfLastHandler, this);
+        subOutlierCloudLast = nh.subscribe<pcl::PointCloud<PointType> >("/outlier_cloud_last", 2, &mapOptimization::laserCloudOutlierLastHandler, this);
         subLaserOdometry = nh.subscribe<nav_msgs::Odometry>("/laser_odom_to_init", 5, &mapOptimization::laserOdometryHandler, this);
+        // odometry每帧都发布，三路点云每skipFrameNum+1帧(降级时更多)才发布一次，只有点云被覆盖才是真正的丢帧
+        frameSync.ignoreDrops(LaserOdometryChannel);
         subImu = nh.subscribe<sensor_msgs::Imu> (imuTopic, 50, &mapOptimization::imuHandler, this);
 
         pubHistoryKeyFrames = nh.advertise<sensor_msgs::PointCloud2>("/history_cloud", 2);
@@ -259,9 +395,6 @@ public:
         downSizeFilterHistoryKeyFrames.setLeafSize(0.4, 0.4, 0.4); // for histor key frames of loop closure
         downSizeFilterSurroundingKeyPoses.setLeafSize(1.0, 1.0, 1.0); // for surrounding key poses of scan-to-map optimization
 
-        downSizeFilterGlobalMapKeyPoses.setLeafSize(1.0, 1.0, 1.0); // for global map visualization
-        downSizeFilterGlobalMapKeyFrames.setLeafSize(0.4, 0.4, 0.4); // for global map visualization
-
         odomAftMapped.header.frame_id = "/camera_init";
         odomAftMapped.child_frame_id = "/aft_mapped";
 
@@ -269,6 +402,75 @@ public:
         aftMappedTrans.child_frame_id_ = "/aft_mapped";
 
         allocateMemory();
+        loadLocalizationMap();
+
+        mapExporter.setTileListener([this](const std::vector<MapExporter::TileUpdate> &updates, bool reset){
+            handleMapTiles(updates, reset);
+        });
+    }
+
+    // lego_loam/localization/下设置enable、map_file以及地图坐标系(camera_init)下的初始位姿initial_pose
+    // [rx, ry, rz, tx, ty, tz](与transformTobeMapped相同)，地图无法读取时退回到建图模式
+    void loadLocalizationMap(){
+        ros::NodeHandle pnh("lego_loam/localization");
+        string mapFile;
+        std::vector<double> initialPose;
+        pnh.param<bool>("enable", localizationMode, localizationModeFlag);
+        pnh.param<string>("map_file", mapFile, fileDirectory + "localizationMap.bin");
+        pnh.param<std::vector<double> >("initial_pose", initialPose, std::vector<double>());
+        if (localizationMode == false)
+            return;
+
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        if (localizationMap.open(mapFile) == false){
+            ROS_ERROR("mapOptimization: cannot read localization map %s, falling back to mapping", mapFile.c_str());
+            localizationMode = false;
+            return;
+        }
+        ROS_INFO("mapOptimization: localization mode, %d map tiles indexed from %s in %.1f ms", localizationMap.tileNum(), mapFile.c_str(),
+                 std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+
+        // transformAssociateToMap按transformAftMapped * (transformBefMapped^-1 * transformSum)预测位姿，
+        // 里程计从0开始，所以把初始位姿放在transformAftMapped中即可
+        if (initialPose.size() == 6){
+            for (int i = 0; i < 6; ++i){
+                transformAftMapped[i] = initialPose[i];
+                transformTobeMapped[i] = initialPose[i];
+            }
+        }
+
+        // 提前请求初始位置附近的块，后台读入之后由第一帧的updateLocalizationMap插入局部地图
+        PointType position;
+        position.x = transformTobeMapped[3];
+        position.y = transformTobeMapped[4];
+        position.z = transformTobeMapped[5];
+        localizationMap.update(position, surroundingKeyframeSearchRadius, addedTiles);
+    }
+
+    // 纯定位模式：按预测的位置加载和卸载地图块，代替extractSurroundingKeyFrames
+    void updateLocalizationMap(){
+        PointType position;
+        position.x = transformTobeMapped[3];
+        position.y = transformTobeMapped[4];
+        position.z = transformTobeMapped[5];
+
+        // 块的体素以块中心(y = 0)为观测位置插入，按水平距离evict即只移除被卸载的块；
+        // 跨越块边界的block属于最后插入它的块，边界上不足一个block的体素随之移除或保留，不影响匹配
+        if (localizationMap.update(position, submapRadius, addedTiles)){
+            PointType horizontalPosition = position;
+            horizontalPosition.y = 0;
+            float radius = localizationMap.unloadRadius(submapRadius);
+            localCornerMap.evict(horizontalPosition, radius);
+            localSurfMap.evict(horizontalPosition, radius);
+        }
+        for (size_t i = 0; i < addedTiles.size(); ++i){
+            int tile = addedTiles[i];
+            LocalVoxelMap &map = localizationMap.layerOf(tile) == LocalizationMap::Corner ? localCornerMap : localSurfMap;
+            map.insert(localizationMap.cloudOf(tile), localizationMap.centerOf(tile));
+        }
+
+        laserCloudCornerFromMapDSNum = localCornerMap.size();
+        laserCloudSurfFromMapDSNum = localSurfMap.size();
     }
 
     void allocateMemory(){
@@ -276,17 +478,12 @@ public:
         cloudKeyPoses3D.reset(new pcl::PointCloud<PointType>());
         cloudKeyPoses6D.reset(new pcl::PointCloud<PointTypePose>());
 
-        kdtreeSurroundingKeyPoses.reset(new pcl::KdTreeFLANN<PointType>());
-        kdtreeHistoryKeyPoses.reset(new pcl::KdTreeFLANN<PointType>());
 
         surroundingKeyPoses.reset(new pcl::PointCloud<PointType>());
         surroundingKeyPosesDS.reset(new pcl::PointCloud<PointType>());        
 
-        laserCloudCornerLast.reset(new pcl::PointCloud<PointType>()); // corner feature set from odoOptimization
-        laserCloudSurfLast.reset(new pcl::PointCloud<PointType>()); // surf feature set from odoOptimization
         laserCloudCornerLastDS.reset(new pcl::PointCloud<PointType>()); // downsampled corner featuer set from odoOptimization
         laserCloudSurfLastDS.reset(new pcl::PointCloud<PointType>()); // downsampled surf featuer set from odoOptimization
-        laserCloudOutlierLast.reset(new pcl::PointCloud<PointType>()); // corner feature set from odoOptimization
         laserCloudOutlierLastDS.reset(new pcl::PointCloud<PointType>()); // downsampled corner feature set from odoOptimization
         laserCloudSurfTotalLast.reset(new pcl::PointCloud<PointType>()); // surf feature set from odoOptimization
         laserCloudSurfTotalLastDS.reset(new pcl::PointCloud<PointType>()); // downsampled surf featuer set from odoOptimization
@@ -294,13 +491,9 @@ public:
         laserCloudOri.reset(new pcl::PointCloud<PointType>());
         coeffSel.reset(new pcl::PointCloud<PointType>());
 
-        laserCloudCornerFromMap.reset(new pcl::PointCloud<PointType>());
-        laserCloudSurfFromMap.reset(new pcl::PointCloud<PointType>());
-        laserCloudCornerFromMapDS.reset(new pcl::PointCloud<PointType>());
         laserCloudSurfFromMapDS.reset(new pcl::PointCloud<PointType>());
-
-        kdtreeCornerFromMap.reset(new pcl::KdTreeFLANN<PointType>());
-        kdtreeSurfFromMap.reset(new pcl::KdTreeFLANN<PointType>());
+        keyFrameWorldCloud.reset(new pcl::PointCloud<PointType>());
+        registeredCloud.reset(new pcl::PointCloud<PointType>());
 
         
         nearHistoryCornerKeyFrameCloud.reset(new pcl::PointCloud<PointType>());
@@ -312,26 +505,12 @@ public:
         latestSurfKeyFrameCloud.reset(new pcl::PointCloud<PointType>());
         latestSurfKeyFrameCloudDS.reset(new pcl::PointCloud<PointType>());
 
-        kdtreeGlobalMap.reset(new pcl::KdTreeFLANN<PointType>());
-        globalMapKeyPoses.reset(new pcl::PointCloud<PointType>());
-        globalMapKeyPosesDS.reset(new pcl::PointCloud<PointType>());
-        globalMapKeyFrames.reset(new pcl::PointCloud<PointType>());
-        globalMapKeyFramesDS.reset(new pcl::PointCloud<PointType>());
-
-        timeLaserCloudCornerLast = 0;
-        timeLaserCloudSurfLast = 0;
         timeLaserOdometry = 0;
-        timeLaserCloudOutlierLast = 0;
+        timeLaserOdometryNew = 0;
         timeLastGloalMapPublish = 0;
 
         timeLastProcessing = -1;
 
-        newLaserCloudCornerLast = false;
-        newLaserCloudSurfLast = false;
-
-        newLaserOdometry = false;
-        newLaserCloudOutlierLast = false;
-
         for (int i = 0; i < 6; ++i){
             transformLast[i] = 0;
             transformSum[i] = 0;
@@ -339,32 +518,37 @@ public:
             transformTobeMapped[i] = 0;
             transformBefMapped[i] = 0;
             transformAftMapped[i] = 0;
+            transformSumNew[i] = 0;
         }
 
-        imuPointerFront = 0;
-        imuPointerLast = -1;
-
-        for (int i = 0; i < imuQueLength; ++i){
-            imuTime[i] = 0;
-            imuRoll[i] = 0;
-            imuPitch[i] = 0;
-        }
+        keyFrameNum = 0;
+        keyFrameProcessedNum = 0;
+        framesQueued = 0;
+        framesMapped = 0;
+        submapRadius = surroundingKeyframeSearchRadius;
+        submapKeyFrameNum = surroundingKeyframeSearchNum;
+        submapGrown = false;
+        loopCorrectionPending = false;
 
         gtsam::Vector Vector6(6);
         Vector6 << 1e-6, 1e-6, 1e-6, 1e-8, 1e-8, 1e-6;
         priorNoise = noiseModel::Diagonal::Variances(Vector6);
         odometryNoise = noiseModel::Diagonal::Variances(Vector6);
 
-        matA0 = cv::Mat (5, 3, CV_32F, cv::Scalar::all(0));
-        matB0 = cv::Mat (5, 1, CV_32F, cv::Scalar::all(-1));
-        matX0 = cv::Mat (3, 1, CV_32F, cv::Scalar::all(0));
+        correspondenceScratch.resize(numberOfCores);
+        for (int t = 0; t < numberOfCores; ++t){
+            CorrespondenceScratch &scratch = correspondenceScratch[t];
+            scratch.matA0 = cv::Mat (5, 3, CV_32F, cv::Scalar::all(0));
+            scratch.matB0 = cv::Mat (5, 1, CV_32F, cv::Scalar::all(-1));
+            scratch.matX0 = cv::Mat (3, 1, CV_32F, cv::Scalar::all(0));
 
-        matA1 = cv::Mat (3, 3, CV_32F, cv::Scalar::all(0));
-        matD1 = cv::Mat (1, 3, CV_32F, cv::Scalar::all(0));
-        matV1 = cv::Mat (3, 3, CV_32F, cv::Scalar::all(0));
+            scratch.matA1 = cv::Mat (3, 3, CV_32F, cv::Scalar::all(0));
+            scratch.matD1 = cv::Mat (1, 3, CV_32F, cv::Scalar::all(0));
+            scratch.matV1 = cv::Mat (3, 3, CV_32F, cv::Scalar::all(0));
+        }
 
         isDegenerate = false;
-        matP = cv::Mat (6, 6, CV_32F, cv::Scalar::all(0));
+        matP.setZero();
 
         laserCloudCornerFromMapDSNum = 0;
         laserCloudSurfFromMapDSNum = 0;
@@ -375,8 +559,11 @@ public:
 
         potentialLoopFlag = false;
         aLoopIsClosed = false;
-
-        latestFrameID = 0;
+        historyTargetFrameID = -1;
+        historyTargetEndID = -1;
+        historyTargetRevision = -1;
+        keyPoseRevision = 0;
+        historyTargetChanged = false;
     }
 
     // 将坐标转移到世界坐标系下,得到可用于建图的Lidar坐标，即修改了transformTobeMapped的值
@@ -476,32 +663,12 @@ public:
 
     void transformUpdate()
     {
-		if (imuPointerLast >= 0) {
-		    float imuRollLast = 0, imuPitchLast = 0;
-		    while (imuPointerFront != imuPointerLast) {
-		        if (timeLaserOdometry + scanPeriod < imuTime[imuPointerFront]) {
-		            break;
-		        }
-		        imuPointerFront = (imuPointerFront + 1) % imuQueLength;
-		    }
-
-		    if (timeLaserOdometry + scanPeriod > imuTime[imuPointerFront]) {
-		        imuRollLast = imuRoll[imuPointerFront];
-		        imuPitchLast = imuPitch[imuPointerFront];
-		    } else {// 插值
-		        int imuPointerBack = (imuPointerFront + imuQueLength - 1) % imuQueLength;
-		        float ratioFront = (timeLaserOdometry + scanPeriod - imuTime[imuPointerBack]) 
-		                         / (imuTime[imuPointerFront] - imuTime[imuPointerBack]);
-		        float ratioBack = (imuTime[imuPointerFront] - timeLaserOdometry - scanPeriod) 
-		                        / (imuTime[imuPointerFront] - imuTime[imuPointerBack]);
-
-		        imuRollLast = imuRoll[imuPointerFront] * ratioFront + imuRoll[imuPointerBack] * ratioBack;
-		        imuPitchLast = imuPitch[imuPointerFront] * ratioFront + imuPitch[imuPointerBack] * ratioBack;
-		    }
+		ImuSample imu;
+		if (imuBuffer.at(timeLaserOdometry + scanPeriod, imu)) { // 插值得到这一帧结束时刻的imu姿态
             // 简单的互补滤波融合
-		    transformTobeMapped[0] = 0.998 * transformTobeMapped[0] + 0.002 * imuPitchLast;
-		    transformTobeMapped[2] = 0.998 * transformTobeMapped[2] + 0.002 * imuRollLast;
-		  }
+		    transformTobeMapped[0] = 0.998 * transformTobeMapped[0] + 0.002 * imu.pitch;
+		    transformTobeMapped[2] = 0.998 * transformTobeMapped[2] + 0.002 * imu.roll;
+		}
 
 		for (int i = 0; i < 6; i++) {
 		    transformBefMapped[i] = transformSum[i];
@@ -510,179 +677,67 @@ public:
     }
 
     void updatePointAssociateToMapSinCos(){
-        // 先提前求好roll,pitch,yaw的sin和cos值
-        cRoll = cos(transformTobeMapped[0]);
-        sRoll = sin(transformTobeMapped[0]);
-
-        cPitch = cos(transformTobeMapped[1]);
-        sPitch = sin(transformTobeMapped[1]);
-
-        cYaw = cos(transformTobeMapped[2]);
-        sYaw = sin(transformTobeMapped[2]);
-
-        tX = transformTobeMapped[3];
-        tY = transformTobeMapped[4];
-        tZ = transformTobeMapped[5];
+        // 先提前求好roll,pitch,yaw的sin和cos值，并与平移合成一个矩阵
+        transformTobeMappedMatrix = poseToMatrixYXZ(transformTobeMapped[0], transformTobeMapped[1], transformTobeMapped[2],
+                                                    transformTobeMapped[3], transformTobeMapped[4], transformTobeMapped[5]);
     }
 
     void pointAssociateToMap(PointType const * const pi, PointType * const po)
     {
         // 进行6自由度的变换，先进行旋转，然后再平移
-        // 主要进行坐标变换，将局部坐标转换到全局坐标中去	
-
-        // 先绕z轴旋转
-        //     |cosrz  -sinrz  0|
-        //  Rz=|sinrz  cosrz   0|
-        //     |0       0      1|
-        // [x1,y1,z1]^T=Rz*[pi->x,pi->y,pi->z]
-        float x1 = cYaw * pi->x - sYaw * pi->y;
-        float y1 = sYaw * pi->x + cYaw * pi->y;
-        float z1 = pi->z;
-
-        // [x2,y2,z2]^T=Rx*[x1,y1,z1]
-        //    |1     0        0|
-        // Rx=|0   cosrx -sinrx|
-        //    |0   sinrx  cosrx|
-        float x2 = x1;
-        float y2 = cRoll * y1 - sRoll * z1;
-        float z2 = sRoll * y1 + cRoll * z1;
-
-        // 最后再绕Y轴旋转，然后加上平移
-        //    |cosry   0   sinry|
-        // Ry=|0       1       0|
-        //    |-sinry  0   cosry|
-        po->x = cPitch * x2 + sPitch * z2 + tX;
-        po->y = y2 + tY;
-        po->z = -sPitch * x2 + cPitch * z2 + tZ;
-        po->intensity = pi->intensity;
+        // 主要进行坐标变换，将局部坐标转换到全局坐标中去
+        // 先绕z轴旋转，再绕x轴旋转，最后再绕Y轴旋转，然后加上平移: po = Ry*Rx*Rz*pi + t
+        transformPoint(transformTobeMappedMatrix, *pi, *po);
     }
 
-    void updateTransformPointCloudSinCos(PointTypePose *tIn){
-
-        ctRoll = cos(tIn->roll);
-        stRoll = sin(tIn->roll);
-
-        ctPitch = cos(tIn->pitch);
-        stPitch = sin(tIn->pitch);
-
-        ctYaw = cos(tIn->yaw);
-        stYaw = sin(tIn->yaw);
-
-        tInX = tIn->x;
-        tInY = tIn->y;
-        tInZ = tIn->z;
-    }
+    // !!! DO NOT use pcl for point cloud transformation, results are not accurate
+    // 旋转顺序与pointAssociateToMap相同，sin/cos对每帧点云只计算一次
+    // 变换后直接追加到cloudOut末尾(原来返回新分配的点云再拼接)，不分配临时点云
+    void transformPointCloud(const pcl::PointCloud<PointType>::ConstPtr &cloudIn, PointTypePose* transformIn,
+                             pcl::PointCloud<PointType> &cloudOut){
 
-    pcl::PointCloud<PointType>::Ptr transformPointCloud(pcl::PointCloud<PointType>::Ptr cloudIn){
-	// !!! DO NOT use pcl for point cloud transformation, results are not accurate
-        // Reason: unkown
-        pcl::PointCloud<PointType>::Ptr cloudOut(new pcl::PointCloud<PointType>());
-
-        PointType *pointFrom;
-        PointType pointTo;
-
-        int cloudSize = cloudIn->points.size();
-        cloudOut->resize(cloudSize);
-
-        for (int i = 0; i < cloudSize; ++i){
-
-            pointFrom = &cloudIn->points[i];
-            float x1 = ctYaw * pointFrom->x - stYaw * pointFrom->y;
-            float y1 = stYaw * pointFrom->x + ctYaw* pointFrom->y;
-            float z1 = pointFrom->z;
-
-            float x2 = x1;
-            float y2 = ctRoll * y1 - stRoll * z1;
-            float z2 = stRoll * y1 + ctRoll* z1;
-
-            pointTo.x = ctPitch * x2 + stPitch * z2 + tInX;
-            pointTo.y = y2 + tInY;
-            pointTo.z = -stPitch * x2 + ctPitch * z2 + tInZ;
-            pointTo.intensity = pointFrom->intensity;
-
-            cloudOut->points[i] = pointTo;
-        }
-        return cloudOut;
-    }
-
-    pcl::PointCloud<PointType>::Ptr transformPointCloud(pcl::PointCloud<PointType>::Ptr cloudIn, PointTypePose* transformIn){
-
-        pcl::PointCloud<PointType>::Ptr cloudOut(new pcl::PointCloud<PointType>());
-
-        PointType *pointFrom;
-        PointType pointTo;
-
-        int cloudSize = cloudIn->points.size();
-        cloudOut->resize(cloudSize);
-        
         // 点云坐标系变换到世界坐标系
-        for (int i = 0; i < cloudSize; ++i){
-
-            pointFrom = &cloudIn->points[i];
-            float x1 = cos(transformIn->yaw) * pointFrom->x - sin(transformIn->yaw) * pointFrom->y;
-            float y1 = sin(transformIn->yaw) * pointFrom->x + cos(transformIn->yaw)* pointFrom->y;
-            float z1 = pointFrom->z;
-
-            float x2 = x1;
-            float y2 = cos(transformIn->roll) * y1 - sin(transformIn->roll) * z1;
-            float z2 = sin(transformIn->roll) * y1 + cos(transformIn->roll)* z1;
-
-            pointTo.x = cos(transformIn->pitch) * x2 + sin(transformIn->pitch) * z2 + transformIn->x;
-            pointTo.y = y2 + transformIn->y;
-            pointTo.z = -sin(transformIn->pitch) * x2 + cos(transformIn->pitch) * z2 + transformIn->z;
-            pointTo.intensity = pointFrom->intensity;
-
-            cloudOut->points[i] = pointTo;
-        }
-        return cloudOut;
+        appendTransformedPointCloud(poseToMatrixYXZ(transformIn->roll, transformIn->pitch, transformIn->yaw,
+                                                    transformIn->x, transformIn->y, transformIn->z), *cloudIn, cloudOut);
     }
 
-    void laserCloudOutlierLastHandler(const sensor_msgs::PointCloud2ConstPtr& msg){
-        timeLaserCloudOutlierLast = msg->header.stamp.toSec();
-        laserCloudOutlierLast->clear();
-        pcl::fromROSMsg(*msg, *laserCloudOutlierLast);
-        newLaserCloudOutlierLast = true;
+    void laserCloudOutlierLastHandler(const pcl::PointCloud<PointType>::ConstPtr& msg){
+        laserCloudOutlierLast = msg;
+        if (frameSync.add(OutlierLastChannel, msg->header.stamp))
+            run();
     }
 
-    void laserCloudCornerLastHandler(const sensor_msgs::PointCloud2ConstPtr& msg){
-        timeLaserCloudCornerLast = msg->header.stamp.toSec();
-        laserCloudCornerLast->clear();
-        pcl::fromROSMsg(*msg, *laserCloudCornerLast);
-        newLaserCloudCornerLast = true;
+    void laserCloudCornerLastHandler(const pcl::PointCloud<PointType>::ConstPtr& msg){
+        laserCloudCornerLast = msg;
+        if (frameSync.add(CornerLastChannel, msg->header.stamp))
+            run();
     }
 
-    void laserCloudSurfLastHandler(const sensor_msgs::PointCloud2ConstPtr& msg){
-        timeLaserCloudSurfLast = msg->header.stamp.toSec();
-        laserCloudSurfLast->clear();
-        pcl::fromROSMsg(*msg, *laserCloudSurfLast);
-        newLaserCloudSurfLast = true;
+    void laserCloudSurfLastHandler(const pcl::PointCloud<PointType>::ConstPtr& msg){
+        laserCloudSurfLast = msg;
+        if (frameSync.add(SurfLastChannel, msg->header.stamp))
+            run();
     }
 
     void laserOdometryHandler(const nav_msgs::Odometry::ConstPtr& laserOdometry){
-        timeLaserOdometry = laserOdometry->header.stamp.toSec();
+        timeLaserOdometryNew = laserOdometry->header.stamp.toSec();
         double roll, pitch, yaw;
         //四元数转换为欧拉角
         geometry_msgs::Quaternion geoQuat = laserOdometry->pose.pose.orientation;
         tf::Matrix3x3(tf::Quaternion(geoQuat.z, -geoQuat.x, -geoQuat.y, geoQuat.w)).getRPY(roll, pitch, yaw);
-        transformSum[0] = -pitch;
-        transformSum[1] = -yaw;
-        transformSum[2] = roll;
-        transformSum[3] = laserOdometry->pose.pose.position.x;
-        transformSum[4] = laserOdometry->pose.pose.position.y;
-        transformSum[5] = laserOdometry->pose.pose.position.z;
-        newLaserOdometry = true;
+        transformSumNew[0] = -pitch;
+        transformSumNew[1] = -yaw;
+        transformSumNew[2] = roll;
+        transformSumNew[3] = laserOdometry->pose.pose.position.x;
+        transformSumNew[4] = laserOdometry->pose.pose.position.y;
+        transformSumNew[5] = laserOdometry->pose.pose.position.z;
+        if (frameSync.add(LaserOdometryChannel, laserOdometry->header.stamp))
+            run();
     }
 
     //接收IMU信息，只使用了翻滚角和俯仰角
     void imuHandler(const sensor_msgs::Imu::ConstPtr& imuIn){
-        double roll, pitch, yaw;
-        tf::Quaternion orientation;
-        tf::quaternionMsgToTF(imuIn->orientation, orientation);
-        tf::Matrix3x3(orientation).getRPY(roll, pitch, yaw);
-        imuPointerLast = (imuPointerLast + 1) % imuQueLength;
-        imuTime[imuPointerLast] = imuIn->header.stamp.toSec();
-        imuRoll[imuPointerLast] = roll;
-        imuPitch[imuPointerLast] = pitch;
+        imuBuffer.push(*imuIn);
     }
 
     void publishTF(){
@@ -723,17 +778,41 @@ public:
         return thisPose6D;
     }
 
+    // transformIn的旋转顺序与pointAssociateToMap一致：先绕z轴，再绕x轴，最后绕y轴，即R=Ry*Rx*Rz
+    Eigen::Affine3f trans2Affine3f(const float transformIn[]){
+        Eigen::Affine3f t = Eigen::Affine3f::Identity();
+        t.linear() = (Eigen::AngleAxisf(transformIn[1], Eigen::Vector3f::UnitY())
+                    * Eigen::AngleAxisf(transformIn[0], Eigen::Vector3f::UnitX())
+                    * Eigen::AngleAxisf(transformIn[2], Eigen::Vector3f::UnitZ())).toRotationMatrix();
+        t.translation() << transformIn[3], transformIn[4], transformIn[5];
+        return t;
+    }
+
+    void affine3f2Trans(const Eigen::Affine3f &t, float transformOut[]){
+        Eigen::Matrix3f R = t.linear();
+        // R的第二行为[cx*sz, cx*cz, -sx]，第三列为[sy*cx, -sx, cy*cx]
+        transformOut[0] = asin(-R(1, 2));
+        transformOut[1] = atan2(R(0, 2), R(2, 2));
+        transformOut[2] = atan2(R(1, 0), R(1, 1));
+        transformOut[3] = t.translation()(0);
+        transformOut[4] = t.translation()(1);
+        transformOut[5] = t.translation()(2);
+    }
+
     void publishKeyPosesAndFrames(){
 
         if (pubKeyPoses.getNumSubscribers() != 0){
             sensor_msgs::PointCloud2 cloudMsgTemp;
+            mtx.lock();
             pcl::toROSMsg(*cloudKeyPoses3D, cloudMsgTemp);
+            mtx.unlock();
             cloudMsgTemp.header.stamp = ros::Time().fromSec(timeLaserOdometry);
             cloudMsgTemp.header.frame_id = "/camera_init";
             pubKeyPoses.publish(cloudMsgTemp);
         }
 
         if (pubRecentKeyFrames.getNumSubscribers() != 0){
+            localSurfMap.getCloud(*laserCloudSurfFromMapDS);
             sensor_msgs::PointCloud2 cloudMsgTemp;
             pcl::toROSMsg(*laserCloudSurfFromMapDS, cloudMsgTemp);
             cloudMsgTemp.header.stamp = ros::Time().fromSec(timeLaserOdometry);
@@ -742,96 +821,115 @@ public:
         }
 
         if (pubRegisteredCloud.getNumSubscribers() != 0){
-            pcl::PointCloud<PointType>::Ptr cloudOut(new pcl::PointCloud<PointType>());
+            registeredCloud->clear();
             PointTypePose thisPose6D = trans2PointTypePose(transformTobeMapped);
-            *cloudOut += *transformPointCloud(laserCloudCornerLastDS,  &thisPose6D);
-            *cloudOut += *transformPointCloud(laserCloudSurfTotalLast, &thisPose6D);
+            transformPointCloud(laserCloudCornerLastDS,  &thisPose6D, *registeredCloud);
+            transformPointCloud(laserCloudSurfTotalLast, &thisPose6D, *registeredCloud);
             
             sensor_msgs::PointCloud2 cloudMsgTemp;
-            pcl::toROSMsg(*cloudOut, cloudMsgTemp);
+            pcl::toROSMsg(*registeredCloud, cloudMsgTemp);
             cloudMsgTemp.header.stamp = ros::Time().fromSec(timeLaserOdometry);
             cloudMsgTemp.header.frame_id = "/camera_init";
             pubRegisteredCloud.publish(cloudMsgTemp);
         } 
     }
 
+    // 等待图优化线程加入新的关键帧(已处理的关键帧数超过processedNum)，并且不早于notBefore，stop()之后返回false
+    bool waitForKeyFrame(int processedNum, std::chrono::steady_clock::time_point notBefore){
+        std::unique_lock<std::mutex> lock(progressMtx);
+        progressCond.wait_until(lock, notBefore, [this]{ return running == false; });
+        progressCond.wait(lock, [this, processedNum]{ return running == false || keyFrameProcessedNum > processedNum; });
+        return running;
+    }
+
+    // 全局地图由地图导出线程按块增量维护(新的订阅者由构造函数中的连接回调处理)，只有新的关键帧加入后才会变化，
+    // /laser_cloud_surround有订阅者时最多每globalMapPublishInterval秒由缓存的块拼接发布一次
     void visualizeGlobalMapThread(){
-        ros::Rate rate(0.2);
-        while (ros::ok()){
-            rate.sleep();
-            publishGlobalMap();
+        int processedNum = 0;
+        std::chrono::steady_clock::time_point notBefore = std::chrono::steady_clock::now();
+        while (waitForKeyFrame(processedNum, notBefore)){
+            processedNum = keyFrameProcessedNum;
+            notBefore = std::chrono::steady_clock::now()
+                      + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(globalMapPublishInterval));
+            if (pubLaserCloudSurround.getNumSubscribers() != 0)
+                publishGlobalMap();
         }
-        // save final point cloud
-        pcl::io::savePCDFileASCII(fileDirectory+"finalCloud.pcd", *globalMapKeyFramesDS);
-
-        string cornerMapString = "/tmp/cornerMap.pcd";
-        string surfaceMapString = "/tmp/surfaceMap.pcd";
-        string trajectoryString = "/tmp/trajectory.pcd";
+    }
 
-        pcl::PointCloud<PointType>::Ptr cornerMapCloud(new pcl::PointCloud<PointType>());
-        pcl::PointCloud<PointType>::Ptr cornerMapCloudDS(new pcl::PointCloud<PointType>());
-        pcl::PointCloud<PointType>::Ptr surfaceMapCloud(new pcl::PointCloud<PointType>());
-        pcl::PointCloud<PointType>::Ptr surfaceMapCloudDS(new pcl::PointCloud<PointType>());
-        
-        for(int i = 0; i < cornerCloudKeyFrames.size(); i++) {
-            *cornerMapCloud  += *transformPointCloud(cornerCloudKeyFrames[i],   &cloudKeyPoses6D->points[i]);
-    	    *surfaceMapCloud += *transformPointCloud(surfCloudKeyFrames[i],     &cloudKeyPoses6D->points[i]);
-    	    *surfaceMapCloud += *transformPointCloud(outlierCloudKeyFrames[i],  &cloudKeyPoses6D->points[i]);
+    // 地图导出线程中调用：在/map_tiles上发布有变化的块，/laser_cloud_surround有订阅者时更新缓存
+    void handleMapTiles(const std::vector<MapExporter::TileUpdate> &updates, bool reset){
+        if (pubMapTiles.getNumSubscribers() != 0){
+            std_msgs::Header header;
+            header.stamp = ros::Time::now();
+            header.frame_id = "/camera_init";
+            for (size_t i = 0; i < updates.size() || (reset && i == 0); ++i){
+                cloud_msgs::MapTile tileMsg;
+                tileMsg.header = header;
+                tileMsg.reset = reset && i == 0;
+                if (i < updates.size()){
+                    tileMsg.layer = updates[i].layer;
+                    tileMsg.x = updates[i].x;
+                    tileMsg.z = updates[i].z;
+                    tileMsg.size = updates[i].size;
+                    pcl::toROSMsg(*updates[i].cloud, tileMsg.cloud);
+                }
+                tileMsg.cloud.header = header;
+                pubMapTiles.publish(tileMsg);
+            }
         }
 
-        downSizeFilterCorner.setInputCloud(cornerMapCloud);
-        downSizeFilterCorner.filter(*cornerMapCloudDS);
-        downSizeFilterSurf.setInputCloud(surfaceMapCloud);
-        downSizeFilterSurf.filter(*surfaceMapCloudDS);
-
-        pcl::io::savePCDFileASCII(fileDirectory+"cornerMap.pcd", *cornerMapCloudDS);
-        pcl::io::savePCDFileASCII(fileDirectory+"surfaceMap.pcd", *surfaceMapCloudDS);
-        pcl::io::savePCDFileASCII(fileDirectory+"trajectory.pcd", *cloudKeyPoses3D);
+        std::lock_guard<std::mutex> lock(globalMapMtx);
+        // 没有订阅者时不保留缓存，新的订阅者出现时会收到全部的块
+        if (pubLaserCloudSurround.getNumSubscribers() == 0){
+            globalMapTiles.clear();
+            return;
+        }
+        if (reset)
+            globalMapTiles.clear();
+        for (size_t i = 0; i < updates.size(); ++i){
+            std::tuple<int, int, int> key(updates[i].layer, updates[i].x, updates[i].z);
+            if (updates[i].cloud->empty())
+                globalMapTiles.erase(key);
+            else
+                globalMapTiles[key] = updates[i];
+        }
+        globalMapChanged = true;
     }
 
+    // 拼接最新关键帧globalMapVisualizationSearchRadius范围内的块，块中的点已经体素降采样，不需要再变换和滤波
     void publishGlobalMap(){
 
-        if (pubLaserCloudSurround.getNumSubscribers() == 0)
-            return;
-
         if (cloudKeyPoses3D->points.empty() == true)
             return;
-	    // kd-tree to find near key frames to visualize
-        std::vector<int> pointSearchIndGlobalMap;
-        std::vector<float> pointSearchSqDisGlobalMap;
-	    // search near key frames to visualize
+
         mtx.lock();
-        kdtreeGlobalMap->setInputCloud(cloudKeyPoses3D);
-        // 通过KDTree进行最近邻搜索
-        kdtreeGlobalMap->radiusSearch(currentRobotPosPoint, globalMapVisualizationSearchRadius, pointSearchIndGlobalMap, pointSearchSqDisGlobalMap, 0);
+        // 以最新的关键帧位置为中心，currentRobotPosPoint归scan-to-map线程所有
+        double timeLatestKeyFrame = cloudKeyPoses6D->points.back().time;
+        PointType latestKeyPose = cloudKeyPoses3D->points.back();
         mtx.unlock();
 
-        for (int i = 0; i < pointSearchIndGlobalMap.size(); ++i)
-          globalMapKeyPoses->points.push_back(cloudKeyPoses3D->points[pointSearchIndGlobalMap[i]]);
-	    // downsample near selected key frames
-        downSizeFilterGlobalMapKeyPoses.setInputCloud(globalMapKeyPoses);
-        downSizeFilterGlobalMapKeyPoses.filter(*globalMapKeyPosesDS);
-	    // extract visualized and downsampled key frames
-        for (int i = 0; i < globalMapKeyPosesDS->points.size(); ++i){
-			int thisKeyInd = (int)globalMapKeyPosesDS->points[i].intensity;
-			*globalMapKeyFrames += *transformPointCloud(cornerCloudKeyFrames[thisKeyInd],   &cloudKeyPoses6D->points[thisKeyInd]);
-			*globalMapKeyFrames += *transformPointCloud(surfCloudKeyFrames[thisKeyInd],    &cloudKeyPoses6D->points[thisKeyInd]);
-			*globalMapKeyFrames += *transformPointCloud(outlierCloudKeyFrames[thisKeyInd], &cloudKeyPoses6D->points[thisKeyInd]);
+        pcl::PointCloud<PointType>::Ptr globalMapCloud(new pcl::PointCloud<PointType>());
+        {
+            std::lock_guard<std::mutex> lock(globalMapMtx);
+            if (globalMapChanged == false)
+                return;
+            globalMapChanged = false;
+            for (auto it = globalMapTiles.begin(); it != globalMapTiles.end(); ++it){
+                const MapExporter::TileUpdate &tile = it->second;
+                // 水平面上最新关键帧到块的最近距离
+                float x0 = tile.x * tile.size, z0 = tile.z * tile.size;
+                float dx = std::max(std::max(x0 - latestKeyPose.x, latestKeyPose.x - (x0 + tile.size)), 0.0f);
+                float dz = std::max(std::max(z0 - latestKeyPose.z, latestKeyPose.z - (z0 + tile.size)), 0.0f);
+                if (dx * dx + dz * dz <= globalMapVisualizationSearchRadius * globalMapVisualizationSearchRadius)
+                    *globalMapCloud += *tile.cloud;
+            }
         }
-	    // downsample visualized points
-        downSizeFilterGlobalMapKeyFrames.setInputCloud(globalMapKeyFrames);
-        downSizeFilterGlobalMapKeyFrames.filter(*globalMapKeyFramesDS);
- 
+
         sensor_msgs::PointCloud2 cloudMsgTemp;
-        pcl::toROSMsg(*globalMapKeyFramesDS, cloudMsgTemp);
-        cloudMsgTemp.header.stamp = ros::Time().fromSec(timeLaserOdometry);
+        pcl::toROSMsg(*globalMapCloud, cloudMsgTemp);
+        cloudMsgTemp.header.stamp = ros::Time().fromSec(timeLatestKeyFrame);
         cloudMsgTemp.header.frame_id = "/camera_init";
-        pubLaserCloudSurround.publish(cloudMsgTemp);  
-
-        globalMapKeyPoses->clear();
-        globalMapKeyPosesDS->clear();
-        globalMapKeyFrames->clear();
-        // globalMapKeyFramesDS->clear();     
+        pubLaserCloudSurround.publish(cloudMsgTemp);
     }
 
     void loopClosureThread(){
@@ -839,9 +937,14 @@ public:
         if (loopClosureEnableFlag == false)
             return;
 
-        ros::Rate rate(1);
-        while (ros::ok()){
-            rate.sleep();
+        metrics.nameThread("loopClosure");
+
+        // 回环检测只使用最新的关键帧，没有新关键帧时结果不会变化，所以每加入新的关键帧执行一次，最多每秒一次
+        int processedNum = 0;
+        std::chrono::steady_clock::time_point notBefore = std::chrono::steady_clock::now();
+        while (waitForKeyFrame(processedNum, notBefore)){
+            processedNum = keyFrameProcessedNum;
+            notBefore = std::chrono::steady_clock::now() + std::chrono::seconds(1);
             performLoopClosure();
         }
     }
@@ -849,8 +952,6 @@ public:
     bool detectLoopClosure(){
 
         latestSurfKeyFrameCloud->clear();
-        nearHistorySurfKeyFrameCloud->clear();
-        nearHistorySurfKeyFrameCloudDS->clear();
 
         // 资源分配时初始化
         // 在互斥量被析构前不解锁
@@ -858,64 +959,96 @@ public:
         // find the closest history key frame
         std::vector<int> pointSearchIndLoop;
         std::vector<float> pointSearchSqDisLoop;
-        kdtreeHistoryKeyPoses->setInputCloud(cloudKeyPoses3D);
+        // 以最新的关键帧作为当前位置
+        PointType latestKeyPose = cloudKeyPoses3D->points.back();
+        double timeLatestKeyFrame = cloudKeyPoses6D->points.back().time;
         // 进行半径historyKeyframeSearchRadius内的邻域搜索，
-        // currentRobotPosPoint：需要查询的点，
+        // latestKeyPose：需要查询的点，
         // pointSearchIndLoop：搜索完的邻域点对应的索引
         // pointSearchSqDisLoop：搜索完的每个邻域点与当前点之间的欧式距离
         // 0：返回的邻域个数，为0表示返回全部的邻域点
-        kdtreeHistoryKeyPoses->radiusSearch(currentRobotPosPoint, historyKeyframeSearchRadius, pointSearchIndLoop, pointSearchSqDisLoop, 0);
+        keyPoseIndex.radiusSearch(latestKeyPose, historyKeyframeSearchRadius, pointSearchIndLoop, pointSearchSqDisLoop);
         
         closestHistoryFrameID = -1;// 与当前帧最近的历史关键帧ID
         for (int i = 0; i < pointSearchIndLoop.size(); ++i){
             int id = pointSearchIndLoop[i];
             // 两个时间差值大于30秒 ///Q 只用时间判断是否太简单了点???
-            if (abs(cloudKeyPoses6D->points[id].time - timeLaserOdometry) > 30.0){
+            if (abs(cloudKeyPoses6D->points[id].time - timeLatestKeyFrame) > 30.0){
                 closestHistoryFrameID = id;
                 break;
             }
         }
-        if (closestHistoryFrameID == -1){ // 找到的点和当前时间上没有超过30秒的
-            return false;
-        }
         // save latest key frames
         latestFrameIDLoopCloure = cloudKeyPoses3D->points.size() - 1; // 回环帧ID
+        loopSourcePose = cloudKeyPoses6D->points[latestFrameIDLoopCloure];
+        if (closestHistoryFrameID == -1){ // 找到的点和当前时间上没有超过30秒的
+            // 漂移较大时当前位置附近找不到回环，用Scan Context在所有关键帧中检索
+            float yawDiff;
+            bool found;
+            {
+                ScopedTimer timer(metrics, "scanContextDetect");
+                found = scanContext.detect(latestFrameIDLoopCloure, 30.0, closestHistoryFrameID, yawDiff);
+            }
+            if (found == false)
+                return false;
+            metrics.increment("scan context candidates");
+            // 漂移后的位姿不能作为配准初值，把回环帧放到候选关键帧的位姿上，并按描述子估计的航向差绕竖直轴(相机坐标系y轴)旋转
+            // 这里忽略了候选帧的roll/yaw(相机坐标系下)与航向旋转的耦合，剩余误差由配准修正
+            loopSourcePose = cloudKeyPoses6D->points[closestHistoryFrameID];
+            loopSourcePose.pitch += yawDiff;
+        }
+        timeSaveFirstCurrentScanForLoopClosure = timeLatestKeyFrame;
         // 回环帧点云的xyz坐标进行坐标系变换(分别绕xyz轴旋转)，转换到世界坐标系下
-        *latestSurfKeyFrameCloud += *transformPointCloud(cornerCloudKeyFrames[latestFrameIDLoopCloure], &cloudKeyPoses6D->points[latestFrameIDLoopCloure]);
-        *latestSurfKeyFrameCloud += *transformPointCloud(surfCloudKeyFrames[latestFrameIDLoopCloure],   &cloudKeyPoses6D->points[latestFrameIDLoopCloure]);
+        KeyFrameStore::KeyFrame latestKeyFrame = keyFrameStore.get(latestFrameIDLoopCloure);
+        transformPointCloud(latestKeyFrame.corner, &loopSourcePose, *latestSurfKeyFrameCloud);
+        transformPointCloud(latestKeyFrame.surf,   &loopSourcePose, *latestSurfKeyFrameCloud);
 
         // latestSurfKeyFrameCloud中存储的是下面公式计算后的index(intensity):
         // thisPoint.intensity = (float)rowIdn + (float)columnIdn / 10000.0;
         // 滤掉latestSurfKeyFrameCloud中index<0的点??? index值会小于0?
-        pcl::PointCloud<PointType>::Ptr hahaCloud(new pcl::PointCloud<PointType>());
+        // 原来把保留的点拷贝到临时点云hahaCloud再拷贝回来，这里原地前移保留的点，顺序不变
         int cloudSize = latestSurfKeyFrameCloud->points.size(); // 回环帧所有特征点数目
+        int keptNum = 0;
         for (int i = 0; i < cloudSize; ++i){
-            // intensity不小于0的点放进hahaCloud队列
+            // intensity不小于0的点保留
             // 初始化时intensity是-1，滤掉那些点
             if ((int)latestSurfKeyFrameCloud->points[i].intensity >= 0){///Q 这里的intensity应该是 线号+相对时间
-                hahaCloud->push_back(latestSurfKeyFrameCloud->points[i]);
+                latestSurfKeyFrameCloud->points[keptNum++] = latestSurfKeyFrameCloud->points[i];
             }
         }
-        latestSurfKeyFrameCloud->clear();
-        *latestSurfKeyFrameCloud = *hahaCloud;
+        latestSurfKeyFrameCloud->resize(keptNum);
+
+        // 配准失败后下一次检测往往得到同一个历史关键帧，目标子图包含的关键帧和位姿都没有变化时直接复用
+        int historyEndID = std::min(closestHistoryFrameID + historyKeyframeSearchNum, latestFrameIDLoopCloure);
+        if (closestHistoryFrameID == historyTargetFrameID && historyEndID == historyTargetEndID &&
+            keyPoseRevision == historyTargetRevision)
+            return true;
+
+        nearHistorySurfKeyFrameCloud->clear();
+        nearHistorySurfKeyFrameCloudDS->clear();
 	   // save history near key frames，前后25个点进行变换
         for (int j = -historyKeyframeSearchNum; j <= historyKeyframeSearchNum; ++j){
             // 要求closestHistoryFrameID + j在0到cloudKeyPoses3D->points.size()-1之间,不能超过索引
             if (closestHistoryFrameID + j < 0 || closestHistoryFrameID + j > latestFrameIDLoopCloure)
                 continue;
             // 以与当前帧最近的历史关键帧为中心，以一定数量向两边扩展形成待回环的局部地图，与回环帧作scan-to-map匹配
-            *nearHistorySurfKeyFrameCloud += *transformPointCloud(cornerCloudKeyFrames[closestHistoryFrameID+j], &cloudKeyPoses6D->points[closestHistoryFrameID+j]);
-            *nearHistorySurfKeyFrameCloud += *transformPointCloud(surfCloudKeyFrames[closestHistoryFrameID+j],   &cloudKeyPoses6D->points[closestHistoryFrameID+j]);
+            KeyFrameStore::KeyFrame historyKeyFrame = keyFrameStore.get(closestHistoryFrameID+j);
+            transformPointCloud(historyKeyFrame.corner, &cloudKeyPoses6D->points[closestHistoryFrameID+j], *nearHistorySurfKeyFrameCloud);
+            transformPointCloud(historyKeyFrame.surf,   &cloudKeyPoses6D->points[closestHistoryFrameID+j], *nearHistorySurfKeyFrameCloud);
         }
 
         // 降采样滤波减少数据量
         downSizeFilterHistoryKeyFrames.setInputCloud(nearHistorySurfKeyFrameCloud);
         downSizeFilterHistoryKeyFrames.filter(*nearHistorySurfKeyFrameCloudDS);
+        historyTargetFrameID = closestHistoryFrameID;
+        historyTargetEndID = historyEndID;
+        historyTargetRevision = keyPoseRevision;
+        historyTargetChanged = true;
         // publish history near key frames
         if (pubHistoryKeyFrames.getNumSubscribers() != 0){
             sensor_msgs::PointCloud2 cloudMsgTemp;
             pcl::toROSMsg(*nearHistorySurfKeyFrameCloudDS, cloudMsgTemp);
-            cloudMsgTemp.header.stamp = ros::Time().fromSec(timeLaserOdometry);
+            cloudMsgTemp.header.stamp = ros::Time().fromSec(timeLatestKeyFrame);
             cloudMsgTemp.header.frame_id = "/camera_init";
             pubHistoryKeyFrames.publish(cloudMsgTemp);
         }
@@ -930,46 +1063,51 @@ public:
         //如果返回true,则可能可以进行闭环，否则直接返回，程序结束。
         if (cloudKeyPoses3D->points.empty() == true)// 这里还没有关键帧数据进来
             return;
+        ScopedTimer timer(metrics, "performLoopClosure");
         // try to find close key frame if there are any
         if (potentialLoopFlag == false){
 
-            if (detectLoopClosure() == true){
+            bool detected;
+            {
+                ScopedTimer timer(metrics, "detectLoopClosure");
+                detected = detectLoopClosure();
+            }
+            if (detected == true){
                 potentialLoopFlag = true; // find some key frames that is old enough or close enough for loop closure
-                timeSaveFirstCurrentScanForLoopClosure = timeLaserOdometry;
             }
             if (potentialLoopFlag == false)
                 return;
         }
         // reset the flag first no matter icp successes or not
         potentialLoopFlag = false;
-        //2.接着使用icp迭代进行对齐
-        // ICP Settings
-        pcl::IterativeClosestPoint<PointType, PointType> icp;
-        icp.setMaxCorrespondenceDistance(100);
-        icp.setMaximumIterations(100);
-        icp.setTransformationEpsilon(1e-6);
-        icp.setEuclideanFitnessEpsilon(1e-6);
-        icp.setRANSACIterations(0); // 设置RANSAC运行次数
-        // Align clouds
-        icp.setInputSource(latestSurfKeyFrameCloud); // 回环帧
-        icp.setInputTarget(nearHistorySurfKeyFrameCloudDS); // 待回环的局部子图 // 使用detectLoopClosure()函数中下采样刚刚更新nearHistorySurfKeyFrameCloudDS
-        pcl::PointCloud<PointType>::Ptr unused_result(new pcl::PointCloud<PointType>());
-        icp.align(*unused_result); // 进行icp点云对齐
+        //2.接着使用点到平面的ICP由粗到细进行对齐
+        // 待回环的局部子图(detectLoopClosure中降采样得到的nearHistorySurfKeyFrameCloudDS)变化时才重新建立KD树和平面参数
+        if (historyTargetChanged == true){
+            ScopedTimer timer(metrics, "loopRegistration.setTarget");
+            loopRegistration.setTarget(nearHistorySurfKeyFrameCloudDS);
+            historyTargetChanged = false;
+        }
+        Eigen::Matrix4f finalTransformation;
+        {
+            ScopedTimer timer(metrics, "loopRegistration.align");
+            loopRegistration.align(latestSurfKeyFrameCloud, finalTransformation); // 回环帧
+        }
+        metrics.addValue("loop target points", nearHistorySurfKeyFrameCloudDS->points.size());
+        metrics.addValue("loop fitness score", loopRegistration.getFitnessScore());
 
         //3.对齐之后判断迭代是否收敛以及噪声是否太大，是则返回并直接结束函数。否则进行迭代后的数据发布处理。
         // 为什么匹配分数高直接返回???分数高代表噪声太多
-        if (icp.hasConverged() == false || icp.getFitnessScore() > historyKeyframeFitnessScore)
+        if (loopRegistration.hasConverged() == false || loopRegistration.getFitnessScore() > historyKeyframeFitnessScore)
             return;
         //4.接下来得到latestSurfKeyFrameCloud和nearHistorySurfKeyFrameCloudDS之间的位置平移和旋转
         // publish corrected cloud
         // 以下在点云icp收敛并且噪声量在一定范围内进行
         if (pubIcpKeyFrames.getNumSubscribers() != 0){
             pcl::PointCloud<PointType>::Ptr closed_cloud(new pcl::PointCloud<PointType>());
-            // icp.getFinalTransformation()的返回值是Eigen::Matrix<Scalar, 4, 4>
-            pcl::transformPointCloud (*latestSurfKeyFrameCloud, *closed_cloud, icp.getFinalTransformation());
+            pcl::transformPointCloud (*latestSurfKeyFrameCloud, *closed_cloud, finalTransformation);
             sensor_msgs::PointCloud2 cloudMsgTemp;
             pcl::toROSMsg(*closed_cloud, cloudMsgTemp);
-            cloudMsgTemp.header.stamp = ros::Time().fromSec(timeLaserOdometry);
+            cloudMsgTemp.header.stamp = ros::Time().fromSec(timeSaveFirstCurrentScanForLoopClosure);
             cloudMsgTemp.header.frame_id = "/camera_init";
             pubIcpKeyFrames.publish(cloudMsgTemp);
         }   
@@ -978,32 +1116,44 @@ public:
         	*/
         float x, y, z, roll, pitch, yaw;
         Eigen::Affine3f correctionCameraFrame;
-        correctionCameraFrame = icp.getFinalTransformation(); // get transformation in camera frame (because points are in camera frame)
+        correctionCameraFrame = finalTransformation; // get transformation in camera frame (because points are in camera frame)
         // 得到平移和旋转的角度
         pcl::getTranslationAndEulerAngles(correctionCameraFrame, x, y, z, roll, pitch, yaw);
         Eigen::Affine3f correctionLidarFrame = pcl::getTransformation(z, x, y, yaw, roll, pitch);
         // transform from world origin to wrong pose
-        Eigen::Affine3f tWrong = pclPointToAffine3fCameraToLidar(cloudKeyPoses6D->points[latestFrameIDLoopCloure]);
+        // 回环帧点云是用loopSourcePose变换到世界坐标系的，半径搜索得到的回环即为漂移后的位姿
+        Eigen::Affine3f tWrong = pclPointToAffine3fCameraToLidar(loopSourcePose);
         // transform from world origin to corrected pose
         Eigen::Affine3f tCorrect = correctionLidarFrame * tWrong; // pre-multiplying -> successive rotation about a fixed frame
         pcl::getTranslationAndEulerAngles (tCorrect, x, y, z, roll, pitch, yaw);
         gtsam::Pose3 poseFrom = Pose3(Rot3::RzRyRx(roll, pitch, yaw), Point3(x, y, z));
         gtsam::Pose3 poseTo = pclPointTogtsamPose3(cloudKeyPoses6D->points[closestHistoryFrameID]);
         gtsam::Vector Vector6(6);
-        float noiseScore = icp.getFitnessScore();
+        float noiseScore = loopRegistration.getFitnessScore();
         Vector6 << noiseScore, noiseScore, noiseScore, noiseScore, noiseScore, noiseScore;
         constraintNoise = noiseModel::Diagonal::Variances(Vector6);
         /* 
         	add constraints
         	*/
         //5.然后进行图优化过程
-        std::lock_guard<std::mutex> lock(mtx);
-        gtSAMgraph.add(BetweenFactor<Pose3>(latestFrameIDLoopCloure, closestHistoryFrameID, poseFrom.between(poseTo), constraintNoise));
-        isam->update(gtSAMgraph);
-        isam->update();
-        gtSAMgraph.resize(0);
-
-        aLoopIsClosed = true;
+        std::unique_lock<std::mutex> lock(mtx);
+        metrics.increment("loop closures");
+        if (backend.addLoop(latestFrameIDLoopCloure, closestHistoryFrameID, poseFrom.between(poseTo), constraintNoise)){
+            // 历史关键帧在优化窗口内，下一次saveKeyFramesAndFactor时修正窗口内的关键帧位姿
+            aLoopIsClosed = true;
+            return;
+        }
+        // 历史关键帧已移出优化窗口，对整条轨迹做一次批量优化，优化期间不持有锁，建图和图优化线程照常运行
+        PoseGraphBackend::Batch batch;
+        backend.prepareBatch(batch);
+        lock.unlock();
+        {
+            ScopedTimer timer(metrics, "batchOptimization");
+            PoseGraphBackend::optimizeBatch(batch);
+        }
+        lock.lock();
+        backend.applyBatch(batch);
+        applyCorrectedPoses(0);
     }
 
     Pose3 pclPointTogtsamPose3(PointTypePose thisPoint){ // camera frame to lidar frame
@@ -1017,361 +1167,361 @@ public:
 
     void extractSurroundingKeyFrames(){
 
-        if (cloudKeyPoses3D->points.empty() == true) // cloudKeyPoses3D在saveKeyFramesAndFactor函数中进行增添等
+        if (keyFrameNum == 0) // 关键帧在submitKeyFrame函数中进行增添等
             return;	
-		
-    	// 如果开启回环检测
-        if (loopClosureEnableFlag == true){ // 这个变量另外只在loopthread这部分中有用到
-    	    // only use recent key poses for graph building
-                // recentCornerCloudKeyFrames保存的点云数量太少，则清空后重新塞入新的点云直至数量够
-                if (recentCornerCloudKeyFrames.size() < surroundingKeyframeSearchNum){ // queue is not full (the beginning of mapping or a loop is just closed)
-                    // clear recent key frames queue
-                    recentCornerCloudKeyFrames. clear();
-                    recentSurfCloudKeyFrames.   clear();
-                    recentOutlierCloudKeyFrames.clear();
-                    int numPoses = cloudKeyPoses3D->points.size();// 所有的关键帧数目
-                    for (int i = numPoses-1; i >= 0; --i){
-                        // cloudKeyPoses3D的intensity中存的是索引值?  // 其实就是关键帧的索引
-                        // 保存的索引值从1开始编号；///Q 关键帧索引值应该是从0开始的!!!
-                        int thisKeyInd = (int)cloudKeyPoses3D->points[i].intensity;
-                        PointTypePose thisTransformation = cloudKeyPoses6D->points[thisKeyInd];// 选定的关键帧相对应的6D位姿
-                        updateTransformPointCloudSinCos(&thisTransformation);
-                        // 依据上面得到的变换thisTransformation，对cornerCloudKeyFrames，surfCloudKeyFrames，surfCloudKeyFrames
-                        // 关键帧点云进行坐标变换，变换至世界坐标系下
-                        // extract surrounding map
-                        recentCornerCloudKeyFrames. push_front(transformPointCloud(cornerCloudKeyFrames[thisKeyInd]));
-                        recentSurfCloudKeyFrames.   push_front(transformPointCloud(surfCloudKeyFrames[thisKeyInd]));
-                        recentOutlierCloudKeyFrames.push_front(transformPointCloud(outlierCloudKeyFrames[thisKeyInd]));
-                        if (recentCornerCloudKeyFrames.size() >= surroundingKeyframeSearchNum)
-                            break;
-                    }
-                }else{  // queue is full, pop the oldest key frame and push the latest key frame
-                    // recentCornerCloudKeyFrames中点云保存的数量较多
-                    // pop队列最前端的一个，再push后面一个
-                    if (latestFrameID != cloudKeyPoses3D->points.size() - 1){  // if the robot is not moving, no need to update recent frames
-
-                        recentCornerCloudKeyFrames. pop_front();
-                        recentSurfCloudKeyFrames.   pop_front();
-                        recentOutlierCloudKeyFrames.pop_front();
-                        // push latest scan to the end of queue
-                        // 为什么要把recentCornerCloudKeyFrames最前面第一个元素弹出???因为是保存的当前帧附近的关键帧，所以是动态更新的
-                        // (1个而不是好几个或者是全部)?
-                        latestFrameID = cloudKeyPoses3D->points.size() - 1;// 后面只有机器人移动超过一定的阈值才会保存关键帧
-                        PointTypePose thisTransformation = cloudKeyPoses6D->points[latestFrameID];
-                        updateTransformPointCloudSinCos(&thisTransformation);
-                        recentCornerCloudKeyFrames. push_back(transformPointCloud(cornerCloudKeyFrames[latestFrameID]));
-                        recentSurfCloudKeyFrames.   push_back(transformPointCloud(surfCloudKeyFrames[latestFrameID]));
-                        recentOutlierCloudKeyFrames.push_back(transformPointCloud(outlierCloudKeyFrames[latestFrameID]));
-                    }
-                }
 
-                for (int i = 0; i < recentCornerCloudKeyFrames.size(); ++i){
-                    // 两个pcl::PointXYZI相加?
-                    // 注意这里把recentOutlierCloudKeyFrames也加入到了laserCloudSurfFromMap                    
-                    *laserCloudCornerFromMap += *recentCornerCloudKeyFrames[i];
-                    *laserCloudSurfFromMap   += *recentSurfCloudKeyFrames[i];
-                    *laserCloudSurfFromMap   += *recentOutlierCloudKeyFrames[i];
-                }
-    	}else{
-            // 下面这部分是没有闭环的代码
+        // 降级时按较小的半径(或关键帧数)移出的关键帧不会再被增量插入，恢复后按新的设置重建一次局部地图
+        if (submapGrown == true){
+            ScopedTimer timer(metrics, "rebuildLocalMap", timeLaserOdometry);
+            // 降级恢复很少发生，与回环修正一样等待已提交的关键帧加入位姿图，重建时不会漏掉它们
+            waitForSubmittedKeyFrames();
+            std::lock_guard<std::mutex> lock(mtx);
+            rebuildLocalMap();
+            submapGrown = false;
+        }
+
+        // 局部地图在submitKeyFrame中增量插入新关键帧，这里只需要移除离开submap的体素，
+        // 不再重新拼接关键帧点云、降采样以及重建KD树；移除的判据与rebuildLocalMap选取关键帧的方式相同，
+        // 开启回环时只保留最近submapKeyFrameNum个关键帧观测的block，否则保留submapRadius以内的block
+        if (loopClosureEnableFlag == true){
+            localCornerMap.evictOlderThan(keyFrameNum - submapKeyFrameNum);
+            localSurfMap.evictOlderThan(keyFrameNum - submapKeyFrameNum);
+        }else{
+            localCornerMap.evict(currentRobotPosPoint, submapRadius);
+            localSurfMap.evict(currentRobotPosPoint, submapRadius);
+        }
+
+        laserCloudCornerFromMapDSNum = localCornerMap.size();
+        laserCloudSurfFromMapDSNum = localSurfMap.size();
+    }
+
+    // 将第keyFrame个关键帧的点云按thisTransformation变换到世界坐标系下插入局部地图
+    void insertKeyFrameToLocalMap(const pcl::PointCloud<PointType>::ConstPtr &corner, const pcl::PointCloud<PointType>::ConstPtr &surf,
+                                  const pcl::PointCloud<PointType>::ConstPtr &outlier, PointTypePose thisTransformation, int keyFrame){
+        Eigen::Matrix4f T = poseToMatrixYXZ(thisTransformation.roll, thisTransformation.pitch, thisTransformation.yaw,
+                                            thisTransformation.x, thisTransformation.y, thisTransformation.z);
+        PointType origin;
+        origin.x = thisTransformation.x;
+        origin.y = thisTransformation.y;
+        origin.z = thisTransformation.z;
+        // 三帧点云依次复用keyFrameWorldCloud，不再为每帧分配新的点云
+        ::transformPointCloud(T, *corner, *keyFrameWorldCloud);
+        localCornerMap.insert(*keyFrameWorldCloud, origin, keyFrame);
+        ::transformPointCloud(T, *surf, *keyFrameWorldCloud);
+        localSurfMap.insert(*keyFrameWorldCloud, origin, keyFrame);
+        ::transformPointCloud(T, *outlier, *keyFrameWorldCloud);
+        localSurfMap.insert(*keyFrameWorldCloud, origin, keyFrame);
+    }
+
+    // 回环修正了关键帧位姿之后，局部地图中的世界坐标失效，需要按修正后的位姿重新构建
+    // 调用时需要持有mtx
+    void rebuildLocalMap(){
+
+        localCornerMap.clear();
+        localSurfMap.clear();
+
+        int numPoses = cloudKeyPoses3D->points.size();
+        if (numPoses == 0)
+            return;
+
+        std::vector<int> keyInds;
+        if (loopClosureEnableFlag == true){
+            // only use recent key poses for graph building
+            for (int i = std::max(0, numPoses - submapKeyFrameNum); i < numPoses; ++i)
+                keyInds.push_back(i);
+        }else{
             surroundingKeyPoses->clear();
             surroundingKeyPosesDS->clear();
-    	    // extract all the nearby key poses and downsample them
-    	    kdtreeSurroundingKeyPoses->setInputCloud(cloudKeyPoses3D);
-            // 进行半径surroundingKeyframeSearchRadius内的邻域搜索，
-            // currentRobotPosPoint：需要查询的点，
-            // pointSearchInd：搜索完的邻域点对应的索引
-            // pointSearchSqDis：搜索完的每个领域点点与传讯点之间的欧式距离
-            // 0：返回的邻域个数，为0表示返回全部的邻域点    	    
-            kdtreeSurroundingKeyPoses->radiusSearch(currentRobotPosPoint, (double)surroundingKeyframeSearchRadius, pointSearchInd, pointSearchSqDis, 0);
-    	    for (int i = 0; i < pointSearchInd.size(); ++i)
+            // extract all the nearby key poses and downsample them
+            keyPoseIndex.radiusSearch(currentRobotPosPoint, submapRadius, pointSearchInd, pointSearchSqDis);
+            for (int i = 0; i < pointSearchInd.size(); ++i)
                 surroundingKeyPoses->points.push_back(cloudKeyPoses3D->points[pointSearchInd[i]]);
-    	    downSizeFilterSurroundingKeyPoses.setInputCloud(surroundingKeyPoses);
-    	    downSizeFilterSurroundingKeyPoses.filter(*surroundingKeyPosesDS);
-    	    // delete key frames that are not in surrounding region
-            // surroundingExistingKeyPosesID其实保存的就是当前帧点云附近的pose的id
-            int numSurroundingPosesDS = surroundingKeyPosesDS->points.size();
-            for (int i = 0; i < surroundingExistingKeyPosesID.size(); ++i){// 第一帧不进入，surroundingExistingKeyPosesID大小会动态变化
-                bool existingFlag = false;
-                for (int j = 0; j < numSurroundingPosesDS; ++j){
-                    // 双重循环，不断对比surroundingExistingKeyPosesID[i]和surroundingKeyPosesDS的点的index
-                    // 如果能够找到一样的，说明存在相同的关键帧(因为surroundingKeyPosesDS从cloudKeyPoses3D中筛选而来)
-                    // 其实就是选定的关键帧在当前帧点云附近，就跳出去               
-                    if (surroundingExistingKeyPosesID[i] == (int)surroundingKeyPosesDS->points[j].intensity){
-                        existingFlag = true;
-                        break;
-                    }
-                }
-                if (existingFlag == false){ // 其实就是选定的关键帧没有在当前帧点云附近，就把它删除
-                    // 如果surroundingExistingKeyPosesID[i]对比了一轮的已经存在的关键位姿的索引后（intensity保存的就是size()）
-                    // 没有找到相同的关键点，那么把这个点从当前队列中删除
-                    // 否则的话，existingFlag为true，该关键点就将它留在队列中                    
-                    surroundingExistingKeyPosesID.   erase(surroundingExistingKeyPosesID.   begin() + i);
-                    surroundingCornerCloudKeyFrames. erase(surroundingCornerCloudKeyFrames. begin() + i);
-                    surroundingSurfCloudKeyFrames.   erase(surroundingSurfCloudKeyFrames.   begin() + i);
-                    surroundingOutlierCloudKeyFrames.erase(surroundingOutlierCloudKeyFrames.begin() + i);
-                    --i;
-                }
-            }
-    	    // add new key frames that are not in calculated existing key frames
-            // 上一个两重for循环主要用于删除数据，此处的两重for循环用来添加数据
-            for (int i = 0; i < numSurroundingPosesDS; ++i) {
-                bool existingFlag = false;
-                for (auto iter = surroundingExistingKeyPosesID.begin(); iter != surroundingExistingKeyPosesID.end(); ++iter){// 第一帧不进入
-                    // *iter就是不同的cloudKeyPoses3D->points.size(),
-                    // 把surroundingExistingKeyPosesID内没有对应的点放进一个队列里
-                    // 这个队列专门存放周围存在的关键帧，但是和surroundingExistingKeyPosesID的点没有对应的，也就是新的点                    
-                    if ((*iter) == (int)surroundingKeyPosesDS->points[i].intensity){
-                        existingFlag = true;
-                        break;
-                    }
-                }
-                if (existingFlag == true){
-                    continue;
-                }else{ // 如果没有当前帧周围的位姿，则新增
-                    int thisKeyInd = (int)surroundingKeyPosesDS->points[i].intensity;// 关键帧id
-                    PointTypePose thisTransformation = cloudKeyPoses6D->points[thisKeyInd]; // 关键帧的6D世界位姿
-                    updateTransformPointCloudSinCos(&thisTransformation);
-                    surroundingExistingKeyPosesID.   push_back(thisKeyInd); // 关键帧id
-                    surroundingCornerCloudKeyFrames. push_back(transformPointCloud(cornerCloudKeyFrames[thisKeyInd]));// 存放的是世界坐标系下的点云
-                    surroundingSurfCloudKeyFrames.   push_back(transformPointCloud(surfCloudKeyFrames[thisKeyInd]));
-                    surroundingOutlierCloudKeyFrames.push_back(transformPointCloud(outlierCloudKeyFrames[thisKeyInd]));
-                }
-            }
+            downSizeFilterSurroundingKeyPoses.setInputCloud(surroundingKeyPoses);
+            downSizeFilterSurroundingKeyPoses.filter(*surroundingKeyPosesDS);
 
-            for (int i = 0; i < surroundingExistingKeyPosesID.size(); ++i) { // 最后一步会进行清空
-                *laserCloudCornerFromMap += *surroundingCornerCloudKeyFrames[i];
-                *laserCloudSurfFromMap   += *surroundingSurfCloudKeyFrames[i];
-                *laserCloudSurfFromMap   += *surroundingOutlierCloudKeyFrames[i];
-            }
-    	}
-        // 进行两次下采样
-        // 最后的输出结果是laserCloudCornerFromMapDS和laserCloudSurfFromMapDS
-        // Downsample the surrounding corner key frames (or map)
-        downSizeFilterCorner.setInputCloud(laserCloudCornerFromMap);
-        downSizeFilterCorner.filter(*laserCloudCornerFromMapDS);
-        laserCloudCornerFromMapDSNum = laserCloudCornerFromMapDS->points.size();
-        // Downsample the surrounding surf key frames (or map)
-        downSizeFilterSurf.setInputCloud(laserCloudSurfFromMap);
-        downSizeFilterSurf.filter(*laserCloudSurfFromMapDS);
-        laserCloudSurfFromMapDSNum = laserCloudSurfFromMapDS->points.size();
-    }
-
-    // 对当前的扫描进行降采样
-    void downsampleCurrentScan(){
+            // 按关键帧先后顺序插入，保证每个block记录的是最新的观测位置
+            for (int i = 0; i < surroundingKeyPosesDS->points.size(); ++i)
+                keyInds.push_back((int)surroundingKeyPosesDS->points[i].intensity);
+            std::sort(keyInds.begin(), keyInds.end());
+        }
 
-        laserCloudCornerLastDS->clear();
-        downSizeFilterCorner.setInputCloud(laserCloudCornerLast);
-        downSizeFilterCorner.filter(*laserCloudCornerLastDS);
-        laserCloudCornerLastDSNum = laserCloudCornerLastDS->points.size();
+        for (int i = 0; i < keyInds.size(); ++i){
+            int thisKeyInd = keyInds[i];
+            KeyFrameStore::KeyFrame keyFrame = keyFrameStore.get(thisKeyInd);
+            insertKeyFrameToLocalMap(keyFrame.corner, keyFrame.surf, keyFrame.outlier, cloudKeyPoses6D->points[thisKeyInd], thisKeyInd);
+        }
+    }
 
-        laserCloudSurfLastDS->clear();
-        downSizeFilterSurf.setInputCloud(laserCloudSurfLast);
-        downSizeFilterSurf.filter(*laserCloudSurfLastDS);
-        laserCloudSurfLastDSNum = laserCloudSurfLastDS->points.size();
+    // 对当前的扫描进行降采样，在降采样线程中执行，与上一帧的scan-to-map优化并行
+    void downsampleCurrentScan(MappingFrame &frame){
+
+        // 降级时体素增大，正常情况下与原来的0.2/0.4/0.4相同
+        const LoadShedder::Settings &load = frame.load;
+        downSizeFilterCorner.setLeafSize(load.cornerLeaf, load.cornerLeaf, load.cornerLeaf);
+        downSizeFilterSurf.setLeafSize(load.surfLeaf, load.surfLeaf, load.surfLeaf);
+        downSizeFilterOutlier.setLeafSize(load.outlierLeaf, load.outlierLeaf, load.outlierLeaf);
+
+        frame.cornerLastDS = frameCloudPool.acquire();
+        downSizeFilterCorner.setInputCloud(frame.cornerLast);
+        downSizeFilterCorner.filter(*frame.cornerLastDS);
+
+        frame.surfLastDS = frameCloudPool.acquire();
+        downSizeFilterSurf.setInputCloud(frame.surfLast);
+        downSizeFilterSurf.filter(*frame.surfLastDS);
+
+        frame.outlierLastDS = frameCloudPool.acquire();
+        downSizeFilterOutlier.setInputCloud(frame.outlierLast);
+        downSizeFilterOutlier.filter(*frame.outlierLastDS);
+
+        frame.surfTotalLast = frameCloudPool.acquire();
+        frame.surfTotalLastDS = frameCloudPool.acquire();
+        *frame.surfTotalLast += *frame.surfLastDS;
+        if (load.matchOutliers)
+            *frame.surfTotalLast += *frame.outlierLastDS; // 降级时界外点只保存在关键帧中，不参与匹配
+        downSizeFilterSurf.setInputCloud(frame.surfTotalLast);
+        downSizeFilterSurf.filter(*frame.surfTotalLastDS);
+    }
 
-        laserCloudOutlierLastDS->clear();
-        downSizeFilterOutlier.setInputCloud(laserCloudOutlierLast);
-        downSizeFilterOutlier.filter(*laserCloudOutlierLastDS);
-        laserCloudOutlierLastDSNum = laserCloudOutlierLastDS->points.size();
+    int threadIndex(){
+#ifdef _OPENMP
+        return omp_get_thread_num();
+#else
+        return 0;
+#endif
+    }
 
-        laserCloudSurfTotalLast->clear();
-        laserCloudSurfTotalLastDS->clear();
-        *laserCloudSurfTotalLast += *laserCloudSurfLastDS;
-        *laserCloudSurfTotalLast += *laserCloudOutlierLastDS;
-        downSizeFilterSurf.setInputCloud(laserCloudSurfTotalLast);
-        downSizeFilterSurf.filter(*laserCloudSurfTotalLastDS);
-        laserCloudSurfTotalLastDSNum = laserCloudSurfTotalLastDS->points.size();
+    // 按线程号顺序合并各线程的结果，保证laserCloudOri/coeffSel的顺序与串行计算相同
+    void mergeCorrespondences(){
+        for (int t = 0; t < correspondenceScratch.size(); ++t){
+            *laserCloudOri += correspondenceScratch[t].laserCloudOri;
+            *coeffSel += correspondenceScratch[t].coeffSel;
+            correspondenceScratch[t].laserCloudOri.clear();
+            correspondenceScratch[t].coeffSel.clear();
+        }
     }
 
     void cornerOptimization(int iterCount){
 
         updatePointAssociateToMapSinCos();
+        // 每个点的近邻搜索和特征值分解相互独立，多线程并行处理
+        // schedule(static)保证各线程按线程号分到连续的索引段，按线程号合并结果即与串行顺序一致
+        #pragma omp parallel for num_threads(numberOfCores) schedule(static)
         for (int i = 0; i < laserCloudCornerLastDSNum; i++) { // 遍历当前帧边缘特征点降采样的数量
+            CorrespondenceScratch &scratch = correspondenceScratch[threadIndex()];
+            PointType pointOri, pointSel, coeff;
             pointOri = laserCloudCornerLastDS->points[i];
             // 进行坐标变换,将局部坐标系下的选定点转换到全局坐标中去（世界坐标系）
             // pointSel:表示选中的点，point select
             // 输入是pointOri，输出是pointSel
             pointAssociateToMap(&pointOri, &pointSel);
-            // 进行5邻域搜索，寻找当前边缘特征点的特征关联(只找对应的边缘点)
-            // pointSel为需要搜索的点，
-            // pointSearchInd搜索完的邻域对应的索引
-            // pointSearchSqDis 邻域点与查询点之间的距离            
-            kdtreeCornerFromMap->nearestKSearch(pointSel, 5, pointSearchInd, pointSearchSqDis);
+            CornerFeature &feature = cornerFeatures[i];
+
+            // 不重新查找对应点时沿用上次拟合的直线
+            if (researchCorrespondences) {
+                feature.valid = false;
+                // 进行5邻域搜索，寻找当前边缘特征点的特征关联(只找对应的边缘点)
+                // pointSel为需要搜索的点，
+                // pointSearchInd搜索完的邻域对应的索引
+                // pointSearchSqDis 邻域点与查询点之间的距离            
+                // 局部地图只返回1m以内的近邻，不足5个时说明第5个近邻的距离超过1m
+                int neighborNum = localCornerMap.nearestKSearch(pointSel, 5, scratch.pointSearchInd, scratch.pointSearchSqDis, scratch.candidates);
             
-            // 只有当最远的那个邻域点的距离pointSearchSqDis[4]小于1m时才进行下面的计算
-            // 以下部分的计算是在计算点集的协方差矩阵，Zhang Ji的论文中有提到这部分            
-            if (pointSearchSqDis[4] < 1.0) {
-                // 先求5个样本的平均值
-                float cx = 0, cy = 0, cz = 0;
-                for (int j = 0; j < 5; j++) {
-                    cx += laserCloudCornerFromMapDS->points[pointSearchInd[j]].x; // 这里是世界坐标
-                    cy += laserCloudCornerFromMapDS->points[pointSearchInd[j]].y;
-                    cz += laserCloudCornerFromMapDS->points[pointSearchInd[j]].z;
-                }
-                cx /= 5; cy /= 5;  cz /= 5;
-
-                // 下面在求矩阵matA1=[ax,ay,az]^t*[ax,ay,az]
-                // 更准确地说应该是在求协方差矩阵matA1                
-                float a11 = 0, a12 = 0, a13 = 0, a22 = 0, a23 = 0, a33 = 0;
-                for (int j = 0; j < 5; j++) {
-                    // ax代表的是x-cx,表示均值与每个实际值的差值，求取5个之后再次取平均，得到matA1
-                    float ax = laserCloudCornerFromMapDS->points[pointSearchInd[j]].x - cx;
-                    float ay = laserCloudCornerFromMapDS->points[pointSearchInd[j]].y - cy;
-                    float az = laserCloudCornerFromMapDS->points[pointSearchInd[j]].z - cz;
-
-                    a11 += ax * ax; a12 += ax * ay; a13 += ax * az;
-                    a22 += ay * ay; a23 += ay * az;
-                    a33 += az * az;
-                }
-                a11 /= 5; a12 /= 5; a13 /= 5; a22 /= 5; a23 /= 5; a33 /= 5;
-
-                matA1.at<float>(0, 0) = a11; matA1.at<float>(0, 1) = a12; matA1.at<float>(0, 2) = a13;
-                matA1.at<float>(1, 0) = a12; matA1.at<float>(1, 1) = a22; matA1.at<float>(1, 2) = a23;
-                matA1.at<float>(2, 0) = a13; matA1.at<float>(2, 1) = a23; matA1.at<float>(2, 2) = a33;
-
-                // 求正交阵的特征值和特征向量
-                // 特征值：matD1，特征向量：matV1中                
-                cv::eigen(matA1, matD1, matV1);
-
-                // 边缘线：与最大特征值相对应的特征向量代表边缘线的方向（一大两小，大方向）
-                // 以下这一大块是在计算点到边缘的距离，最后通过系数s来判断是否距离很近
-                // 如果距离很近就认为这个点在边缘上，需要放到laserCloudOri中                
-                if (matD1.at<float>(0, 0) > 3 * matD1.at<float>(0, 1)) { ///Q 条件是否过于放松
-
-                    float x0 = pointSel.x; // 当前选定点的世界坐标
-                    float y0 = pointSel.y;
-                    float z0 = pointSel.z;
-                    float x1 = cx + 0.1 * matV1.at<float>(0, 0); // 选定在边缘线上的两个点来计算选定的边缘特征点pointSel到其对应关联的距离
-                    float y1 = cy + 0.1 * matV1.at<float>(0, 1);
-                    float z1 = cz + 0.1 * matV1.at<float>(0, 2);
-                    float x2 = cx - 0.1 * matV1.at<float>(0, 0);
-                    float y2 = cy - 0.1 * matV1.at<float>(0, 1);
-                    float z2 = cz - 0.1 * matV1.at<float>(0, 2);
-
-                    // 这边是在求[(x0-x1),(y0-y1),(z0-z1)]与[(x0-x2),(y0-y2),(z0-z2)]叉乘得到的向量的模长
-                    // 这个模长是由0.2*V1[0]和点[x0,y0,z0]构成的平行四边形的面积
-                    // 因为[(x0-x1),(y0-y1),(z0-z1)]x[(x0-x2),(y0-y2),(z0-z2)]=[XXX,YYY,ZZZ],
-                    // [XXX,YYY,ZZZ]=[(y0-y1)(z0-z2)-(y0-y2)(z0-z1),-(x0-x1)(z0-z2)+(x0-x2)(z0-z1),(x0-x1)(y0-y2)-(x0-x2)(y0-y1)]                    
-                    float a012 = sqrt(((x0 - x1)*(y0 - y2) - (x0 - x2)*(y0 - y1))
-                                    * ((x0 - x1)*(y0 - y2) - (x0 - x2)*(y0 - y1)) 
-                                    + ((x0 - x1)*(z0 - z2) - (x0 - x2)*(z0 - z1))
-                                    * ((x0 - x1)*(z0 - z2) - (x0 - x2)*(z0 - z1)) 
-                                    + ((y0 - y1)*(z0 - z2) - (y0 - y2)*(z0 - z1))
-                                    * ((y0 - y1)*(z0 - z2) - (y0 - y2)*(z0 - z1)));
-
-                    // l12表示的是0.2*(||V1[0]||)
-                    // 也就是平行四边形一条底的长度                    
-                    float l12 = sqrt((x1 - x2)*(x1 - x2) + (y1 - y2)*(y1 - y2) + (z1 - z2)*(z1 - z2));
-
-                    // 求叉乘结果[la',lb',lc']=[(x1-x2),(y1-y2),(z1-z2)]x[XXX,YYY,ZZZ]
-                    // [la,lb,lc]=[la',lb',lc']/a012/l12
-                    // LLL=[la,lb,lc]是0.2*V1[0]这条高上的单位法向量。||LLL||=1；                    
-                    float la = ((y1 - y2)*((x0 - x1)*(y0 - y2) - (x0 - x2)*(y0 - y1)) 
-                              + (z1 - z2)*((x0 - x1)*(z0 - z2) - (x0 - x2)*(z0 - z1))) / a012 / l12;
-
-                    float lb = -((x1 - x2)*((x0 - x1)*(y0 - y2) - (x0 - x2)*(y0 - y1)) 
-                               - (z1 - z2)*((y0 - y1)*(z0 - z2) - (y0 - y2)*(z0 - z1))) / a012 / l12;
-
-                    float lc = -((x1 - x2)*((x0 - x1)*(z0 - z2) - (x0 - x2)*(z0 - z1)) 
-                               + (y1 - y2)*((y0 - y1)*(z0 - z2) - (y0 - y2)*(z0 - z1))) / a012 / l12;
-
-                    // 计算点pointSel到直线的距离
-                    // 这里需要特别说明的是ld2代表的是点pointSel到过点[cx,cy,cz]的方向向量直线的距离                    
-                    float ld2 = a012 / l12;
-
-                    // 如果在最理想的状态的话，ld2应该为0，表示点在直线上
-                    // 最理想状态s=1；                    
-                    float s = 1 - 0.9 * fabs(ld2);
-
-                    // coeff代表系数的意思
-                    // coff用于保存距离的方向向量                    
-                    coeff.x = s * la;
-                    coeff.y = s * lb;
-                    coeff.z = s * lc;
-                    // intensity本质上构成了一个核函数，ld2越接近于1，增长越慢
-                    // intensity=(1-0.9*ld2)*ld2=ld2-0.9*ld2*ld2                    
-                    coeff.intensity = s * ld2;
-
-                    // 所以就应该认为这个点是边缘点
-                    // s>0.1 也就是要求点到直线的距离ld2要小于1m
-                    // s越大说明ld2越小(离边缘线越近)，这样就说明点pointOri在直线上                    
-                    if (s > 0.1) {
-                        laserCloudOri->push_back(pointOri); // 保存的选定点的局部坐标
-                        coeffSel->push_back(coeff);
+                // 只有当最远的那个邻域点的距离pointSearchSqDis[4]小于1m时才进行下面的计算
+                // 以下部分的计算是在计算点集的协方差矩阵，Zhang Ji的论文中有提到这部分            
+                if (neighborNum == 5 && scratch.pointSearchSqDis[4] < 1.0) {
+                    // 先求5个样本的平均值
+                    float cx = 0, cy = 0, cz = 0;
+                    for (int j = 0; j < 5; j++) {
+                        cx += localCornerMap[scratch.pointSearchInd[j]].x; // 这里是世界坐标
+                        cy += localCornerMap[scratch.pointSearchInd[j]].y;
+                        cz += localCornerMap[scratch.pointSearchInd[j]].z;
                     }
+                    cx /= 5; cy /= 5;  cz /= 5;
+
+                    // 下面在求矩阵matA1=[ax,ay,az]^t*[ax,ay,az]
+                    // 更准确地说应该是在求协方差矩阵matA1                
+                    float a11 = 0, a12 = 0, a13 = 0, a22 = 0, a23 = 0, a33 = 0;
+                    for (int j = 0; j < 5; j++) {
+                        // ax代表的是x-cx,表示均值与每个实际值的差值，求取5个之后再次取平均，得到matA1
+                        float ax = localCornerMap[scratch.pointSearchInd[j]].x - cx;
+                        float ay = localCornerMap[scratch.pointSearchInd[j]].y - cy;
+                        float az = localCornerMap[scratch.pointSearchInd[j]].z - cz;
+
+                        a11 += ax * ax; a12 += ax * ay; a13 += ax * az;
+                        a22 += ay * ay; a23 += ay * az;
+                        a33 += az * az;
+                    }
+                    a11 /= 5; a12 /= 5; a13 /= 5; a22 /= 5; a23 /= 5; a33 /= 5;
+
+                    scratch.matA1.at<float>(0, 0) = a11; scratch.matA1.at<float>(0, 1) = a12; scratch.matA1.at<float>(0, 2) = a13;
+                    scratch.matA1.at<float>(1, 0) = a12; scratch.matA1.at<float>(1, 1) = a22; scratch.matA1.at<float>(1, 2) = a23;
+                    scratch.matA1.at<float>(2, 0) = a13; scratch.matA1.at<float>(2, 1) = a23; scratch.matA1.at<float>(2, 2) = a33;
+
+                    // 求正交阵的特征值和特征向量
+                    // 特征值：matD1，特征向量：matV1中                
+                    cv::eigen(scratch.matA1, scratch.matD1, scratch.matV1);
+
+                    // 边缘线：与最大特征值相对应的特征向量代表边缘线的方向（一大两小，大方向）
+                    if (scratch.matD1.at<float>(0, 0) > 3 * scratch.matD1.at<float>(0, 1)) { ///Q 条件是否过于放松
+                        feature.valid = true;
+                        feature.cx = cx; feature.cy = cy; feature.cz = cz;
+                        feature.vx = scratch.matV1.at<float>(0, 0);
+                        feature.vy = scratch.matV1.at<float>(0, 1);
+                        feature.vz = scratch.matV1.at<float>(0, 2);
+                    }
+                }
+            }
+
+            // 以下这一大块是在计算点到边缘的距离，最后通过系数s来判断是否距离很近
+            // 如果距离很近就认为这个点在边缘上，需要放到laserCloudOri中                
+            if (feature.valid) {
+
+                float x0 = pointSel.x; // 当前选定点的世界坐标
+                float y0 = pointSel.y;
+                float z0 = pointSel.z;
+                float x1 = feature.cx + 0.1 * feature.vx; // 选定在边缘线上的两个点来计算选定的边缘特征点pointSel到其对应关联的距离
+                float y1 = feature.cy + 0.1 * feature.vy;
+                float z1 = feature.cz + 0.1 * feature.vz;
+                float x2 = feature.cx - 0.1 * feature.vx;
+                float y2 = feature.cy - 0.1 * feature.vy;
+                float z2 = feature.cz - 0.1 * feature.vz;
+
+                // 这边是在求[(x0-x1),(y0-y1),(z0-z1)]与[(x0-x2),(y0-y2),(z0-z2)]叉乘得到的向量的模长
+                // 这个模长是由0.2*V1[0]和点[x0,y0,z0]构成的平行四边形的面积
+                // 因为[(x0-x1),(y0-y1),(z0-z1)]x[(x0-x2),(y0-y2),(z0-z2)]=[XXX,YYY,ZZZ],
+                // [XXX,YYY,ZZZ]=[(y0-y1)(z0-z2)-(y0-y2)(z0-z1),-(x0-x1)(z0-z2)+(x0-x2)(z0-z1),(x0-x1)(y0-y2)-(x0-x2)(y0-y1)]                    
+                float a012 = sqrt(((x0 - x1)*(y0 - y2) - (x0 - x2)*(y0 - y1))
+                                * ((x0 - x1)*(y0 - y2) - (x0 - x2)*(y0 - y1)) 
+                                + ((x0 - x1)*(z0 - z2) - (x0 - x2)*(z0 - z1))
+                                * ((x0 - x1)*(z0 - z2) - (x0 - x2)*(z0 - z1)) 
+                                + ((y0 - y1)*(z0 - z2) - (y0 - y2)*(z0 - z1))
+                                * ((y0 - y1)*(z0 - z2) - (y0 - y2)*(z0 - z1)));
+
+                // l12表示的是0.2*(||V1[0]||)
+                // 也就是平行四边形一条底的长度                    
+                float l12 = sqrt((x1 - x2)*(x1 - x2) + (y1 - y2)*(y1 - y2) + (z1 - z2)*(z1 - z2));
+
+                // 求叉乘结果[la',lb',lc']=[(x1-x2),(y1-y2),(z1-z2)]x[XXX,YYY,ZZZ]
+                // [la,lb,lc]=[la',lb',lc']/a012/l12
+                // LLL=[la,lb,lc]是0.2*V1[0]这条高上的单位法向量。||LLL||=1；                    
+                float la = ((y1 - y2)*((x0 - x1)*(y0 - y2) - (x0 - x2)*(y0 - y1)) 
+                          + (z1 - z2)*((x0 - x1)*(z0 - z2) - (x0 - x2)*(z0 - z1))) / a012 / l12;
+
+                float lb = -((x1 - x2)*((x0 - x1)*(y0 - y2) - (x0 - x2)*(y0 - y1)) 
+                           - (z1 - z2)*((y0 - y1)*(z0 - z2) - (y0 - y2)*(z0 - z1))) / a012 / l12;
+
+                float lc = -((x1 - x2)*((x0 - x1)*(z0 - z2) - (x0 - x2)*(z0 - z1)) 
+                           + (y1 - y2)*((y0 - y1)*(z0 - z2) - (y0 - y2)*(z0 - z1))) / a012 / l12;
+
+                // 计算点pointSel到直线的距离
+                // 这里需要特别说明的是ld2代表的是点pointSel到过点[cx,cy,cz]的方向向量直线的距离                    
+                float ld2 = a012 / l12;
+
+                // 如果在最理想的状态的话，ld2应该为0，表示点在直线上
+                // 最理想状态s=1；                    
+                float s = 1 - 0.9 * fabs(ld2);
+
+                // coeff代表系数的意思
+                // coff用于保存距离的方向向量                    
+                coeff.x = s * la;
+                coeff.y = s * lb;
+                coeff.z = s * lc;
+                // intensity本质上构成了一个核函数，ld2越接近于1，增长越慢
+                // intensity=(1-0.9*ld2)*ld2=ld2-0.9*ld2*ld2                    
+                coeff.intensity = s * ld2;
+
+                // 所以就应该认为这个点是边缘点
+                // s>0.1 也就是要求点到直线的距离ld2要小于1m
+                // s越大说明ld2越小(离边缘线越近)，这样就说明点pointOri在直线上                    
+                if (s > 0.1) {
+                    scratch.laserCloudOri.push_back(pointOri); // 保存的选定点的局部坐标
+                    scratch.coeffSel.push_back(coeff);
                 }
             }
         }
+        mergeCorrespondences();
     }
 
     void surfOptimization(int iterCount){
         updatePointAssociateToMapSinCos();
+        #pragma omp parallel for num_threads(numberOfCores) schedule(static)
         for (int i = 0; i < laserCloudSurfTotalLastDSNum; i++) {
+            CorrespondenceScratch &scratch = correspondenceScratch[threadIndex()];
+            PointType pointOri, pointSel, coeff;
             pointOri = laserCloudSurfTotalLastDS->points[i];
             pointAssociateToMap(&pointOri, &pointSel); 
-            kdtreeSurfFromMap->nearestKSearch(pointSel, 5, pointSearchInd, pointSearchSqDis);
-
-            if (pointSearchSqDis[4] < 1.0) {
-                for (int j = 0; j < 5; j++) {
-                    matA0.at<float>(j, 0) = laserCloudSurfFromMapDS->points[pointSearchInd[j]].x;
-                    matA0.at<float>(j, 1) = laserCloudSurfFromMapDS->points[pointSearchInd[j]].y;
-                    matA0.at<float>(j, 2) = laserCloudSurfFromMapDS->points[pointSearchInd[j]].z;
-                }
-                // matB0是一个5x1的矩阵
-                // matB0 = cv::Mat (5, 1, CV_32F, cv::Scalar::all(-1));
-                // matX0是3x1的矩阵
-                // 求解方程matA0*matX0=matB0
-                // 公式其实是在求由matA0中的点构成的平面的法向量matX0                
-                cv::solve(matA0, matB0, matX0, cv::DECOMP_QR);
-
-                // [pa,pb,pc,pd]=[matX0,pd]
-                // 正常情况下（见后面planeValid判断条件），应该是
-                // pa * laserCloudSurfFromMapDS->points[pointSearchInd[j]].x +
-                // pb * laserCloudSurfFromMapDS->points[pointSearchInd[j]].y +
-                // pc * laserCloudSurfFromMapDS->points[pointSearchInd[j]].z = -1
-                // 所以pd设置为1                
-                float pa = matX0.at<float>(0, 0);
-                float pb = matX0.at<float>(1, 0);
-                float pc = matX0.at<float>(2, 0);
-                float pd = 1;
-
-                // 对[pa,pb,pc,pd]进行单位化
-                float ps = sqrt(pa * pa + pb * pb + pc * pc);
-                pa /= ps; pb /= ps; pc /= ps; pd /= ps;
-
-                // 求解后再次检查平面是否是有效平面
-                bool planeValid = true;
-                for (int j = 0; j < 5; j++) {
-                    if (fabs(pa * laserCloudSurfFromMapDS->points[pointSearchInd[j]].x +
-                             pb * laserCloudSurfFromMapDS->points[pointSearchInd[j]].y +
-                             pc * laserCloudSurfFromMapDS->points[pointSearchInd[j]].z + pd) > 0.2) {
-                        planeValid = false;
-                        break;
+            SurfFeature &feature = surfFeatures[i];
+
+            // 不重新查找对应点时沿用上次拟合的平面
+            if (researchCorrespondences) {
+                feature.valid = false;
+                int neighborNum = localSurfMap.nearestKSearch(pointSel, 5, scratch.pointSearchInd, scratch.pointSearchSqDis, scratch.candidates);
+
+                if (neighborNum == 5 && scratch.pointSearchSqDis[4] < 1.0) {
+                    for (int j = 0; j < 5; j++) {
+                        scratch.matA0.at<float>(j, 0) = localSurfMap[scratch.pointSearchInd[j]].x;
+                        scratch.matA0.at<float>(j, 1) = localSurfMap[scratch.pointSearchInd[j]].y;
+                        scratch.matA0.at<float>(j, 2) = localSurfMap[scratch.pointSearchInd[j]].z;
+                    }
+                    // matB0是一个5x1的矩阵
+                    // matB0 = cv::Mat (5, 1, CV_32F, cv::Scalar::all(-1));
+                    // matX0是3x1的矩阵
+                    // 求解方程matA0*matX0=matB0
+                    // 公式其实是在求由matA0中的点构成的平面的法向量matX0                
+                    cv::solve(scratch.matA0, scratch.matB0, scratch.matX0, cv::DECOMP_QR);
+
+                    // [pa,pb,pc,pd]=[matX0,pd]
+                    // 正常情况下（见后面planeValid判断条件），应该是
+                    // pa * localSurfMap[pointSearchInd[j]].x +
+                    // pb * localSurfMap[pointSearchInd[j]].y +
+                    // pc * localSurfMap[pointSearchInd[j]].z = -1
+                    // 所以pd设置为1                
+                    float pa = scratch.matX0.at<float>(0, 0);
+                    float pb = scratch.matX0.at<float>(1, 0);
+                    float pc = scratch.matX0.at<float>(2, 0);
+                    float pd = 1;
+
+                    // 对[pa,pb,pc,pd]进行单位化
+                    float ps = sqrt(pa * pa + pb * pb + pc * pc);
+                    pa /= ps; pb /= ps; pc /= ps; pd /= ps;
+
+                    // 求解后再次检查平面是否是有效平面
+                    bool planeValid = true;
+                    for (int j = 0; j < 5; j++) {
+                        if (fabs(pa * localSurfMap[scratch.pointSearchInd[j]].x +
+                                 pb * localSurfMap[scratch.pointSearchInd[j]].y +
+                                 pc * localSurfMap[scratch.pointSearchInd[j]].z + pd) > 0.2) {
+                            planeValid = false;
+                            break;
+                        }
                     }
+
+                    feature.valid = planeValid;
+                    feature.pa = pa; feature.pb = pb; feature.pc = pc; feature.pd = pd;
                 }
+            }
 
-                if (planeValid) {
-                    // 后面部分相除求的是[pa,pb,pc,pd]与pointSel的夹角余弦值(两个sqrt，其实并不是余弦值)
-                    // 这个夹角余弦值越小越好，越小证明所求的[pa,pb,pc,pd]与平面越垂直                    
-                    float pd2 = pa * pointSel.x + pb * pointSel.y + pc * pointSel.z + pd;
+            if (feature.valid) {
+                // 后面部分相除求的是[pa,pb,pc,pd]与pointSel的夹角余弦值(两个sqrt，其实并不是余弦值)
+                // 这个夹角余弦值越小越好，越小证明所求的[pa,pb,pc,pd]与平面越垂直                    
+                float pd2 = feature.pa * pointSel.x + feature.pb * pointSel.y + feature.pc * pointSel.z + feature.pd;
 
-                    float s = 1 - 0.9 * fabs(pd2) / sqrt(sqrt(pointSel.x * pointSel.x
-                            + pointSel.y * pointSel.y + pointSel.z * pointSel.z));
+                float s = 1 - 0.9 * fabs(pd2) / sqrt(sqrt(pointSel.x * pointSel.x
+                        + pointSel.y * pointSel.y + pointSel.z * pointSel.z));
 
-                    coeff.x = s * pa;
-                    coeff.y = s * pb;
-                    coeff.z = s * pc;
-                    coeff.intensity = s * pd2;
+                coeff.x = s * feature.pa;
+                coeff.y = s * feature.pb;
+                coeff.z = s * feature.pc;
+                coeff.intensity = s * pd2;
 
-                    // 判断是否是合格平面，是就加入laserCloudOri
-                    if (s > 0.1) {
-                        laserCloudOri->push_back(pointOri);
-                        coeffSel->push_back(coeff);
-                    }
+                // 判断是否是合格平面，是就加入laserCloudOri
+                if (s > 0.1) {
+                    scratch.laserCloudOri.push_back(pointOri);
+                    scratch.coeffSel.push_back(coeff);
                 }
             }
         }
+        mergeCorrespondences();
     }
 
     // 这部分的代码是基于高斯牛顿法的优化，不是zhang ji论文中提到的基于L-M的优化方法
@@ -1389,12 +1539,9 @@ public:
             return false;
         }
 
-        cv::Mat matA(laserCloudSelNum, 6, CV_32F, cv::Scalar::all(0));
-        cv::Mat matAt(6, laserCloudSelNum, CV_32F, cv::Scalar::all(0));
-        cv::Mat matAtA(6, 6, CV_32F, cv::Scalar::all(0));
-        cv::Mat matB(laserCloudSelNum, 1, CV_32F, cv::Scalar::all(0));
-        cv::Mat matAtB(6, 1, CV_32F, cv::Scalar::all(0));
-        cv::Mat matX(6, 1, CV_32F, cv::Scalar::all(0));
+        // 每个点的雅克比行直接累加进6*6的matAtA和6*1的matAtB，不再构造laserCloudSelNum*6的matA
+        normalEquations.reset();
+        Eigen::Matrix<float, 6, 1> matA;
         for (int i = 0; i < laserCloudSelNum; i++) {
             pointOri = laserCloudOri->points[i];
             coeff = coeffSel->points[i];
@@ -1429,96 +1576,68 @@ public:
             coeff.z = s * pc;
             coeff.intensity = s * pd2;
             */            
-            matA.at<float>(i, 0) = arx;
-            matA.at<float>(i, 1) = ary;
-            matA.at<float>(i, 2) = arz;
-            // 这部分是雅克比矩阵中距离对平移的偏导
-            matA.at<float>(i, 3) = coeff.x;
-            matA.at<float>(i, 4) = coeff.y;
-            matA.at<float>(i, 5) = coeff.z;
-            // 残差项
-            matB.at<float>(i, 0) = -coeff.intensity;
+            // 后三项是雅克比矩阵中距离对平移的偏导
+            matA << arx, ary, arz, coeff.x, coeff.y, coeff.z;
+            // 残差项-coeff.intensity，累加matAtA += matA*matA^T，matAtB += matA*(-coeff.intensity)
+            normalEquations.add(matA, -coeff.intensity);
         }
-        
-        // 将矩阵由matA转置生成matAt
-        // 先进行计算，以便于后边调用 cv::solve求解
-        cv::transpose(matA, matAt);
-        matAtA = matAt * matA;
-        matAtB = matAt * matB;
 
         // 利用高斯牛顿法进行求解，
         // 高斯牛顿法的原型是J^(T)*J * delta(x) = -J*f(x)
         // J是雅克比矩阵，这里是A，f(x)是优化目标，这里是-B(符号在给B赋值时候就放进去了)
         // 通过QR分解的方式，求解matAtA*matX=matAtB，得到解matX        
-        cv::solve(matAtA, matAtB, matX, cv::DECOMP_QR);
+        Eigen::Matrix<float, 6, 1> matX = normalEquations.solve();
 
         if (iterCount == 0) { // iterCount==0 说明是第一次迭代，需要初始化
-            cv::Mat matE(1, 6, CV_32F, cv::Scalar::all(0));
-            cv::Mat matV(6, 6, CV_32F, cv::Scalar::all(0));
-            cv::Mat matV2(6, 6, CV_32F, cv::Scalar::all(0));
-
-            // 对近似的Hessian矩阵求特征值和特征向量，
-            cv::eigen(matAtA, matE, matV);
-            matV.copyTo(matV2);
-
-            isDegenerate = false;
-            float eignThre[6] = {100, 100, 100, 100, 100, 100};
-            for (int i = 5; i >= 0; i--) {
-                if (matE.at<float>(0, i) < eignThre[i]) {
-                    for (int j = 0; j < 6; j++) {
-                        matV2.at<float>(i, j) = 0;
-                    }
-                    isDegenerate = true;
-                } else {
-                    break;
-                }
-            }
-            matP = matV.inv() * matV2;
+            // 对近似的Hessian矩阵求特征值和特征向量，特征值小于100的方向视为退化
+            isDegenerate = normalEquations.computeDegeneracy(100, matP);
         }
 
         if (isDegenerate) {
-            cv::Mat matX2(6, 1, CV_32F, cv::Scalar::all(0));
-            matX.copyTo(matX2);
+            Eigen::Matrix<float, 6, 1> matX2 = matX;
             matX = matP * matX2;
         }
 
-        transformTobeMapped[0] += matX.at<float>(0, 0);
-        transformTobeMapped[1] += matX.at<float>(1, 0);
-        transformTobeMapped[2] += matX.at<float>(2, 0);
-        transformTobeMapped[3] += matX.at<float>(3, 0);
-        transformTobeMapped[4] += matX.at<float>(4, 0);
-        transformTobeMapped[5] += matX.at<float>(5, 0);
+        transformTobeMapped[0] += matX(0);
+        transformTobeMapped[1] += matX(1);
+        transformTobeMapped[2] += matX(2);
+        transformTobeMapped[3] += matX(3);
+        transformTobeMapped[4] += matX(4);
+        transformTobeMapped[5] += matX(5);
 
         float deltaR = sqrt(
-                            pow(pcl::rad2deg(matX.at<float>(0, 0)), 2) +
-                            pow(pcl::rad2deg(matX.at<float>(1, 0)), 2) +
-                            pow(pcl::rad2deg(matX.at<float>(2, 0)), 2));
+                            pow(pcl::rad2deg(matX(0)), 2) +
+                            pow(pcl::rad2deg(matX(1)), 2) +
+                            pow(pcl::rad2deg(matX(2)), 2));
         float deltaT = sqrt(
-                            pow(matX.at<float>(3, 0) * 100, 2) +
-                            pow(matX.at<float>(4, 0) * 100, 2) +
-                            pow(matX.at<float>(5, 0) * 100, 2));
+                            pow(matX(3) * 100, 2) +
+                            pow(matX(4) * 100, 2) +
+                            pow(matX(5) * 100, 2));
 
         // 旋转或者平移量足够小就停止这次迭代过程
-        if (deltaR < 0.05 && deltaT < 0.05) {
+        if (scan2MapControl.converged(deltaR, deltaT)) {
             return true;
         }
         return false;
     }
 
     void scan2MapOptimization(){
-        // laserCloudCornerFromMapDSNum是extractSurroundingKeyFrames()函数最后降采样得到的coner点云数
-        // laserCloudSurfFromMapDSNum是extractSurroundingKeyFrames()函数降采样得到的surface点云数
+        // laserCloudCornerFromMapDSNum是局部边缘点地图localCornerMap中的体素数
+        // laserCloudSurfFromMapDSNum是局部平面点地图localSurfMap中的体素数
         if (laserCloudCornerFromMapDSNum > 10 && laserCloudSurfFromMapDSNum > 100) {
 
-            // laserCloudCornerFromMapDS和laserCloudSurfFromMapDS的来源有2个：
-            // 当有闭环时，来源是：recentCornerCloudKeyFrames，没有闭环时，来源surroundingCornerCloudKeyFrames
-            kdtreeCornerFromMap->setInputCloud(laserCloudCornerFromMapDS);
-            kdtreeSurfFromMap->setInputCloud(laserCloudSurfFromMapDS);
+            // 近邻搜索直接在增量维护的localCornerMap和localSurfMap上进行，不需要重建KD树
+            // 迭代次数、收敛条件、重新查找对应点的时机和这一帧的时间限制见iterationControl.h
+            scan2MapControl.start(IterationControl::Clock::now());
+            cornerFeatures.resize(laserCloudCornerLastDSNum);
+            surfFeatures.resize(laserCloudSurfTotalLastDSNum);
 
-            for (int iterCount = 0; iterCount < 10; iterCount++) {
+            int iterCount = 0;
+            for (; scan2MapControl.running(iterCount); iterCount++) {
 
                 laserCloudOri->clear();
                 coeffSel->clear();
+                researchCorrespondences = scan2MapControl.research();
 
                 // cornerOptimization 在这两个函数中其实没有用到
                 cornerOptimization(iterCount);
@@ -1527,6 +1646,11 @@ public:
                 if (LMOptimization(iterCount) == true)// iterCount只在第一次迭代有用到
                     break;              
             }
+            metrics.addValue("scan2map iterations", scan2MapControl.iterations());
+            metrics.addValue("scan2map researches", scan2MapControl.researches());
+            metrics.addValue("scan2map correspondences", laserCloudOri->points.size());
+            if (scan2MapControl.isDeadlineHit())
+                metrics.increment("scan2map deadline hits", 1, true);
 
             // 迭代结束更新相关的转移矩阵
             transformUpdate();
@@ -1534,7 +1658,8 @@ public:
     }
 
 
-    void saveKeyFramesAndFactor(){
+    // 在scan-to-map线程中判断当前帧是否为关键帧，是则插入局部地图并交给图优化线程
+    void submitKeyFrame(){
 
         // 保存当前机器人mapping之后的世界坐标
         currentRobotPosPoint.x = transformAftMapped[3];
@@ -1549,75 +1674,114 @@ public:
             saveThisKeyFrame = false;
         }
 
-        
         // 只有当第一帧 或者 非第一帧但是达到了阈值条件 这两种情况才可以继续下去
-        if (saveThisKeyFrame == false && !cloudKeyPoses3D->points.empty())
+        if (saveThisKeyFrame == false && keyFrameNum > 0)
         	return;
 
         previousRobotPosPoint = currentRobotPosPoint;
+
+        boost::shared_ptr<KeyFrameJob> job(new KeyFrameJob());
+        job->time = timeLaserOdometry;
+        for (int i = 0; i < 6; ++i){
+            job->last[i] = keyFrameNum == 0 ? transformTobeMapped[i] : transformLast[i];
+            job->transform[i] = keyFrameNum == 0 ? transformTobeMapped[i] : transformAftMapped[i];
+            transformLast[i] = job->transform[i];
+        }
+
+        // 图优化线程处理完之后释放，下一个关键帧复用
+        job->corner = keyFrameCloudPool.acquire();
+        job->surf = keyFrameCloudPool.acquire();
+        job->outlier = keyFrameCloudPool.acquire();
+        // 降采样后的当前帧扫描
+        pcl::copyPointCloud(*laserCloudCornerLastDS,  *job->corner);
+        pcl::copyPointCloud(*laserCloudSurfLastDS,    *job->surf);
+        pcl::copyPointCloud(*laserCloudOutlierLastDS, *job->outlier);
+
+        // 新关键帧增量插入局部地图
+        insertKeyFrameToLocalMap(job->corner, job->surf, job->outlier, trans2PointTypePose(job->transform), keyFrameNum);
+
+        ++keyFrameNum;
+        metrics.setCounter("key frame cloud pool allocations", keyFrameCloudPool.allocations());
+        graphQueue.push(job);
+    }
+
+    // 等待图优化线程处理完已提交的关键帧，之后cloudKeyPoses中包含局部地图中的所有关键帧
+    void waitForSubmittedKeyFrames(){
+        std::unique_lock<std::mutex> lock(progressMtx);
+        progressCond.wait(lock, [this]{ return running == false || keyFrameProcessedNum >= keyFrameNum; });
+    }
+
+    // 图优化线程完成回环修正后，将scan-to-map线程的位姿估计同步到修正后的轨迹上，并重建局部地图
+    void applyLoopCorrection(){
+
+        if (loopCorrectionPending == false)
+            return;
+        ScopedTimer timer(metrics, "applyLoopCorrection", timeLaserOdometry);
+
+        // 等待已提交的关键帧全部加入因子图，这样最新的关键帧位姿就是transformLast修正后的结果
+        // 回环很少发生，这里的等待不会影响正常的流水线
+        waitForSubmittedKeyFrames();
+
+        std::lock_guard<std::mutex> lock(mtx);
+        loopCorrectionPending = false;
+
+        const PointTypePose &latestPose = cloudKeyPoses6D->points.back();
+        float transformCorrected[6] = {latestPose.roll, latestPose.pitch, latestPose.yaw,
+                                       latestPose.x, latestPose.y, latestPose.z};
+        Eigen::Affine3f tCorrection = trans2Affine3f(transformCorrected) * trans2Affine3f(transformLast).inverse();
+
+        affine3f2Trans(tCorrection * trans2Affine3f(transformAftMapped), transformAftMapped);
+        for (int i = 0; i < 6; ++i){
+            transformTobeMapped[i] = transformAftMapped[i];
+            transformLast[i] = transformCorrected[i];
+        }
+        previousRobotPosPoint.x = latestPose.x;
+        previousRobotPosPoint.y = latestPose.y;
+        previousRobotPosPoint.z = latestPose.z;
+        currentRobotPosPoint.x = transformAftMapped[3];
+        currentRobotPosPoint.y = transformAftMapped[4];
+        currentRobotPosPoint.z = transformAftMapped[5];
+
+        // 位姿修正后重建局部地图
+        rebuildLocalMap();
+    }
+
+    // 在图优化线程中执行，因子图和关键帧由mtx保护
+    void saveKeyFramesAndFactor(const KeyFrameJob &job){
+
+        std::lock_guard<std::mutex> lock(mtx);// 互斥锁，和回环检测不同时进行
         /**
          * update gtsam graph
          */
-        if (cloudKeyPoses3D->points.empty()){ // 第一帧的时候
-            // static Rot3 	RzRyRx (double x, double y, double z),Rotations around Z, Y, then X axes
-            // RzRyRx依次按照z(transformTobeMapped[2])，y(transformTobeMapped[0])，x(transformTobeMapped[1])坐标轴旋转
-            // Point3 (double x, double y, double z)  Construct from x(transformTobeMapped[5]), y(transformTobeMapped[3]), and z(transformTobeMapped[4]) coordinates. 
-            // Pose3 (const Rot3 &R, const Point3 &t) Construct from R,t. 从旋转和平移构造姿态
-            // NonlinearFactorGraph增加一个PriorFactor因子
-            gtSAMgraph.add(PriorFactor<Pose3>(0, Pose3(Rot3::RzRyRx(transformTobeMapped[2], transformTobeMapped[0], transformTobeMapped[1]),
-                                                       		 Point3(transformTobeMapped[5], transformTobeMapped[3], transformTobeMapped[4])), priorNoise));
-            // initialEstimate的数据类型是Values,其实就是一个map，这里在0对应的值下面保存了一个Pose3
-            initialEstimate.insert(0, Pose3(Rot3::RzRyRx(transformTobeMapped[2], transformTobeMapped[0], transformTobeMapped[1]),
-                                                  Point3(transformTobeMapped[5], transformTobeMapped[3], transformTobeMapped[4])));
-            for (int i = 0; i < 6; ++i)
-            	transformLast[i] = transformTobeMapped[i];
+        // 位姿图由PoseGraphBackend维护，返回isam增量优化后的最新关键帧位姿
+        // RzRyRx依次按照z(transform[2])，y(transform[0])，x(transform[1])坐标轴旋转
+        // Point3 (double x, double y, double z)  Construct from x(transform[5]), y(transform[3]), and z(transform[4]) coordinates. 
+        gtsam::Pose3 poseTo = Pose3(Rot3::RzRyRx(job.transform[2], job.transform[0], job.transform[1]),
+                                          Point3(job.transform[5], job.transform[3], job.transform[4]));
+        Pose3 latestEstimate;
+        if (cloudKeyPoses3D->points.empty()){ // 第一帧的时候，加入先验因子
+            latestEstimate = backend.addPrior(poseTo, priorNoise);
         }
         else{ // 非第一帧
-            gtsam::Pose3 poseFrom = Pose3(Rot3::RzRyRx(transformLast[2], transformLast[0], transformLast[1]),
-                                                Point3(transformLast[5], transformLast[3], transformLast[4]));
-            gtsam::Pose3 poseTo   = Pose3(Rot3::RzRyRx(transformAftMapped[2], transformAftMapped[0], transformAftMapped[1]),
-                                                Point3(transformAftMapped[5], transformAftMapped[3], transformAftMapped[4]));
-            // 构造函数原型:BetweenFactor (Key key1, Key key2, const VALUE &measured, const SharedNoiseModel &model)
-            gtSAMgraph.add(BetweenFactor<Pose3>(cloudKeyPoses3D->points.size()-1, cloudKeyPoses3D->points.size(), poseFrom.between(poseTo), odometryNoise));
-            initialEstimate.insert(cloudKeyPoses3D->points.size(), Pose3(Rot3::RzRyRx(transformAftMapped[2], transformAftMapped[0], transformAftMapped[1]),
-                                                                     		   Point3(transformAftMapped[5], transformAftMapped[3], transformAftMapped[4])));
+            // job.last和job.transform位于同一条scan-to-map轨迹上，两者之差是不受回环修正影响的相对运动
+            gtsam::Pose3 poseFrom = Pose3(Rot3::RzRyRx(job.last[2], job.last[0], job.last[1]),
+                                                Point3(job.last[5], job.last[3], job.last[4]));
+            latestEstimate = backend.addOdometry(poseFrom.between(poseTo), poseTo, odometryNoise);
         }
-        /**
-         * update iSAM
-         */
-        // gtsam::ISAM2::update函数原型:
-        // ISAM2Result gtsam::ISAM2::update	(	const NonlinearFactorGraph & 	newFactors = NonlinearFactorGraph(),
-        // const Values & 	newTheta = Values(),
-        // const std::vector< size_t > & 	removeFactorIndices = std::vector<size_t>(),
-        // const boost::optional< FastMap< Key, int > > & 	constrainedKeys = boost::none,
-        // const boost::optional< FastList< Key > > & 	noRelinKeys = boost::none,
-        // const boost::optional< FastList< Key > > & 	extraReelimKeys = boost::none,
-        // bool 	force_relinearize = false )	
-        // gtSAMgraph是新加到系统中的因子
-        // initialEstimate是加到系统中的新变量的初始点
-        isam->update(gtSAMgraph, initialEstimate);
-        isam->update(); // update 函数为什么需要调用两次？
-        
-        // 删除内容?
-        gtSAMgraph.resize(0);
-        initialEstimate.clear();
+        metrics.addValue("pose graph window", backend.size() - backend.windowBegin());
 
         /**
          * save key poses
          */
         PointType thisPose3D;
         PointTypePose thisPose6D;
-        Pose3 latestEstimate;
-
-        // Compute an estimate from the incomplete linear delta computed during the last update.
-        isamCurrentEstimate = isam->calculateEstimate();
-        latestEstimate = isamCurrentEstimate.at<Pose3>(isamCurrentEstimate.size()-1);
 
         thisPose3D.x = latestEstimate.translation().y();
         thisPose3D.y = latestEstimate.translation().z();
         thisPose3D.z = latestEstimate.translation().x();
         thisPose3D.intensity = cloudKeyPoses3D->points.size(); // this can be used as index
         cloudKeyPoses3D->push_back(thisPose3D);
+        keyPoseIndex.add(thisPose3D);
 
         thisPose6D.x = thisPose3D.x;
         thisPose6D.y = thisPose3D.y;
@@ -1626,117 +1790,343 @@ public:
         thisPose6D.roll  = latestEstimate.rotation().pitch();
         thisPose6D.pitch = latestEstimate.rotation().yaw();
         thisPose6D.yaw   = latestEstimate.rotation().roll(); // in camera frame，局部坐标系下!!!
-        thisPose6D.time = timeLaserOdometry;
+        thisPose6D.time = job.time;
         cloudKeyPoses6D->push_back(thisPose6D);
-        /**
-         * save updated transform，第一帧不处理，保存gtsam优化后的位姿
-         */
-        if (cloudKeyPoses3D->points.size() > 1){
-            transformAftMapped[0] = latestEstimate.rotation().pitch();
-            transformAftMapped[1] = latestEstimate.rotation().yaw();
-            transformAftMapped[2] = latestEstimate.rotation().roll();
-            transformAftMapped[3] = latestEstimate.translation().y();
-            transformAftMapped[4] = latestEstimate.translation().z();
-            transformAftMapped[5] = latestEstimate.translation().x();
-
-            for (int i = 0; i < 6; ++i){
-            	transformLast[i] = transformAftMapped[i];
-            	transformTobeMapped[i] = transformAftMapped[i];
-            }
-        }
+        // 没有回环时gtsam优化后的位姿与job.transform一致，有回环时由applyLoopCorrection同步到scan-to-map线程
 
-        pcl::PointCloud<PointType>::Ptr thisCornerKeyFrame(new pcl::PointCloud<PointType>());
-        pcl::PointCloud<PointType>::Ptr thisSurfKeyFrame(new pcl::PointCloud<PointType>());
-        pcl::PointCloud<PointType>::Ptr thisOutlierKeyFrame(new pcl::PointCloud<PointType>());
-        // 降采样后的当前帧扫描
-        pcl::copyPointCloud(*laserCloudCornerLastDS,  *thisCornerKeyFrame);
-        pcl::copyPointCloud(*laserCloudSurfLastDS,    *thisSurfKeyFrame);
-        pcl::copyPointCloud(*laserCloudOutlierLastDS, *thisOutlierKeyFrame);
+        int keyFrameIndex = keyFrameStore.add(*job.corner, *job.surf, *job.outlier);
+        if (loopClosureEnableFlag == true)
+            scanContext.add(*job.corner, *job.surf, *job.outlier, job.time);
+        mapExporter.addKeyFrame(keyFrameIndex, thisPose6D);
 
-        cornerCloudKeyFrames.push_back(thisCornerKeyFrame);
-        surfCloudKeyFrames.push_back(thisSurfKeyFrame);
-        outlierCloudKeyFrames.push_back(thisOutlierKeyFrame);
+        // 如果回环检测线程中isam完成了一次全局位姿优化,那么对关键帧中cloudKeyPoses3D/6D的位姿进行修正
+        correctPoses();
     }
 
     void correctPoses(){
-    	if (aLoopIsClosed == true){ // 回环检测进行了更新
-            recentCornerCloudKeyFrames. clear();
-            recentSurfCloudKeyFrames.   clear();
-            recentOutlierCloudKeyFrames.clear();
-            // update key poses
-                int numPoses = isamCurrentEstimate.size();
-            for (int i = 0; i < numPoses; ++i){
-            cloudKeyPoses3D->points[i].x = isamCurrentEstimate.at<Pose3>(i).translation().y();
-            cloudKeyPoses3D->points[i].y = isamCurrentEstimate.at<Pose3>(i).translation().z();
-            cloudKeyPoses3D->points[i].z = isamCurrentEstimate.at<Pose3>(i).translation().x();
+    	if (aLoopIsClosed == true){ // 回环检测进行了更新，窗口内的关键帧位姿被修正
+            applyCorrectedPoses(backend.takeLoopCorrection());
+            aLoopIsClosed = false;
+        }
+    }
+
+    // 用位姿图中从begin开始的关键帧位姿修正cloudKeyPoses3D/6D，窗口之前的关键帧位姿没有变化
+    void applyCorrectedPoses(int begin){
+        // update key poses
+        int numPoses = backend.size();
+        for (int i = begin; i < numPoses; ++i){
+            const Pose3 &pose = backend.estimate(i);
+            cloudKeyPoses3D->points[i].x = pose.translation().y();
+            cloudKeyPoses3D->points[i].y = pose.translation().z();
+            cloudKeyPoses3D->points[i].z = pose.translation().x();
 
             cloudKeyPoses6D->points[i].x = cloudKeyPoses3D->points[i].x;
             cloudKeyPoses6D->points[i].y = cloudKeyPoses3D->points[i].y;
             cloudKeyPoses6D->points[i].z = cloudKeyPoses3D->points[i].z;
-            cloudKeyPoses6D->points[i].roll  = isamCurrentEstimate.at<Pose3>(i).rotation().pitch();
-            cloudKeyPoses6D->points[i].pitch = isamCurrentEstimate.at<Pose3>(i).rotation().yaw();
-            cloudKeyPoses6D->points[i].yaw   = isamCurrentEstimate.at<Pose3>(i).rotation().roll();
-            }
-
-            aLoopIsClosed = false;
+            cloudKeyPoses6D->points[i].roll  = pose.rotation().pitch();
+            cloudKeyPoses6D->points[i].pitch = pose.rotation().yaw();
+            cloudKeyPoses6D->points[i].yaw   = pose.rotation().roll();
         }
+
+        keyPoseIndex.update(*cloudKeyPoses3D, begin);
+        ++keyPoseRevision;
+
+        // 通知scan-to-map线程同步位姿并重建局部地图
+        loopCorrectionPending = true;
+        // 导出和发布的全局地图中只更新位姿有变化的关键帧覆盖的块
+        mapExporter.correctPoses(*cloudKeyPoses6D, begin);
     }
 
     void clearCloud(){
-        laserCloudCornerFromMap->clear();
-        laserCloudSurfFromMap->clear();  
-        laserCloudCornerFromMapDS->clear();
         laserCloudSurfFromMapDS->clear();   
     }
 
+    // 同一帧的四路消息都到达后由回调调用，将这一帧数据送入流水线
     void run(){
 
-        if (newLaserCloudCornerLast  && std::abs(timeLaserCloudCornerLast  - timeLaserOdometry) < 0.005 &&
-            newLaserCloudSurfLast    && std::abs(timeLaserCloudSurfLast    - timeLaserOdometry) < 0.005 &&
-            newLaserCloudOutlierLast && std::abs(timeLaserCloudOutlierLast - timeLaserOdometry) < 0.005 &&
-            newLaserOdometry) // 时间同步
-        {
+        if (timeLaserOdometryNew - timeLastProcessing >= mappingProcessInterval) { // 时间间隔大于等于mappingProcessInterval就进行低频更新
 
-            newLaserCloudCornerLast = false; newLaserCloudSurfLast = false; newLaserCloudOutlierLast = false; newLaserOdometry = false;
+            timeLastProcessing = timeLaserOdometryNew;
 
-            std::lock_guard<std::mutex> lock(mtx);// 互斥锁，和回环检测不同时进行
+            boost::shared_ptr<MappingFrame> frame(new MappingFrame());
+            frame->time = timeLaserOdometryNew;
+            for (int i = 0; i < 6; ++i)
+                frame->transformSum[i] = transformSumNew[i];
+            // 直接持有回调函数收到的只读点云，不需要拷贝
+            frame->cornerLast = laserCloudCornerLast;
+            frame->surfLast = laserCloudSurfLast;
+            frame->outlierLast = laserCloudOutlierLast;
+
+            // 队列满时阻塞，反压到ROS的订阅队列，阻塞时间持续增加说明建图跟不上输入
+            // 同时通知loadShedder提高降级级别，降级设置随帧传递给各阶段
+            if (prepQueue.full())
+                loadShedder.markQueueFull();
+            frame->load = loadShedder.current();
+            ScopedTimer timer(metrics, "prepQueue.push", frame->time);
+            if (prepQueue.push(frame))
+                ++framesQueued;
+        }
+        metrics.setCounter("unmatched messages", frameSync.droppedNum(), true);
+        metrics.addValue("downsample queue depth", prepQueue.size());
+        metrics.addValue("mapping queue depth", mappingQueue.size());
+        metrics.addValue("graph queue depth", graphQueue.size());
+        metrics.publishIfDue();
+
+        // 各阶段的队列深度，持续不为0说明该阶段跟不上输入
+        ROS_DEBUG_THROTTLE(5.0, "mapOptimization queues: downsample %d, mapping %d, graph %d, unmatched messages %d",
+                           (int)prepQueue.size(), (int)mappingQueue.size(), (int)graphQueue.size(), (int)frameSync.droppedNum());
+    }
 
-            if (timeLaserOdometry - timeLastProcessing >= mappingProcessInterval) { // 时间间隔大于等于0.3s就进行低频更新
+    // 降采样线程：对第N+1帧降采样，同时scan-to-map线程处理第N帧
+    void downsampleThread(){
+        metrics.nameThread("downsample");
+        boost::shared_ptr<MappingFrame> frame;
+        while (prepQueue.pop(frame)){
+            {
+                ScopedTimer timer(metrics, "downsampleCurrentScan", frame->time);
+                downsampleCurrentScan(*frame);
+            }
+            metrics.setCounter("frame cloud pool allocations", frameCloudPool.allocations());
+            if (mappingQueue.push(frame) == false)
+                break;
+        }
+        mappingQueue.close();
+    }
 
-                timeLastProcessing = timeLaserOdometry;
-                // 应该是根据当前的odom pose,以及上一次进行map_optimation前后的pose(即漂移),计算目前最优的位姿估计
-                transformAssociateToMap(); //获取世界坐标系转换矩阵，// 将坐标转移到世界坐标系下->得到可用于建图的Lidar坐标
-                // 第一帧不执行
-                extractSurroundingKeyFrames();// 确定周围的关键帧的索引,点云保存到recentCorner等，地图拼接保存到laserCloudCornerFromMap等
+    // 把降采样后的一帧设为scan-to-map线程的当前帧
+    void loadFrame(const MappingFrame &frame){
+        timeLaserOdometry = frame.time;
+        for (int i = 0; i < 6; ++i)
+            transformSum[i] = frame.transformSum[i];
+        laserCloudCornerLastDS = frame.cornerLastDS;
+        laserCloudSurfLastDS = frame.surfLastDS;
+        laserCloudOutlierLastDS = frame.outlierLastDS;
+        laserCloudSurfTotalLast = frame.surfTotalLast;
+        laserCloudSurfTotalLastDS = frame.surfTotalLastDS;
+        laserCloudCornerLastDSNum = laserCloudCornerLastDS->points.size();
+        laserCloudSurfLastDSNum = laserCloudSurfLastDS->points.size();
+        laserCloudOutlierLastDSNum = laserCloudOutlierLastDS->points.size();
+        laserCloudSurfTotalLastDSNum = laserCloudSurfTotalLastDS->points.size();
+        float previousRadius = submapRadius;
+        submapRadius = surroundingKeyframeSearchRadius * frame.load.submapScale;
+        submapKeyFrameNum = std::max(1, (int)(surroundingKeyframeSearchNum * frame.load.submapScale));
+        if (submapRadius > previousRadius)
+            submapGrown = true;
+    }
 
-                downsampleCurrentScan();// 降采样当前扫描
+    // 降级级别变化时输出并发布当前的设置，级别升高(建图跟不上输入)时诊断状态为WARN
+    void reportLoadShedding(const LoadShedder::Settings &previous){
+        LoadShedder::Settings load = loadShedder.current();
+        if (load.level > previous.level)
+            metrics.increment("load shedding escalations", 1, true);
+        else
+            metrics.increment("load shedding recoveries");
+        ROS_WARN("mapOptimization load shedding level %d -> %d (load %.2f): corner/surf/outlier leaf %.1f/%.1f/%.1f m, "
+                 "outliers %s, submap scale %.1f, extra skipped frames %d",
+                 previous.level, load.level, loadShedder.currentLoad(), load.cornerLeaf, load.surfLeaf, load.outlierLeaf,
+                 load.matchOutliers ? "matched" : "not matched", load.submapScale, load.extraSkipFrames);
+
+        if (load.extraSkipFrames != previous.extraSkipFrames){
+            std_msgs::UInt32 msg;
+            msg.data = load.extraSkipFrames;
+            pubBackpressure.publish(msg);
+        }
+    }
 
-                // 进行scan-to-map位姿优化,并为下一次做准备 (第一帧不执行)
-                // 最优位姿保存在和transformAftMapped中，同时transformBfeMapped中保存了优化前的位姿，两者的差距就是激光odo和最优位姿之间偏移量的估计
+    // scan-to-map线程：位姿预测、局部地图维护、scan-to-map优化，选出关键帧交给图优化线程
+    void mappingThread(){
+        metrics.nameThread("scan2map");
+        boost::shared_ptr<MappingFrame> frame;
+        while (mappingQueue.pop(frame)){
+            ScopedTimer frameTimer(metrics, "mappingFrame", frame->time);
+            PipelineMetrics::Clock::time_point frameStart = PipelineMetrics::Clock::now();
+
+            loadFrame(*frame);
+
+            // 如果图优化线程已按回环结果修正了关键帧位姿，先同步当前位姿估计和局部地图
+            applyLoopCorrection();
+
+            // 应该是根据当前的odom pose,以及上一次进行map_optimation前后的pose(即漂移),计算目前最优的位姿估计
+            transformAssociateToMap(); //获取世界坐标系转换矩阵，// 将坐标转移到世界坐标系下->得到可用于建图的Lidar坐标
+            // 第一帧不执行
+            if (localizationMode) {
+                ScopedTimer timer(metrics, "updateLocalizationMap", frame->time);
+                updateLocalizationMap();
+            } else {
+                ScopedTimer timer(metrics, "extractSurroundingKeyFrames", frame->time);
+                extractSurroundingKeyFrames();// 移除局部地图localCornerMap/localSurfMap中离开当前位置搜索半径的体素
+            }
+            // 局部地图的体素数即scan-to-map近邻搜索的规模
+            metrics.addValue("local corner map size", laserCloudCornerFromMapDSNum);
+            metrics.addValue("local surf map size", laserCloudSurfFromMapDSNum);
+            metrics.addValue("corner points DS", laserCloudCornerLastDSNum);
+            metrics.addValue("surf points DS", laserCloudSurfTotalLastDSNum);
+
+            // 进行scan-to-map位姿优化,并为下一次做准备 (第一帧不执行)
+            // 最优位姿保存在和transformAftMapped中，同时transformBfeMapped中保存了优化前的位姿，两者的差距就是激光odo和最优位姿之间偏移量的估计
+            {
+                ScopedTimer timer(metrics, "scan2MapOptimization", frame->time);
                 scan2MapOptimization(); // 当前扫描进行边缘优化，图优化以及进行LM优化的过程
-                // 到这里，虽然在scan-to-scan之后，又进行了scan-to-map的匹配，但是并未出现回环检测和优化，
-                // 所以依然是一个误差不断积累的里程计的概念
-
-                // 如果距离上一次保存的关键帧欧式距离最够大，需要保存当前关键帧
-                // 计算与上一关键帧之间的约束，这种约束可以理解为局部的小回环，加入后端进行优化，
-                // 将优化的结果保存作为关键帧位姿，同步到scan-to-map优化环节
-                saveKeyFramesAndFactor();
+            }
 
-                // 如果另一个回环检测线程中isam完成了一次全局位姿优化,那么对关键帧中cloudKeyPoses3D/6D的位姿进行修正
-                correctPoses();
+            // 如果距离上一次保存的关键帧欧式距离最够大，需要保存当前关键帧
+            // 插入局部地图，并交给图优化线程计算与上一关键帧之间的约束
+            // 纯定位模式下地图不变，不插入关键帧，图优化、回环检测和全局地图可视化线程一直空闲
+            if (localizationMode == false) {
+                ScopedTimer timer(metrics, "submitKeyFrame", frame->time);
+                submitKeyFrame();
+            }
 
+            {
+                ScopedTimer timer(metrics, "publishKeyPosesAndFrames", frame->time);
                 // 发布优化后的位姿,及tf变换
                 publishTF();
 
                 // 发布所有关键帧位姿,当前的局部面点地图及当前帧中的面点/角点
                 publishKeyPosesAndFrames();
+            }
+
+            clearCloud();
+
+            // 这一帧的耗时与帧间隔之比决定之后送入流水线的帧的降级设置
+            double frameMs = std::chrono::duration<double, std::milli>(PipelineMetrics::Clock::now() - frameStart).count();
+            LoadShedder::Settings previous = loadShedder.current();
+            if (loadShedder.addFrame(frame->time, frameMs))
+                reportLoadShedding(previous);
+            metrics.addValue("load shedding level", frame->load.level);
+            metrics.addValue("submap radius", submapRadius);
 
-                clearCloud();
+            {
+                std::lock_guard<std::mutex> lock(progressMtx);
+                ++framesMapped;
+            }
+            progressCond.notify_all();
+        }
+        graphQueue.close();
+    }
+
+    // 图优化线程：ISAM2更新，与下一帧的scan-to-map优化并行
+    void graphThread(){
+        metrics.nameThread("graph");
+        boost::shared_ptr<KeyFrameJob> job;
+        while (graphQueue.pop(job)){
+            {
+                ScopedTimer timer(metrics, "saveKeyFramesAndFactor", job->time);
+                saveKeyFramesAndFactor(*job);
+            }
+            metrics.addValue("key frames", keyFrameProcessedNum + 1);
+            {
+                std::lock_guard<std::mutex> lock(progressMtx);
+                ++keyFrameProcessedNum;
             }
+            progressCond.notify_all();
         }
     }
+
+    // 建图流水线：降采样 -> scan-to-map优化 -> ISAM2图优化，各阶段之间通过有界队列连接
+    void startPipeline(){
+        downsampleWorker = std::thread(&mapOptimization::downsampleThread, this);
+        mappingWorker = std::thread(&mapOptimization::mappingThread, this);
+        graphWorker = std::thread(&mapOptimization::graphThread, this);
+    }
+
+    // 关闭流水线入口，各阶段处理完队列中剩余的数据后依次退出
+    void finishPipeline(){
+        prepQueue.close();
+        downsampleWorker.join();
+        mappingWorker.join();
+        graphWorker.join();
+    }
+
+    // 离线回放时使用：等待已送入流水线的帧全部完成scan-to-map优化和图优化，使结果与线程调度无关
+    void waitPipelineIdle(){
+        std::unique_lock<std::mutex> lock(progressMtx);
+        progressCond.wait(lock, [this]{
+            return running == false || (framesMapped >= framesQueued && keyFrameProcessedNum >= keyFrameNum); });
+    }
+
+    // save final point cloud，地图已经在后台增量导出，这里只写入剩余部分
+    void saveMap(){
+        // 纯定位模式下没有新的关键帧，不能覆盖已有的地图
+        if (localizationMode)
+            return;
+        mapExporter.finish(*cloudKeyPoses3D);
+    }
+
+    // 启动各工作线程并运行主循环，独立进程和nodelet共用
+    // queue为NULL时处理全局回调队列，否则处理nodelet中设置的独立回调队列，回调与run()始终在同一线程中执行
+    void spin(ros::CallbackQueue *queue){
+
+        // 进行闭环检测与闭环修正的功能
+        std::thread loopthread(&mapOptimization::loopClosureThread, this);
+        // 该线程中进行的工作是publishGlobalMap(),将数据发布到ros中，可视化
+        std::thread visualizeMapThread(&mapOptimization::visualizeGlobalMapThread, this);
+        startPipeline();
+
+        // 没有消息时阻塞在回调队列上，同一帧的消息到齐后在回调中直接执行run()，超时只用于检查running
+        if (queue == NULL)
+            queue = ros::getGlobalCallbackQueue();
+        while (ros::ok() && running)
+            queue->callAvailable(ros::WallDuration(0.1));
+
+        // 唤醒等待新关键帧的线程，流水线处理完队列中剩余的数据后退出
+        stop();
+        finishPipeline();
+
+        loopthread.join();
+        visualizeMapThread.join();
+
+        saveMap();
+    }
+
+    void stop(){
+        {
+            std::lock_guard<std::mutex> lock(progressMtx);
+            running = false;
+        }
+        progressCond.notify_all();
+    }
 };
 
+#ifdef LEGO_LOAM_NODELET
+
+namespace lego_loam{
+
+// nodelet版本，回调放入独立的回调队列，由主循环线程处理，与独立进程时的执行顺序相同
+class MapOptimizationNodelet : public nodelet::Nodelet{
+
+private:
+
+    ros::CallbackQueue queue;
+    boost::shared_ptr<mapOptimization> MO;
+    std::thread worker;
+
+    virtual void onInit(){
+        ros::NodeHandle nh(getPrivateNodeHandle());
+        nh.setCallbackQueue(&queue);
+        MO.reset(new mapOptimization(nh));
+        worker = std::thread(&mapOptimization::spin, MO.get(), &queue);
+        NODELET_INFO("\033[1;32m---->\033[0m Map Optimization Nodelet Started.");
+    }
+
+public:
+
+    ~MapOptimizationNodelet(){
+        if (MO){
+            MO->stop();
+            worker.join();
+        }
+    }
+};
+
+}
+
+PLUGINLIB_EXPORT_CLASS(lego_loam::MapOptimizationNodelet, nodelet::Nodelet)
+
+#elif !defined(LEGO_LOAM_OFFLINE)
+
+// offlineReplay.cpp把四个节点编译进同一个程序，由它提供main
+
 // lasermapping部分 is called only once per sweep
 int main(int argc, char** argv)
 {
@@ -1746,24 +2136,9 @@ int main(int argc, char** argv)
 
     mapOptimization MO;
 
-    // std::thread 构造函数，将MO作为参数传入构造的线程中使用
-    // 进行闭环检测与闭环修正的功能
-    std::thread loopthread(&mapOptimization::loopClosureThread, &MO);
-    // 该线程中进行的工作是publishGlobalMap(),将数据发布到ros中，可视化
-    std::thread visualizeMapThread(&mapOptimization::visualizeGlobalMapThread, &MO);
-
-    ros::Rate rate(200);
-    while (ros::ok())
-    {
-        ros::spinOnce();
-
-        MO.run(); // 循环进行scan-to-map的优化,保存关键帧
-
-        rate.sleep();
-    }
-
-    loopthread.join();
-    visualizeMapThread.join();
+    MO.spin(NULL);
 
     return 0;
 }
+
+#endif
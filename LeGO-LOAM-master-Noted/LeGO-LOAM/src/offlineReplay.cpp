@@ -0,0 +1,174 @@
+// 离线回放：直接读取rosbag，在同一个进程中按确定的顺序驱动四个节点，处理速度只受CPU限制
+// 用法：rosrun lego_loam offlineReplay <bag文件> [--loop-closure-period 秒]，或使用launch/run_offline.launch
+//
+// 与rosbag play + 四个独立节点相比：
+//   不依赖墙上时钟，没有ros::Rate轮询带来的延迟，也不会因为处理不及时而丢帧，
+//   每个点云依次经过ImageProjection -> FeatureAssociation -> mapOptimization -> TransformFusion，
+//   节点之间仍然通过话题连接(同一进程内以共享指针传递)，各节点使用独立的回调队列，由这里显式处理，
+//   每一帧都等待建图流水线处理完毕，回环检测按bag时间每隔loop-closure-period秒在主线程中执行一次，
+//   因此同一个bag、同一组参数的结果与机器负载无关，可以在集群上重复处理大量数据及A/B对比参数
+// 话题连接需要ROS master(roslaunch会自动启动)，四个节点的类通过包含各自的源文件编译进来，
+// 这样utility.h中的参数只定义一次
+
+#define LEGO_LOAM_OFFLINE
+
+#include "imageProjection.cpp"
+#include "featureAssociation.cpp"
+#include "transformFusion.cpp"
+#include "mapOptmization.cpp"
+
+#include <rosbag/bag.h>
+#include <rosbag/view.h>
+
+class OfflineReplay{
+
+private:
+
+    ros::CallbackQueue imageProjectionQueue;
+    ros::CallbackQueue featureAssociationQueue;
+    ros::CallbackQueue mapOptimizationQueue;
+    ros::CallbackQueue transformFusionQueue;
+
+    boost::shared_ptr<ImageProjection> IP;
+    boost::shared_ptr<FeatureAssociation> FA;
+    boost::shared_ptr<TransformFusion> TFusion;
+    boost::shared_ptr<mapOptimization> MO;
+
+    ros::NodeHandle nh;
+    ros::Publisher pubLaserCloud;
+    ros::Publisher pubImu;
+
+    double loopClosurePeriod;
+    double timeLastLoopClosure;
+
+    ros::NodeHandle queueHandle(ros::CallbackQueue &queue){
+        ros::NodeHandle handle("~");
+        handle.setCallbackQueue(&queue);
+        return handle;
+    }
+
+    // 等待同一进程内的订阅者连接上，否则第一批消息会被丢弃
+    static void waitForSubscriber(const ros::Publisher &pub){
+        while (pub.getNumSubscribers() == 0 && ros::ok())
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    void processImu(const sensor_msgs::ImuConstPtr &imu){
+        pubImu.publish(imu);
+        featureAssociationQueue.callAvailable();
+        mapOptimizationQueue.callAvailable();
+    }
+
+    void processCloud(const sensor_msgs::PointCloud2ConstPtr &cloud){
+        pubLaserCloud.publish(cloud);
+        imageProjectionQueue.callAvailable();
+
+        // 同一帧的消息到齐后，FeatureAssociation和mapOptimization在回调中直接处理
+        featureAssociationQueue.callAvailable();
+        mapOptimizationQueue.callAvailable();
+        MO->waitPipelineIdle();
+
+        double time = cloud->header.stamp.toSec();
+        if (loopClosureEnableFlag == true && time - timeLastLoopClosure >= loopClosurePeriod){
+            timeLastLoopClosure = time;
+            MO->performLoopClosure();
+        }
+
+        transformFusionQueue.callAvailable();
+    }
+
+public:
+
+    OfflineReplay(double period):
+        nh("~"),
+        loopClosurePeriod(period),
+        timeLastLoopClosure(0)
+    {
+        IP.reset(new ImageProjection(queueHandle(imageProjectionQueue)));
+        FA.reset(new FeatureAssociation(queueHandle(featureAssociationQueue)));
+        TFusion.reset(new TransformFusion(queueHandle(transformFusionQueue)));
+        MO.reset(new mapOptimization(queueHandle(mapOptimizationQueue)));
+
+        pubLaserCloud = nh.advertise<sensor_msgs::PointCloud2>(pointCloudTopic, 1);
+        pubImu = nh.advertise<sensor_msgs::Imu>(imuTopic, 50);
+        waitForSubscriber(pubLaserCloud);
+
+        MO->startPipeline();
+    }
+
+    // 按bag中的顺序处理全部点云和imu消息，返回处理的点云帧数
+    int replay(const string &bagFile, double &bagDuration){
+
+        rosbag::Bag bag;
+        bag.open(bagFile, rosbag::bagmode::Read);
+
+        std::vector<string> topics;
+        topics.push_back(pointCloudTopic);
+        topics.push_back(imuTopic);
+        rosbag::View view(bag, rosbag::TopicQuery(topics));
+        bagDuration = (view.getEndTime() - view.getBeginTime()).toSec();
+
+        int cloudNum = 0;
+        for (rosbag::View::iterator it = view.begin(); it != view.end(); ++it){
+            const rosbag::MessageInstance &m = *it;
+            if (ros::ok() == false)
+                break;
+            sensor_msgs::ImuConstPtr imu = m.instantiate<sensor_msgs::Imu>();
+            if (imu != NULL){
+                processImu(imu);
+                continue;
+            }
+            sensor_msgs::PointCloud2ConstPtr cloud = m.instantiate<sensor_msgs::PointCloud2>();
+            if (cloud != NULL){
+                processCloud(cloud);
+                if (++cloudNum % 100 == 0)
+                    ROS_INFO("Offline replay: %d clouds processed.", cloudNum);
+            }
+        }
+        bag.close();
+        return cloudNum;
+    }
+
+    void finish(){
+        MO->finishPipeline();
+        MO->saveMap();
+    }
+};
+
+int main(int argc, char** argv)
+{
+    ros::init(argc, argv, "lego_loam");
+
+    if (argc < 2){
+        ROS_ERROR("Usage: offlineReplay <bag file> [--loop-closure-period seconds]");
+        return 1;
+    }
+    string bagFile = argv[1];
+    double loopClosurePeriod = 1.0; // 与loopClosureThread中ros::Rate(1)相同
+    for (int i = 2; i + 1 < argc; ++i)
+        if (string(argv[i]) == "--loop-closure-period")
+            loopClosurePeriod = atof(argv[i + 1]);
+
+    readSensorParams();
+
+    ROS_INFO("\033[1;32m---->\033[0m Offline Replay Started: %s", bagFile.c_str());
+
+    OfflineReplay replay(loopClosurePeriod);
+
+    ros::WallTime start = ros::WallTime::now();
+    double bagDuration = 0;
+    int cloudNum;
+    try{
+        cloudNum = replay.replay(bagFile, bagDuration);
+    }catch (const rosbag::BagException &e){
+        ROS_ERROR("Offline replay: %s", e.what());
+        replay.finish();
+        return 1;
+    }
+    replay.finish();
+
+    double elapsed = (ros::WallTime::now() - start).toSec();
+    ROS_INFO("Offline replay finished: %d clouds, %.1f s of data in %.1f s (%.1fx real time).",
+             cloudNum, bagDuration, elapsed, elapsed > 0 ? bagDuration / elapsed : 0.0);
+    return 0;
+}
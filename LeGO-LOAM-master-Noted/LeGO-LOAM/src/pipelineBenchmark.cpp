@@ -0,0 +1,405 @@
+// 各处理阶段的基准测试：读取bag中录制的点云(或生成确定的仿真点云)，在同一线程中依次单独调用各阶段并计时
+// 用法：rosrun lego_loam pipelineBenchmark <bag文件>|--synthetic [--frames N] [--warmup N] [--csv 文件]
+//       或 roslaunch lego_loam run_benchmark.launch sensor:=vlp16|hdl32e|os1-64 bag:=...
+//
+// 测试的阶段：
+//   ImageProjection::projectPointCloud/groundRemoval/cloudSegmentation
+//   FeatureAssociation::extractFeatures/findCorrespondingSurfFeatures/calculateTransformationSurf/
+//                       findCorrespondingCornerFeatures/calculateTransformationCorner(每帧所有迭代的总和)
+//   mapOptimization::extractSurroundingKeyFrames/scan2MapOptimization
+// 每个阶段输出每帧耗时的均值、p50/p90/p99、最大值以及吞吐量(每秒处理的点数)，前warmup帧不计入统计
+// 线束数由lego_loam/sensor参数决定(与节点相同)，16/32/64线分别用对应的config/*.yaml运行，
+// --csv把结果追加到同一个文件中，便于对比不同雷达和不同版本
+// 阶段之间直接传递数据，不经过话题，不启动mapOptimization的流水线线程，结果与线程调度无关
+// 与offlineReplay相同，四个节点的类通过包含各自的源文件编译进来，节点的NodeHandle需要ROS master(roslaunch会自动启动)
+// run_benchmark.launch中关闭了lego_loam/metrics，避免指标统计的开销计入被测阶段
+
+#define LEGO_LOAM_OFFLINE
+
+#include "imageProjection.cpp"
+#include "featureAssociation.cpp"
+#include "transformFusion.cpp"
+#include "mapOptmization.cpp"
+
+#include <rosbag/bag.h>
+#include <rosbag/view.h>
+
+#include <random>
+
+/*
+    * 确定的仿真场景：长走廊形的房间，两侧有一排柱子，雷达以5m/s沿x轴前进
+    * 按当前的N_SCAN/Horizon_SCAN/ang_res_y/ang_bottom生成带ring的点云，点的顺序与Velodyne相同(逐列、顺时针)
+    */
+class SyntheticScan{
+
+private:
+
+    std::mt19937 rng;
+    std::normal_distribution<float> noise;
+
+    static const float sensorHeight;
+    static const float roomMinX, roomMaxX, roomHalfWidth, roomHeight;
+    static const float pillarSpacing, pillarOffset, pillarRadius;
+
+    // 射线origin + t*dir与场景的最近交点，没有交点时返回-1
+    static float raycast(const Eigen::Vector3f &origin, const Eigen::Vector3f &dir){
+        float best = FLT_MAX;
+        // 地面和天花板
+        if (dir.z() < -1e-6)
+            best = std::min(best, (-sensorHeight - origin.z()) / dir.z());
+        else if (dir.z() > 1e-6)
+            best = std::min(best, (roomHeight - sensorHeight - origin.z()) / dir.z());
+        // 四面墙
+        if (dir.x() > 1e-6)
+            best = std::min(best, (roomMaxX - origin.x()) / dir.x());
+        else if (dir.x() < -1e-6)
+            best = std::min(best, (roomMinX - origin.x()) / dir.x());
+        if (dir.y() > 1e-6)
+            best = std::min(best, (roomHalfWidth - origin.y()) / dir.y());
+        else if (dir.y() < -1e-6)
+            best = std::min(best, (-roomHalfWidth - origin.y()) / dir.y());
+        // 柱子(竖直的圆柱)
+        float a = dir.x() * dir.x() + dir.y() * dir.y();
+        if (a > 1e-6){
+            for (float px = roomMinX + pillarSpacing; px < roomMaxX; px += pillarSpacing){
+                for (int side = -1; side <= 1; side += 2){
+                    float dx = origin.x() - px, dy = origin.y() - side * pillarOffset;
+                    float b = 2 * (dir.x() * dx + dir.y() * dy);
+                    float c = dx * dx + dy * dy - pillarRadius * pillarRadius;
+                    float disc = b * b - 4 * a * c;
+                    if (disc < 0)
+                        continue;
+                    float t = (-b - sqrt(disc)) / (2 * a);
+                    if (t > 0)
+                        best = std::min(best, t);
+                }
+            }
+        }
+        return best == FLT_MAX ? -1 : best;
+    }
+
+public:
+
+    SyntheticScan(): rng(2018), noise(0, 0.01) {}
+
+    sensor_msgs::PointCloud2ConstPtr generate(int frame){
+
+        Eigen::Vector3f origin(0.5f * frame, 0, 0);
+        pcl::PointCloud<PointXYZIR> cloud;
+        cloud.points.reserve(N_SCAN * Horizon_SCAN);
+        for (int j = 0; j < Horizon_SCAN; ++j){
+            float azimuth = -2 * M_PI * j / Horizon_SCAN;
+            for (int i = 0; i < N_SCAN; ++i){
+                float vertical = (-ang_bottom + i * ang_res_y) / 180.0 * M_PI;
+                Eigen::Vector3f dir(cos(vertical) * cos(azimuth), cos(vertical) * sin(azimuth), sin(vertical));
+                float t = raycast(origin, dir);
+                if (t < 0 || t > 100)
+                    continue;
+                t += noise(rng);
+                PointXYZIR p;
+                p.x = t * dir.x();
+                p.y = t * dir.y();
+                p.z = t * dir.z();
+                p.intensity = 50;
+                p.ring = i;
+                cloud.points.push_back(p);
+            }
+        }
+        cloud.width = cloud.points.size();
+        cloud.height = 1;
+
+        boost::shared_ptr<sensor_msgs::PointCloud2> msg(new sensor_msgs::PointCloud2());
+        pcl::toROSMsg(cloud, *msg);
+        msg->header.stamp = ros::Time(1000.0 + scanPeriod * frame);
+        msg->header.frame_id = "velodyne";
+        return msg;
+    }
+};
+
+const float SyntheticScan::sensorHeight = 1.5;
+const float SyntheticScan::roomMinX = -30, SyntheticScan::roomMaxX = 200;
+const float SyntheticScan::roomHalfWidth = 12, SyntheticScan::roomHeight = 5;
+const float SyntheticScan::pillarSpacing = 8, SyntheticScan::pillarOffset = 6, SyntheticScan::pillarRadius = 0.4;
+
+class PipelineBenchmark{
+
+private:
+
+    typedef std::chrono::steady_clock Clock;
+
+    // 一个阶段每帧的耗时和处理的点数
+    struct Stage{
+        string name;
+        std::vector<double> ms;
+        double points;
+        Stage(const string &nameIn): name(nameIn), points(0) {}
+    };
+
+    std::vector<Stage> stages;
+    int warmup;
+    int frameNum;
+
+    boost::shared_ptr<ImageProjection> IP;
+    boost::shared_ptr<FeatureAssociation> FA;
+    boost::shared_ptr<mapOptimization> MO;
+
+    double inputPoints;   // 当前帧原始点云中的点数
+
+    enum { ProjectPointCloud, GroundRemoval, CloudSegmentation,
+           ExtractFeatures, FindCorrespondingSurfFeatures, CalculateTransformationSurf,
+           FindCorrespondingCornerFeatures, CalculateTransformationCorner,
+           ExtractSurroundingKeyFrames, Scan2MapOptimization };
+
+    static double elapsedMs(Clock::time_point start){
+        return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+    }
+
+    // 跳过预热帧
+    void record(int stage, double ms, double points){
+        if (frameNum < warmup)
+            return;
+        stages[stage].ms.push_back(ms);
+        stages[stage].points += points;
+    }
+
+    // 与ImageProjection::processRangeImage()相同的模板分派，常见雷达使用编译期确定尺寸的版本
+    void runImageProjection(){
+        if (N_SCAN == 16 && Horizon_SCAN == 1800)
+            runImageProjection<16, 1800>();
+        else if (N_SCAN == 32 && Horizon_SCAN == 1800)
+            runImageProjection<32, 1800>();
+        else if (N_SCAN == 128 && Horizon_SCAN == 1800)
+            runImageProjection<128, 1800>();
+        else if (N_SCAN == 16 && Horizon_SCAN == 1024)
+            runImageProjection<16, 1024>();
+        else if (N_SCAN == 64 && Horizon_SCAN == 1024)
+            runImageProjection<64, 1024>();
+        else
+            runImageProjection<0, 0>();
+    }
+
+    template <int Rows, int Cols>
+    void runImageProjection(){
+        Clock::time_point start = Clock::now();
+        IP->projectPointCloud<Rows, Cols>();
+        record(ProjectPointCloud, elapsedMs(start), inputPoints);
+
+        start = Clock::now();
+        IP->groundRemoval<Rows, Cols>();
+        record(GroundRemoval, elapsedMs(start), inputPoints);
+
+        start = Clock::now();
+        IP->cloudSegmentation<Rows, Cols>();
+        record(CloudSegmentation, elapsedMs(start), inputPoints);
+    }
+
+    // 直接调用FeatureAssociation::updateTransformation()，由其中的计时累计每个函数在这一帧所有迭代中的耗时
+    void runUpdateTransformation(){
+        FA->updateTransformation();
+        const FeatureAssociation::TransformationTiming &timing = FA->transformationTiming;
+        if (timing.matched == false)
+            return;
+        record(FindCorrespondingSurfFeatures, timing.findSurfMs, FA->surfPointsFlat->points.size());
+        record(CalculateTransformationSurf, timing.calculateSurfMs, FA->surfPointsFlat->points.size());
+        record(FindCorrespondingCornerFeatures, timing.findCornerMs, FA->cornerPointsSharp->points.size());
+        record(CalculateTransformationCorner, timing.calculateCornerMs, FA->cornerPointsSharp->points.size());
+    }
+
+    // 返回true表示这一帧的特征点发送给了mapOptimization(与publishCloudsLast中的跳帧相同)
+    bool runFeatureAssociation(const ros::Time &stamp){
+
+        // 与laserCloudHandler/outlierCloudHandler/laserCloudInfoHandler相同的输入
+        FA->cloudHeader.stamp = stamp;
+        FA->timeScanCur = stamp.toSec();
+        *FA->segmentedCloud = *IP->segmentedCloud;
+        FA->outlierCloud = FA->outlierCloudPool.acquire();
+        *FA->outlierCloud = *IP->outlierCloud;
+        FA->segInfo = IP->segMsg;
+
+        FA->adjustDistortion();
+        FA->calculateSmoothness();
+        FA->markOccludedPoints();
+        Clock::time_point start = Clock::now();
+        FA->extractFeatures();
+        record(ExtractFeatures, elapsedMs(start), FA->segmentedCloud->points.size());
+
+        if (!FA->systemInitedLM) {
+            FA->checkSystemInitialization();
+            return false;
+        }
+        FA->updateInitialGuess();
+        runUpdateTransformation();
+        FA->integrateTransformation();
+        FA->publishCloudsLast();
+        return FA->frameCount == 0;
+    }
+
+    // 与mapOptimization::run()以及降采样、scan-to-map、图优化三个线程中的处理相同，在当前线程中依次执行
+    void runMapOptimization(double time){
+
+        if (time - MO->timeLastProcessing < mappingProcessInterval)
+            return;
+        MO->timeLastProcessing = time;
+
+        mapOptimization::MappingFrame frame;
+        frame.time = time;
+        for (int i = 0; i < 6; ++i)
+            frame.transformSum[i] = FA->transformSum[i];
+        frame.cornerLast = FA->laserCloudCornerLast;
+        frame.surfLast = FA->laserCloudSurfLast;
+        frame.outlierLast = FA->outlierCloud;
+        MO->downsampleCurrentScan(frame);
+        MO->loadFrame(frame);
+
+        MO->applyLoopCorrection();
+        MO->transformAssociateToMap();
+
+        double points = MO->laserCloudCornerLastDSNum + MO->laserCloudSurfTotalLastDSNum;
+        Clock::time_point start = Clock::now();
+        MO->extractSurroundingKeyFrames();
+        record(ExtractSurroundingKeyFrames, elapsedMs(start), points);
+
+        start = Clock::now();
+        MO->scan2MapOptimization();
+        record(Scan2MapOptimization, elapsedMs(start), points);
+
+        MO->submitKeyFrame();
+        boost::shared_ptr<mapOptimization::KeyFrameJob> job;
+        while (MO->graphQueue.tryPop(job)){
+            MO->saveKeyFramesAndFactor(*job);
+            ++MO->keyFrameProcessedNum;
+        }
+        MO->clearCloud();
+    }
+
+public:
+
+    PipelineBenchmark(int warmupIn):
+        warmup(warmupIn),
+        frameNum(0)
+    {
+        const char *names[] = {"ImageProjection::projectPointCloud", "ImageProjection::groundRemoval", "ImageProjection::cloudSegmentation",
+                               "FeatureAssociation::extractFeatures", "FeatureAssociation::findCorrespondingSurfFeatures",
+                               "FeatureAssociation::calculateTransformationSurf", "FeatureAssociation::findCorrespondingCornerFeatures",
+                               "FeatureAssociation::calculateTransformationCorner",
+                               "mapOptimization::extractSurroundingKeyFrames", "mapOptimization::scan2MapOptimization"};
+        for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); ++i)
+            stages.push_back(Stage(names[i]));
+
+        IP.reset(new ImageProjection());
+        FA.reset(new FeatureAssociation());
+        FA->transformationTiming.enabled = true;
+        MO.reset(new mapOptimization());
+    }
+
+    void process(const sensor_msgs::PointCloud2ConstPtr &cloud){
+
+        if (IP->copyPointCloud(cloud) == false){
+            IP->resetParameters();
+            return;
+        }
+        inputPoints = IP->cloudReader.size(*cloud);
+        IP->findStartEndAngle();
+        runImageProjection();
+
+        if (runFeatureAssociation(cloud->header.stamp))
+            runMapOptimization(cloud->header.stamp.toSec());
+        IP->resetParameters();
+        ++frameNum;
+    }
+
+    int processedNum() const { return frameNum; }
+
+    void report(const string &label, const string &csvFile){
+
+        printf("\nLeGO-LOAM pipeline benchmark (%s): N_SCAN=%d Horizon_SCAN=%d, %d frames, first %d excluded\n",
+               label.c_str(), N_SCAN, Horizon_SCAN, frameNum, std::min(warmup, frameNum));
+        printf("%-52s %7s %9s %9s %9s %9s %9s %12s\n", "stage", "frames", "mean(ms)", "p50", "p90", "p99", "max", "Mpoints/s");
+
+        std::ofstream csv;
+        if (csvFile.empty() == false){
+            bool exists = std::ifstream(csvFile.c_str()).good();
+            csv.open(csvFile.c_str(), std::ios::app);
+            if (exists == false)
+                csv << "input,N_SCAN,Horizon_SCAN,stage,frames,mean_ms,p50_ms,p90_ms,p99_ms,max_ms,mpoints_per_s\n";
+        }
+
+        for (size_t i = 0; i < stages.size(); ++i){
+            std::vector<double> ms = stages[i].ms;
+            if (ms.empty()){
+                printf("%-52s %7d\n", stages[i].name.c_str(), 0);
+                continue;
+            }
+            std::sort(ms.begin(), ms.end());
+            double sum = 0;
+            for (size_t k = 0; k < ms.size(); ++k)
+                sum += ms[k];
+            // 最近秩法求分位数
+            double p[3];
+            double q[3] = {0.5, 0.9, 0.99};
+            for (int k = 0; k < 3; ++k)
+                p[k] = ms[std::min(ms.size() - 1, (size_t)std::max(0.0, ceil(q[k] * ms.size()) - 1))];
+            double throughput = sum > 0 ? stages[i].points / (sum / 1000.0) / 1e6 : 0;
+            printf("%-52s %7d %9.3f %9.3f %9.3f %9.3f %9.3f %12.2f\n", stages[i].name.c_str(), (int)ms.size(),
+                   sum / ms.size(), p[0], p[1], p[2], ms.back(), throughput);
+            if (csv.is_open())
+                csv << label << "," << N_SCAN << "," << Horizon_SCAN << "," << stages[i].name << "," << ms.size() << ","
+                    << sum / ms.size() << "," << p[0] << "," << p[1] << "," << p[2] << "," << ms.back() << "," << throughput << "\n";
+        }
+    }
+};
+
+int main(int argc, char** argv)
+{
+    ros::init(argc, argv, "lego_loam");
+
+    if (argc < 2){
+        ROS_ERROR("Usage: pipelineBenchmark <bag file>|--synthetic [--frames N] [--warmup N] [--csv file]");
+        return 1;
+    }
+    string input = argv[1];
+    int maxFrames = -1;
+    int warmup = 10;
+    string csvFile;
+    for (int i = 2; i + 1 < argc; ++i){
+        if (string(argv[i]) == "--frames")
+            maxFrames = atoi(argv[i + 1]);
+        else if (string(argv[i]) == "--warmup")
+            warmup = atoi(argv[i + 1]);
+        else if (string(argv[i]) == "--csv")
+            csvFile = argv[i + 1];
+    }
+
+    readSensorParams();
+
+    PipelineBenchmark benchmark(warmup);
+
+    if (input == "--synthetic"){
+        if (maxFrames < 0)
+            maxFrames = 200;
+        SyntheticScan scan;
+        for (int i = 0; i < maxFrames && ros::ok(); ++i)
+            benchmark.process(scan.generate(i));
+        benchmark.report("synthetic", csvFile);
+        return 0;
+    }
+
+    try{
+        rosbag::Bag bag;
+        bag.open(input, rosbag::bagmode::Read);
+        rosbag::View view(bag, rosbag::TopicQuery(std::vector<string>(1, pointCloudTopic)));
+        for (rosbag::View::iterator it = view.begin(); it != view.end(); ++it){
+            if (ros::ok() == false || (maxFrames >= 0 && benchmark.processedNum() >= maxFrames))
+                break;
+            sensor_msgs::PointCloud2ConstPtr cloud = it->instantiate<sensor_msgs::PointCloud2>();
+            if (cloud != NULL)
+                benchmark.process(cloud);
+        }
+        bag.close();
+    }catch (const rosbag::BagException &e){
+        ROS_ERROR("Benchmark: %s", e.what());
+        return 1;
+    }
+    benchmark.report(input, csvFile);
+    return 0;
+}
@@ -0,0 +1,348 @@
+// imageProjection的CUDA后端，接口与说明见include/rangeImageGpu.h
+// 各kernel中的计算与imageProjection.cpp中projectPointCloud、groundRemoval、isSameSegment逐项对应
+
+#include "rangeImageGpu.h"
+
+#include <cuda_runtime.h>
+#include <cfloat>
+#include <cmath>
+#include <cstring>
+
+namespace {
+
+// 与sensor_msgs::PointField中的datatype相同
+enum { INT8 = 1, UINT8 = 2, INT16 = 3, UINT16 = 4, INT32 = 5, UINT32 = 6, FLOAT32 = 7, FLOAT64 = 8 };
+
+// 与pcl::PointXYZI的内存布局相同，结果直接拷贝到fullCloud/fullInfoCloud的points中
+struct DevicePoint{
+    float x, y, z, w;
+    float intensity;
+    float pad[3];
+};
+
+const int BlockSize = 256;
+
+// 消息缓存不保证对齐，用memcpy读取
+template <typename T>
+__device__ T readAs(const uint8_t *ptr){
+    T value;
+    memcpy(&value, ptr, sizeof(T));
+    return value;
+}
+
+__device__ float readField(const uint8_t *pointPtr, int offset, uint8_t datatype){
+    const uint8_t *ptr = pointPtr + offset;
+    switch (datatype){
+        case INT8:    return readAs<int8_t>(ptr);
+        case UINT8:   return readAs<uint8_t>(ptr);
+        case INT16:   return readAs<int16_t>(ptr);
+        case UINT16:  return readAs<uint16_t>(ptr);
+        case INT32:   return readAs<int32_t>(ptr);
+        case UINT32:  return readAs<uint32_t>(ptr);
+        case FLOAT64: return readAs<double>(ptr);
+        default:      return readAs<float>(ptr);
+    }
+}
+
+// 第index个点的起始地址，与PointCloud2Reader::pointData相同
+__device__ const uint8_t *pointData(const uint8_t *data, const RangeImageGpu::Layout &layout, size_t index){
+    if (layout.height <= 1)
+        return data + index * layout.pointStep;
+    return data + (index / layout.width) * layout.rowStep + (index % layout.width) * layout.pointStep;
+}
+
+// 与projectPointCloud中对一个点的计算相同，点无效或不落在距离图像中时返回false
+__device__ bool projectPoint(const uint8_t *pointPtr, const RangeImageGpu::Layout &layout, const RangeImageGpu::Params &params,
+                             DevicePoint &point, int &row, int &col, float &range){
+    point.x = readField(pointPtr, layout.offset[0], layout.datatype[0]);
+    point.y = readField(pointPtr, layout.offset[1], layout.datatype[1]);
+    point.z = readField(pointPtr, layout.offset[2], layout.datatype[2]);
+    point.w = 1;
+    point.intensity = layout.offset[3] >= 0 ? readField(pointPtr, layout.offset[3], layout.datatype[3]) : 0;
+    point.pad[0] = point.pad[1] = point.pad[2] = 0;
+    if (!isfinite(point.x) || !isfinite(point.y) || !isfinite(point.z))
+        return false;
+
+    if (params.useRing){
+        row = (int)readField(pointPtr, layout.offset[4], layout.datatype[4]);
+    }else{
+        float verticalAngle = atan2f(point.z, sqrtf(point.x * point.x + point.y * point.y)) * 180 / M_PI;
+        row = (int)((verticalAngle + params.angBottom) / params.angResY);
+    }
+    if (row < 0 || row >= params.rows)
+        return false;
+
+    float horizonAngle = atan2f(point.x, point.y) * 180 / M_PI;
+    long column = (long)(-round((horizonAngle - 90.0) / params.angResX) + params.cols / 2);
+    if (column >= params.cols)
+        column -= params.cols;
+    if (column < 0 || column >= params.cols)
+        return false;
+    col = (int)column;
+
+    range = sqrtf(point.x * point.x + point.y * point.y + point.z * point.z);
+    return range >= params.minRange;
+}
+
+// 每个点一个线程：同一像素保留原始点云中靠后的点，与CPU上按顺序覆盖的结果相同
+__global__ void projectKernel(const uint8_t *data, int pointNum, RangeImageGpu::Layout layout, RangeImageGpu::Params params,
+                              int *owner){
+    int i = blockIdx.x * blockDim.x + threadIdx.x;
+    if (i >= pointNum)
+        return;
+    DevicePoint point;
+    int row, col;
+    float range;
+    if (projectPoint(pointData(data, layout, i), layout, params, point, row, col, range))
+        atomicMax(&owner[col + row * params.cols], i);
+}
+
+// 每个像素一个线程：写入rangeMat和fullCloud/fullInfoCloud，没有点的像素为FLT_MAX和nanPoint
+__global__ void writePixelKernel(const uint8_t *data, RangeImageGpu::Layout layout, RangeImageGpu::Params params,
+                                 const int *owner, float *range, DevicePoint *fullCloud, DevicePoint *fullInfoCloud){
+    int ind = blockIdx.x * blockDim.x + threadIdx.x;
+    if (ind >= params.rows * params.cols)
+        return;
+    DevicePoint point;
+    int row, col;
+    float pointRange;
+    if (owner[ind] >= 0 && projectPoint(pointData(data, layout, owner[ind]), layout, params, point, row, col, pointRange)){
+        range[ind] = pointRange;
+        point.intensity = (float)row + (float)col / 10000.0;
+        fullCloud[ind] = point;
+        point.intensity = pointRange;
+        fullInfoCloud[ind] = point;
+    }else{
+        float nan = __int_as_float(0x7fc00000);
+        DevicePoint nanPoint = {nan, nan, nan, 1, -1, {0, 0, 0}};
+        range[ind] = FLT_MAX;
+        fullCloud[ind] = nanPoint;
+        fullInfoCloud[ind] = nanPoint;
+    }
+}
+
+// 每列一个线程：与groundRemoval相同，沿列向上比较相邻两线，再标记不参与分割的点(地面点和无效点)
+__global__ void groundKernel(RangeImageGpu::Params params, const DevicePoint *fullCloud, const float *range,
+                             int8_t *ground, int *label){
+    int j = blockIdx.x * blockDim.x + threadIdx.x;
+    if (j >= params.cols)
+        return;
+    const int cols = params.cols;
+    for (int i = 0; i < params.rows; ++i)
+        ground[j + i*cols] = 0;
+    for (int i = 0; i < params.groundScanInd; ++i){
+        int lowerInd = j + ( i )*cols;
+        int upperInd = j + (i+1)*cols;
+        if (fullCloud[lowerInd].intensity == -1 || fullCloud[upperInd].intensity == -1){
+            ground[lowerInd] = -1;
+            continue;
+        }
+        float diffX = fullCloud[upperInd].x - fullCloud[lowerInd].x;
+        float diffY = fullCloud[upperInd].y - fullCloud[lowerInd].y;
+        float diffZ = fullCloud[upperInd].z - fullCloud[lowerInd].z;
+        float angle = atan2f(diffZ, sqrtf(diffX*diffX + diffY*diffY)) * 180 / M_PI;
+        if (fabsf(angle - params.mountAngle) <= 10){
+            ground[lowerInd] = 1;
+            ground[upperInd] = 1;
+        }
+    }
+    for (int i = 0; i < params.rows; ++i){
+        int ind = j + i*cols;
+        label[ind] = (ground[ind] == 1 || range[ind] == FLT_MAX) ? -1 : 0;
+    }
+}
+
+__device__ bool isSameSegment(float rangeA, float rangeB, float alpha, float theta){
+    float d1 = fmaxf(rangeA, rangeB);
+    float d2 = fminf(rangeA, rangeB);
+    return atan2f(d2*sinf(alpha), (d1 - d2*cosf(alpha))) > theta;
+}
+
+__global__ void initComponentKernel(int pixelNum, const int *label, int *component){
+    int ind = blockIdx.x * blockDim.x + threadIdx.x;
+    if (ind < pixelNum)
+        component[ind] = label[ind] == 0 ? ind : -1;
+}
+
+// 与相连的邻点(左右环状连通，上下不连通)取聚类索引的最小值，有变化时置changed
+__global__ void propagateKernel(RangeImageGpu::Params params, const int *label, const float *range, int *component, int *changed){
+    int ind = blockIdx.x * blockDim.x + threadIdx.x;
+    const int rows = params.rows, cols = params.cols;
+    if (ind >= rows * cols || label[ind] != 0)
+        return;
+    int i = ind / cols, j = ind % cols;
+    int neighbor[4];
+    float alpha[4];
+    int neighborNum = 0;
+    neighbor[neighborNum] = ((j + 1 == cols) ? 0 : j + 1) + i*cols;
+    alpha[neighborNum++] = params.alphaX;
+    neighbor[neighborNum] = ((j == 0) ? cols - 1 : j - 1) + i*cols;
+    alpha[neighborNum++] = params.alphaX;
+    if (i + 1 < rows){
+        neighbor[neighborNum] = j + (i+1)*cols;
+        alpha[neighborNum++] = params.alphaY;
+    }
+    if (i > 0){
+        neighbor[neighborNum] = j + (i-1)*cols;
+        alpha[neighborNum++] = params.alphaY;
+    }
+
+    int best = component[ind];
+    for (int k = 0; k < neighborNum; ++k){
+        int q = neighbor[k];
+        if (label[q] == 0 && isSameSegment(range[ind], range[q], alpha[k], params.segmentTheta))
+            best = min(best, component[q]);
+    }
+    if (best < component[ind]){
+        atomicMin(&component[ind], best);
+        *changed = 1;
+    }
+}
+
+// 指针跳跃：component[x] <= x始终成立，沿component链走到不再减小的位置
+__global__ void jumpKernel(int pixelNum, const int *label, int *component){
+    int ind = blockIdx.x * blockDim.x + threadIdx.x;
+    if (ind >= pixelNum || label[ind] != 0)
+        return;
+    int c = component[ind];
+    int next = component[c];
+    while (next < c){
+        c = next;
+        next = component[c];
+    }
+    component[ind] = c;
+}
+
+int blocksFor(int num){
+    return (num + BlockSize - 1) / BlockSize;
+}
+
+}
+
+struct RangeImageGpu::Impl{
+    Params params;
+    bool ok;
+    std::string error;
+
+    uint8_t *data;
+    size_t dataCapacity;
+    int *owner;
+    float *range;
+    int8_t *ground;
+    int *label;
+    int *component;
+    DevicePoint *fullCloud;
+    DevicePoint *fullInfoCloud;
+    int *changed;
+
+    bool check(cudaError_t status, const char *what){
+        if (status == cudaSuccess)
+            return true;
+        error = std::string(what) + ": " + cudaGetErrorString(status);
+        return false;
+    }
+};
+
+RangeImageGpu::RangeImageGpu(const Params &params):
+    impl(new Impl())
+{
+    impl->params = params;
+    impl->ok = false;
+    impl->data = NULL;
+    impl->dataCapacity = 0;
+    impl->owner = impl->label = impl->component = impl->changed = NULL;
+    impl->range = NULL;
+    impl->ground = NULL;
+    impl->fullCloud = impl->fullInfoCloud = NULL;
+
+    int deviceNum = 0;
+    if (impl->check(cudaGetDeviceCount(&deviceNum), "cudaGetDeviceCount") == false)
+        return;
+    if (deviceNum == 0){
+        impl->error = "no CUDA device";
+        return;
+    }
+    size_t pixelNum = (size_t)params.rows * params.cols;
+    impl->ok = impl->check(cudaMalloc((void**)&impl->owner, pixelNum * sizeof(int)), "cudaMalloc") &&
+               impl->check(cudaMalloc((void**)&impl->range, pixelNum * sizeof(float)), "cudaMalloc") &&
+               impl->check(cudaMalloc((void**)&impl->ground, pixelNum * sizeof(int8_t)), "cudaMalloc") &&
+               impl->check(cudaMalloc((void**)&impl->label, pixelNum * sizeof(int)), "cudaMalloc") &&
+               impl->check(cudaMalloc((void**)&impl->component, pixelNum * sizeof(int)), "cudaMalloc") &&
+               impl->check(cudaMalloc((void**)&impl->fullCloud, pixelNum * sizeof(DevicePoint)), "cudaMalloc") &&
+               impl->check(cudaMalloc((void**)&impl->fullInfoCloud, pixelNum * sizeof(DevicePoint)), "cudaMalloc") &&
+               impl->check(cudaMalloc((void**)&impl->changed, sizeof(int)), "cudaMalloc");
+}
+
+RangeImageGpu::~RangeImageGpu(){
+    cudaFree(impl->data);
+    cudaFree(impl->owner);
+    cudaFree(impl->range);
+    cudaFree(impl->ground);
+    cudaFree(impl->label);
+    cudaFree(impl->component);
+    cudaFree(impl->fullCloud);
+    cudaFree(impl->fullInfoCloud);
+    cudaFree(impl->changed);
+    delete impl;
+}
+
+bool RangeImageGpu::ok() const {
+    return impl->ok;
+}
+
+const std::string &RangeImageGpu::error() const {
+    return impl->error;
+}
+
+bool RangeImageGpu::process(const uint8_t *data, size_t bytes, const Layout &layout, const Output &output, int &iterations){
+    iterations = 0;
+    if (impl->ok == false)
+        return false;
+    const Params &params = impl->params;
+    const int pixelNum = params.rows * params.cols;
+    const int pointNum = (int)((size_t)layout.width * layout.height);
+
+    // 1. 上传原始点云的字节缓存，容量不够时重新分配
+    if (bytes > impl->dataCapacity){
+        cudaFree(impl->data);
+        impl->data = NULL;
+        impl->dataCapacity = 0;
+        if (impl->check(cudaMalloc((void**)&impl->data, bytes), "cudaMalloc") == false)
+            return false;
+        impl->dataCapacity = bytes;
+    }
+    if (bytes > 0 && impl->check(cudaMemcpy(impl->data, data, bytes, cudaMemcpyHostToDevice), "cudaMemcpy") == false)
+        return false;
+
+    // 2. 投影、地面点标记
+    if (impl->check(cudaMemset(impl->owner, 0xFF, pixelNum * sizeof(int)), "cudaMemset") == false)
+        return false;
+    if (pointNum > 0)
+        projectKernel<<<blocksFor(pointNum), BlockSize>>>(impl->data, pointNum, layout, params, impl->owner);
+    writePixelKernel<<<blocksFor(pixelNum), BlockSize>>>(impl->data, layout, params, impl->owner, impl->range,
+                                                         impl->fullCloud, impl->fullInfoCloud);
+    groundKernel<<<blocksFor(params.cols), BlockSize>>>(params, impl->fullCloud, impl->range, impl->ground, impl->label);
+
+    // 3. 连通域：传播最小索引直到不再变化
+    initComponentKernel<<<blocksFor(pixelNum), BlockSize>>>(pixelNum, impl->label, impl->component);
+    int changed = 1;
+    while (changed != 0 && iterations < pixelNum){
+        if (impl->check(cudaMemset(impl->changed, 0, sizeof(int)), "cudaMemset") == false)
+            return false;
+        propagateKernel<<<blocksFor(pixelNum), BlockSize>>>(params, impl->label, impl->range, impl->component, impl->changed);
+        jumpKernel<<<blocksFor(pixelNum), BlockSize>>>(pixelNum, impl->label, impl->component);
+        if (impl->check(cudaMemcpy(&changed, impl->changed, sizeof(int), cudaMemcpyDeviceToHost), "cudaMemcpy") == false)
+            return false;
+        ++iterations;
+    }
+    if (impl->check(cudaGetLastError(), "kernel launch") == false)
+        return false;
+
+    // 4. 取回结果
+    return impl->check(cudaMemcpy(output.range, impl->range, pixelNum * sizeof(float), cudaMemcpyDeviceToHost), "cudaMemcpy") &&
+           impl->check(cudaMemcpy(output.ground, impl->ground, pixelNum * sizeof(int8_t), cudaMemcpyDeviceToHost), "cudaMemcpy") &&
+           impl->check(cudaMemcpy(output.label, impl->label, pixelNum * sizeof(int), cudaMemcpyDeviceToHost), "cudaMemcpy") &&
+           impl->check(cudaMemcpy(output.component, impl->component, pixelNum * sizeof(int), cudaMemcpyDeviceToHost), "cudaMemcpy") &&
+           impl->check(cudaMemcpy(output.fullCloud, impl->fullCloud, pixelNum * sizeof(DevicePoint), cudaMemcpyDeviceToHost), "cudaMemcpy") &&
+           impl->check(cudaMemcpy(output.fullInfoCloud, impl->fullInfoCloud, pixelNum * sizeof(DevicePoint), cudaMemcpyDeviceToHost), "cudaMemcpy");
+}
@@ -31,16 +31,27 @@
 //     Robotics: Science and Systems Conference (RSS). Berkeley, CA, July 2014.
 
 #include "utility.h"
+#include "pipelineMetrics.h"
+#include "posePropagator.h"
+#include "cloud_msgs/PropagatedPose.h"
+
+#ifdef LEGO_LOAM_NODELET
+#include <nodelet/nodelet.h>
+#include <pluginlib/class_list_macros.h>
+#endif
 
 class TransformFusion{
 
 private:
 
     ros::NodeHandle nh;
+    PipelineMetrics metrics;    // 回调耗时统计，发布在/diagnostics上
 
     ros::Publisher pubLaserOdometry2;
     ros::Subscriber subLaserOdometry;
     ros::Subscriber subOdomAftMapped;
+    ros::Subscriber subImu;
+    ros::Publisher pubPropagatedPose;
   
 
     nav_msgs::Odometry laserOdometry2;
@@ -61,9 +72,20 @@ private:
 
     std_msgs::Header currentHeader;
 
+    // imu频率的位姿推算，lego_loam/imu_propagation/enable为true时订阅imu
+    bool imuPropagation;
+    double propagationMaxAge;
+    ImuBuffer imuBuffer;
+    PosePropagator propagator;
+    cloud_msgs::PropagatedPose propagatedPose;
+
 public:
 
-    TransformFusion(){
+    // nodelet中传入nodelet的NodeHandle
+    TransformFusion(ros::NodeHandle nodeHandle = ros::NodeHandle()):
+        nh(nodeHandle),
+        metrics(nh, "transformFusion"),
+        imuBuffer(imuQueLength){
 
         pubLaserOdometry2 = nh.advertise<nav_msgs::Odometry> ("/integrated_to_init", 5);
         subLaserOdometry = nh.subscribe<nav_msgs::Odometry>("/laser_odom_to_init", 5, &TransformFusion::laserOdometryHandler, this);
@@ -81,6 +103,16 @@ public:
         camera_2_base_link_Trans.frame_id_ = "/camera";
         camera_2_base_link_Trans.child_frame_id_ = "/base_link";
 
+        ros::NodeHandle pnh("lego_loam/imu_propagation");
+        pnh.param<bool>("enable", imuPropagation, imuPropagationFlag);
+        pnh.param<double>("max_age", propagationMaxAge, imuPropagationMaxAge);
+        if (imuPropagation == true){
+            subImu = nh.subscribe<sensor_msgs::Imu>(imuTopic, 50, &TransformFusion::imuHandler, this);
+            pubPropagatedPose = nh.advertise<cloud_msgs::PropagatedPose> ("/integrated_to_init_imu", 50);
+            propagatedPose.odom.header.frame_id = "/camera_init";
+            propagatedPose.odom.child_frame_id = "/camera";
+        }
+
         for (int i = 0; i < 6; ++i)
         {
             transformSum[i] = 0;
@@ -180,6 +212,9 @@ public:
 
     void laserOdometryHandler(const nav_msgs::Odometry::ConstPtr& laserOdometry)
     {
+        metrics.publishIfDue();
+        ScopedTimer timer(metrics, "laserOdometryHandler", laserOdometry->header.stamp.toSec());
+
         currentHeader = laserOdometry->header;
 
         double roll, pitch, yaw;
@@ -196,6 +231,9 @@ public:
 
         transformAssociateToMap();
 
+        if (imuPropagation == true)
+            propagator.anchor(laserOdometry->header.stamp.toSec(), transformMapped, transformSum, true);
+
         geoQuat = tf::createQuaternionMsgFromRollPitchYaw
                   (transformMapped[2], -transformMapped[0], -transformMapped[1]);
 
@@ -217,6 +255,7 @@ public:
 
     void odomAftMappedHandler(const nav_msgs::Odometry::ConstPtr& odomAftMapped)
     {
+        ScopedTimer timer(metrics, "odomAftMappedHandler", odomAftMapped->header.stamp.toSec());
         double roll, pitch, yaw;
         geometry_msgs::Quaternion geoQuat = odomAftMapped->pose.pose.orientation;
         tf::Matrix3x3(tf::Quaternion(geoQuat.z, -geoQuat.x, -geoQuat.y, geoQuat.w)).getRPY(roll, pitch, yaw);
@@ -236,9 +275,84 @@ public:
         transformBefMapped[3] = odomAftMapped->twist.twist.linear.x;
         transformBefMapped[4] = odomAftMapped->twist.twist.linear.y;
         transformBefMapped[5] = odomAftMapped->twist.twist.linear.z;
+
+        // 建图修正到达后，在最近一次激光里程计的时刻用新的修正重新锚定
+        if (imuPropagation == true && propagator.isAnchored() == true){
+            transformAssociateToMap();
+            propagator.anchor(propagator.getAnchorTime(), transformMapped, transformSum, false);
+        }
+    }
+
+    // 每个imu消息推算一次当前的位姿，锚点过旧或没有锚点时不发布
+    void imuHandler(const sensor_msgs::Imu::ConstPtr& imuIn)
+    {
+        imuBuffer.push(*imuIn);
+
+        double imuTime = imuIn->header.stamp.toSec();
+        float transform[6];
+        Eigen::Vector3f velocity;
+        if (propagator.predict(imuBuffer, imuTime, propagationMaxAge, transform, velocity) == false){
+            metrics.increment("unpropagated imu messages");
+            return;
+        }
+
+        geometry_msgs::Quaternion geoQuat = tf::createQuaternionMsgFromRollPitchYaw
+                                            (transform[2], -transform[0], -transform[1]);
+
+        nav_msgs::Odometry &odom = propagatedPose.odom;
+        odom.header.stamp = imuIn->header.stamp;
+        odom.pose.pose.orientation.x = -geoQuat.y;
+        odom.pose.pose.orientation.y = -geoQuat.z;
+        odom.pose.pose.orientation.z = geoQuat.x;
+        odom.pose.pose.orientation.w = geoQuat.w;
+        odom.pose.pose.position.x = transform[3];
+        odom.pose.pose.position.y = transform[4];
+        odom.pose.pose.position.z = transform[5];
+
+        // 速度转换到/camera坐标系，imu的角速度为交换前的前左上坐标系，交换为左上前
+        Eigen::Vector3f bodyVelocity = poseToMatrixYXZ(transform[0], transform[1], transform[2], 0, 0, 0)
+                                       .topLeftCorner<3, 3>().transpose() * velocity;
+        odom.twist.twist.linear.x = bodyVelocity.x();
+        odom.twist.twist.linear.y = bodyVelocity.y();
+        odom.twist.twist.linear.z = bodyVelocity.z();
+        odom.twist.twist.angular.x = imuIn->angular_velocity.y;
+        odom.twist.twist.angular.y = imuIn->angular_velocity.z;
+        odom.twist.twist.angular.z = imuIn->angular_velocity.x;
+
+        propagatedPose.age = imuTime - propagator.getAnchorTime();
+        propagatedPose.latency = (ros::Time::now() - imuIn->header.stamp).toSec();
+        pubPropagatedPose.publish(propagatedPose);
+
+        metrics.addValue("propagation age", propagatedPose.age);
+        metrics.addValue("propagation latency", propagatedPose.latency);
+    }
+};
+
+
+#ifdef LEGO_LOAM_NODELET
+
+namespace lego_loam{
+
+// nodelet版本，纯回调驱动，直接使用nodelet的回调队列
+class TransformFusionNodelet : public nodelet::Nodelet{
+
+private:
+
+    boost::shared_ptr<TransformFusion> TFusion;
+
+    virtual void onInit(){
+        TFusion.reset(new TransformFusion(getNodeHandle()));
+        NODELET_INFO("\033[1;32m---->\033[0m Transform Fusion Nodelet Started.");
     }
 };
 
+}
+
+PLUGINLIB_EXPORT_CLASS(lego_loam::TransformFusionNodelet, nodelet::Nodelet)
+
+#elif !defined(LEGO_LOAM_OFFLINE)
+
+// offlineReplay.cpp把四个节点编译进同一个程序，由它提供main
 
 int main(int argc, char** argv)
 {
@@ -252,3 +366,5 @@ int main(int argc, char** argv)
 
     return 0;
 }
+
+#endif